@@ -11,6 +11,7 @@
 #include <cstddef>
 #include <cstdint>
 #include <memory>
+#include <mutex>
 #include <sstream>
 
 #ifndef LIBNDT7_SINGLE_INCLUDE
@@ -35,6 +36,36 @@ using UniqueCurl = std::unique_ptr<CURL, CurlDeleter>;
 using CurlWriteCb = size_t (*)(char *ptr, size_t size, size_t nmemb,
                                void *userdata);
 
+// CurlShare is a libcurl share handle. Easy handles using the same CurlShare,
+// possibly from different threads, share the DNS cache, the TLS sessions and
+// the connection pool, so that repeated requests to the same host do not pay
+// again for name resolution and for the TCP and TLS handshakes.
+class CurlShare {
+ public:
+  CurlShare() noexcept;
+
+  CurlShare(const CurlShare &) = delete;
+  CurlShare &operator=(const CurlShare &) = delete;
+  CurlShare(CurlShare &&) = delete;
+  CurlShare &operator=(CurlShare &&) = delete;
+
+  // Get returns the share handle, or nullptr if its creation failed.
+  CURLSH *Get() const noexcept;
+
+  // Mutex returns the mutex protecting the specified shared data.
+  std::mutex &Mutex(curl_lock_data data) noexcept;
+
+  // Global returns the CurlShare used by default by all the clients in
+  // the current process.
+  static CurlShare &Global() noexcept;
+
+  ~CurlShare() noexcept;
+
+ private:
+  CURLSH *handle_ = nullptr;
+  std::mutex mutexes_[CURL_LOCK_DATA_LAST];
+};
+
 // Curlx allows to emulate failures in libcurl code.
 class Curlx {
  public:
@@ -42,6 +73,11 @@ class Curlx {
 
   explicit Curlx(const Logger &logger, const std::string &agent) noexcept;
 
+  // Like the above constructor but every handle created by GetMaybeSOCKS5()
+  // will use @p share, if not nullptr. The @p share MUST outlive this object.
+  Curlx(const Logger &logger, const std::string &agent,
+        CurlShare *share) noexcept;
+
   virtual bool GetMaybeSOCKS5(const std::string &proxy_port,
                               const std::string &url, long timeout,
                               std::string *body) noexcept;
@@ -67,6 +103,8 @@ class Curlx {
 
   virtual CURLcode SetoptFailonerr(UniqueCurl &handle) noexcept;
 
+  virtual CURLcode SetoptShare(UniqueCurl &handle, CurlShare *share) noexcept;
+
   virtual CURLcode Perform(UniqueCurl &handle) noexcept;
 
   virtual UniqueCurl NewUniqueCurl() noexcept;
@@ -79,6 +117,7 @@ class Curlx {
  private:
   const Logger &logger_;
   const std::string agent_;
+  CurlShare *share_ = nullptr;
 };
 
 }  // namespace internal
@@ -111,6 +150,17 @@ static size_t libndt7_curl_callback(char *ptr, size_t size, size_t nmemb,
   return nmemb;
 }
 
+static void libndt7_curl_lock(CURL *, curl_lock_data data, curl_lock_access,
+                              void *userptr) {
+  using namespace measurementlab::libndt7::internal;
+  static_cast<CurlShare *>(userptr)->Mutex(data).lock();
+}
+
+static void libndt7_curl_unlock(CURL *, curl_lock_data data, void *userptr) {
+  using namespace measurementlab::libndt7::internal;
+  static_cast<CurlShare *>(userptr)->Mutex(data).unlock();
+}
+
 }  // extern "C"
 namespace measurementlab {
 namespace libndt7 {
@@ -122,10 +172,50 @@ void CurlDeleter::operator()(CURL *handle) noexcept {
   }
 }
 
+CurlShare::CurlShare() noexcept {
+  handle_ = ::curl_share_init();
+  if (handle_ == nullptr) {
+    return;
+  }
+  // We don't check the return value of the following calls: if sharing some
+  // data is not possible, each easy handle will simply keep its own copy.
+  (void)::curl_share_setopt(handle_, CURLSHOPT_LOCKFUNC, libndt7_curl_lock);
+  (void)::curl_share_setopt(handle_, CURLSHOPT_UNLOCKFUNC, libndt7_curl_unlock);
+  (void)::curl_share_setopt(handle_, CURLSHOPT_USERDATA, this);
+  (void)::curl_share_setopt(handle_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  (void)::curl_share_setopt(handle_, CURLSHOPT_SHARE,
+                            CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900  // Since v7.57.0
+  (void)::curl_share_setopt(handle_, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+}
+
+CURLSH *CurlShare::Get() const noexcept { return handle_; }
+
+std::mutex &CurlShare::Mutex(curl_lock_data data) noexcept {
+  LIBNDT7_ASSERT(data >= 0 && data < CURL_LOCK_DATA_LAST);
+  return mutexes_[data];
+}
+
+CurlShare &CurlShare::Global() noexcept {
+  static CurlShare singleton;
+  return singleton;
+}
+
+CurlShare::~CurlShare() noexcept {
+  if (handle_ != nullptr) {
+    ::curl_share_cleanup(handle_);
+  }
+}
+
 Curlx::Curlx(const Logger &logger) noexcept : logger_{logger}, agent_{"default-ndt7-client-cc-agent"} {}
 
 Curlx::Curlx(const Logger &logger, const std::string &agent) noexcept : logger_{logger}, agent_{agent} {}
 
+Curlx::Curlx(const Logger &logger, const std::string &agent,
+             CurlShare *share) noexcept
+    : logger_{logger}, agent_{agent}, share_{share} {}
+
 bool Curlx::GetMaybeSOCKS5(const std::string &proxy_port,
                            const std::string &url, long timeout,
                            std::string *body) noexcept {
@@ -134,6 +224,12 @@ bool Curlx::GetMaybeSOCKS5(const std::string &proxy_port,
     LIBNDT7_LOGGER_WARNING(logger_, "curlx: cannot initialize cURL");
     return false;
   }
+  if (share_ != nullptr && share_->Get() != nullptr) {
+    if (this->SetoptShare(handle, share_) != CURLE_OK) {
+      LIBNDT7_LOGGER_WARNING(logger_, "curlx: cannot set share handle");
+      return false;
+    }
+  }
   if (!proxy_port.empty()) {
     std::stringstream ss;
     ss << "socks5h://127.0.0.1:" << proxy_port;
@@ -241,6 +337,12 @@ CURLcode Curlx::SetoptFailonerr(UniqueCurl &handle) noexcept {
   return ::curl_easy_setopt(handle.get(), CURLOPT_FAILONERROR, 1L);
 }
 
+CURLcode Curlx::SetoptShare(UniqueCurl &handle, CurlShare *share) noexcept {
+  LIBNDT7_ASSERT(handle);
+  LIBNDT7_ASSERT(share);
+  return ::curl_easy_setopt(handle.get(), CURLOPT_SHARE, share->Get());
+}
+
 CURLcode Curlx::Perform(UniqueCurl &handle) noexcept {
   LIBNDT7_ASSERT(handle);
   return ::curl_easy_perform(handle.get());
@@ -59,6 +59,7 @@ enum class Err {
   eof,       // We got an unexpected EOF
   socks5h,   // SOCKSv5 protocol error
   ws_proto,  // WebSocket protocol error
+  canceled,  // The operation was canceled
 };
 
 std::string libndt7_perror(Err err) noexcept;
@@ -100,6 +101,7 @@ std::string libndt7_perror(Err err) noexcept {
     LIBNDT7_PERROR(ssl_want_write);
     LIBNDT7_PERROR(ssl_syscall);
     LIBNDT7_PERROR(ws_proto);
+    LIBNDT7_PERROR(canceled);
   }
 #undef LIBNDT7_PERROR  // Tidy
   //
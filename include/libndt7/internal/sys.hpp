@@ -105,6 +105,9 @@ class Sys {
   virtual int Getsockopt(Socket socket, int level, int name, void *value,
                          socklen_t *len) const noexcept;
 
+  virtual int Setsockopt(Socket socket, int level, int name, const void *value,
+                         socklen_t len) const noexcept;
+
   virtual ~Sys() noexcept;
 };
 
@@ -294,6 +297,15 @@ int Sys::Getsockopt(Socket socket, int level, int name, void *value,
                       len);
 }
 
+int Sys::Setsockopt(Socket socket, int level, int name, const void *value,
+                    socklen_t len) const noexcept {
+#ifdef _WIN32
+  return ::setsockopt(socket, level, name, (const char *)value, len);
+#else
+  return ::setsockopt(socket, level, name, value, len);
+#endif
+}
+
 Sys::~Sys() noexcept {}
 
 }  // namespace internal
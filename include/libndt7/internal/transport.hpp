@@ -0,0 +1,70 @@
+// Part of Measurement Lab <https://www.measurementlab.net/>.
+// Measurement Lab libndt7 is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef MEASUREMENTLAB_LIBNDT7_INTERNAL_TRANSPORT_HPP
+#define MEASUREMENTLAB_LIBNDT7_INTERNAL_TRANSPORT_HPP
+
+// libndt7/internal/transport.hpp - per-connection state
+
+#ifndef LIBNDT7_SINGLE_INCLUDE
+#include "libndt7/internal/sys.hpp"
+#endif
+
+#include <memory>
+
+typedef struct ssl_st SSL;
+
+namespace measurementlab {
+namespace libndt7 {
+namespace internal {
+
+// Transport is a connection owned by a Client. It owns the socket and, when
+// TLS is enabled, the SSL object bound to such socket. Because all the state
+// of a connection lives here, a Client can drive many connections at once and
+// the data path does not need to map a socket to its SSL object.
+class Transport {
+ public:
+  // sock is the underlying socket.
+  Socket sock = (Socket)-1;
+
+  // ssl is the TLS state or nullptr when the connection is clear text.
+  SSL *ssl = nullptr;
+
+  // sys is the Sys used by the TLS BIO to perform socket I/O. It is set when
+  // ssl is bound to the socket, so the BIO does not need to know the Client.
+  Sys *sys = nullptr;
+
+  // bytes_recv is the number of bytes received at the netx layer.
+  Size bytes_recv = 0;
+
+  // bytes_sent is the number of bytes sent at the netx layer.
+  Size bytes_sent = 0;
+
+  // recv_calls is the number of successful nonblocking receives.
+  Size recv_calls = 0;
+
+  // send_calls is the number of successful nonblocking sends.
+  Size send_calls = 0;
+
+  // bio_reads is the number of socket reads issued by the TLS BIO.
+  Size bio_reads = 0;
+
+  // rbuf contains bytes received from the network but not yet consumed by
+  // the WebSocket parser. It is only allocated when the client is configured
+  // to use a receive buffer. Buffered data is in [rbuf_off, rbuf_end).
+  std::unique_ptr<uint8_t[]> rbuf;
+
+  // rbuf_size is the size of rbuf.
+  Size rbuf_size = 0;
+
+  // rbuf_off is the offset of the first unconsumed byte in rbuf.
+  Size rbuf_off = 0;
+
+  // rbuf_end is the offset one past the last unconsumed byte in rbuf.
+  Size rbuf_end = 0;
+};
+
+}  // namespace internal
+}  // namespace libndt7
+}  // namespace measurementlab
+#endif  // MEASUREMENTLAB_LIBNDT7_INTERNAL_TRANSPORT_HPP
@@ -10,6 +10,7 @@
 #include "libndt7/internal/curlx.hpp"
 #include "libndt7/internal/err.hpp"
 #include "libndt7/internal/sys.hpp"
+#include "libndt7/internal/transport.hpp"
 #include "libndt7/timeout.hpp"
 #endif  // !LIBNDT7_SINGLE_INCLUDE
 
@@ -41,11 +42,14 @@
 #include <limits.h>
 #include <netdb.h>
 #include <poll.h>
+#include <sys/resource.h>
 #endif
 #include <stddef.h>
+#include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #ifndef _WIN32
 #include <unistd.h>
 #endif
@@ -53,6 +57,8 @@
 #include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <fstream>
 #include <functional>
 #include <iomanip>
 #include <iostream>
@@ -60,6 +66,7 @@
 #include <memory>
 #include <mutex>
 #include <random>
+#include <typeinfo>
 
 // TODO(github.com/m-lab/ndt7-client-cc/issues/10): Remove pragma ignoring
 // warning when possible.
@@ -188,19 +195,28 @@ constexpr const char *ws_proto_ndt7 = "net.measurementlab.ndt.v7";
 // Private utils
 // `````````````
 
+// Mutex serializing the logging callbacks, which several threads may invoke
+// at once, e.g. while racing connections. It is recursive so that a callback
+// may itself emit logs.
+static std::recursive_mutex &log_mutex() noexcept {
+  static std::recursive_mutex mutex;
+  return mutex;
+}
+
 // Generic macro for emitting logs.
-#define LIBNDT7_EMIT_LOG_EX(client, level, statements)     \
-  do {                                                     \
-    if (client->get_verbosity() >= verbosity_##level) {    \
-      std::stringstream ss_log_lines;                      \
-      ss_log_lines << statements;                          \
-      std::string log_line;                                \
-      while (std::getline(ss_log_lines, log_line, '\n')) { \
-        if (!log_line.empty()) {                           \
-          client->on_##level(std::move(log_line));         \
-        }                                                  \
-      }                                                    \
-    }                                                      \
+#define LIBNDT7_EMIT_LOG_EX(client, level, statements)             \
+  do {                                                             \
+    if (client->get_verbosity() >= verbosity_##level) {            \
+      std::stringstream ss_log_lines;                              \
+      ss_log_lines << statements;                                  \
+      std::string log_line;                                        \
+      std::lock_guard<std::recursive_mutex> log_lock{log_mutex()}; \
+      while (std::getline(ss_log_lines, log_line, '\n')) {         \
+        if (!log_line.empty()) {                                   \
+          client->on_##level(std::move(log_line));                 \
+        }                                                          \
+      }                                                            \
+    }                                                              \
   } while (0)
 
 #define LIBNDT7_EMIT_WARNING_EX(clnt, stmnts) \
@@ -241,6 +257,221 @@ static void random_printable_fill(char *buffer, size_t length) noexcept {
   }
 }
 
+constexpr size_t SpeedHistogram::num_buckets;
+
+double SpeedHistogram::upper_bound(size_t index) noexcept {
+  // From 1 Mbit/s to 10 Gbit/s using 1-2.5-5 steps.
+  static const double bounds[num_buckets] = {
+      1e03, 2.5e03, 5e03, 1e04, 2.5e04, 5e04, 1e05,
+      2.5e05, 5e05, 1e06, 2.5e06, 5e06, 1e07};
+  return bounds[index];
+}
+
+void SpeedHistogram::observe(double speed) noexcept {
+  size_t index = 0;
+  while (index < num_buckets && speed > upper_bound(index)) {
+    ++index;
+  }
+  counts[index] += 1;
+  count += 1;
+  sum += speed;
+}
+
+// Returns the sample for the @p bytes transferred between @p from and @p to
+// during a subtest started at @p begin.
+static ThroughputSample throughput_sample(
+    std::chrono::steady_clock::time_point begin,
+    std::chrono::steady_clock::time_point from,
+    std::chrono::steady_clock::time_point to, uint64_t bytes) noexcept {
+  ThroughputSample sample;
+  sample.elapsed = std::chrono::duration<double>(to - begin).count();
+  sample.duration = std::chrono::duration<double>(to - from).count();
+  sample.bytes = bytes;
+  return sample;
+}
+
+// ThreadCpuUsage contains the resources used so far by the calling thread.
+struct ThreadCpuUsage {
+  // CPU time (seconds). Negative if not available on this platform.
+  double cpu_time = -1.0;
+
+  // Voluntary context switches.
+  uint64_t voluntary_switches = 0;
+
+  // Involuntary context switches.
+  uint64_t involuntary_switches = 0;
+};
+
+// thread_cpu_usage returns the resources used so far by the calling thread.
+// Where per-thread context switches are not available, e.g. on macOS, we
+// use the ones of the whole process, which is fine for the client.
+static ThreadCpuUsage thread_cpu_usage() noexcept {
+  ThreadCpuUsage usage;
+#if !defined(_WIN32) && defined(CLOCK_THREAD_CPUTIME_ID)
+  struct timespec ts {};
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0) {
+    usage.cpu_time = (double)ts.tv_sec + (double)ts.tv_nsec / 1e09;
+  }
+#ifdef RUSAGE_THREAD
+  constexpr int who = RUSAGE_THREAD;
+#else
+  constexpr int who = RUSAGE_SELF;
+#endif  // RUSAGE_THREAD
+  struct rusage ru {};
+  if (getrusage(who, &ru) == 0) {
+    usage.voluntary_switches = (uint64_t)ru.ru_nvcsw;
+    usage.involuntary_switches = (uint64_t)ru.ru_nivcsw;
+  }
+#endif
+  return usage;
+}
+
+// cpu_diagnosis returns the CpuDiagnosis measured fields of a subtest that
+// started when the thread usage was @p begin, that lasted @p wall_time and
+// during which the sender waited for the client for @p client_limited.
+static CpuDiagnosis cpu_diagnosis(const ThreadCpuUsage &begin, double wall_time,
+                                  double client_limited) noexcept {
+  CpuDiagnosis diagnosis;
+  ThreadCpuUsage end = thread_cpu_usage();
+  if (begin.cpu_time >= 0.0 && end.cpu_time >= begin.cpu_time) {
+    diagnosis.cpu_time = end.cpu_time - begin.cpu_time;
+  }
+  diagnosis.wall_time = wall_time;
+  diagnosis.voluntary_switches =
+      end.voluntary_switches - begin.voluntary_switches;
+  diagnosis.involuntary_switches =
+      end.involuntary_switches - begin.involuntary_switches;
+  diagnosis.client_limited = client_limited;
+  return diagnosis;
+}
+
+// ConvergenceDetector tells whether the speed of a subtest has converged, by
+// comparing the speeds measured over the latest three windows.
+class ConvergenceDetector {
+ public:
+  ConvergenceDetector(double window, double tolerance) noexcept
+      : window_{window}, tolerance_{tolerance} {}
+
+  // Returns whether the speed has converged after transferring @p total bytes
+  // in @p elapsed seconds. Call this periodically, more often than the window.
+  bool update(double elapsed, uint64_t total) noexcept {
+    if (window_ <= 0.0 || elapsed - window_begin_ < window_) {
+      return false;
+    }
+    speeds_[count_ % 3] = compute_speed_kbits(total - window_total_,
+                                              elapsed - window_begin_);
+    count_ += 1;
+    window_begin_ = elapsed;
+    window_total_ = total;
+    if (count_ < 3) {
+      return false;
+    }
+    double mean = (speeds_[0] + speeds_[1] + speeds_[2]) / 3.0;
+    if (mean <= 0.0) {
+      return false;
+    }
+    for (double speed : speeds_) {
+      if (speed < mean * (1.0 - tolerance_) ||
+          speed > mean * (1.0 + tolerance_)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+ private:
+  double window_;
+  double tolerance_;
+  double window_begin_ = 0.0;
+  uint64_t window_total_ = 0;
+  double speeds_[3] = {};
+  uint64_t count_ = 0;
+};
+
+// TcpInfoSampler reads the TCP_INFO of a socket from a background thread,
+// until it is destroyed, so that the subtest loops are not slowed down.
+class TcpInfoSampler {
+ public:
+  TcpInfoSampler(Client *client, NettestFlags nettest, internal::Socket sock,
+                 uint32_t interval_ms,
+                 std::chrono::steady_clock::time_point begin) noexcept {
+#ifdef __linux__
+    if (interval_ms == 0) {
+      return;
+    }
+    thread_ = std::thread{[=]() {
+      std::unique_lock<std::mutex> lock{mutex_};
+      do {
+        struct tcp_info tcpinfo {};
+        socklen_t tcpinfolen = sizeof(tcpinfo);
+        if (client->sys->Getsockopt(sock, IPPROTO_TCP, TCP_INFO,
+                                    (void *)&tcpinfo, &tcpinfolen) != 0) {
+          break;
+        }
+        TcpInfoSample sample;
+        sample.elapsed = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - begin)
+                             .count();
+        sample.rtt = tcpinfo.tcpi_rtt;
+        sample.min_rtt = tcpinfo.tcpi_min_rtt;
+        sample.rcv_rtt = tcpinfo.tcpi_rcv_rtt;
+        sample.rcv_space = tcpinfo.tcpi_rcv_space;
+        sample.bytes_received = tcpinfo.tcpi_bytes_received;
+        sample.bytes_acked = tcpinfo.tcpi_bytes_acked;
+        sample.delivery_rate = tcpinfo.tcpi_delivery_rate;
+        sample.busy_time = tcpinfo.tcpi_busy_time;
+        sample.rwnd_limited = tcpinfo.tcpi_rwnd_limited;
+        sample.sndbuf_limited = tcpinfo.tcpi_sndbuf_limited;
+        sample.app_limited = tcpinfo.tcpi_delivery_rate_app_limited != 0;
+        client->ndt7_tcp_info_add(nettest, sample);
+      } while (!cond_.wait_for(lock, std::chrono::milliseconds(interval_ms),
+                               [this]() { return stop_; }));
+    }};
+#else
+    (void)client;
+    (void)nettest;
+    (void)sock;
+    (void)interval_ms;
+    (void)begin;
+#endif
+  }
+
+  TcpInfoSampler(const TcpInfoSampler &) = delete;
+  TcpInfoSampler &operator=(const TcpInfoSampler &) = delete;
+  TcpInfoSampler(TcpInfoSampler &&) = delete;
+  TcpInfoSampler &operator=(TcpInfoSampler &&) = delete;
+
+  ~TcpInfoSampler() noexcept { stop(); }
+
+  // Stops sampling and waits for the background thread to terminate.
+  void stop() noexcept {
+    if (thread_.joinable()) {
+      {
+        std::unique_lock<std::mutex> _{mutex_};
+        stop_ = true;
+      }
+      cond_.notify_all();
+      thread_.join();
+    }
+  }
+
+ private:
+  std::thread thread_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  bool stop_ = false;
+};
+
+static NetxCounters netx_counters(const internal::Transport *t) noexcept {
+  NetxCounters counters;
+  counters.bytes_recv = t->bytes_recv;
+  counters.bytes_sent = t->bytes_sent;
+  counters.recv_calls = t->recv_calls;
+  counters.send_calls = t->send_calls;
+  counters.bio_reads = t->bio_reads;
+  return counters;
+}
+
 double compute_speed_kbits(uint64_t data_bytes, double elapsed_sec) noexcept {
   if (elapsed_sec <= 0.0) {
     return 0.0;
@@ -343,82 +574,131 @@ EventHandler::~EventHandler() noexcept {}
 // Client constructor and destructor
 // `````````````````````````````````
 
-Client::Client() noexcept : sys{new internal::Sys{}} {}
+Client::Client() noexcept : sys{new internal::Sys{}} {
+#ifndef _WIN32
+  if (::pipe(cancel_pipe_) == 0) {
+    for (int fd : cancel_pipe_) {
+      (void)::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+      (void)::fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+  } else {
+    cancel_pipe_[0] = cancel_pipe_[1] = -1;
+  }
+#endif
+}
 
 Client::Client(Settings settings) noexcept : Client::Client() {
   std::swap(settings_, settings);
 }
 
 Client::~Client() noexcept {
-  if (sock_ != -1) {
-    netx_closesocket(sock_);
+  for (auto &probe : probe_threads_) {
+    probe.thread.join();
+  }
+  std::vector<internal::Socket> sockets;
+  {
+    std::unique_lock<std::mutex> _{transports_mutex_};
+    for (auto &t : transports_) {
+      sockets.push_back(t->sock);
+    }
+  }
+  for (auto &fd : sockets) {
+    netx_closesocket(fd);
   }
+#ifndef _WIN32
+  for (int fd : cancel_pipe_) {
+    if (fd != -1) {
+      (void)::close(fd);
+    }
+  }
+#endif
 }
 
 // Top-level API
 // `````````````
 
 bool Client::run() noexcept {
+  summary_ = SummaryData{};
+  download_measurements_.reset(0);
+  upload_measurements_.reset(0);
   std::vector<nlohmann::json> targets;
-  if (!query_locate_api(settings_.metadata, &targets)) {
+  auto locate_begin = std::chrono::steady_clock::now();
+  run_deadline_ = (settings_.max_run_time_ms > 0)
+                      ? locate_begin + std::chrono::milliseconds(
+                                           settings_.max_run_time_ms)
+                      : std::chrono::steady_clock::time_point::max();
+  subtest_deadline_ = std::chrono::steady_clock::time_point::max();
+  if (settings_.adaptive_duration && settings_.convergence_window_ms == 0) {
+    LIBNDT7_EMIT_WARNING("run: adaptive_duration needs a positive "
+                         "convergence_window_ms; the subtests will not stop "
+                         "when the speed converges");
+  }
+  if (canceled_ || !query_locate_api(settings_.metadata, &targets) ||
+      canceled_) {
+    run_deadline_ = std::chrono::steady_clock::time_point::max();
     return false;
   }
-  std::string scheme = "ws";
-  if ((settings_.protocol_flags & protocol_flag_tls) != 0) {
-    scheme = "wss";
+  if (settings_.hostname.empty()) {
+    std::chrono::duration<double, std::milli> locate_time =
+        std::chrono::steady_clock::now() - locate_begin;
+    summary_.locate_time = locate_time.count();
+  }
+  // We cannot measure the latency when using a proxy and there is no choice
+  // to make when the user specified the server.
+  if (settings_.probe_timeout_ms > 0 && targets.size() > 1 &&
+      settings_.socks5h_port.empty() && settings_.hostname.empty()) {
+    probe_targets(&targets);
   }
   bool success = true;
   LIBNDT7_EMIT_DEBUG("using the ndt7 protocol");
   if ((settings_.nettest_flags & nettest_flag_download) != 0) {
-    for (auto &urls : targets) {
-      auto key = scheme + ":///ndt/v7/download";
-      if (!urls.contains(key)) {
-        LIBNDT7_EMIT_WARNING("ndt7: scheme not found in results: " << scheme);
-        continue;
-      }
-      auto url = urls[key];
-      UrlParts parts = parse_ws_url(url);
-      success = ndt7_download(parts);
-      if (!success) {
-        LIBNDT7_EMIT_WARNING("ndt7: download failed");
-        // try next server.
-        continue;
-      }
-      // download succeeded.
-      break;
-    }
+    success = ndt7_run_subtest(targets, nettest_flag_download);
   }
   if (!success) {
-    LIBNDT7_EMIT_WARNING("no more hosts to try; failing the test");
+    if (!canceled_) {
+      LIBNDT7_EMIT_WARNING("no more hosts to try; failing the test");
+    }
+    run_deadline_ = std::chrono::steady_clock::time_point::max();
     return false;
   }
   if ((settings_.nettest_flags & nettest_flag_upload) != 0) {
-    for (auto &urls : targets) {
-      auto key = scheme + ":///ndt/v7/upload";
-      if (!urls.contains(key)) {
-        LIBNDT7_EMIT_WARNING("ndt7: scheme not found in results: " << scheme);
-        continue;
-      }
-      auto url = urls[key];
-      UrlParts parts = parse_ws_url(url);
-      success = ndt7_upload(parts);
-      if (!success) {
-        LIBNDT7_EMIT_WARNING("ndt7: upload failed");
-        // Try next server.
-        continue;
-      }
-      // upload succeeded.
-      break;
-    }
+    success = ndt7_run_subtest(targets, nettest_flag_upload);
   }
+  run_deadline_ = std::chrono::steady_clock::time_point::max();
   if (success) {
     LIBNDT7_EMIT_INFO("ndt7: test complete");
-  } else {
+  } else if (!canceled_) {
     LIBNDT7_EMIT_WARNING("no more hosts to try; failing the test");
   }
   return success;
 }
 
+void Client::cancel() noexcept {
+  canceled_ = true;
+#ifndef _WIN32
+  if (cancel_pipe_[1] != -1) {
+    char c = 0;
+    // If the pipe is full, waits are going to wake up anyway.
+    ssize_t rv = ::write(cancel_pipe_[1], &c, 1);
+    (void)rv;
+  }
+#endif
+}
+
+void Client::reset_cancel() noexcept {
+  canceled_ = false;
+#ifndef _WIN32
+  if (cancel_pipe_[0] != -1) {
+    char buf[64];
+    while (::read(cancel_pipe_[0], buf, sizeof(buf)) > 0) {
+      // Discard the wake ups of previous cancel() calls.
+    }
+  }
+#endif
+}
+
+bool Client::is_canceled() const noexcept { return canceled_; }
+
 void Client::on_warning(const std::string &msg) const noexcept {
   std::clog << "[!] " << msg << std::endl;
 }
@@ -465,6 +745,61 @@ void Client::on_server_busy(std::string msg) noexcept {
 
 SummaryData Client::get_summary() noexcept { return summary_; }
 
+std::vector<ThroughputSample> Client::get_time_series(
+    NettestFlags nettest) const noexcept {
+  return (nettest == nettest_flag_download) ? download_samples_.get()
+                                            : upload_samples_.get();
+}
+
+std::vector<TcpInfoSample> Client::get_tcp_info(NettestFlags nettest) const
+    noexcept {
+  std::unique_lock<std::mutex> _{tcp_info_mutex_};
+  return (nettest == nettest_flag_download) ? download_tcp_info_.get()
+                                            : upload_tcp_info_.get();
+}
+
+Progress Client::get_progress() const noexcept {
+  std::unique_lock<std::mutex> _{progress_mutex_};
+  return progress_;
+}
+
+static std::string format_stop_reason(StopReason reason) noexcept {
+  switch (reason) {
+    case StopReason::converged: return "speed converged";
+    case StopReason::byte_budget: return "byte budget used";
+    case StopReason::canceled: return "canceled";
+    default: return "completed";
+  }
+}
+
+static std::string format_phase_timings(const PhaseTimings &phases) noexcept {
+  std::stringstream ss;
+  ss << std::fixed << std::setprecision(2);
+  auto phase = [&](const char *name, double value) {
+    if (value >= 0.0) {
+      ss << name << " " << value << " ms; ";
+    }
+  };
+  phase("resolve", phases.resolve);
+  phase("connect", phases.connect);
+  phase("TLS handshake", phases.tls_handshake);
+  phase("WebSocket handshake", phases.ws_handshake);
+  phase("first message", phases.first_message);
+  return ss.str();
+}
+
+static std::string format_socket_profile(const SocketProfile &profile) noexcept {
+  std::stringstream ss;
+  ss << "rcvbuf " << profile.rcvbuf << "; sndbuf " << profile.sndbuf << "; ";
+  if (!profile.congestion.empty()) {
+    ss << "congestion " << profile.congestion << "; ";
+  }
+  ss << "notsent_lowat " << profile.notsent_lowat << "; busy_poll "
+     << profile.busy_poll << "; nodelay " << profile.nodelay << "; tos "
+     << profile.tos << "; ";
+  return ss.str();
+}
+
 void Client::summary() noexcept {
   LIBNDT7_EMIT_INFO(std::endl << "[Test results]");
   if (summary_.download_speed != 0.0) {
@@ -479,6 +814,13 @@ void Client::summary() noexcept {
     LIBNDT7_EMIT_INFO("Latency: " << std::fixed << std::setprecision(2)
                                   << (summary_.min_rtt / 1000.0) << " ms");
   }
+  for (auto &probe : summary_.server_probes) {
+    if (probe.connect_time >= 0.0) {
+      LIBNDT7_EMIT_INFO("Connect time to " << probe.hostname << ": "
+                                           << std::fixed << std::setprecision(2)
+                                           << probe.connect_time << " ms");
+    }
+  }
   if (summary_.download_retrans != 0.0) {
     LIBNDT7_EMIT_INFO("Download retransmission: "
                       << std::fixed << std::setprecision(2)
@@ -489,6 +831,46 @@ void Client::summary() noexcept {
                       << std::fixed << std::setprecision(2)
                       << (summary_.upload_retrans * 100) << "%");
   }
+  if (summary_.download_speed != 0.0 &&
+      summary_.download_stop_reason != StopReason::completed) {
+    LIBNDT7_EMIT_INFO("Download stopped early: "
+                      << format_stop_reason(summary_.download_stop_reason));
+  }
+  if (summary_.upload_speed != 0.0 &&
+      summary_.upload_stop_reason != StopReason::completed) {
+    LIBNDT7_EMIT_INFO("Upload stopped early: "
+                      << format_stop_reason(summary_.upload_stop_reason));
+  }
+  if (summary_.download_speed != 0.0 && summary_.download_cpu.cpu_limited) {
+    LIBNDT7_EMIT_INFO("Download limited by the client CPU (confidence: "
+                      << std::fixed << std::setprecision(0)
+                      << (summary_.download_cpu.confidence * 100) << "%)");
+  }
+  if (summary_.upload_speed != 0.0 && summary_.upload_cpu.cpu_limited) {
+    LIBNDT7_EMIT_INFO("Upload limited by the client CPU (confidence: "
+                      << std::fixed << std::setprecision(0)
+                      << (summary_.upload_cpu.confidence * 100) << "%)");
+  }
+  if (summary_.locate_time >= 0.0) {
+    LIBNDT7_EMIT_DEBUG("Locate API time: " << std::fixed << std::setprecision(2)
+                                           << summary_.locate_time << " ms");
+  }
+  if (summary_.download_speed != 0.0) {
+    LIBNDT7_EMIT_DEBUG("Download phases: "
+                       << format_phase_timings(summary_.download_phases));
+  }
+  if (summary_.upload_speed != 0.0) {
+    LIBNDT7_EMIT_DEBUG("Upload phases: "
+                       << format_phase_timings(summary_.upload_phases));
+  }
+  if (summary_.download_speed != 0.0) {
+    LIBNDT7_EMIT_DEBUG("Download socket: "
+                       << format_socket_profile(summary_.download_socket));
+  }
+  if (summary_.upload_speed != 0.0) {
+    LIBNDT7_EMIT_DEBUG("Upload socket: "
+                       << format_socket_profile(summary_.upload_socket));
+  }
 }
 
 std::string Client::get_static_locate_result(std::string opts,
@@ -528,6 +910,360 @@ std::string Client::replace_all_with(std::string templ, std::string pattern,
   return result;
 }
 
+void Client::probe_targets(std::vector<nlohmann::json> *targets) noexcept {
+  assert(targets != nullptr);
+  std::string scheme = "ws";
+  if ((settings_.protocol_flags & protocol_flag_tls) != 0) {
+    scheme = "wss";
+  }
+  // Do not let the probes that outlived a previous call pile up, e.g. when
+  // the same Client runs periodically.
+  (void)join_probe_threads();
+  // The probes report into a shared state, so that we can stop waiting once
+  // the time budget is over. There is no portable way to bound a DNS lookup,
+  // hence a probe may outlive this function. Such a probe only writes into
+  // the shared state and into its done flag (see probe_threads_).
+  struct ProbeState {
+    std::mutex mutex;
+    std::condition_variable done;
+    std::vector<ServerProbe> probes;
+    size_t pending = 0;
+  };
+  std::shared_ptr<ProbeState> state{new ProbeState{}};
+  state->probes.resize(targets->size());
+  std::vector<ProbeThread> threads;
+  for (size_t i = 0; i < targets->size(); ++i) {
+    auto &urls = (*targets)[i];
+    std::string url;
+    for (auto &test : {"download", "upload"}) {
+      auto key = scheme + ":///ndt/v7/" + test;
+      if (url.empty() && urls.contains(key) && urls[key].is_string()) {
+        url = urls[key].get<std::string>();
+      }
+    }
+    if (url.empty()) {
+      continue;
+    }
+    UrlParts parts = parse_ws_url(url);
+    std::string hostname = parts.host;
+    std::string port = parts.port;
+    if (port.empty()) {
+      port = (scheme == "wss") ? "443" : "80";
+    }
+    state->probes[i].hostname = hostname;
+    state->probes[i].port = port;
+    state->pending += 1;
+    std::shared_ptr<std::atomic<bool>> done{new std::atomic<bool>{false}};
+    std::thread thread{[this, state, done, i, hostname, port]() {
+      double connect_time = 0.0;
+      auto err = netx_probe(hostname, port, settings_.probe_timeout_ms,
+                            &connect_time);
+      std::unique_lock<std::mutex> _{state->mutex};
+      if (err == internal::Err::none) {
+        state->probes[i].connect_time = connect_time;
+      }
+      state->pending -= 1;
+      state->done.notify_all();
+      *done = true;
+    }};
+    threads.push_back(ProbeThread{std::move(thread), std::move(done)});
+  }
+  std::vector<ServerProbe> probes;
+  bool complete = false;
+  {
+    std::unique_lock<std::mutex> lock{state->mutex};
+    complete = state->done.wait_for(
+        lock, std::chrono::milliseconds(settings_.probe_timeout_ms),
+        [&]() { return state->pending == 0; });
+    if (!complete) {
+      LIBNDT7_EMIT_DEBUG("probe: " << state->pending
+                                   << " probes exceeded the time budget");
+    }
+    probes = state->probes;
+  }
+  for (auto &probe : threads) {
+    if (complete) {
+      probe.thread.join();
+    } else {
+      probe_threads_.push_back(std::move(probe));
+    }
+  }
+  std::vector<size_t> order(targets->size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    if (probes[a].connect_time < 0.0 || probes[b].connect_time < 0.0) {
+      return probes[b].connect_time < 0.0 && probes[a].connect_time >= 0.0;
+    }
+    return probes[a].connect_time < probes[b].connect_time;
+  });
+  std::vector<nlohmann::json> sorted;
+  for (auto i : order) {
+    LIBNDT7_EMIT_DEBUG("probe: " << probes[i].hostname << ": "
+                                 << probes[i].connect_time << " ms");
+    sorted.push_back(std::move((*targets)[i]));
+    summary_.server_probes.push_back(std::move(probes[i]));
+  }
+  std::swap(*targets, sorted);
+}
+
+size_t Client::join_probe_threads() noexcept {
+  auto finished = std::partition(
+      probe_threads_.begin(), probe_threads_.end(),
+      [](const ProbeThread &probe) { return !*probe.done; });
+  for (auto it = finished; it != probe_threads_.end(); ++it) {
+    it->thread.join();
+  }
+  probe_threads_.erase(finished, probe_threads_.end());
+  return probe_threads_.size();
+}
+
+// Locate API cache
+// ````````````````
+//
+// Results live in a process-wide map from the Locate API URL to the list of
+// targets, ordered as returned by the Locate API, and, optionally, in a JSON
+// file using the same structure. Each target is saved along with the expiry
+// time of its access tokens.
+
+static std::mutex &locate_cache_mutex() noexcept {
+  static std::mutex mutex;
+  return mutex;
+}
+
+static nlohmann::json &locate_cache_memory() noexcept {
+  static nlohmann::json cache = nlohmann::json::object();
+  return cache;
+}
+
+static nlohmann::json locate_cache_read_file(const std::string &path) noexcept {
+  std::ifstream file{path};
+  if (!file.good()) {
+    return nlohmann::json::object();
+  }
+  try {
+    auto json = nlohmann::json::parse(file);
+    if (json.is_object()) {
+      return json;
+    }
+  } catch (const nlohmann::json::exception &) {
+    // FALLTHROUGH
+  }
+  return nlohmann::json::object();
+}
+
+static bool locate_cache_write_file(const std::string &path,
+                                    const nlohmann::json &json) noexcept {
+  // Write a temporary file and rename it so readers never see a partial file.
+  // The temporary name is unique, so concurrent clients do not clobber each
+  // other, and the file is only readable by us, since it contains tokens.
+  std::string data = json.dump();
+  std::string temp = path + ".XXXXXX";
+#ifndef _WIN32
+  int fd = ::mkstemp(&temp[0]);  // creates the file with mode 0600
+  if (fd == -1) {
+    return false;
+  }
+  const char *base = data.data();
+  size_t count = data.size();
+  while (count > 0) {
+    ssize_t n = ::write(fd, base, count);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    base += n;
+    count -= (size_t)n;
+  }
+  if (::close(fd) != 0 || count > 0) {
+    (void)::unlink(temp.c_str());
+    return false;
+  }
+#else
+  if (::_mktemp_s(&temp[0], temp.size() + 1) != 0) {
+    return false;
+  }
+  {
+    std::ofstream file{temp, std::ios::trunc};
+    if (!file.good()) {
+      return false;
+    }
+    file << data;
+    if (!file.good()) {
+      (void)::remove(temp.c_str());
+      return false;
+    }
+  }
+  (void)::remove(path.c_str());  // rename() does not replace files on Windows
+#endif
+  if (::rename(temp.c_str(), path.c_str()) != 0) {
+    (void)::remove(temp.c_str());
+    return false;
+  }
+  return true;
+}
+
+static bool base64url_decode(const std::string &in, std::string *out) noexcept {
+  assert(out != nullptr);
+  uint32_t accum = 0;
+  int bits = 0;
+  for (char c : in) {
+    uint32_t v = 0;
+    if (c >= 'A' && c <= 'Z') {
+      v = (uint32_t)(c - 'A');
+    } else if (c >= 'a' && c <= 'z') {
+      v = (uint32_t)(c - 'a' + 26);
+    } else if (c >= '0' && c <= '9') {
+      v = (uint32_t)(c - '0' + 52);
+    } else if (c == '-' || c == '+') {
+      v = 62;
+    } else if (c == '_' || c == '/') {
+      v = 63;
+    } else if (c == '=') {
+      break;
+    } else {
+      return false;
+    }
+    accum = (accum << 6) | v;
+    bits += 6;
+    if (bits >= 8) {
+      bits -= 8;
+      *out += (char)((accum >> bits) & 0xff);
+    }
+  }
+  return true;
+}
+
+int64_t Client::locate_token_expiry(const nlohmann::json &urls) noexcept {
+  int64_t expiry = 0;
+  if (!urls.is_object()) {
+    return 0;
+  }
+  for (auto &url : urls) {
+    if (!url.is_string()) {
+      continue;
+    }
+    // The access token is a JWT: the expiry is the "exp" claim of its payload.
+    std::string s = url.get<std::string>();
+    static const std::string param = "access_token=";
+    auto pos = s.find(param);
+    if (pos == std::string::npos) {
+      return 0;
+    }
+    std::string token = s.substr(pos + param.size());
+    token = token.substr(0, token.find('&'));
+    auto first = token.find('.');
+    auto second = token.find('.', first + 1);
+    if (first == std::string::npos || second == std::string::npos) {
+      return 0;
+    }
+    std::string payload;
+    if (!base64url_decode(token.substr(first + 1, second - first - 1),
+                          &payload)) {
+      return 0;
+    }
+    int64_t exp = 0;
+    try {
+      auto claims = nlohmann::json::parse(payload);
+      exp = claims.at("exp").get<int64_t>();
+    } catch (const nlohmann::json::exception &) {
+      return 0;
+    }
+    if (exp <= 0) {
+      return 0;
+    }
+    if (expiry == 0 || exp < expiry) {
+      expiry = exp;
+    }
+  }
+  return expiry;
+}
+
+int64_t Client::locate_cache_now() const noexcept {
+  return (int64_t)std::chrono::duration_cast<std::chrono::seconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+bool Client::locate_cache_lookup(const std::string &key,
+                                 std::vector<nlohmann::json> *urls) noexcept {
+  assert(urls != nullptr);
+  // A target is only useful if its tokens survive both subtests.
+  int64_t deadline = locate_cache_now() + 2 * (int64_t)settings_.max_runtime +
+                     (int64_t)settings_.timeout;
+  std::unique_lock<std::mutex> _{locate_cache_mutex()};
+  auto &memory = locate_cache_memory();
+  if (!memory.contains(key) && !settings_.locate_cache_path.empty()) {
+    auto disk = locate_cache_read_file(settings_.locate_cache_path);
+    if (disk.contains(key) && disk[key].is_array()) {
+      memory[key] = disk[key];
+    }
+  }
+  if (!memory.contains(key)) {
+    return false;
+  }
+  for (auto &target : memory[key]) {
+    if (target.value("expiry", (int64_t)0) > deadline &&
+        target.contains("urls")) {
+      urls->push_back(target["urls"]);
+    }
+  }
+  return urls->size() > 0;
+}
+
+void Client::locate_cache_store(
+    const std::string &key, const std::vector<nlohmann::json> &urls) noexcept {
+  nlohmann::json targets = nlohmann::json::array();
+  for (auto &u : urls) {
+    int64_t expiry = locate_token_expiry(u);
+    if (expiry <= 0) {
+      LIBNDT7_EMIT_DEBUG("locate_cache: not caching target without tokens");
+      continue;
+    }
+    targets.push_back({{"urls", u}, {"expiry", expiry}});
+  }
+  std::unique_lock<std::mutex> _{locate_cache_mutex()};
+  locate_cache_memory()[key] = targets;
+  if (!settings_.locate_cache_path.empty()) {
+    auto disk = locate_cache_read_file(settings_.locate_cache_path);
+    disk[key] = targets;
+    if (!locate_cache_write_file(settings_.locate_cache_path, disk)) {
+      LIBNDT7_EMIT_WARNING("locate_cache: cannot write "
+                           << settings_.locate_cache_path);
+    }
+  }
+}
+
+void Client::locate_cache_forget(const nlohmann::json &urls) noexcept {
+  if (!settings_.locate_cache || locate_cache_key_.empty()) {
+    return;
+  }
+  auto remove = [&](nlohmann::json *cache) {
+    if (!cache->contains(locate_cache_key_)) {
+      return;
+    }
+    auto &targets = (*cache)[locate_cache_key_];
+    nlohmann::json kept = nlohmann::json::array();
+    for (auto &target : targets) {
+      if (target.value("urls", nlohmann::json{}) != urls) {
+        kept.push_back(target);
+      }
+    }
+    targets = kept;
+  };
+  std::unique_lock<std::mutex> _{locate_cache_mutex()};
+  remove(&locate_cache_memory());
+  if (!settings_.locate_cache_path.empty()) {
+    auto disk = locate_cache_read_file(settings_.locate_cache_path);
+    remove(&disk);
+    (void)locate_cache_write_file(settings_.locate_cache_path, disk);
+  }
+  LIBNDT7_EMIT_DEBUG("locate_cache: forgot failed target");
+}
+
 bool Client::query_locate_api(const std::map<std::string, std::string> &opts,
                               std::vector<nlohmann::json> *urls) noexcept {
   assert(urls != nullptr);
@@ -548,9 +1284,19 @@ bool Client::query_locate_api(const std::map<std::string, std::string> &opts,
       // TODO(soltesz): generalize options for country, region, or lat/lon, etc?
       locate_api_url += "?" + format_http_params(opts);
     }
+    if (settings_.locate_cache) {
+      locate_cache_key_ = locate_api_url;
+      if (locate_cache_lookup(locate_api_url, urls)) {
+        LIBNDT7_EMIT_INFO("using cached locate results: " << locate_api_url);
+        return true;
+      }
+    }
     LIBNDT7_EMIT_INFO("using locate: " << locate_api_url);
-    if (!query_locate_api_curl(locate_api_url,
-                               static_cast<long>(settings_.timeout), &body)) {
+    // libcurl wants seconds and takes zero as no timeout, so round up.
+    long timeout =
+        (std::max)(1L, (long)((netx_timeout_msec(settings_.timeout) + 999) /
+                              1000));
+    if (!query_locate_api_curl(locate_api_url, timeout, &body)) {
       return false;
     }
   }
@@ -591,6 +1337,10 @@ bool Client::query_locate_api(const std::map<std::string, std::string> &opts,
     } while (0);
     urls->push_back(std::move(result_urls));
   }
+  if (settings_.locate_cache && !locate_cache_key_.empty() &&
+      settings_.hostname.empty()) {
+    locate_cache_store(locate_cache_key_, *urls);
+  }
   return urls->size() > 0;
 }
 
@@ -606,17 +1356,86 @@ bool Client::ndt7_download(const UrlParts &url) noexcept {
   // The following value is the maximum amount of bytes that an implementation
   // SHOULD be prepared to handle when receiving ndt7 messages.
   constexpr internal::Size ndt7_bufsiz = (1 << 24);
-  std::unique_ptr<uint8_t[]> buff{new uint8_t[ndt7_bufsiz]};
+  if (download_buffer_ == nullptr) {
+    download_buffer_.reset(new uint8_t[ndt7_bufsiz]);
+  }
+  uint8_t *buff = download_buffer_.get();
+  summary_.download_phases = conn_phases_;
+  summary_.download_socket = netx_socket_profile(conn_->sock);
+  ndt7_sampler_reset(nettest_flag_download);
+  const auto sample_interval = std::chrono::milliseconds(
+      (std::max)(settings_.sample_interval_ms, (uint32_t)10));
   auto begin = std::chrono::steady_clock::now();
   auto latest = begin;
+  auto sample_begin = begin;
   internal::Size total = 0;
+  internal::Size latest_total = 0;
+  internal::Size sample_total = 0;
   std::chrono::duration<double> elapsed;
+  TcpInfoSampler tcp_info_sampler{this, nettest_flag_download, conn_->sock,
+                                  settings_.tcp_info_interval_ms, begin};
+  ConvergenceDetector convergence{
+      (settings_.adaptive_duration) ? settings_.convergence_window_ms / 1000.0
+                                    : 0.0,
+      settings_.convergence_tolerance};
+  subtest_deadline_ = begin + std::chrono::seconds(settings_.max_runtime);
+  summary_.download_stop_reason = StopReason::completed;
   summary_.download_speed = 0.0;
   summary_.download_retrans = 0.0;
+  summary_.download_cpu = CpuDiagnosis{};
   summary_.min_rtt = 0;
+  const ThreadCpuUsage cpu_begin = thread_cpu_usage();
+  const bool fastpath = netx_fastpath_enabled();
+  // We also send our own measurements to the server. They are queued and
+  // written only when the socket accepts them without blocking, such that
+  // sending rarely delays receiving, and a queued measurement is replaced by
+  // the next one. Once we have started writing a measurement, however, we
+  // finish writing it before receiving again: a CLOSE or a PING makes
+  // ws_recvmsg() reply with a control frame, which must not end up in the
+  // middle of the measurement, and TLS requires repeating a write that would
+  // block with the same arguments before writing anything else.
+  std::string outgoing;
+  auto flush_outgoing = [&]() {
+    if (outgoing.empty()) {
+      return;
+    }
+    internal::Size n = 0;
+    internal::Err err =
+        (fastpath) ? netx_send_nonblocking_fast(conn_, outgoing.data(),
+                                                outgoing.size(), &n)
+                   : netx_send_nonblocking(conn_->sock, outgoing.data(),
+                                           outgoing.size(), &n);
+    if (err == internal::Err::operation_would_block ||
+        err == internal::Err::ssl_want_write ||
+        err == internal::Err::ssl_want_read) {
+      if (conn_->ssl == nullptr) {
+        return;  // Nothing written, so we can try again later.
+      }
+      n = 0;
+      err = internal::Err::none;
+    }
+    if (err == internal::Err::none && n < outgoing.size()) {
+      err = (fastpath) ? netx_sendn_fast(conn_, outgoing.data() + n,
+                                         outgoing.size() - n)
+                       : netx_sendn(conn_->sock, outgoing.data() + n,
+                                    outgoing.size() - n);
+    }
+    if (err != internal::Err::none) {
+      // Let the receive path deal with a broken connection.
+      LIBNDT7_EMIT_DEBUG("ndt7: cannot send measurement");
+    }
+    outgoing.clear();
+  };
   for (;;) {
     auto now = std::chrono::steady_clock::now();
     elapsed = now - begin;
+    if (now - sample_begin >= sample_interval) {
+      ndt7_sampler_add(nettest_flag_download,
+                       throughput_sample(begin, sample_begin, now,
+                                         total - sample_total));
+      sample_begin = now;
+      sample_total = total;
+    }
     if (elapsed.count() > settings_.max_runtime) {
       LIBNDT7_EMIT_WARNING("ndt7: download running for too much time");
       return false;
@@ -624,22 +1443,69 @@ bool Client::ndt7_download(const UrlParts &url) noexcept {
     constexpr auto measurement_interval = 0.25;
     std::chrono::duration<double> interval = now - latest;
     if (interval.count() > measurement_interval) {
+      double speed = compute_speed_kbits(total - latest_total, interval.count());
+      summary_.download_intervals.observe(speed);
+      ndt7_set_progress(nettest_flag_download, elapsed.count(), speed);
       if (!settings_.summary_only) {
         on_performance(nettest_flag_download, 1, total, elapsed.count(),
                        settings_.max_runtime);
       }
+      std::chrono::duration<double, std::micro> elapsed_usec = elapsed;
+      std::string json = ndt7_client_measurement(
+          conn_->sock, (uint64_t)elapsed_usec.count(), total);
+      outgoing = ws_prepare_frame(ws_opcode_text | ws_fin_flag,
+                                  (uint8_t *)json.data(), json.size());
       latest = now;
+      latest_total = total;
+    }
+    if (convergence.update(elapsed.count(), total)) {
+      LIBNDT7_EMIT_INFO("ndt7: download speed has converged; stopping");
+      summary_.download_stop_reason = StopReason::converged;
+    }
+    if (settings_.subtest_byte_budget > 0 &&
+        total >= settings_.subtest_byte_budget) {
+      LIBNDT7_EMIT_INFO("ndt7: download has used its byte budget; stopping");
+      summary_.download_stop_reason = StopReason::byte_budget;
+    }
+    if (canceled_) {
+      LIBNDT7_EMIT_WARNING("ndt7: download canceled");
+      summary_.download_stop_reason = StopReason::canceled;
     }
+    if (summary_.download_stop_reason != StopReason::completed) {
+      // Tell the server we are done. We don't wait for its reply since we
+      // are only interested in stopping the transfer.
+      (void)ws_send_frame(conn_->sock, ws_opcode_close | ws_fin_flag, nullptr,
+                          0);
+      break;
+    }
+    flush_outgoing();
     uint8_t opcode = 0;
     internal::Size count = 0;
     internal::Err err =
-        ws_recvmsg(sock_, &opcode, buff.get(), ndt7_bufsiz, &count);
+        (fastpath) ? ws_recvmsg_fast(conn_, &opcode, buff, ndt7_bufsiz,
+                                     &count)
+                   : ws_recvmsg(conn_->sock, &opcode, buff, ndt7_bufsiz,
+                                &count);
     if (err != internal::Err::none) {
       if (err == internal::Err::eof) {
         break;
       }
+      if (err == internal::Err::canceled) {
+        LIBNDT7_EMIT_WARNING("ndt7: download canceled");
+        summary_.download_stop_reason = StopReason::canceled;
+        break;
+      }
+      if (err == internal::Err::timed_out &&
+          std::chrono::steady_clock::now() >= subtest_deadline_) {
+        LIBNDT7_EMIT_WARNING("ndt7: download running for too much time");
+      }
       return false;
     }
+    if (summary_.download_phases.first_message < 0.0) {
+      std::chrono::duration<double, std::milli> first_message =
+          std::chrono::steady_clock::now() - begin;
+      summary_.download_phases.first_message = first_message.count();
+    }
     if (opcode == ws_opcode_text) {
       // The following is an issue both on armv7 and on Windows 32 bit: the
       // definition of size we have chose is such that later conversion to
@@ -648,166 +1514,1088 @@ bool Client::ndt7_download(const UrlParts &url) noexcept {
       // measurement that big, so the check to make sure the casting is okay
       // is not going to be a real problem, it's just a theoric issue.
       if (count <= SIZE_MAX) {
-        std::string sinfo{(const char *)buff.get(), (size_t)count};
-        // Try parsing the received message as JSON.
-        try {
-          measurement_ = std::unique_ptr<nlohmann::json>(
-              new nlohmann::json(nlohmann::json::parse(sinfo)));
-          if (measurement_->contains("ConnectionInfo")) {
-            connection_info_ = std::unique_ptr<nlohmann::json>(
-                new nlohmann::json((*measurement_)["ConnectionInfo"]));
-          }
+        std::string sinfo{(const char *)buff, (size_t)count};
+        ndt7_download_measurement(sinfo);
+        on_result("ndt7", "download", std::move(sinfo));
+      }
+    }
+    total += count;  // Assume we won't overflow
+  }
+  if (total > sample_total) {
+    ndt7_sampler_add(nettest_flag_download,
+                     throughput_sample(begin, sample_begin,
+                                       std::chrono::steady_clock::now(),
+                                       total - sample_total));
+  }
+  summary_.download_speed = compute_speed_kbits(total, elapsed.count());
+  summary_.download_netx = netx_counters(conn_);
+  tcp_info_sampler.stop();
+  summary_.download_throughput =
+      ndt7_throughput_stats(get_time_series(nettest_flag_download));
+  summary_.download_tcp_info = ndt7_tcp_info_stats(
+      nettest_flag_download, get_tcp_info(nettest_flag_download));
+  // The server is the sender, hence we compute its statistics like the ones
+  // of the client during the upload.
+  summary_.download_server_tcp_info = ndt7_tcp_info_stats(
+      nettest_flag_upload, get_server_tcp_info(nettest_flag_download));
+  summary_.download_cpu = ndt7_cpu_diagnosis(cpu_diagnosis(
+      cpu_begin, elapsed.count(), summary_.download_cpu.client_limited));
+  return true;
+}
+
+bool Client::ndt7_upload(const UrlParts &url) noexcept {
+  LIBNDT7_EMIT_INFO("ndt7: starting upload test: " << url.scheme << "://"
+                                                   << url.host);
+  if (!ndt7_connect(url)) {
+    return false;
+  }
+  // Implementation note: we send messages smaller than the maximum message
+  // size accepted by the protocol. We have chosen this value because it
+  // currently seems to be a reasonable size for outgoing messages.
+  constexpr internal::Size ndt7_bufsiz = (1 << 13);
+  std::unique_ptr<uint8_t[]> buff{new uint8_t[ndt7_bufsiz]};
+  random_printable_fill((char *)buff.get(), ndt7_bufsiz);
+  // The following is the expected ndt7 transfer time for a subtest.
+  constexpr double max_upload_time = 10.0;
+  summary_.upload_phases = conn_phases_;
+  summary_.upload_socket = netx_socket_profile(conn_->sock);
+  ndt7_sampler_reset(nettest_flag_upload);
+  const auto sample_interval = std::chrono::milliseconds(
+      (std::max)(settings_.sample_interval_ms, (uint32_t)10));
+  auto begin = std::chrono::steady_clock::now();
+  auto latest = begin;
+  auto sample_begin = begin;
+  std::chrono::duration<double> elapsed;
+  internal::Size total = 0;
+  internal::Size latest_total = 0;
+  internal::Size sample_total = 0;
+  TcpInfoSampler tcp_info_sampler{this, nettest_flag_upload, conn_->sock,
+                                  settings_.tcp_info_interval_ms, begin};
+  ConvergenceDetector convergence{
+      (settings_.adaptive_duration) ? settings_.convergence_window_ms / 1000.0
+                                    : 0.0,
+      settings_.convergence_tolerance};
+  subtest_deadline_ =
+      begin + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                  std::chrono::duration<double>(max_upload_time));
+  summary_.upload_stop_reason = StopReason::completed;
+  summary_.upload_speed = 0.0;
+  summary_.upload_cpu = CpuDiagnosis{};
+  const ThreadCpuUsage cpu_begin = thread_cpu_usage();
+  const bool fastpath = netx_fastpath_enabled();
+  std::string frame =
+      ws_prepare_frame(ws_opcode_binary | ws_fin_flag, buff.get(), ndt7_bufsiz);
+#ifdef TCP_NOTSENT_LOWAT
+  // Keep few unsent bytes in the send buffer, such that a measurement frame
+  // does not wait behind megabytes of payload, unless the user chose a value.
+  if (settings_.socket_profile.notsent_lowat <= 0 &&
+      settings_.upload_notsent_lowat > 0) {
+    int lowat = (int)(std::min)(settings_.upload_notsent_lowat,
+                                (uint32_t)INT_MAX);
+    if (sys->Setsockopt(conn_->sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat,
+                        sizeof(lowat)) != 0) {
+      LIBNDT7_EMIT_DEBUG("ndt7: cannot set TCP_NOTSENT_LOWAT");
+    }
+  }
+#endif  // TCP_NOTSENT_LOWAT
+  // We write payload only when the socket is writeable and we prepare the
+  // measurement frame when it is due, even while waiting. The measurement
+  // frame is sent as soon as we are at a frame boundary. Since TLS requires
+  // repeating a write that would block with the same arguments, we consider
+  // that write still in progress until it succeeds.
+  constexpr auto measurement_interval = std::chrono::milliseconds(250);
+  std::string measurement;
+  internal::Size frame_off = 0;
+  bool write_pending = false;
+  // We also read the measurements sent by the server, when the socket is
+  // readable while we wait for writing at a frame boundary and at each
+  // measurement interval, so that they do not pile up in the receive buffer.
+  // We only read what has already arrived and we only parse the messages
+  // that we have received whole, so that a message split across segments
+  // or TLS records does not stall the upload.
+  constexpr internal::Size ndt7_recv_bufsiz = (1 << 24);
+  if (download_buffer_ == nullptr) {
+    download_buffer_.reset(new uint8_t[ndt7_recv_bufsiz]);
+  }
+  std::string received;
+  auto read_server_messages = [&]() -> internal::Err {
+    uint8_t *rbuff = download_buffer_.get();
+    for (;;) {
+      uint8_t opcode = 0;
+      internal::Size count = 0;
+      internal::Size consumed = 0;
+      internal::Err err = ws_recvmsg_buffered(
+          conn_->sock, (const uint8_t *)received.data(), received.size(),
+          &opcode, rbuff, ndt7_recv_bufsiz, &count, &consumed);
+      if (err != internal::Err::none) {
+        return err;
+      }
+      if (consumed > 0) {
+        received.erase(0, (size_t)consumed);
+        if (opcode == ws_opcode_text && count <= SIZE_MAX) {
+          ndt7_upload_server_measurement(
+              std::string{(const char *)rbuff, (size_t)count});
+        }
+        continue;
+      }
+      bool buffered = conn_->rbuf_off < conn_->rbuf_end ||
+                      (conn_->ssl != nullptr && ::SSL_pending(conn_->ssl) > 0);
+      if (!buffered) {
+        std::vector<pollfd> pfds(1);
+        pfds[0].fd = conn_->sock;
+        pfds[0].events = POLLIN;
+        err = netx_poll(&pfds, 0);
+        if (err == internal::Err::timed_out) {
+          return internal::Err::none;
+        }
+        if (err != internal::Err::none) {
+          return err;
+        }
+      }
+      constexpr internal::Size ndt7_read_size = (1 << 16);
+      internal::Size n = 0;
+      err = (fastpath) ? netx_recv_nonblocking_fast(conn_, rbuff,
+                                                    ndt7_read_size, &n)
+                       : netx_recv_nonblocking(conn_->sock, rbuff,
+                                               ndt7_read_size, &n);
+      if (err == internal::Err::operation_would_block ||
+          err == internal::Err::ssl_want_read ||
+          err == internal::Err::ssl_want_write) {
+        return internal::Err::none;
+      }
+      if (err != internal::Err::none) {
+        return err;
+      }
+      received.append((const char *)rbuff, (size_t)n);
+    }
+  };
+  for (;;) {
+    auto now = std::chrono::steady_clock::now();
+    elapsed = now - begin;
+    std::chrono::duration<double, std::micro> elapsed_usec =
+        std::chrono::duration_cast<std::chrono::microseconds>(elapsed);
+    if (now - sample_begin >= sample_interval) {
+      ndt7_sampler_add(nettest_flag_upload,
+                       throughput_sample(begin, sample_begin, now,
+                                         total - sample_total));
+      sample_begin = now;
+      sample_total = total;
+    }
+    if (canceled_) {
+      LIBNDT7_EMIT_WARNING("ndt7: upload canceled");
+      summary_.upload_stop_reason = StopReason::canceled;
+      break;
+    }
+    const bool at_boundary = (frame_off == 0 && !write_pending);
+    if (at_boundary && elapsed.count() > max_upload_time) {
+      LIBNDT7_EMIT_DEBUG("ndt7: upload has run for enough time");
+      break;
+    }
+    if (at_boundary && convergence.update(elapsed.count(), total)) {
+      LIBNDT7_EMIT_INFO("ndt7: upload speed has converged; stopping");
+      summary_.upload_stop_reason = StopReason::converged;
+      break;
+    }
+    if (at_boundary && settings_.subtest_byte_budget > 0 &&
+        total >= settings_.subtest_byte_budget) {
+      LIBNDT7_EMIT_INFO("ndt7: upload has used its byte budget; stopping");
+      summary_.upload_stop_reason = StopReason::byte_budget;
+      break;
+    }
+    if (now - latest >= measurement_interval) {
+      std::chrono::duration<double> interval = now - latest;
+      double speed = compute_speed_kbits(total - latest_total, interval.count());
+      summary_.upload_intervals.observe(speed);
+      ndt7_set_progress(nettest_flag_upload, elapsed.count(), speed);
+      if (!settings_.summary_only) {
+        on_performance(nettest_flag_upload, 1, total, elapsed.count(),
+                       max_upload_time);
+      }
+      std::string json = ndt7_upload_measurement(
+          conn_->sock, (uint64_t)elapsed_usec.count(), total);
+      on_result("ndt7", "upload", json);
+      // If the previous measurement is still queued, this one replaces it.
+      measurement = ws_prepare_frame(ws_opcode_text | ws_fin_flag,
+                                     (uint8_t *)json.data(), json.size());
+      latest = now;
+      latest_total = total;
+    }
+    internal::Err err = internal::Err::none;
+    if (!measurement.empty() && at_boundary) {
+      err = read_server_messages();
+      if (err == internal::Err::eof) {
+        LIBNDT7_EMIT_DEBUG("ndt7: the server closed the upload");
+        break;
+      }
+      if (err == internal::Err::canceled) {
+        LIBNDT7_EMIT_WARNING("ndt7: upload canceled");
+        summary_.upload_stop_reason = StopReason::canceled;
+        break;
+      }
+      if (err != internal::Err::none) {
+        LIBNDT7_EMIT_WARNING("ndt7: cannot read server measurement");
+        return false;
+      }
+      // Send measurement to the server.
+      err = (fastpath) ? netx_sendn_fast(conn_, measurement.data(),
+                                         measurement.size())
+                       : netx_sendn(conn_->sock, measurement.data(),
+                                    measurement.size());
+      if (err == internal::Err::canceled) {
+        LIBNDT7_EMIT_WARNING("ndt7: upload canceled");
+        summary_.upload_stop_reason = StopReason::canceled;
+        break;
+      }
+      if (err != internal::Err::none) {
+        LIBNDT7_EMIT_WARNING("ndt7: cannot send measurement");
+        return false;
+      }
+      measurement.clear();
+      continue;
+    }
+    internal::Size n = 0;
+    err = (fastpath)
+              ? netx_send_nonblocking_fast(conn_, frame.data() + frame_off,
+                                           frame.size() - frame_off, &n)
+              : netx_send_nonblocking(conn_->sock, frame.data() + frame_off,
+                                      frame.size() - frame_off, &n);
+    if (err == internal::Err::none) {
+      write_pending = false;
+      frame_off += n;
+      if (frame_off < frame.size()) {
+        continue;
+      }
+      frame_off = 0;
+      if (summary_.upload_phases.first_message < 0.0) {
+        std::chrono::duration<double, std::milli> first_message =
+            std::chrono::steady_clock::now() - begin;
+        summary_.upload_phases.first_message = first_message.count();
+      }
+      total += ndt7_bufsiz;  // Assume we won't overflow
+      continue;
+    }
+    if (err == internal::Err::operation_would_block ||
+        err == internal::Err::ssl_want_write ||
+        err == internal::Err::ssl_want_read) {
+      write_pending = (conn_->ssl != nullptr);
+      std::vector<pollfd> pfds(1);
+      pfds[0].fd = conn_->sock;
+      pfds[0].events =
+          (err == internal::Err::ssl_want_read) ? POLLIN : POLLOUT;
+      // We only read at frame boundaries, since reading a CLOSE or a PING
+      // makes ws_recvmsg() reply with a control frame, which must not end up
+      // in the middle of the frame we are writing. Likewise, with TLS we
+      // cannot read while a write is in progress.
+      const bool can_read = (frame_off == 0 && !write_pending);
+      if (can_read) {
+        pfds[0].events |= POLLIN;
+      }
+      int timeout_msec = netx_timeout_msec(settings_.timeout);
+      bool measurement_due = false;
+      if (measurement.empty()) {
+        // Wake up in time to prepare the next measurement.
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        latest + measurement_interval - now)
+                        .count() + 1;
+        if (left < timeout_msec) {
+          timeout_msec = (int)(std::max)(left, (decltype(left))0);
+          measurement_due = true;
+        }
+      }
+      err = netx_poll(&pfds, timeout_msec);
+      if (err == internal::Err::none && can_read &&
+          (pfds[0].revents & (POLLIN | POLLHUP | POLLERR)) != 0) {
+        err = read_server_messages();
+        if (err == internal::Err::eof) {
+          LIBNDT7_EMIT_DEBUG("ndt7: the server closed the upload");
+          break;
+        }
+      }
+      if (err == internal::Err::none ||
+          (err == internal::Err::timed_out && measurement_due)) {
+        continue;
+      }
+    }
+    if (err == internal::Err::timed_out &&
+        std::chrono::steady_clock::now() >= subtest_deadline_) {
+      LIBNDT7_EMIT_DEBUG("ndt7: upload has run for enough time");
+      break;
+    }
+    if (err == internal::Err::canceled) {
+      LIBNDT7_EMIT_WARNING("ndt7: upload canceled");
+      summary_.upload_stop_reason = StopReason::canceled;
+      break;
+    }
+    LIBNDT7_EMIT_WARNING("ndt7: cannot send frame");
+    return false;
+  }
+  if (total > sample_total) {
+    ndt7_sampler_add(nettest_flag_upload,
+                     throughput_sample(begin, sample_begin,
+                                       std::chrono::steady_clock::now(),
+                                       total - sample_total));
+  }
+  summary_.upload_speed = compute_speed_kbits(total, elapsed.count());
+  summary_.upload_netx = netx_counters(conn_);
+  tcp_info_sampler.stop();
+  summary_.upload_throughput =
+      ndt7_throughput_stats(get_time_series(nettest_flag_upload));
+  summary_.upload_tcp_info = ndt7_tcp_info_stats(
+      nettest_flag_upload, get_tcp_info(nettest_flag_upload));
+  // The server is the receiver, hence we compute its statistics like the
+  // ones of the client during the download.
+  summary_.upload_server_tcp_info = ndt7_tcp_info_stats(
+      nettest_flag_download, get_server_tcp_info(nettest_flag_upload));
+  summary_.upload_cpu = ndt7_cpu_diagnosis(cpu_diagnosis(
+      cpu_begin, elapsed.count(),
+      (summary_.upload_tcp_info.samples > 0)
+          ? summary_.upload_tcp_info.app_limited
+          : -1.0));
+  return true;
+}
+
+// MeasurementParser fills a Measurement and a ConnectionInfo while parsing an
+// ndt7 measurement message, without building the JSON document. It considers
+// only the members of the objects of the top-level object.
+class MeasurementParser : public nlohmann::json_sax<nlohmann::json> {
+ public:
+  MeasurementParser(Measurement *measurement, ConnectionInfo *info) noexcept
+      : measurement_{measurement}, info_{info} {}
+
+  bool null() override { return true; }
+
+  bool boolean(bool) override { return true; }
+
+  bool number_integer(number_integer_t value) override {
+    return assign(value);
+  }
+
+  bool number_unsigned(number_unsigned_t value) override {
+    return assign(value);
+  }
+
+  bool number_float(number_float_t value, const string_t &) override {
+    return assign((int64_t)value);
+  }
+
+  bool string(string_t &value) override {
+    if (depth_ == 2 && object_ == "ConnectionInfo") {
+      if (key_ == "Client") {
+        info_->client = value;
+      } else if (key_ == "Server") {
+        info_->server = value;
+      } else if (key_ == "UUID") {
+        info_->uuid = value;
+      }
+    }
+    return true;
+  }
+
+  bool start_object(std::size_t) override {
+    if (++depth_ == 2) {
+      object_ = key_;
+      has_connection_info_ |= (object_ == "ConnectionInfo");
+      measurement_->has_app_info |= (object_ == "AppInfo");
+      measurement_->has_tcp_info |= (object_ == "TCPInfo");
+      measurement_->has_bbr_info |= (object_ == "BBRInfo");
+    }
+    return true;
+  }
+
+  bool key(string_t &value) override {
+    key_ = value;
+    return true;
+  }
+
+  bool end_object() override {
+    if (depth_-- == 2) {
+      object_.clear();
+    }
+    return true;
+  }
+
+  bool start_array(std::size_t) override {
+    ++depth_;
+    return true;
+  }
+
+  bool end_array() override {
+    --depth_;
+    return true;
+  }
+
+  bool parse_error(std::size_t, const std::string &,
+                   const nlohmann::detail::exception &) override {
+    return false;
+  }
+
+  // Returns whether the message contained the ConnectionInfo object.
+  bool has_connection_info() const noexcept { return has_connection_info_; }
+
+ private:
+  template <typename Number>
+  bool assign(Number value) noexcept {
+    if (depth_ != 2) {
+      return true;
+    }
+    if (object_ == "TCPInfo") {
+      set(&measurement_->tcp_info, value);
+    } else if (object_ == "AppInfo") {
+      set(&measurement_->app_info, value);
+    } else if (object_ == "BBRInfo") {
+      set(&measurement_->bbr_info, value);
+    }
+    return true;
+  }
+
+#define XX(type_, member_, json_)                             \
+  if (key_ == #json_) {                                       \
+    fields->member_ = (type_)value;                           \
+    fields->present |= (uint64_t)1 << (unsigned)Field::member_; \
+    return;                                                   \
+  }
+  template <typename Number>
+  void set(MeasurementAppInfo *fields, Number value) noexcept {
+    using Field = MeasurementAppInfoField;
+    NDT7_ENUM_MEASUREMENT_APP_INFO
+  }
+
+  template <typename Number>
+  void set(MeasurementTcpInfo *fields, Number value) noexcept {
+    using Field = MeasurementTcpInfoField;
+    NDT7_ENUM_MEASUREMENT_TCP_INFO
+  }
+
+  template <typename Number>
+  void set(MeasurementBbrInfo *fields, Number value) noexcept {
+    using Field = MeasurementBbrInfoField;
+    NDT7_ENUM_MEASUREMENT_BBR_INFO
+  }
+#undef XX
+
+  // The `present` bitmasks have room for 64 fields.
+#define XX(type_, member_, json_) +1
+  static_assert(0 NDT7_ENUM_MEASUREMENT_APP_INFO <= 64, "too many fields");
+  static_assert(0 NDT7_ENUM_MEASUREMENT_TCP_INFO <= 64, "too many fields");
+  static_assert(0 NDT7_ENUM_MEASUREMENT_BBR_INFO <= 64, "too many fields");
+#undef XX
+
+  Measurement *measurement_;
+  ConnectionInfo *info_;
+  bool has_connection_info_ = false;
+  int depth_ = 0;
+  std::string object_;
+  std::string key_;
+};
+
+// parse_measurement parses the measurement @p message sent by the server into
+// @p measurement and, if the message contains it, @p info. Returns false if
+// the message is not valid JSON, in which case it changes neither of them.
+static bool parse_measurement(const std::string &message,
+                              Measurement *measurement, ConnectionInfo *info) {
+  Measurement parsed;
+  ConnectionInfo parsed_info;
+  MeasurementParser parser{&parsed, &parsed_info};
+  try {
+    if (!nlohmann::json::sax_parse(message, &parser)) {
+      return false;
+    }
+  } catch (const nlohmann::json::exception &) {
+    return false;
+  }
+  *measurement = parsed;
+  if (parser.has_connection_info()) {
+    *info = std::move(parsed_info);
+  }
+  return true;
+}
 
-          // Calculate retransmission rate (BytesRetrans / BytesSent).
-          try {
-            nlohmann::json tcpinfo_json = (*measurement_)["TCPInfo"];
-            double bytes_retrans =
-                (double)tcpinfo_json["BytesRetrans"].get<int64_t>();
-            double bytes_sent =
-                (double)tcpinfo_json["BytesSent"].get<int64_t>();
-            summary_.download_retrans =
-                (bytes_sent != 0.0) ? bytes_retrans / bytes_sent : 0.0;
-            summary_.min_rtt = tcpinfo_json["MinRTT"].get<uint32_t>();
-          } catch (const std::exception &e) {
-            LIBNDT7_EMIT_WARNING(
-                "TCPInfo not available, cannot get \
-              retransmission rate and latency: "
-                << e.what());
-          }
-        } catch (nlohmann::json::parse_error &e) {
-          LIBNDT7_EMIT_WARNING("Unable to parse message as JSON: " << sinfo);
-        }
+// tcp_info_sample converts the TCPInfo of a @p measurement sent by the server
+// into a TcpInfoSample.
+static TcpInfoSample tcp_info_sample(const Measurement &measurement) {
+  const MeasurementTcpInfo &tcp_info = measurement.tcp_info;
+  TcpInfoSample sample;
+  sample.elapsed = (double)tcp_info.elapsed_time / 1e06;
+  sample.rtt = tcp_info.rtt;
+  sample.min_rtt = tcp_info.min_rtt;
+  sample.rcv_rtt = tcp_info.rcv_rtt;
+  sample.rcv_space = tcp_info.rcv_space;
+  sample.bytes_received = tcp_info.bytes_received;
+  sample.bytes_acked = tcp_info.bytes_acked;
+  sample.delivery_rate = tcp_info.delivery_rate;
+  sample.busy_time = tcp_info.busy_time;
+  sample.rwnd_limited = tcp_info.rwnd_limited;
+  sample.sndbuf_limited = tcp_info.sndbuf_limited;
+  sample.app_limited = (tcp_info.app_limited != 0);
+  return sample;
+}
 
-        on_result("ndt7", "download", std::move(sinfo));
-      }
+std::vector<TcpInfoSample> Client::get_server_tcp_info(
+    NettestFlags nettest) const noexcept {
+  std::vector<TcpInfoSample> samples;
+  for (auto &measurement : get_measurements(nettest)) {
+    if (measurement.has_tcp_info) {
+      samples.push_back(tcp_info_sample(measurement));
     }
-    total += count;  // Assume we won't overflow
   }
-  summary_.download_speed = compute_speed_kbits(total, elapsed.count());
-  return true;
+  return samples;
 }
 
-bool Client::ndt7_upload(const UrlParts &url) noexcept {
-  LIBNDT7_EMIT_INFO("ndt7: starting upload test: " << url.scheme << "://"
-                                                   << url.host);
-  if (!ndt7_connect(url)) {
-    return false;
+std::vector<Measurement> Client::get_measurements(NettestFlags nettest) const
+    noexcept {
+  return (nettest == nettest_flag_download) ? download_measurements_.get()
+                                            : upload_measurements_.get();
+}
+
+void Client::ndt7_upload_server_measurement(
+    const std::string &message) noexcept {
+  Measurement measurement;
+  if (!parse_measurement(message, &measurement,
+                         &summary_.upload_connection_info)) {
+    LIBNDT7_EMIT_WARNING("Unable to parse message as JSON: " << message);
+    return;
   }
-  // Implementation note: we send messages smaller than the maximum message
-  // size accepted by the protocol. We have chosen this value because it
-  // currently seems to be a reasonable size for outgoing messages.
-  constexpr internal::Size ndt7_bufsiz = (1 << 13);
-  std::unique_ptr<uint8_t[]> buff{new uint8_t[ndt7_bufsiz]};
-  random_printable_fill((char *)buff.get(), ndt7_bufsiz);
-  // The following is the expected ndt7 transfer time for a subtest.
-  constexpr double max_upload_time = 10.0;
-  auto begin = std::chrono::steady_clock::now();
-  auto latest = begin;
-  std::chrono::duration<double> elapsed;
-  internal::Size total = 0;
-  summary_.upload_speed = 0.0;
-  std::string frame =
-      ws_prepare_frame(ws_opcode_binary | ws_fin_flag, buff.get(), ndt7_bufsiz);
-  for (;;) {
-    auto now = std::chrono::steady_clock::now();
-    elapsed = now - begin;
-    std::chrono::duration<double, std::micro> elapsed_usec =
-        std::chrono::duration_cast<std::chrono::microseconds>(elapsed);
-    if (elapsed.count() > max_upload_time) {
-      LIBNDT7_EMIT_DEBUG("ndt7: upload has run for enough time");
-      break;
-    }
-    constexpr auto measurement_interval = 0.25;
-    std::chrono::duration<double> interval = now - latest;
-    if (interval.count() > measurement_interval) {
-      nlohmann::json measurement;
-      measurement["AppInfo"] = nlohmann::json();
-      measurement["AppInfo"]["ElapsedTime"] =
-          (std::uint64_t)elapsed_usec.count();
-      measurement["AppInfo"]["NumBytes"] = total;
+  upload_measurements_.add(measurement);
+  // Without a download, this is the only latency that we know.
+  if (measurement.tcp_info.has(MeasurementTcpInfoField::min_rtt) &&
+      summary_.min_rtt == 0) {
+    summary_.min_rtt = measurement.tcp_info.min_rtt;
+  }
+}
+
+void Client::ndt7_download_measurement(const std::string &sinfo) noexcept {
+  Measurement measurement;
+  if (!parse_measurement(sinfo, &measurement,
+                         &summary_.download_connection_info)) {
+    LIBNDT7_EMIT_WARNING("Unable to parse message as JSON: " << sinfo);
+    return;
+  }
+  download_measurements_.add(measurement);
+  if (!measurement.has_tcp_info) {
+    LIBNDT7_EMIT_WARNING(
+        "TCPInfo not available, cannot get retransmission rate and latency");
+    return;
+  }
+  const MeasurementTcpInfo &tcp_info = measurement.tcp_info;
+
+  // Calculate retransmission rate (BytesRetrans / BytesSent).
+  summary_.download_retrans =
+      (tcp_info.bytes_sent != 0)
+          ? (double)tcp_info.bytes_retrans / (double)tcp_info.bytes_sent
+          : 0.0;
+  if (tcp_info.has(MeasurementTcpInfoField::min_rtt)) {
+    summary_.min_rtt = tcp_info.min_rtt;
+  }
+
+  // Calculate how much the server waited for us (RWndLimited / BusyTime),
+  // which is optional because not all servers report it.
+  if (tcp_info.busy_time > 0) {
+    summary_.download_cpu.client_limited =
+        (std::min)((double)tcp_info.rwnd_limited / (double)tcp_info.busy_time,
+                   1.0);
+  }
+}
+
+// client_measurement returns the AppInfo and, on Linux, the TCPInfo of the
+// client after transferring @p total bytes over @p fd in @p elapsed_usec.
+static nlohmann::json client_measurement(internal::Sys *sys, internal::Socket fd,
+                                         uint64_t elapsed_usec,
+                                         internal::Size total) noexcept {
+  nlohmann::json measurement;
+  measurement["AppInfo"] = nlohmann::json();
+  measurement["AppInfo"]["ElapsedTime"] = elapsed_usec;
+  measurement["AppInfo"]["NumBytes"] = total;
 #ifdef __linux__
-      // Read tcp_info data for the socket and print it as JSON.
-      struct tcp_info tcpinfo {};
-      socklen_t tcpinfolen = sizeof(tcpinfo);
-      if (sys->Getsockopt(sock_, IPPROTO_TCP, TCP_INFO, (void *)&tcpinfo,
-                          &tcpinfolen) == 0) {
-        measurement["TCPInfo"] = nlohmann::json();
-        measurement["TCPInfo"]["ElapsedTime"] =
-            (std::uint64_t)elapsed_usec.count();
+  // Read tcp_info data for the socket and print it as JSON.
+  struct tcp_info tcpinfo {};
+  socklen_t tcpinfolen = sizeof(tcpinfo);
+  if (sys->Getsockopt(fd, IPPROTO_TCP, TCP_INFO, (void *)&tcpinfo,
+                      &tcpinfolen) == 0) {
+    measurement["TCPInfo"] = nlohmann::json();
+    measurement["TCPInfo"]["ElapsedTime"] = elapsed_usec;
 #define XX(lower_, upper_) \
   measurement["TCPInfo"][#upper_] = (uint64_t)tcpinfo.lower_;
-        NDT7_ENUM_TCP_INFO
+    NDT7_ENUM_TCP_INFO
 #ifdef NDT7_UPLOAD_RETRANSMISSION_SUPPORT
-        NDT7_ENUM_TCP_INFO_ADVANCED
+    NDT7_ENUM_TCP_INFO_ADVANCED
 #endif  // NDT7_UPLOAD_RETRANSMISSION_SUPPORT
 #undef XX
-      }
-
-#ifdef NDT7_UPLOAD_RETRANSMISSION_SUPPORT
-      // Calculate retransmission rate.
-      try {
-        nlohmann::json tcpinfo_json = measurement["TCPInfo"];
-        double bytes_retrans =
-            (double)tcpinfo_json["TcpiBytesRetrans"].get<int64_t>();
-        double bytes_sent =
-            (double)tcpinfo_json["TcpiBytesSent"].get<int64_t>();
-        summary_.upload_retrans =
-            (bytes_sent != 0.0) ? bytes_retrans / bytes_sent : 0.0;
-      } catch (const std::exception &e) {
-        LIBNDT7_EMIT_WARNING(
-            "Cannot calculate retransmission rate: " << e.what());
-      }
-#endif  // NDT7_UPLOAD_RETRANSMISSION_SUPPORT
+  }
+#else
+  (void)sys;
+  (void)fd;
 #endif  // __linux__
-      if (!settings_.summary_only) {
-        on_performance(nettest_flag_upload, 1, total, elapsed.count(),
-                       max_upload_time);
-      }
-      // This could fail if there are non-utf8 characters. This structure just
-      // contains integers and ASCII strings, so we should be good.
-      std::string json = measurement.dump();
-      on_result("ndt7", "upload", json);
-      // Send measurement to the server.
-      internal::Err err = ws_send_frame(sock_, ws_opcode_text | ws_fin_flag,
-                                        (uint8_t *)json.data(), json.size());
-      if (err != internal::Err::none) {
-        LIBNDT7_EMIT_WARNING("ndt7: cannot send measurement");
-        return false;
-      }
-      latest = now;
-    }
-    internal::Err err = netx_sendn(sock_, frame.data(), frame.size());
-    if (err != internal::Err::none) {
-      LIBNDT7_EMIT_WARNING("ndt7: cannot send frame");
-      return false;
-    }
-    total += ndt7_bufsiz;  // Assume we won't overflow
+  return measurement;
+}
+
+std::string Client::ndt7_client_measurement(internal::Socket fd,
+                                            uint64_t elapsed_usec,
+                                            internal::Size total) noexcept {
+  // This could fail if there are non-utf8 characters. This structure just
+  // contains integers and ASCII strings, so we should be good.
+  return client_measurement(sys.get(), fd, elapsed_usec, total).dump();
+}
+
+std::string Client::ndt7_upload_measurement(internal::Socket fd,
+                                            uint64_t elapsed_usec,
+                                            internal::Size total) noexcept {
+  nlohmann::json measurement =
+      client_measurement(sys.get(), fd, elapsed_usec, total);
+#if defined __linux__ && defined NDT7_UPLOAD_RETRANSMISSION_SUPPORT
+  // Calculate retransmission rate.
+  try {
+    nlohmann::json tcpinfo_json = measurement["TCPInfo"];
+    double bytes_retrans =
+        (double)tcpinfo_json["TcpiBytesRetrans"].get<int64_t>();
+    double bytes_sent = (double)tcpinfo_json["TcpiBytesSent"].get<int64_t>();
+    summary_.upload_retrans =
+        (bytes_sent != 0.0) ? bytes_retrans / bytes_sent : 0.0;
+  } catch (const std::exception &e) {
+    LIBNDT7_EMIT_WARNING("Cannot calculate retransmission rate: " << e.what());
+  }
+#endif  // __linux__ && NDT7_UPLOAD_RETRANSMISSION_SUPPORT
+  // This could fail if there are non-utf8 characters. This structure just
+  // contains integers and ASCII strings, so we should be good.
+  return measurement.dump();
+}
+
+// While dialing, this variable points to where to store the duration of each
+// connection phase. It is thread-local because we dial in parallel when racing
+// connections and because timings are collected before having a Transport.
+static thread_local PhaseTimings *netx_phases = nullptr;
+
+// Sets @p field of the PhaseTimings of the connection being dialed, if any, to
+// the milliseconds elapsed since @p begin.
+static void netx_phase_done(
+    double PhaseTimings::*field,
+    std::chrono::steady_clock::time_point begin) noexcept {
+  if (netx_phases != nullptr) {
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - begin;
+    netx_phases->*field = elapsed.count();
   }
-  summary_.upload_speed = compute_speed_kbits(total, elapsed.count());
-  return true;
 }
 
 bool Client::ndt7_connect(const UrlParts &url) noexcept {
+  if (conn_pending_) {
+    LIBNDT7_EMIT_DEBUG("ndt7: using the connection established by the race");
+    conn_pending_ = false;
+    return true;
+  }
   // Don't leak resources if the socket is already open.
-  if (internal::IsSocketValid(sock_)) {
+  if (conn_ != nullptr) {
     LIBNDT7_EMIT_DEBUG("ndt7: closing socket openned in previous attempt");
-    (void)netx_closesocket(sock_);
-    sock_ = (internal::Socket)-1;
+    (void)netx_closesocket(conn_->sock);
+    conn_ = nullptr;
   }
   // Note: ndt7 implies WebSocket.
   settings_.protocol_flags |= protocol_flag_websocket;
+  internal::Socket sock = (internal::Socket)-1;
+  PhaseTimings phases;
+  netx_phases = &phases;
   internal::Err err =
       netx_maybews_dial(url.host, url.port,
                         ws_f_connection | ws_f_upgrade | ws_f_sec_ws_accept |
                             ws_f_sec_ws_protocol,
-                        ws_proto_ndt7, url.path, &sock_);
+                        ws_proto_ndt7, url.path, &sock);
+  netx_phases = nullptr;
   if (err != internal::Err::none) {
     return false;
   }
+  conn_ = netx_transport_add(sock);
+  conn_phases_ = phases;
   LIBNDT7_EMIT_DEBUG("ndt7: WebSocket connection established");
   return true;
 }
 
+// default_ca_bundle_path returns the path of a readable CA bundle installed
+// with the system, or an empty string if there is none.
+static std::string default_ca_bundle_path() noexcept {
+#ifndef _WIN32
+  // See <https://serverfault.com/a/722646>
+  std::vector<std::string> candidates{
+      "/etc/ssl/cert.pem",                   // macOS
+      "/etc/ssl/certs/ca-certificates.crt",  // Debian
+  };
+  for (auto &candidate : candidates) {
+    if (access(candidate.c_str(), R_OK) == 0) {
+      return candidate;
+    }
+  }
+#endif
+  return "";
+}
+
+// Racing connections run in parallel threads sharing the same Client. Each
+// racer thread points this variable to a flag telling whether the race is
+// over, which netx_poll() checks, so that losers give up quickly.
+static thread_local const std::atomic<bool> *netx_race_over = nullptr;
+
+bool Client::ndt7_connect_race(const std::vector<UrlParts> &urls,
+                               size_t *winner,
+                               std::vector<size_t> *failed) noexcept {
+  assert(winner != nullptr);
+  conn_pending_ = false;
+  if (conn_ != nullptr) {
+    (void)netx_closesocket(conn_->sock);
+    conn_ = nullptr;
+  }
+  // Note: ndt7 implies WebSocket.
+  settings_.protocol_flags |= protocol_flag_websocket;
+  // The racers only read settings_, so we look for the CA bundle once here
+  // rather than letting each of them do it.
+  if ((settings_.protocol_flags & protocol_flag_tls) != 0 &&
+      settings_.tls_verify_peer && settings_.ca_bundle_path.empty()) {
+    settings_.ca_bundle_path = default_ca_bundle_path();
+  }
+  std::vector<internal::Socket> socks(urls.size(), (internal::Socket)-1);
+  std::vector<internal::Err> errs(urls.size(), internal::Err::none);
+  std::vector<PhaseTimings> phases(urls.size());
+  std::vector<size_t> finished;
+  std::vector<std::thread> threads;
+  std::atomic<bool> over{false};
+  std::mutex mutex;
+  std::condition_variable cond;
+  auto start = [&](size_t i) {
+    LIBNDT7_EMIT_DEBUG("ndt7: racing connection to " << urls[i].host);
+    threads.emplace_back([&, i]() {
+      netx_race_over = &over;
+      netx_phases = &phases[i];
+      internal::Socket sock = (internal::Socket)-1;
+      auto err = netx_maybews_dial(
+          urls[i].host, urls[i].port,
+          ws_f_connection | ws_f_upgrade | ws_f_sec_ws_accept |
+              ws_f_sec_ws_protocol,
+          ws_proto_ndt7, urls[i].path, &sock);
+      netx_race_over = nullptr;
+      netx_phases = nullptr;
+      std::unique_lock<std::mutex> _{mutex};
+      socks[i] = sock;
+      errs[i] = err;
+      finished.push_back(i);
+      cond.notify_all();
+    });
+  };
+  bool found = false;
+  {
+    std::unique_lock<std::mutex> lock{mutex};
+    size_t started = 0, seen = 0;
+    auto deadline = std::chrono::steady_clock::now();
+    while (!found && seen < urls.size()) {
+      if (started < urls.size() &&
+          (started == seen || std::chrono::steady_clock::now() >= deadline)) {
+        // Start the next attempt when the stagger delay has expired or when
+        // all the pending attempts have failed.
+        start(started++);
+        deadline = std::chrono::steady_clock::now() +
+                   std::chrono::milliseconds(settings_.race_stagger_ms);
+      }
+      if (finished.size() == seen) {
+        if (started < urls.size()) {
+          cond.wait_until(lock, deadline);
+        } else {
+          cond.wait(lock);
+        }
+      }
+      for (; seen < finished.size(); ++seen) {
+        auto i = finished[seen];
+        if (errs[i] == internal::Err::none && !found) {
+          found = true;
+          *winner = i;
+        } else if (errs[i] != internal::Err::none) {
+          LIBNDT7_EMIT_WARNING("ndt7: cannot connect to "
+                               << urls[i].host << ": "
+                               << internal::libndt7_perror(errs[i]));
+        }
+      }
+    }
+  }
+  over = true;
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  if (failed != nullptr) {
+    failed->clear();
+    for (size_t i = 0; i < errs.size(); ++i) {
+      // The attempts that did not start have Err::none.
+      if (errs[i] != internal::Err::none &&
+          errs[i] != internal::Err::canceled) {
+        failed->push_back(i);
+      }
+    }
+  }
+  for (size_t i = 0; i < socks.size(); ++i) {
+    if ((!found || i != *winner) && socks[i] != (internal::Socket)-1) {
+      LIBNDT7_EMIT_DEBUG("ndt7: closing the connection to " << urls[i].host);
+      (void)netx_closesocket(socks[i]);
+    }
+  }
+  if (!found) {
+    return false;
+  }
+  conn_ = netx_transport_add(socks[*winner]);
+  conn_phases_ = phases[*winner];
+  conn_pending_ = true;
+  LIBNDT7_EMIT_DEBUG("ndt7: " << urls[*winner].host << " won the race");
+  return true;
+}
+
+bool Client::ndt7_run_subtest(const std::vector<nlohmann::json> &targets,
+                              NettestFlags nettest) noexcept {
+  std::string scheme = "ws";
+  if ((settings_.protocol_flags & protocol_flag_tls) != 0) {
+    scheme = "wss";
+  }
+  std::string name = (nettest == nettest_flag_download) ? "download" : "upload";
+  std::vector<nlohmann::json> candidates;
+  std::vector<UrlParts> urls;
+  for (auto &target : targets) {
+    auto key = scheme + ":///ndt/v7/" + name;
+    if (!target.contains(key)) {
+      LIBNDT7_EMIT_WARNING("ndt7: scheme not found in results: " << scheme);
+      continue;
+    }
+    candidates.push_back(target);
+    urls.push_back(parse_ws_url(target[key]));
+  }
+  while (!urls.empty()) {
+    if (canceled_) {
+      return false;
+    }
+    if (std::chrono::steady_clock::now() >= run_deadline_) {
+      LIBNDT7_EMIT_WARNING("ndt7: the run has used its time budget");
+      return false;
+    }
+    size_t index = 0;
+    size_t width = (std::min)((size_t)settings_.race_width, urls.size());
+    if (width > 1) {
+      std::vector<UrlParts> batch{urls.begin(), urls.begin() + (long)width};
+      std::vector<size_t> failed;
+      bool connected = ndt7_connect_race(batch, &index, &failed);
+      // Only forget the servers that failed, not those that lost the race.
+      for (auto i : failed) {
+        locate_cache_forget(candidates[i]);
+      }
+      if (!connected) {
+        // Try the next batch of servers.
+        candidates.erase(candidates.begin(), candidates.begin() + (long)width);
+        urls.erase(urls.begin(), urls.begin() + (long)width);
+        continue;
+      }
+    }
+    bool success = (nettest == nettest_flag_download)
+                       ? ndt7_download(urls[index])
+                       : ndt7_upload(urls[index]);
+    subtest_deadline_ = std::chrono::steady_clock::time_point::max();
+    ndt7_set_progress(0, 0.0, 0.0);
+    conn_pending_ = false;
+    if (canceled_) {
+      // Close now, rather than when the next test connects.
+      if (conn_ != nullptr) {
+        (void)netx_closesocket(conn_->sock);
+      }
+      return false;
+    }
+    if (success) {
+      return true;
+    }
+    LIBNDT7_EMIT_WARNING("ndt7: " << name << " failed");
+    // Try next server.
+    locate_cache_forget(candidates[index]);
+    candidates.erase(candidates.begin() + (long)index);
+    urls.erase(urls.begin() + (long)index);
+  }
+  return false;
+}
+
+void Client::ndt7_set_progress(NettestFlags nettest, double elapsed,
+                               double speed) noexcept {
+  std::unique_lock<std::mutex> _{progress_mutex_};
+  progress_.nettest = nettest;
+  progress_.elapsed = elapsed;
+  progress_.speed = speed;
+}
+
+void Client::ndt7_sampler_reset(NettestFlags nettest) noexcept {
+  size_t capacity =
+      (settings_.sample_interval_ms > 0) ? settings_.sample_capacity : 0;
+  size_t tcp_info_capacity =
+      (settings_.tcp_info_interval_ms > 0) ? settings_.sample_capacity : 0;
+  std::unique_lock<std::mutex> _{tcp_info_mutex_};
+  if (nettest == nettest_flag_download) {
+    download_samples_.reset(capacity);
+    download_tcp_info_.reset(tcp_info_capacity);
+    download_measurements_.reset(settings_.sample_capacity);
+  } else {
+    upload_samples_.reset(capacity);
+    upload_tcp_info_.reset(tcp_info_capacity);
+    upload_measurements_.reset(settings_.sample_capacity);
+  }
+}
+
+void Client::ndt7_sampler_add(NettestFlags nettest,
+                              const ThroughputSample &sample) noexcept {
+  if (nettest == nettest_flag_download) {
+    download_samples_.add(sample);
+  } else {
+    upload_samples_.add(sample);
+  }
+}
+
+void Client::ndt7_tcp_info_add(NettestFlags nettest,
+                               const TcpInfoSample &sample) noexcept {
+  std::unique_lock<std::mutex> _{tcp_info_mutex_};
+  if (nettest == nettest_flag_download) {
+    download_tcp_info_.add(sample);
+  } else {
+    upload_tcp_info_.add(sample);
+  }
+}
+
+TcpInfoStats Client::ndt7_tcp_info_stats(
+    NettestFlags nettest, const std::vector<TcpInfoSample> &samples) noexcept {
+  TcpInfoStats stats;
+  if (samples.empty()) {
+    return stats;
+  }
+  stats.samples = samples.size();
+  auto &first = samples.front();
+  auto &last = samples.back();
+  uint64_t first_bytes = (nettest == nettest_flag_download)
+                             ? first.bytes_received
+                             : first.bytes_acked;
+  uint64_t last_bytes = (nettest == nettest_flag_download)
+                            ? last.bytes_received
+                            : last.bytes_acked;
+  if (last_bytes > first_bytes) {
+    stats.goodput = compute_speed_kbits(last_bytes - first_bytes,
+                                        last.elapsed - first.elapsed);
+  }
+  std::vector<uint32_t> rcv_rtts;
+  uint64_t app_limited = 0;
+  for (auto &sample : samples) {
+    if (sample.rcv_rtt > 0) {
+      rcv_rtts.push_back(sample.rcv_rtt);
+    }
+    stats.rcv_space = (std::max)(stats.rcv_space, sample.rcv_space);
+    app_limited += (sample.app_limited) ? 1 : 0;
+    if (sample.min_rtt > 0 &&
+        (stats.min_rtt == 0 || sample.min_rtt < stats.min_rtt)) {
+      stats.min_rtt = sample.min_rtt;
+    }
+  }
+  stats.app_limited = (double)app_limited / (double)samples.size();
+  if (!rcv_rtts.empty()) {
+    std::sort(rcv_rtts.begin(), rcv_rtts.end());
+    stats.rcv_rtt = rcv_rtts[(rcv_rtts.size() - 1) / 2];
+  }
+  if (last.busy_time > 0) {
+    stats.rwnd_limited = (double)last.rwnd_limited / (double)last.busy_time;
+    stats.sndbuf_limited =
+        (double)last.sndbuf_limited / (double)last.busy_time;
+  }
+  return stats;
+}
+
+CpuDiagnosis Client::ndt7_cpu_diagnosis(CpuDiagnosis diagnosis) noexcept {
+  diagnosis.cpu_limited = false;
+  diagnosis.confidence = 0.0;
+  if (diagnosis.cpu_time < 0.0 || diagnosis.wall_time <= 0.0) {
+    return diagnosis;
+  }
+  double on_cpu = (std::min)(diagnosis.cpu_time / diagnosis.wall_time, 1.0);
+  // Attribute the time off CPU to waiting for I/O or to being preempted in
+  // proportion to the voluntary and involuntary context switches. Time spent
+  // preempted is time in which we wanted a CPU but could not get one.
+  uint64_t switches =
+      diagnosis.voluntary_switches + diagnosis.involuntary_switches;
+  double preempted =
+      (switches > 0) ? (double)diagnosis.involuntary_switches / (double)switches
+                     : 0.0;
+  double busy = on_cpu + (1.0 - on_cpu) * preempted;
+  constexpr double busy_threshold = 0.9;
+  if (busy < busy_threshold) {
+    return diagnosis;
+  }
+  if (diagnosis.client_limited < 0.0) {
+    // Without TCP evidence, a busy thread is only a hint.
+    diagnosis.cpu_limited = true;
+    diagnosis.confidence = 0.5;
+    return diagnosis;
+  }
+  // A busy thread while the sender rarely waited for us means that we were
+  // keeping up with the network, e.g. by spinning, so we are not the limit.
+  constexpr double client_limited_threshold = 0.1;
+  if (diagnosis.client_limited < client_limited_threshold) {
+    return diagnosis;
+  }
+  diagnosis.cpu_limited = true;
+  diagnosis.confidence = (std::min)(0.5 + diagnosis.client_limited, 1.0);
+  return diagnosis;
+}
+
+ThroughputStats Client::ndt7_throughput_stats(
+    const std::vector<ThroughputSample> &samples) noexcept {
+  ThroughputStats stats;
+  if (samples.empty()) {
+    return stats;
+  }
+  std::vector<double> speeds;
+  for (auto &sample : samples) {
+    speeds.push_back(compute_speed_kbits(sample.bytes, sample.duration));
+  }
+  std::vector<double> sorted = speeds;
+  std::sort(sorted.begin(), sorted.end());
+  // Use the nearest-rank method, which always returns one of the speeds.
+  auto percentile = [&sorted](size_t p) -> double {
+    size_t rank = (p * sorted.size() + 99) / 100;
+    return sorted[(rank > 0) ? rank - 1 : 0];
+  };
+  stats.samples = samples.size();
+  stats.p10 = percentile(10);
+  stats.median = percentile(50);
+  stats.p90 = percentile(90);
+  stats.p99 = percentile(99);
+  stats.peak = sorted.back();
+  // Compute the steady state speed using the second half of the subtest.
+  std::vector<double> second_half;
+  double half = samples.back().elapsed / 2.0;
+  for (size_t i = 0; i < samples.size(); ++i) {
+    if (samples[i].elapsed > half) {
+      second_half.push_back(speeds[i]);
+    }
+  }
+  // This is empty when no time has elapsed, e.g. with a single sample at zero.
+  if (second_half.empty()) {
+    return stats;
+  }
+  std::sort(second_half.begin(), second_half.end());
+  double steady = second_half[(second_half.size() - 1) / 2];
+  if (steady <= 0.0) {
+    return stats;
+  }
+  // Slide a window of at least 250 ms over the samples.
+  constexpr double window = 0.25;
+  size_t first = 0;
+  uint64_t bytes = 0;
+  double duration = 0.0;
+  for (size_t i = 0; i < samples.size(); ++i) {
+    bytes += samples[i].bytes;
+    duration += samples[i].duration;
+    while (first < i && duration - samples[first].duration >= window) {
+      bytes -= samples[first].bytes;
+      duration -= samples[first].duration;
+      ++first;
+    }
+    if (duration >= window &&
+        compute_speed_kbits(bytes, duration) >= 0.9 * steady) {
+      stats.time_to_steady_state = samples[i].elapsed;
+      break;
+    }
+  }
+  return stats;
+}
+
 // WebSocket
 // `````````
 // This section contains the websocket implementation. Although this has been
@@ -1041,21 +2829,45 @@ internal::Err Client::ws_send_frame(internal::Socket sock, uint8_t first_byte,
   return netx_sendn(sock, prep.c_str(), prep.size());
 }
 
-internal::Err Client::ws_recv_any_frame(internal::Socket sock, uint8_t *opcode,
-                                        bool *fin, uint8_t *base,
-                                        internal::Size total,
-                                        internal::Size *count) const noexcept {
+// The receive path is written once as templates parametrized by a Reader,
+// i.e. a class with `recvn()` and `sock()` methods. NetxReader uses the
+// overridable netx API. The compile-time readers used by the data loops are
+// defined in the networking section below.
+class NetxReader {
+ public:
+  NetxReader(const Client *client, internal::Socket sock) noexcept
+      : client_{client}, sock_{sock} {}
+
+  internal::Err recvn(void *base, internal::Size count) const noexcept {
+    return client_->netx_recvn(sock_, base, count);
+  }
+
+  internal::Socket sock() const noexcept { return sock_; }
+
+ private:
+  const Client *client_;
+  internal::Socket sock_;
+};
+
+template <typename Reader>
+static internal::Err ws_recv_any_frame_impl(const Client *client,
+                                            const Reader &reader,
+                                            uint8_t *opcode, bool *fin,
+                                            uint8_t *base, internal::Size total,
+                                            internal::Size *count) noexcept {
   // TODO(bassosimone): in this function we should consider an EOF as an
   // error, because with WebSocket we have explicit FIN mechanism.
   if (opcode == nullptr || fin == nullptr || count == nullptr) {
-    LIBNDT7_EMIT_WARNING("ws_recv_any_frame: passed invalid return arguments");
+    LIBNDT7_EMIT_WARNING_EX(
+        client, "ws_recv_any_frame: passed invalid return arguments");
     return internal::Err::invalid_argument;
   }
   *opcode = 0;
   *fin = false;
   *count = 0;
   if (base == nullptr || total <= 0) {
-    LIBNDT7_EMIT_WARNING("ws_recv_any_frame: passed invalid buffer arguments");
+    LIBNDT7_EMIT_WARNING_EX(
+        client, "ws_recv_any_frame: passed invalid buffer arguments");
     return internal::Err::invalid_argument;
   }
   // Message header
@@ -1069,25 +2881,29 @@ internal::Err Client::ws_recv_any_frame(internal::Socket sock, uint8_t *opcode,
                 "Size is not 64 bit wide");
   {
     uint8_t buf[2];
-    auto err = netx_recvn(sock, buf, sizeof(buf));
+    auto err = reader.recvn(buf, sizeof(buf));
     if (err != internal::Err::none) {
-      LIBNDT7_EMIT_WARNING("ws_recv_any_frame: netx_recvn() failed for header");
+      LIBNDT7_EMIT_WARNING_EX(
+          client, "ws_recv_any_frame: netx_recvn() failed for header");
       return err;
     }
-    LIBNDT7_EMIT_DEBUG("ws_recv_any_frame: ws header: "
-                       << represent(std::string{(char *)buf, sizeof(buf)}));
+    LIBNDT7_EMIT_DEBUG_EX(
+        client, "ws_recv_any_frame: ws header: "
+                    << represent(std::string{(char *)buf, sizeof(buf)}));
     *fin = (buf[0] & ws_fin_flag) != 0;
-    LIBNDT7_EMIT_DEBUG("ws_recv_any_frame: FIN: " << std::boolalpha << *fin);
+    LIBNDT7_EMIT_DEBUG_EX(client,
+                          "ws_recv_any_frame: FIN: " << std::boolalpha << *fin);
     uint8_t reserved = (uint8_t)(buf[0] & ws_reserved_mask);
     if (reserved != 0) {
       // They only make sense for extensions, which we don't use. So we return
       // error. See <https://tools.ietf.org/html/rfc6455#section-5.2>.
-      LIBNDT7_EMIT_WARNING(
-          "ws_recv_any_frame: invalid reserved bits: " << reserved);
+      LIBNDT7_EMIT_WARNING_EX(
+          client, "ws_recv_any_frame: invalid reserved bits: " << reserved);
       return internal::Err::ws_proto;
     }
     *opcode = (uint8_t)(buf[0] & ws_opcode_mask);
-    LIBNDT7_EMIT_DEBUG("ws_recv_any_frame: opcode: " << (unsigned int)*opcode);
+    LIBNDT7_EMIT_DEBUG_EX(
+        client, "ws_recv_any_frame: opcode: " << (unsigned int)*opcode);
     switch (*opcode) {
         // clang-format off
       case ws_opcode_continue:
@@ -1099,7 +2915,7 @@ internal::Err Client::ws_recv_any_frame(internal::Socket sock, uint8_t *opcode,
       // clang-format off
       default:
         // See <https://tools.ietf.org/html/rfc6455#section-5.2>.
-        LIBNDT7_EMIT_WARNING("ws_recv_any_frame: invalid opcode");
+        LIBNDT7_EMIT_WARNING_EX(client, "ws_recv_any_frame: invalid opcode");
         return internal::Err::ws_proto;
     }
     auto hasmask = (buf[1] & ws_mask_flag) != 0;
@@ -1108,7 +2924,8 @@ internal::Err Client::ws_recv_any_frame(internal::Socket sock, uint8_t *opcode,
     //
     // See <https://tools.ietf.org/html/rfc6455#section-5.1>.
     if (hasmask) {
-      LIBNDT7_EMIT_WARNING("ws_recv_any_frame: received masked frame");
+      LIBNDT7_EMIT_WARNING_EX(client,
+                              "ws_recv_any_frame: received masked frame");
       return internal::Err::invalid_argument;
     }
     length = (buf[1] & ws_len_mask);
@@ -1117,51 +2934,59 @@ internal::Err Client::ws_recv_any_frame(internal::Socket sock, uint8_t *opcode,
       case ws_opcode_ping:
       case ws_opcode_pong:
         if (length > 125 || *fin == false) {
-          LIBNDT7_EMIT_WARNING("ws_recv_any_frame: control messages MUST have a "
-                       "payload length of 125 bytes or less and MUST NOT "
-                       "be fragmented (see RFC6455 Sect 5.5.)");
+          LIBNDT7_EMIT_WARNING_EX(
+              client,
+              "ws_recv_any_frame: control messages MUST have a "
+              "payload length of 125 bytes or less and MUST NOT "
+              "be fragmented (see RFC6455 Sect 5.5.)");
           return internal::Err::ws_proto;
         }
         break;
     }
     // As mentioned above, length is transmitted using big endian encoding.
-#define AL(value)                                                            \
-  do {                                                                       \
-    LIBNDT7_EMIT_DEBUG("ws_recv_any_frame: length byte: " << (unsigned int)(value)); \
-    length += (value);                                                       \
+#define AL(value)                                                       \
+  do {                                                                  \
+    LIBNDT7_EMIT_DEBUG_EX(client, "ws_recv_any_frame: length byte: "    \
+                                      << (unsigned int)(value));        \
+    length += (value);                                                  \
   } while (0)
     // The following should not happen because the lenght is over 7 bits but
     // it's nice to enforce assertions to make assumptions explicit.
     assert(length <= 127);
     if (length == 126) {
       uint8_t len_buf[2];
-      auto recvn_err = netx_recvn(sock, len_buf, sizeof(len_buf));
+      auto recvn_err = reader.recvn(len_buf, sizeof(len_buf));
       if (recvn_err != internal::Err::none) {
-        LIBNDT7_EMIT_WARNING(
-            "ws_recv_any_frame: netx_recvn() failed for 16 bit length");
+        LIBNDT7_EMIT_WARNING_EX(
+            client, "ws_recv_any_frame: netx_recvn() failed for 16 bit length");
         return recvn_err;
       }
-      LIBNDT7_EMIT_DEBUG("ws_recv_any_frame: 16 bit length: "
-                 << represent(std::string{(char *)len_buf, sizeof(len_buf)}));
+      LIBNDT7_EMIT_DEBUG_EX(
+          client,
+          "ws_recv_any_frame: 16 bit length: "
+              << represent(std::string{(char *)len_buf, sizeof(len_buf)}));
       length = 0;  // Need to reset the length as AL() does +=
       AL(((internal::Size)len_buf[0]) << 8);
       AL((internal::Size)len_buf[1]);
     } else if (length == 127) {
       uint8_t len_buf[8];
-      auto recvn_err = netx_recvn(sock, len_buf, sizeof(len_buf));
+      auto recvn_err = reader.recvn(len_buf, sizeof(len_buf));
       if (recvn_err != internal::Err::none) {
-        LIBNDT7_EMIT_WARNING(
-            "ws_recv_any_frame: netx_recvn() failed for 64 bit length");
+        LIBNDT7_EMIT_WARNING_EX(
+            client, "ws_recv_any_frame: netx_recvn() failed for 64 bit length");
         return recvn_err;
       }
-      LIBNDT7_EMIT_DEBUG("ws_recv_any_frame: 64 bit length: "
-                 << represent(std::string{(char *)len_buf, sizeof(len_buf)}));
+      LIBNDT7_EMIT_DEBUG_EX(
+          client,
+          "ws_recv_any_frame: 64 bit length: "
+              << represent(std::string{(char *)len_buf, sizeof(len_buf)}));
       length = 0;  // Need to reset the length as AL() does +=
       AL(((internal::Size)len_buf[0]) << 56);
       if ((len_buf[0] & 0x80) != 0) {
         // See <https://tools.ietf.org/html/rfc6455#section-5.2>: "[...] the
         // most significant bit MUST be 0."
-        LIBNDT7_EMIT_WARNING("ws_recv_any_frame: 64 bit length: invalid first bit");
+        LIBNDT7_EMIT_WARNING_EX(
+            client, "ws_recv_any_frame: 64 bit length: invalid first bit");
         return internal::Err::ws_proto;
       }
       AL(((internal::Size)len_buf[1]) << 48);
@@ -1174,45 +2999,53 @@ internal::Err Client::ws_recv_any_frame(internal::Socket sock, uint8_t *opcode,
     }
 #undef AL  // Tidy
     if (length > total) {
-      LIBNDT7_EMIT_WARNING("ws_recv_any_frame: buffer too small");
+      LIBNDT7_EMIT_WARNING_EX(client, "ws_recv_any_frame: buffer too small");
       return internal::Err::message_size;
     }
-    LIBNDT7_EMIT_DEBUG("ws_recv_any_frame: length: " << length);
+    LIBNDT7_EMIT_DEBUG_EX(client, "ws_recv_any_frame: length: " << length);
   }
-  LIBNDT7_EMIT_DEBUG("ws_recv_any_frame: received header");
+  LIBNDT7_EMIT_DEBUG_EX(client, "ws_recv_any_frame: received header");
   // Message body
   if (length > 0) {
     assert(length <= total);
-    auto err = netx_recvn(sock, base, length);
+    auto err = reader.recvn(base, length);
     if (err != internal::Err::none) {
-      LIBNDT7_EMIT_WARNING("ws_recv_any_frame: netx_recvn() failed for body");
+      LIBNDT7_EMIT_WARNING_EX(
+          client, "ws_recv_any_frame: netx_recvn() failed for body");
       return err;
     }
     // This makes the code too noisy when using -verbose. It may still be
     // useful to remove the comment when debugging.
     /*
-    LIBNDT7_EMIT_DEBUG("ws_recv_any_frame: received body: "
-               << represent(std::string{(char *)base, length}));
+    LIBNDT7_EMIT_DEBUG_EX(client, "ws_recv_any_frame: received body: "
+                          << represent(std::string{(char *)base, length}));
     */
     *count = length;
   } else {
-    LIBNDT7_EMIT_DEBUG("ws_recv_any_frame: no body in this message");
+    LIBNDT7_EMIT_DEBUG_EX(client,
+                          "ws_recv_any_frame: no body in this message");
     assert(*count == 0);
   }
   return internal::Err::none;
 }
 
-internal::Err Client::ws_recv_frame(internal::Socket sock, uint8_t *opcode, bool *fin,
-      uint8_t *base, internal::Size total, internal::Size *count) const noexcept {
+template <typename Reader>
+static internal::Err ws_recv_frame_impl(const Client *client,
+                                        const Reader &reader, uint8_t *opcode,
+                                        bool *fin, uint8_t *base,
+                                        internal::Size total,
+                                        internal::Size *count) noexcept {
   // "Control frames (see Section 5.5) MAY be injected in the middle of
   // a fragmented message.  Control frames themselves MUST NOT be fragmented."
   //    -- RFC6455 Section 5.4.
   if (opcode == nullptr || fin == nullptr || count == nullptr) {
-    LIBNDT7_EMIT_WARNING("ws_recv_frame: passed invalid return arguments");
+    LIBNDT7_EMIT_WARNING_EX(client,
+                            "ws_recv_frame: passed invalid return arguments");
     return internal::Err::invalid_argument;
   }
   if (base == nullptr || total <= 0) {
-    LIBNDT7_EMIT_WARNING("ws_recv_frame: passed invalid buffer arguments");
+    LIBNDT7_EMIT_WARNING_EX(client,
+                            "ws_recv_frame: passed invalid buffer arguments");
     return internal::Err::invalid_argument;
   }
   auto err = internal::Err::none;
@@ -1220,9 +3053,10 @@ again:
   *opcode = 0;
   *fin = false;
   *count = 0;
-  err = ws_recv_any_frame(sock, opcode, fin, base, total, count);
+  err = ws_recv_any_frame_impl(client, reader, opcode, fin, base, total, count);
   if (err != internal::Err::none) {
-    LIBNDT7_EMIT_WARNING("ws_recv_frame: ws_recv_any_frame() failed");
+    LIBNDT7_EMIT_WARNING_EX(client,
+                            "ws_recv_frame: ws_recv_any_frame() failed");
     return err;
   }
   // "The application MUST NOT send any more data frames after sending a
@@ -1231,38 +3065,47 @@ again:
   // with an error, which will cause the connection to be closed. Note that
   // we MUST reply with CLOSE here (again Sect. 5.5.1).
   if (*opcode == ws_opcode_close) {
-    LIBNDT7_EMIT_DEBUG("ws_recv_frame: received CLOSE frame; sending CLOSE back");
+    LIBNDT7_EMIT_DEBUG_EX(
+        client, "ws_recv_frame: received CLOSE frame; sending CLOSE back");
     // Setting the FIN flag because control messages MUST NOT be fragmented
     // as specified in Section 5.5 of RFC6455.
-    (void)ws_send_frame(sock, ws_opcode_close | ws_fin_flag, nullptr, 0);
+    (void)client->ws_send_frame(reader.sock(), ws_opcode_close | ws_fin_flag,
+                                nullptr, 0);
     // TODO(bassosimone): distinguish between a shutdown at the socket layer
     // and a proper shutdown implemented at the WebSocket layer.
     return internal::Err::eof;
   }
   if (*opcode == ws_opcode_pong) {
     // RFC6455 Sect. 5.5.3 says that we must ignore a PONG.
-    LIBNDT7_EMIT_DEBUG("ws_recv_frame: received PONG frame; continuing to read");
+    LIBNDT7_EMIT_DEBUG_EX(
+        client, "ws_recv_frame: received PONG frame; continuing to read");
     goto again;
   }
   if (*opcode == ws_opcode_ping) {
     // TODO(bassosimone): in theory a malicious server could DoS us by sending
     // a constant stream of PING frames for a long time.
-    LIBNDT7_EMIT_DEBUG("ws_recv_frame: received PING frame; PONGing back");
+    LIBNDT7_EMIT_DEBUG_EX(client,
+                          "ws_recv_frame: received PING frame; PONGing back");
     assert(*count <= total);
-    err = ws_send_frame(sock, ws_opcode_pong | ws_fin_flag, base, *count);
+    err = client->ws_send_frame(reader.sock(), ws_opcode_pong | ws_fin_flag,
+                                base, *count);
     if (err != internal::Err::none) {
-      LIBNDT7_EMIT_WARNING("ws_recv_frame: ws_send_frame() failed for PONG frame");
+      LIBNDT7_EMIT_WARNING_EX(
+          client, "ws_recv_frame: ws_send_frame() failed for PONG frame");
       return err;
     }
-    LIBNDT7_EMIT_DEBUG("ws_recv_frame: continuing to read after PONG");
+    LIBNDT7_EMIT_DEBUG_EX(client,
+                          "ws_recv_frame: continuing to read after PONG");
     goto again;
   }
   return internal::Err::none;
 }
 
-internal::Err Client::ws_recvmsg(  //
-    internal::Socket sock, uint8_t *opcode, uint8_t *base, internal::Size total,
-    internal::Size *count) const noexcept {
+template <typename Reader>
+static internal::Err ws_recvmsg_impl(const Client *client, const Reader &reader,
+                                     uint8_t *opcode, uint8_t *base,
+                                     internal::Size total,
+                                     internal::Size *count) noexcept {
   // General remark from RFC6455 Sect. 5.4: "[I]n absence of extensions, senders
   // and receivers must not depend on [...] specific frame boundaries."
   //
@@ -1272,63 +3115,182 @@ internal::Err Client::ws_recvmsg(  //
   // not only for the control protocol but also for c2s and s2c, where in
   // general we attempt to use messages smaller than 256K.
   if (opcode == nullptr || count == nullptr) {
-    LIBNDT7_EMIT_WARNING("ws_recv: passed invalid return arguments");
+    LIBNDT7_EMIT_WARNING_EX(client, "ws_recv: passed invalid return arguments");
     return internal::Err::invalid_argument;
   }
   if (base == nullptr || total <= 0) {
-    LIBNDT7_EMIT_WARNING("ws_recv: passed invalid buffer arguments");
+    LIBNDT7_EMIT_WARNING_EX(client, "ws_recv: passed invalid buffer arguments");
     return internal::Err::invalid_argument;
   }
   bool fin = false;
   *opcode = 0;
   *count = 0;
-  auto err = ws_recv_frame(sock, opcode, &fin, base, total, count);
+  auto err =
+      ws_recv_frame_impl(client, reader, opcode, &fin, base, total, count);
   if (err != internal::Err::none) {
     // We don't want to scary the user in case of clean EOF
     if (err != internal::Err::eof) {
-      LIBNDT7_EMIT_WARNING("ws_recv: ws_recv_frame() failed for first frame");
+      LIBNDT7_EMIT_WARNING_EX(
+          client, "ws_recv: ws_recv_frame() failed for first frame");
     }
     return err;
   }
   if (*opcode != ws_opcode_binary && *opcode != ws_opcode_text) {
-    LIBNDT7_EMIT_WARNING("ws_recv: received unexpected opcode: " << *opcode);
+    LIBNDT7_EMIT_WARNING_EX(client,
+                            "ws_recv: received unexpected opcode: " << *opcode);
     return internal::Err::ws_proto;
   }
   if (fin) {
-    LIBNDT7_EMIT_DEBUG("ws_recv: the first frame is also the last frame");
+    LIBNDT7_EMIT_DEBUG_EX(client,
+                          "ws_recv: the first frame is also the last frame");
     return internal::Err::none;
   }
   while (*count < total) {
     if ((uintptr_t)base > UINTPTR_MAX - *count) {
-      LIBNDT7_EMIT_WARNING("ws_recv: avoiding pointer overflow");
+      LIBNDT7_EMIT_WARNING_EX(client, "ws_recv: avoiding pointer overflow");
       return internal::Err::value_too_large;
     }
     uint8_t op = 0;
-		internal::Size n = 0;
-    err = ws_recv_frame(sock, &op, &fin, base + *count, total - *count, &n);
+    internal::Size n = 0;
+    err = ws_recv_frame_impl(client, reader, &op, &fin, base + *count,
+                             total - *count, &n);
     if (err != internal::Err::none) {
-      LIBNDT7_EMIT_WARNING("ws_recv: ws_recv_frame() failed for continuation frame");
+      LIBNDT7_EMIT_WARNING_EX(
+          client, "ws_recv: ws_recv_frame() failed for continuation frame");
       return err;
     }
     if (*count > internal::SizeMax - n) {
-      LIBNDT7_EMIT_WARNING("ws_recv: avoiding integer overflow");
+      LIBNDT7_EMIT_WARNING_EX(client, "ws_recv: avoiding integer overflow");
       return internal::Err::value_too_large;
     }
     *count += n;
     if (op != ws_opcode_continue) {
-      LIBNDT7_EMIT_WARNING("ws_recv: received unexpected opcode: " << op);
+      LIBNDT7_EMIT_WARNING_EX(client,
+                              "ws_recv: received unexpected opcode: " << op);
       return internal::Err::ws_proto;
     }
     if (fin) {
-      LIBNDT7_EMIT_DEBUG("ws_recv: this is the last frame");
+      LIBNDT7_EMIT_DEBUG_EX(client, "ws_recv: this is the last frame");
       return internal::Err::none;
     }
-    LIBNDT7_EMIT_DEBUG("ws_recv: this is not the last frame");
+    LIBNDT7_EMIT_DEBUG_EX(client, "ws_recv: this is not the last frame");
   }
-  LIBNDT7_EMIT_WARNING("ws_recv: buffer smaller than incoming message");
+  LIBNDT7_EMIT_WARNING_EX(client,
+                          "ws_recv: buffer smaller than incoming message");
   return internal::Err::message_size;
 }
 
+internal::Err Client::ws_recv_any_frame(internal::Socket sock, uint8_t *opcode,
+                                        bool *fin, uint8_t *base,
+                                        internal::Size total,
+                                        internal::Size *count) const noexcept {
+  return ws_recv_any_frame_impl(this, NetxReader{this, sock}, opcode, fin,
+                                base, total, count);
+}
+
+internal::Err Client::ws_recv_frame(internal::Socket sock, uint8_t *opcode,
+                                    bool *fin, uint8_t *base,
+                                    internal::Size total,
+                                    internal::Size *count) const noexcept {
+  return ws_recv_frame_impl(this, NetxReader{this, sock}, opcode, fin, base,
+                            total, count);
+}
+
+internal::Err Client::ws_recvmsg(  //
+    internal::Socket sock, uint8_t *opcode, uint8_t *base, internal::Size total,
+    internal::Size *count) const noexcept {
+  return ws_recvmsg_impl(this, NetxReader{this, sock}, opcode, base, total,
+                         count);
+}
+
+// BufferReader is a Reader serving bytes that were already received. It is
+// only used once we know that they contain all the bytes to parse.
+class BufferReader {
+ public:
+  BufferReader(internal::Socket sock, const uint8_t *data,
+               internal::Size size) noexcept
+      : sock_{sock}, data_{data}, size_{size} {}
+
+  internal::Err recvn(void *base, internal::Size count) const noexcept {
+    if (count > size_ - off_) {
+      return internal::Err::eof;
+    }
+    memcpy(base, data_ + off_, count);
+    off_ += count;
+    return internal::Err::none;
+  }
+
+  internal::Socket sock() const noexcept { return sock_; }
+
+ private:
+  internal::Socket sock_;
+  const uint8_t *data_;
+  internal::Size size_;
+  mutable internal::Size off_ = 0;
+};
+
+// ws_buffered_message_size returns the number of bytes at the beginning of
+// the @p size bytes at @p data that ws_recvmsg() would read to receive a
+// message of at most @p total bytes, or zero if some of them are missing.
+// We do not validate the frames here: once we know that a frame is invalid
+// or too large, we return a nonzero size and let ws_recvmsg() fail.
+static internal::Size ws_buffered_message_size(const uint8_t *data,
+                                               internal::Size size,
+                                               internal::Size total) noexcept {
+  internal::Size off = 0;
+  internal::Size payload = 0;
+  for (;;) {
+    if (size - off < 2) {
+      return 0;
+    }
+    const uint8_t *p = data + off;
+    uint8_t opcode = (uint8_t)(p[0] & ws_opcode_mask);
+    bool control = (opcode & 0x08) != 0;
+    internal::Size length = (internal::Size)(p[1] & ws_len_mask);
+    internal::Size extended = (length == 127) ? 8 : (length == 126) ? 2 : 0;
+    internal::Size header =
+        2 + extended + (((p[1] & ws_mask_flag) != 0) ? 4 : 0);
+    if (size - off < header) {
+      return 0;
+    }
+    if (extended > 0) {
+      length = 0;
+      for (internal::Size i = 0; i < extended; ++i) {
+        length = (length << 8) | p[2 + i];
+      }
+    }
+    if (!control) {
+      if (length > total - payload) {
+        return off + header;
+      }
+      payload += length;
+    } else if (length > 125) {
+      return off + header;
+    }
+    if (size - off - header < length) {
+      return 0;
+    }
+    off += header + length;
+    if (opcode == ws_opcode_close || (!control && (p[0] & ws_fin_flag) != 0) ||
+        off > total) {
+      return off;
+    }
+  }
+}
+
+internal::Err Client::ws_recvmsg_buffered(
+    internal::Socket sock, const uint8_t *data, internal::Size size,
+    uint8_t *opcode, uint8_t *base, internal::Size total,
+    internal::Size *count, internal::Size *consumed) const noexcept {
+  assert(consumed != nullptr);
+  *consumed = ws_buffered_message_size(data, size, total);
+  if (*consumed <= 0) {
+    return internal::Err::none;
+  }
+  return ws_recvmsg_impl(this, BufferReader{sock, data, *consumed}, opcode,
+                         base, total, count);
+}
+
 // } - - - END WEBSOCKET IMPLEMENTATION - - -
 
 // Networking layer
@@ -1381,22 +3343,23 @@ internal::Err Client::ws_recvmsg(  //
  * DEALINGS IN THE SOFTWARE.
  */
 
-// Helper used to route read and write calls to Client's I/O methods. We
+// Helper used to route read and write calls to the Transport's Sys. We
 // disregard the const qualifier of the `base` argument for the write operation,
 // but that is not a big deal since we add it again before calling the real
-// Socket op (see libndt7_bio_write() below).
-static int libndt7_bio_operation(
-    BIO *bio, char *base, int count,
-    std::function<internal::Ssize(Client *, internal::Socket, char *, internal::Size)> operation,
-    std::function<void(BIO *)> set_retry) noexcept {
-  // Implementation note: before we have a valid Client pointer we cannot
+// Socket op (see libndt7_bio_write() below). This is a template rather than
+// taking std::function arguments so that the operations are inlined.
+template <typename Operation, typename SetRetry>
+static int libndt7_bio_operation(BIO *bio, char *base, int count,
+                                 Operation operation,
+                                 SetRetry set_retry) noexcept {
+  // Implementation note: before we have a valid Transport pointer we cannot
   // of course use mocked functions. Hence OS_SET_LAST_ERROR().
   if (bio == nullptr || base == nullptr || count <= 0) {
     OS_SET_LAST_ERROR(LIBNDT7_OS_EINVAL);
     return -1;
   }
-  auto clnt = static_cast<Client *>(::BIO_get_data(bio));
-  if (clnt == nullptr) {
+  auto t = static_cast<internal::Transport *>(::BIO_get_data(bio));
+  if (t == nullptr || t->sys == nullptr) {
     OS_SET_LAST_ERROR(LIBNDT7_OS_EINVAL);
     return -1;
   }
@@ -1408,10 +3371,11 @@ static int libndt7_bio_operation(
   ::BIO_clear_retry_flags(bio);
   // Cast to Socket safe as int is okay to represent a Socket as we explained
   // above. Cast to Size safe because we've checked for negative above.
-	internal::Ssize rv = operation(clnt, (internal::Socket)sock, base, (internal::Size)count);
+  internal::Ssize rv =
+      operation(t, (internal::Socket)sock, base, (internal::Size)count);
   if (rv < 0) {
     assert(rv == -1);
-    auto err = clnt->netx_map_errno(clnt->sys->GetLastError());
+    auto err = Client::netx_map_errno(t->sys->GetLastError());
     if (err == internal::Err::operation_would_block) {
       set_retry(bio);
     }
@@ -1428,8 +3392,8 @@ static int libndt7_bio_write(BIO *bio, const char *base, int count) noexcept {
   // clang-format off
   return libndt7_bio_operation(
       bio, (char *)base, count,
-      [](Client *clnt, internal::Socket sock, char *base, internal::Size count) noexcept {
-        return clnt->sys->Send(sock, (const char *)base, count);
+      [](internal::Transport *t, internal::Socket sock, char *base, internal::Size count) noexcept {
+        return t->sys->Send(sock, (const char *)base, count);
       },
       [](BIO *bio) noexcept { ::BIO_set_retry_write(bio); });
   // clang-format on
@@ -1440,8 +3404,9 @@ static int libndt7_bio_read(BIO *bio, char *base, int count) noexcept {
   // clang-format off
   return libndt7_bio_operation(
       bio, base, count,
-      [](Client *clnt, internal::Socket sock, char *base, internal::Size count) noexcept {
-        return clnt->sys->Recv(sock, base, count);
+      [](internal::Transport *t, internal::Socket sock, char *base, internal::Size count) noexcept {
+        t->bio_reads += 1;
+        return t->sys->Recv(sock, base, count);
       },
       [](BIO *bio) noexcept { ::BIO_set_retry_read(bio); });
   // clang-format on
@@ -1486,8 +3451,56 @@ static BIO_METHOD *libndt7_bio_method() noexcept {
   return method.get();
 }
 
-// } - - - END BIO IMPLEMENTATION - - -
-
+// } - - - END BIO IMPLEMENTATION - - -
+
+// Creating a SSL_CTX means parsing the whole CA bundle, so we create one for
+// each distinct configuration and share it among all clients and runs. There
+// are only a handful of configurations in practice, hence we never free them.
+static SSL_CTX *ssl_ctx_get(const Client *client,
+                            const std::string &ca_bundle_path,
+                            bool tls_verify_peer,
+                            uint32_t recv_buffer_size) noexcept {
+  static std::mutex mutex;
+  static std::map<std::string, SSL_CTX *> cache;
+  std::string key = std::to_string((int)tls_verify_peer) + ":" +
+                    std::to_string(recv_buffer_size) + ":" + ca_bundle_path;
+  std::unique_lock<std::mutex> _{mutex};
+  auto it = cache.find(key);
+  if (it != cache.end()) {
+    LIBNDT7_EMIT_DEBUG_EX(client, "Reusing SSL_CTX");
+    return it->second;
+  }
+  // TODO(bassosimone): understand whether we can remove old SSL versions
+  // taking into account that the NDT server runs on very old code.
+  SSL_CTX *ctx = ::SSL_CTX_new(SSLv23_client_method());
+  if (ctx == nullptr) {
+    LIBNDT7_EMIT_WARNING_EX(client, "SSL_CTX_new() failed");
+    return nullptr;
+  }
+  LIBNDT7_EMIT_DEBUG_EX(client, "SSL_CTX created");
+  if (tls_verify_peer) {
+    if (!::SSL_CTX_load_verify_locations(ctx, ca_bundle_path.c_str(),
+                                         nullptr)) {
+      LIBNDT7_EMIT_WARNING_EX(
+          client, "Cannot load the CA bundle path from the file system");
+      ::SSL_CTX_free(ctx);
+      return nullptr;
+    }
+    LIBNDT7_EMIT_DEBUG_EX(client, "Loaded the CA bundle path");
+  }
+  if (recv_buffer_size > 0) {
+    // With read-ahead, OpenSSL reads as much as fits into its record buffer
+    // rather than first the record header and then the record body.
+    ::SSL_CTX_set_read_ahead(ctx, 1);
+#ifndef LIBRESSL_VERSION_NUMBER
+    ::SSL_CTX_set_default_read_buffer_len(ctx, recv_buffer_size);
+#endif
+    LIBNDT7_EMIT_DEBUG_EX(client, "Enabled TLS read-ahead");
+  }
+  cache[key] = ctx;
+  return ctx;
+}
+
 // Common function to map OpenSSL errors to Err.
 static internal::Err map_ssl_error(const Client *client, SSL *ssl,
                                    int ret) noexcept {
@@ -1556,12 +3569,14 @@ internal::Err Client::netx_maybews_dial(const std::string &hostname,
     return internal::Err::none;
   }
   LIBNDT7_EMIT_DEBUG("netx_maybews_dial: about to start websocket handhsake");
+  auto begin = std::chrono::steady_clock::now();
   err = ws_handshake(*sock, port, ws_flags, ws_protocol, url_path);
   if (err != internal::Err::none) {
     (void)netx_closesocket(*sock);
     *sock = (internal::Socket)-1;
     return err;
   }
+  netx_phase_done(&PhaseTimings::ws_handshake, begin);
   LIBNDT7_EMIT_DEBUG("netx_maybews_dial: established websocket channel");
   return internal::Err::none;
 }
@@ -1569,13 +3584,9 @@ internal::Err Client::netx_maybews_dial(const std::string &hostname,
 internal::Err Client::netx_maybessl_dial(const std::string &hostname,
                                          const std::string &port,
                                          internal::Socket *sock) noexcept {
-  // Temporarily clear the TLS flag because I/O functions inside of socks5h
-  // code would otherwise fail given we've not established TLS yet. Then restore
-  // the original flags right after the socks5h code returns.
-  auto flags = settings_.protocol_flags;
-  settings_.protocol_flags &= ~protocol_flag_tls;
+  // The socks5h code performs clear text I/O on the socket. This works because
+  // I/O only uses TLS once we have attached an SSL object to the Transport.
   auto err = netx_maybesocks5h_dial(hostname, port, sock);
-  settings_.protocol_flags = flags;
   if (err != internal::Err::none) {
     return err;
   }
@@ -1586,77 +3597,54 @@ internal::Err Client::netx_maybessl_dial(const std::string &hostname,
     return internal::Err::none;
   }
   LIBNDT7_EMIT_DEBUG("netx_maybetls_dial: about to start TLS handshake");
-  if (settings_.ca_bundle_path.empty() && settings_.tls_verify_peer) {
-#ifndef _WIN32
-    // See <https://serverfault.com/a/722646>
-    std::vector<std::string> candidates{
-        "/etc/ssl/cert.pem",                   // macOS
-        "/etc/ssl/certs/ca-certificates.crt",  // Debian
-    };
-    for (auto &candidate : candidates) {
-      if (access(candidate.c_str(), R_OK) == 0) {
-        LIBNDT7_EMIT_DEBUG("Using '" << candidate.c_str() << "' as CA");
-        settings_.ca_bundle_path = candidate;
-        break;
-      }
-    }
-    if (settings_.ca_bundle_path.empty()) {
-#endif
+  // Racing connections share settings_, so we must not write into it here.
+  std::string ca_bundle_path = settings_.ca_bundle_path;
+  if (ca_bundle_path.empty() && settings_.tls_verify_peer) {
+    ca_bundle_path = default_ca_bundle_path();
+    if (ca_bundle_path.empty()) {
       LIBNDT7_EMIT_WARNING(
           "You did not provide me with a CA bundle path. Without this "
           "information I cannot validate the other TLS endpoint. So, "
           "I will not continue to run this test.");
       return internal::Err::invalid_argument;
-#ifndef _WIN32
     }
-#endif
+    LIBNDT7_EMIT_DEBUG("Using '" << ca_bundle_path << "' as CA");
   }
   SSL *ssl = nullptr;
+  internal::Transport *transport = nullptr;
   {
-    // TODO(bassosimone): understand whether we can remove old SSL versions
-    // taking into account that the NDT server runs on very old code.
-    SSL_CTX *ctx = ::SSL_CTX_new(SSLv23_client_method());
+    SSL_CTX *ctx = ssl_ctx_get(this, ca_bundle_path,
+                               settings_.tls_verify_peer,
+                               settings_.recv_buffer_size);
     if (ctx == nullptr) {
-      LIBNDT7_EMIT_WARNING("SSL_CTX_new() failed");
       netx_closesocket(*sock);
       return internal::Err::ssl_generic;
     }
-    LIBNDT7_EMIT_DEBUG("SSL_CTX created");
-    if (settings_.tls_verify_peer) {
-      if (!::SSL_CTX_load_verify_locations(  //
-              ctx, settings_.ca_bundle_path.c_str(), nullptr)) {
-        LIBNDT7_EMIT_WARNING(
-            "Cannot load the CA bundle path from the file system");
-        ::SSL_CTX_free(ctx);
-        netx_closesocket(*sock);
-        return internal::Err::ssl_generic;
-      }
-      LIBNDT7_EMIT_DEBUG("Loaded the CA bundle path");
-    }
     ssl = ::SSL_new(ctx);
     if (ssl == nullptr) {
       LIBNDT7_EMIT_WARNING("SSL_new() failed");
-      ::SSL_CTX_free(ctx);
       netx_closesocket(*sock);
       return internal::Err::ssl_generic;
     }
     LIBNDT7_EMIT_DEBUG("SSL created");
-    ::SSL_CTX_free(ctx);  // Referenced by `ssl` so safe to free here
-    assert(fd_to_ssl_.count(*sock) == 0);
+    auto t = netx_transport_add(*sock);
+    assert(t->ssl == nullptr);
     // Implementation note: after this point `netx_closesocket(*sock)` will
     // imply that `::SSL_free(ssl)` is also called.
-    fd_to_ssl_[*sock] = ssl;
+    t->ssl = ssl;
+    t->sys = sys.get();
+    transport = t;
   }
   BIO *bio = ::BIO_new(libndt7_bio_method());
   if (bio == nullptr) {
     LIBNDT7_EMIT_WARNING("BIO_new() failed");
     netx_closesocket(*sock);
-    //::SSL_free(ssl); // MUST NOT be called because of fd_to_ssl
+    //::SSL_free(ssl); // MUST NOT be called because the Transport owns it
     return internal::Err::ssl_generic;
   }
   LIBNDT7_EMIT_DEBUG("libndt7 BIO created");
-  // We use BIO_NOCLOSE because it's the socket that owns the BIO and the SSL
-  // via fd_to_ssl rather than the other way around. Note that sockets are
+  // We use BIO_NOCLOSE because it's the Transport that owns the socket and the
+  // SSL (hence the BIO) rather than the other way around. Note that sockets are
   // always `int` in OpenSSL notwithstanding their definition on Windows, so
   // here we're casting unconditionally to silence compiler warnings.
   //
@@ -1667,7 +3655,9 @@ internal::Err Client::netx_maybessl_dial(const std::string &hostname,
   // For historical reasons, if the two BIOs are equal, the SSL object will
   // increase the refcount of bio just once rather than twice.
   ::SSL_set_bio(ssl, bio, bio);
-  ::BIO_set_data(bio, this);
+  // The BIO reaches the Sys and the counters through the Transport, which
+  // outlives it, so the TLS data path does not need to look it up.
+  ::BIO_set_data(bio, transport);
   ::SSL_set_connect_state(ssl);
   LIBNDT7_EMIT_DEBUG("Socket added to SSL context");
   if (settings_.tls_verify_peer) {
@@ -1680,12 +3670,15 @@ internal::Err Client::netx_maybessl_dial(const std::string &hostname,
     if (!::X509_VERIFY_PARAM_set1_host(p, hostname.data(), hostname.size())) {
       LIBNDT7_EMIT_WARNING("Cannot set the hostname for hostname validation");
       netx_closesocket(*sock);
-      //::SSL_free(ssl); // MUST NOT be called because of fd_to_ssl
+      //::SSL_free(ssl); // MUST NOT be called because the Transport owns it
       return internal::Err::ssl_generic;
     }
     SSL_set_verify(ssl, SSL_VERIFY_PEER, nullptr);
     LIBNDT7_EMIT_DEBUG("SSL_VERIFY_PEER configured");
   }
+  // We start measuring here, so that the time to create the SSL_CTX, which
+  // includes parsing the CA bundle on the first run, is not counted.
+  auto begin = std::chrono::steady_clock::now();
   err = ssl_retry_unary_op("SSL_do_handshake", this, ssl, *sock,
                            settings_.timeout, [](SSL *ssl) -> int {
                              ERR_clear_error();
@@ -1693,10 +3686,11 @@ internal::Err Client::netx_maybessl_dial(const std::string &hostname,
                            });
   if (err != internal::Err::none) {
     netx_closesocket(*sock);
-    //::SSL_free(ssl); // MUST NOT be called because of fd_to_ssl
+    //::SSL_free(ssl); // MUST NOT be called because the Transport owns it
     return internal::Err::ssl_generic;
   }
   LIBNDT7_EMIT_DEBUG("SSL handshake complete");
+  netx_phase_done(&PhaseTimings::tls_handshake, begin);
   return internal::Err::none;
 }
 
@@ -2000,9 +3994,12 @@ internal::Err Client::netx_dial(const std::string &hostname,
   // to reimplement a simpler method, compared to reimplementing getaddrinfo().
   std::vector<std::string> addresses;
   internal::Err err;
+  auto begin = std::chrono::steady_clock::now();
   if ((err = netx_resolve(hostname, &addresses)) != internal::Err::none) {
     return err;
   }
+  netx_phase_done(&PhaseTimings::resolve, begin);
+  begin = std::chrono::steady_clock::now();
   for (auto &addr : addresses) {
     addrinfo hints{};
     hints.ai_socktype = SOCK_STREAM;
@@ -2042,6 +4039,9 @@ internal::Err Client::netx_dial(const std::string &hostname,
         *sock = (libndt7::internal::Socket)-1;
         continue;
       }
+      // Buffer sizes, in particular, must be set before connecting because
+      // they determine the window scale negotiated in the SYN.
+      netx_apply_socket_profile(*sock, aip->ai_family);
       // While on Unix ai_addrlen is socklen_t, it's size_t on Windows. Just
       // for the sake of correctness, add a check that ensures that the size has
       // a reasonable value before casting to socklen_t. My understanding is
@@ -2087,7 +4087,73 @@ internal::Err Client::netx_dial(const std::string &hostname,
     }
   }
   // TODO(bassosimone): it's possible to write a better algorithm here
-  return *sock != -1 ? internal::Err::none : internal::Err::io_error;
+  if (*sock == -1) {
+    return internal::Err::io_error;
+  }
+  netx_phase_done(&PhaseTimings::connect, begin);
+  return internal::Err::none;
+}
+
+internal::Err Client::netx_probe(const std::string &hostname,
+                                 const std::string &port, uint32_t timeout_ms,
+                                 double *connect_time) noexcept {
+  assert(connect_time != nullptr);
+  auto begin = std::chrono::steady_clock::now();
+  auto remaining = [&]() -> int {
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - begin;
+    return (int)((double)timeout_ms - elapsed.count());
+  };
+  std::vector<std::string> addresses;
+  auto err = netx_resolve(hostname, &addresses);
+  if (err != internal::Err::none) {
+    return err;
+  }
+  if (addresses.empty() || remaining() <= 0) {
+    return internal::Err::timed_out;
+  }
+  addrinfo hints{};
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags |= AI_NUMERICHOST | AI_NUMERICSERV;
+  addrinfo *rp = nullptr;
+  int rv = sys->Getaddrinfo(addresses[0].data(), port.data(), &hints, &rp);
+  if (rv != 0) {
+    return netx_map_eai(rv);
+  }
+  assert(rp);
+  err = internal::Err::io_error;
+  sys->SetLastError(0);
+  auto sock = sys->NewSocket(rp->ai_family, rp->ai_socktype, 0);
+  if (internal::IsSocketValid(sock)) {
+    if (netx_setnonblocking(sock, true) == internal::Err::none) {
+      // We measure from here to exclude the time spent resolving.
+      auto start = std::chrono::steady_clock::now();
+      if (sys->Connect(sock, rp->ai_addr, (socklen_t)rp->ai_addrlen) == 0) {
+        err = internal::Err::none;
+      } else if (CONNECT_IN_PROGRESS(netx_map_errno(sys->GetLastError()))) {
+        std::vector<pollfd> pfds(1);
+        pfds[0].fd = sock;
+        pfds[0].events = POLLOUT;
+        int ms = remaining();
+        err = (ms > 0) ? netx_poll(&pfds, ms) : internal::Err::timed_out;
+        if (err == internal::Err::none) {
+          int soerr = 0;
+          socklen_t soerrlen = sizeof(soerr);
+          if (sys->Getsockopt(sock, SOL_SOCKET, SO_ERROR, (void *)&soerr,
+                              &soerrlen) != 0 ||
+              soerr != 0) {
+            err = internal::Err::io_error;
+          }
+        }
+      }
+      std::chrono::duration<double, std::milli> elapsed =
+          std::chrono::steady_clock::now() - start;
+      *connect_time = elapsed.count();
+    }
+    sys->Closesocket(sock);
+  }
+  sys->Freeaddrinfo(rp);
+  return err;
 }
 
 #undef CONNECT_IN_PROGRESS  // Tidy
@@ -2126,22 +4192,28 @@ internal::Err Client::netx_recv_nonblocking(
         "netx_poll() to check the state of a socket");
     return internal::Err::invalid_argument;
   }
+  auto t = netx_transport_get(fd);
+  if (t != nullptr && t->rbuf_off < t->rbuf_end) {
+    // Consume first what ws_recvmsg_fast() buffered but did not use.
+    *actual = (std::min)(count, t->rbuf_end - t->rbuf_off);
+    memcpy(base, t->rbuf.get() + t->rbuf_off, *actual);
+    t->rbuf_off += *actual;
+    return internal::Err::none;
+  }
   sys->SetLastError(0);
-  if ((settings_.protocol_flags & protocol_flag_tls) != 0) {
+  if (t != nullptr && t->ssl != nullptr) {
     if (count > INT_MAX) {
       return internal::Err::invalid_argument;
     }
-    if (fd_to_ssl_.count(fd) != 1) {
-      return internal::Err::invalid_argument;
-    }
-    auto ssl = fd_to_ssl_.at(fd);
     // TODO(bassosimone): add mocks and regress tests for OpenSSL.
     ERR_clear_error();
-    int ret = ::SSL_read(ssl, base, (int)count);
+    int ret = ::SSL_read(t->ssl, base, (int)count);
     if (ret <= 0) {
-      return map_ssl_error(this, ssl, ret);
+      return map_ssl_error(this, t->ssl, ret);
     }
     *actual = (internal::Size)ret;
+    t->recv_calls += 1;
+    t->bytes_recv += *actual;
     return internal::Err::none;
   }
   auto rv = sys->Recv(fd, base, count);
@@ -2154,6 +4226,10 @@ internal::Err Client::netx_recv_nonblocking(
     return internal::Err::eof;
   }
   *actual = (internal::Size)rv;
+  if (t != nullptr) {
+    t->recv_calls += 1;
+    t->bytes_recv += *actual;
+  }
   return internal::Err::none;
 }
 
@@ -2212,21 +4288,20 @@ internal::Err Client::netx_send_nonblocking(
     return internal::Err::invalid_argument;
   }
   sys->SetLastError(0);
-  if ((settings_.protocol_flags & protocol_flag_tls) != 0) {
+  auto t = netx_transport_get(fd);
+  if (t != nullptr && t->ssl != nullptr) {
     if (count > INT_MAX) {
       return internal::Err::invalid_argument;
     }
-    if (fd_to_ssl_.count(fd) != 1) {
-      return internal::Err::invalid_argument;
-    }
-    auto ssl = fd_to_ssl_.at(fd);
     ERR_clear_error();
     // TODO(bassosimone): add mocks and regress tests for OpenSSL.
-    int ret = ::SSL_write(ssl, base, (int)count);
+    int ret = ::SSL_write(t->ssl, base, (int)count);
     if (ret <= 0) {
-      return map_ssl_error(this, ssl, ret);
+      return map_ssl_error(this, t->ssl, ret);
     }
     *actual = (internal::Size)ret;
+    t->send_calls += 1;
+    t->bytes_sent += *actual;
     return internal::Err::none;
   }
   auto rv = sys->Send(fd, base, count);
@@ -2241,6 +4316,10 @@ internal::Err Client::netx_send_nonblocking(
     return internal::Err::io_error;
   }
   *actual = (internal::Size)rv;
+  if (t != nullptr) {
+    t->send_calls += 1;
+    t->bytes_sent += *actual;
+  }
   return internal::Err::none;
 }
 
@@ -2345,6 +4424,122 @@ internal::Err Client::netx_setnonblocking(internal::Socket fd,
   return internal::Err::none;
 }
 
+void Client::netx_apply_socket_profile(internal::Socket fd,
+                                       int family) noexcept {
+  const SocketProfile &profile = settings_.socket_profile;
+  auto set = [&](int level, int name, const void *value, socklen_t len,
+                 const char *option) {
+    if (sys->Setsockopt(fd, level, name, value, len) != 0) {
+      LIBNDT7_EMIT_WARNING("netx_apply_socket_profile: cannot set " << option);
+      return;
+    }
+    LIBNDT7_EMIT_DEBUG("netx_apply_socket_profile: set " << option);
+  };
+  auto set_int = [&](int level, int name, int value, const char *option) {
+    set(level, name, &value, sizeof(value), option);
+  };
+  if (profile.rcvbuf > 0) {
+#ifdef SO_RCVBUFFORCE
+    // Only succeeds with CAP_NET_ADMIN, so fall back silently.
+    if (sys->Setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &profile.rcvbuf,
+                        sizeof(profile.rcvbuf)) != 0)
+#endif  // SO_RCVBUFFORCE
+      set_int(SOL_SOCKET, SO_RCVBUF, profile.rcvbuf, "SO_RCVBUF");
+  }
+  if (profile.sndbuf > 0) {
+#ifdef SO_SNDBUFFORCE
+    if (sys->Setsockopt(fd, SOL_SOCKET, SO_SNDBUFFORCE, &profile.sndbuf,
+                        sizeof(profile.sndbuf)) != 0)
+#endif  // SO_SNDBUFFORCE
+      set_int(SOL_SOCKET, SO_SNDBUF, profile.sndbuf, "SO_SNDBUF");
+  }
+  if (!profile.congestion.empty()) {
+#ifdef TCP_CONGESTION
+    set(IPPROTO_TCP, TCP_CONGESTION, profile.congestion.data(),
+        (socklen_t)profile.congestion.size(), "TCP_CONGESTION");
+#else
+    LIBNDT7_EMIT_WARNING("netx_apply_socket_profile: TCP_CONGESTION is not "
+                         "supported on this platform");
+#endif  // TCP_CONGESTION
+  }
+  if (profile.notsent_lowat > 0) {
+#ifdef TCP_NOTSENT_LOWAT
+    set_int(IPPROTO_TCP, TCP_NOTSENT_LOWAT, profile.notsent_lowat,
+            "TCP_NOTSENT_LOWAT");
+#else
+    LIBNDT7_EMIT_WARNING("netx_apply_socket_profile: TCP_NOTSENT_LOWAT is not "
+                         "supported on this platform");
+#endif  // TCP_NOTSENT_LOWAT
+  }
+  if (profile.busy_poll > 0) {
+#ifdef SO_BUSY_POLL
+    set_int(SOL_SOCKET, SO_BUSY_POLL, profile.busy_poll, "SO_BUSY_POLL");
+#else
+    LIBNDT7_EMIT_WARNING("netx_apply_socket_profile: SO_BUSY_POLL is not "
+                         "supported on this platform");
+#endif  // SO_BUSY_POLL
+  }
+  if (profile.nodelay) {
+    set_int(IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+  }
+  if (profile.tos >= 0) {
+    if (family == AF_INET6) {
+#ifdef IPV6_TCLASS
+      set_int(IPPROTO_IPV6, IPV6_TCLASS, profile.tos, "IPV6_TCLASS");
+#endif  // IPV6_TCLASS
+    } else {
+      set_int(IPPROTO_IP, IP_TOS, profile.tos, "IP_TOS");
+    }
+  }
+}
+
+SocketProfile Client::netx_socket_profile(internal::Socket fd) const
+    noexcept {
+  SocketProfile profile;
+  auto get_int = [&](int level, int name, int *value) -> bool {
+    int v = 0;
+    socklen_t len = sizeof(v);
+    if (sys->Getsockopt(fd, level, name, &v, &len) != 0) {
+      return false;
+    }
+    *value = v;
+    return true;
+  };
+  (void)get_int(SOL_SOCKET, SO_RCVBUF, &profile.rcvbuf);
+  (void)get_int(SOL_SOCKET, SO_SNDBUF, &profile.sndbuf);
+#ifdef TCP_CONGESTION
+  {
+    char name[32] = {};
+    socklen_t len = sizeof(name) - 1;
+    if (sys->Getsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, name, &len) == 0) {
+      profile.congestion = name;
+    }
+  }
+#endif  // TCP_CONGESTION
+#ifdef TCP_NOTSENT_LOWAT
+  (void)get_int(IPPROTO_TCP, TCP_NOTSENT_LOWAT, &profile.notsent_lowat);
+#endif  // TCP_NOTSENT_LOWAT
+#ifdef SO_BUSY_POLL
+  (void)get_int(SOL_SOCKET, SO_BUSY_POLL, &profile.busy_poll);
+#endif  // SO_BUSY_POLL
+  int nodelay = 0;
+  if (get_int(IPPROTO_TCP, TCP_NODELAY, &nodelay)) {
+    profile.nodelay = (nodelay != 0);
+  }
+  sockaddr_storage ss{};
+  socklen_t sslen = sizeof(ss);
+  if (::getsockname(fd, (sockaddr *)&ss, &sslen) == 0) {
+    if (ss.ss_family == AF_INET6) {
+#ifdef IPV6_TCLASS
+      (void)get_int(IPPROTO_IPV6, IPV6_TCLASS, &profile.tos);
+#endif  // IPV6_TCLASS
+    } else {
+      (void)get_int(IPPROTO_IP, IP_TOS, &profile.tos);
+    }
+  }
+  return profile;
+}
+
 static internal::Err netx_wait(const Client *client, internal::Socket fd,
                                Timeout timeout,
                                short expected_events) noexcept {
@@ -2353,13 +4548,7 @@ static internal::Err netx_wait(const Client *client, internal::Socket fd,
   pfd.events |= expected_events;
   std::vector<pollfd> pfds;
   pfds.push_back(pfd);
-  // The following makes sure that it's okay to cast Timeout (an unsigned int
-  // type) to poll()'s timeout type (i.e. signed int).
-  static_assert(sizeof(timeout) == sizeof(int), "Unexpected Timeout size");
-  if (timeout > INT_MAX / 1000) {
-    timeout = INT_MAX / 1000;
-  }
-  auto err = client->netx_poll(&pfds, (int)timeout * 1000);
+  auto err = client->netx_poll(&pfds, client->netx_timeout_msec(timeout));
   // Either it's success and something happened or we failed and nothing
   // must have happened on the socket. We previously checked whether we had
   // `expected_events` set however the flags actually set by poll are
@@ -2375,6 +4564,24 @@ static internal::Err netx_wait(const Client *client, internal::Socket fd,
   return err;
 }
 
+internal::Socket Client::netx_cancel_fd() const noexcept {
+  return (internal::Socket)cancel_pipe_[0];
+}
+
+int Client::netx_timeout_msec(Timeout timeout) const noexcept {
+  int64_t msec = (std::min)((int64_t)timeout * 1000, (int64_t)INT_MAX);
+  auto deadline = (std::min)(run_deadline_, subtest_deadline_);
+  if (deadline != std::chrono::steady_clock::time_point::max()) {
+    // Round up, so that we don't wake up just before the deadline and then
+    // poll again with a zero timeout.
+    int64_t left = (int64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+                       deadline - std::chrono::steady_clock::now())
+                       .count();
+    msec = (std::min)(msec, (std::max)((int64_t)0, (left + 999) / 1000));
+  }
+  return (int)msec;
+}
+
 internal::Err Client::netx_wait_readable(internal::Socket fd,
                                          Timeout timeout) const noexcept {
   return netx_wait(this, fd, timeout, POLLIN);
@@ -2395,18 +4602,48 @@ internal::Err Client::netx_poll(std::vector<pollfd> *pfds,
     pfd.revents = 0;  // clear unconditionally
   }
   int rv = 0;
-#ifndef _WIN32
+  // We also poll the cancel pipe, so that cancel() wakes us up. Racer threads
+  // (see ndt7_connect_race()), and everyone when there is no cancel pipe, poll
+  // in slices so that they notice quickly when they should give up.
+  constexpr int race_slice_msec = 50;
+  int slice_msec = timeout_msec;
+  internal::Socket cancel_fd = netx_cancel_fd();
+  const bool sliced =
+      (netx_race_over != nullptr || cancel_fd == (internal::Socket)-1);
 again:
-#endif
+  if (canceled_ || (netx_race_over != nullptr && netx_race_over->load())) {
+    return internal::Err::canceled;
+  }
+  if (sliced) {
+    slice_msec = (timeout_msec < 0 || timeout_msec > race_slice_msec)
+                     ? race_slice_msec
+                     : timeout_msec;
+  }
   // Different operating systems have different representations of size_t
   // and of nfds_t. Overcome these differences by choosing a smaller
   // representation of the fdset size and letting the compiler promote
   // it to the correct integer. We don't need many fds in any case.
-  if (pfds->size() > UINT8_MAX) {
+  if (pfds->size() >= UINT8_MAX) {
     LIBNDT7_EMIT_WARNING("netx_poll: avoiding overflow");
     return internal::Err::value_too_large;
   }
-  rv = sys->Poll(pfds->data(), (uint8_t)pfds->size(), timeout_msec);
+  if (cancel_fd != (internal::Socket)-1) {
+    pollfd cancel_pfd{};
+    cancel_pfd.fd = cancel_fd;
+    cancel_pfd.events = POLLIN;
+    pfds->push_back(cancel_pfd);
+  }
+  rv = sys->Poll(pfds->data(), (uint8_t)pfds->size(), slice_msec);
+  if (cancel_fd != (internal::Socket)-1) {
+    bool woken = (rv > 0 && pfds->back().revents != 0);
+    pfds->pop_back();
+    if (woken) {
+      for (auto &pfd : *pfds) {
+        pfd.revents = 0;
+      }
+      return internal::Err::canceled;
+    }
+  }
   // TODO(bassosimone): handle the case where POLLNVAL is returned.
 #ifdef _WIN32
   if (rv == SOCKET_ERROR) {
@@ -2422,17 +4659,394 @@ again:
     return err;
   }
 #endif
+  if (rv == 0 && sliced && timeout_msec != slice_msec) {
+    if (timeout_msec > 0) {
+      timeout_msec -= slice_msec;
+    }
+    goto again;
+  }
   return (rv == 0) ? internal::Err::timed_out : internal::Err::none;
 }
 
-internal::Err Client::netx_shutdown_both(internal::Socket fd) noexcept {
-  if ((settings_.protocol_flags & protocol_flag_tls) != 0) {
-    if (fd_to_ssl_.count(fd) != 1) {
-      return internal::Err::invalid_argument;
+// Compile-time I/O path
+// `````````````````````
+//
+// The steady-state data loops move most bytes of a test and, going through
+// the virtual netx API, each read would cross netx_recvn(), netx_recv(),
+// netx_recv_nonblocking() and Sys::Recv(), each of them dispatched at runtime.
+// The following policies let the compiler flatten this stack. SysPolicy
+// selects between calling the base Sys methods directly (when no mock is
+// installed) and calling through the Sys vtable. IoPolicy selects between
+// clear text and TLS based on the Transport, which is decided once per
+// connection rather than by checking the Settings at every layer.
+
+class VirtualSys {
+ public:
+  static internal::Ssize recv(const internal::Sys &sys, internal::Socket fd,
+                              void *base, internal::Size count) noexcept {
+    return sys.Recv(fd, base, count);
+  }
+
+  static internal::Ssize send(const internal::Sys &sys, internal::Socket fd,
+                              const void *base, internal::Size count) noexcept {
+    return sys.Send(fd, base, count);
+  }
+
+  static int poll(const internal::Sys &sys, pollfd *pfds, uint8_t nfds,
+                  int ms) noexcept {
+    return sys.Poll(pfds, nfds, ms);
+  }
+
+  static int get_last_error(const internal::Sys &sys) noexcept {
+    return sys.GetLastError();
+  }
+
+  static void set_last_error(const internal::Sys &sys, int ec) noexcept {
+    sys.SetLastError(ec);
+  }
+};
+
+// The qualified calls below bypass the vtable and allow inlining.
+class RealSys {
+ public:
+  static internal::Ssize recv(const internal::Sys &sys, internal::Socket fd,
+                              void *base, internal::Size count) noexcept {
+    return sys.internal::Sys::Recv(fd, base, count);
+  }
+
+  static internal::Ssize send(const internal::Sys &sys, internal::Socket fd,
+                              const void *base, internal::Size count) noexcept {
+    return sys.internal::Sys::Send(fd, base, count);
+  }
+
+  static int poll(const internal::Sys &sys, pollfd *pfds, uint8_t nfds,
+                  int ms) noexcept {
+    return sys.internal::Sys::Poll(pfds, nfds, ms);
+  }
+
+  static int get_last_error(const internal::Sys &sys) noexcept {
+    return sys.internal::Sys::GetLastError();
+  }
+
+  static void set_last_error(const internal::Sys &sys, int ec) noexcept {
+    sys.internal::Sys::SetLastError(ec);
+  }
+};
+
+template <typename SysPolicy>
+static internal::Err fast_wait(const Client *client, internal::Socket fd,
+                               Timeout timeout, short events) noexcept {
+  pollfd pfds[2] = {};
+  pfds[0].fd = fd;
+  pfds[0].events = events;
+  pfds[1].fd = client->netx_cancel_fd();
+  pfds[1].events = POLLIN;
+  uint8_t nfds = (pfds[1].fd != (internal::Socket)-1) ? 2 : 1;
+  for (;;) {
+    if (client->is_canceled()) {
+      return internal::Err::canceled;
+    }
+    int rv = SysPolicy::poll(*client->sys, pfds, nfds,
+                             client->netx_timeout_msec(timeout));
+    if (rv < 0) {
+      auto err =
+          Client::netx_map_errno(SysPolicy::get_last_error(*client->sys));
+      if (err == internal::Err::interrupted) {
+        continue;
+      }
+      return err;
+    }
+    if (nfds == 2 && pfds[1].revents != 0) {
+      return internal::Err::canceled;
+    }
+    return (rv == 0) ? internal::Err::timed_out : internal::Err::none;
+  }
+}
+
+template <typename SysPolicy>
+class PlainIo {
+ public:
+  using Sys = SysPolicy;
+
+  static internal::Err recv(const Client *client, internal::Transport *t,
+                            void *base, internal::Size count,
+                            internal::Size *actual) noexcept {
+    auto rv = SysPolicy::recv(*client->sys, t->sock, base, count);
+    if (rv < 0) {
+      return Client::netx_map_errno(SysPolicy::get_last_error(*client->sys));
+    }
+    if (rv == 0) {
+      return internal::Err::eof;
+    }
+    *actual = (internal::Size)rv;
+    t->recv_calls += 1;
+    t->bytes_recv += *actual;
+    return internal::Err::none;
+  }
+
+  static internal::Err send(const Client *client, internal::Transport *t,
+                            const void *base, internal::Size count,
+                            internal::Size *actual) noexcept {
+    auto rv = SysPolicy::send(*client->sys, t->sock, base, count);
+    if (rv < 0) {
+      return Client::netx_map_errno(SysPolicy::get_last_error(*client->sys));
+    }
+    if (rv == 0) {
+      return internal::Err::io_error;
+    }
+    *actual = (internal::Size)rv;
+    t->send_calls += 1;
+    t->bytes_sent += *actual;
+    return internal::Err::none;
+  }
+};
+
+template <typename SysPolicy>
+class TlsIo {
+ public:
+  using Sys = SysPolicy;
+
+  static internal::Err recv(const Client *client, internal::Transport *t,
+                            void *base, internal::Size count,
+                            internal::Size *actual) noexcept {
+    SysPolicy::set_last_error(*client->sys, 0);
+    ERR_clear_error();
+#if !defined LIBRESSL_VERSION_NUMBER && OPENSSL_VERSION_NUMBER >= 0x10101000L
+    size_t n = 0;
+    int ret = ::SSL_read_ex(t->ssl, base, count, &n);
+    if (ret <= 0) {
+      return map_ssl_error(client, t->ssl, ret);
+    }
+    *actual = (internal::Size)n;
+#else
+    if (count > INT_MAX) {
+      count = INT_MAX;  // short reads are fine here
+    }
+    int ret = ::SSL_read(t->ssl, base, (int)count);
+    if (ret <= 0) {
+      return map_ssl_error(client, t->ssl, ret);
+    }
+    *actual = (internal::Size)ret;
+#endif
+    t->recv_calls += 1;
+    t->bytes_recv += *actual;
+    return internal::Err::none;
+  }
+
+  static internal::Err send(const Client *client, internal::Transport *t,
+                            const void *base, internal::Size count,
+                            internal::Size *actual) noexcept {
+    if (count > INT_MAX) {
+      count = INT_MAX;  // short writes are fine here
+    }
+    SysPolicy::set_last_error(*client->sys, 0);
+    ERR_clear_error();
+    int ret = ::SSL_write(t->ssl, base, (int)count);
+    if (ret <= 0) {
+      return map_ssl_error(client, t->ssl, ret);
+    }
+    *actual = (internal::Size)ret;
+    t->send_calls += 1;
+    t->bytes_sent += *actual;
+    return internal::Err::none;
+  }
+};
+
+// FastReader is a Reader (see the WebSocket code) using an IoPolicy. When the
+// Transport has a receive buffer, it fills the buffer with large reads and
+// serves the parser's small reads (e.g. frame headers) from there.
+template <typename IoPolicy>
+class FastReader {
+ public:
+  FastReader(const Client *client, internal::Transport *t,
+             Timeout timeout) noexcept
+      : client_{client}, t_{t}, timeout_{timeout} {}
+
+  internal::Err recvn(void *base, internal::Size count) const noexcept {
+    if (t_->rbuf_size <= 0) {
+      return recvn_unbuffered(base, count);
+    }
+    uint8_t *p = (uint8_t *)base;
+    while (count > 0) {
+      if (t_->rbuf_off < t_->rbuf_end) {
+        internal::Size n = (std::min)(count, t_->rbuf_end - t_->rbuf_off);
+        memcpy(p, t_->rbuf.get() + t_->rbuf_off, n);
+        t_->rbuf_off += n;
+        p += n;
+        count -= n;
+        continue;
+      }
+      if (count >= t_->rbuf_size) {
+        return recvn_unbuffered(p, count);  // no point in copying
+      }
+      internal::Size n = 0;
+      auto err = recv_some(t_->rbuf.get(), t_->rbuf_size, &n);
+      if (err != internal::Err::none) {
+        return err;
+      }
+      t_->rbuf_off = 0;
+      t_->rbuf_end = n;
+    }
+    return internal::Err::none;
+  }
+
+  internal::Err sendn(const void *base, internal::Size count) const noexcept {
+    internal::Size off = 0;
+    while (off < count) {
+      internal::Size n = 0;
+      auto err = IoPolicy::send(client_, t_, (const char *)base + off,
+                                count - off, &n);
+      if (err == internal::Err::none) {
+        off += n;
+        continue;
+      }
+      if (err == internal::Err::ssl_want_read) {
+        err = fast_wait<typename IoPolicy::Sys>(client_, t_->sock, timeout_,
+                                                POLLIN);
+      } else if (err == internal::Err::operation_would_block ||
+                 err == internal::Err::ssl_want_write) {
+        err = fast_wait<typename IoPolicy::Sys>(client_, t_->sock, timeout_,
+                                                POLLOUT);
+      }
+      if (err != internal::Err::none) {
+        return err;
+      }
     }
-    auto ssl = fd_to_ssl_.at(fd);
+    return internal::Err::none;
+  }
+
+  internal::Socket sock() const noexcept { return t_->sock; }
+
+ private:
+  internal::Err recv_some(void *base, internal::Size count,
+                          internal::Size *actual) const noexcept {
+    for (;;) {
+      auto err = IoPolicy::recv(client_, t_, base, count, actual);
+      if (err == internal::Err::operation_would_block ||
+          err == internal::Err::ssl_want_read) {
+        err = fast_wait<typename IoPolicy::Sys>(client_, t_->sock, timeout_,
+                                                POLLIN);
+      } else if (err == internal::Err::ssl_want_write) {
+        err = fast_wait<typename IoPolicy::Sys>(client_, t_->sock, timeout_,
+                                                POLLOUT);
+      } else {
+        return err;
+      }
+      if (err != internal::Err::none) {
+        return err;
+      }
+    }
+  }
+
+  internal::Err recvn_unbuffered(void *base,
+                                 internal::Size count) const noexcept {
+    internal::Size off = 0;
+    while (off < count) {
+      internal::Size n = 0;
+      auto err = recv_some((char *)base + off, count - off, &n);
+      if (err != internal::Err::none) {
+        return err;
+      }
+      off += n;
+    }
+    return internal::Err::none;
+  }
+
+  const Client *client_;
+  internal::Transport *t_;
+  Timeout timeout_;
+};
+
+bool Client::netx_fastpath_enabled() const noexcept {
+  return settings_.io_fastpath;
+}
+
+internal::Err Client::ws_recvmsg_fast(internal::Transport *t, uint8_t *opcode,
+                                      uint8_t *base, internal::Size total,
+                                      internal::Size *count) const noexcept {
+  assert(t != nullptr);
+  if (settings_.recv_buffer_size > 0 && t->rbuf == nullptr) {
+    t->rbuf.reset(new uint8_t[settings_.recv_buffer_size]);
+    t->rbuf_size = settings_.recv_buffer_size;
+  }
+  // We only bypass the Sys vtable when the Sys is not a mock.
+  bool real_sys = typeid(*sys) == typeid(internal::Sys);
+  if (t->ssl != nullptr) {
+    if (real_sys) {
+      FastReader<TlsIo<RealSys>> reader{this, t, settings_.timeout};
+      return ws_recvmsg_impl(this, reader, opcode, base, total, count);
+    }
+    FastReader<TlsIo<VirtualSys>> reader{this, t, settings_.timeout};
+    return ws_recvmsg_impl(this, reader, opcode, base, total, count);
+  }
+  if (real_sys) {
+    FastReader<PlainIo<RealSys>> reader{this, t, settings_.timeout};
+    return ws_recvmsg_impl(this, reader, opcode, base, total, count);
+  }
+  FastReader<PlainIo<VirtualSys>> reader{this, t, settings_.timeout};
+  return ws_recvmsg_impl(this, reader, opcode, base, total, count);
+}
+
+internal::Err Client::netx_sendn_fast(internal::Transport *t, const void *base,
+                                      internal::Size count) const noexcept {
+  assert(t != nullptr);
+  bool real_sys = typeid(*sys) == typeid(internal::Sys);
+  if (t->ssl != nullptr) {
+    if (real_sys) {
+      return FastReader<TlsIo<RealSys>>{this, t, settings_.timeout}.sendn(
+          base, count);
+    }
+    return FastReader<TlsIo<VirtualSys>>{this, t, settings_.timeout}.sendn(
+        base, count);
+  }
+  if (real_sys) {
+    return FastReader<PlainIo<RealSys>>{this, t, settings_.timeout}.sendn(
+        base, count);
+  }
+  return FastReader<PlainIo<VirtualSys>>{this, t, settings_.timeout}.sendn(
+      base, count);
+}
+
+internal::Err Client::netx_recv_nonblocking_fast(
+    internal::Transport *t, void *base, internal::Size count,
+    internal::Size *actual) const noexcept {
+  assert(t != nullptr && actual != nullptr);
+  *actual = 0;
+  if (t->rbuf_off < t->rbuf_end) {
+    // Consume first what ws_recvmsg_fast() buffered but did not use.
+    *actual = (std::min)(count, t->rbuf_end - t->rbuf_off);
+    memcpy(base, t->rbuf.get() + t->rbuf_off, *actual);
+    t->rbuf_off += *actual;
+    return internal::Err::none;
+  }
+  bool real_sys = typeid(*sys) == typeid(internal::Sys);
+  if (t->ssl != nullptr) {
+    return (real_sys) ? TlsIo<RealSys>::recv(this, t, base, count, actual)
+                      : TlsIo<VirtualSys>::recv(this, t, base, count, actual);
+  }
+  return (real_sys) ? PlainIo<RealSys>::recv(this, t, base, count, actual)
+                    : PlainIo<VirtualSys>::recv(this, t, base, count, actual);
+}
+
+internal::Err Client::netx_send_nonblocking_fast(
+    internal::Transport *t, const void *base, internal::Size count,
+    internal::Size *actual) const noexcept {
+  assert(t != nullptr && actual != nullptr);
+  *actual = 0;
+  bool real_sys = typeid(*sys) == typeid(internal::Sys);
+  if (t->ssl != nullptr) {
+    return (real_sys) ? TlsIo<RealSys>::send(this, t, base, count, actual)
+                      : TlsIo<VirtualSys>::send(this, t, base, count, actual);
+  }
+  return (real_sys) ? PlainIo<RealSys>::send(this, t, base, count, actual)
+                    : PlainIo<VirtualSys>::send(this, t, base, count, actual);
+}
+
+internal::Err Client::netx_shutdown_both(internal::Socket fd) noexcept {
+  auto t = netx_transport_get(fd);
+  if (t != nullptr && t->ssl != nullptr) {
     auto err = ssl_retry_unary_op(  //
-        "SSL_shutdown", this, ssl, fd, settings_.timeout, [](SSL *ssl) -> int {
+        "SSL_shutdown", this, t->ssl, fd, settings_.timeout, [](SSL *ssl) -> int {
           ERR_clear_error();
           return ::SSL_shutdown(ssl);
         });
@@ -2447,12 +5061,25 @@ internal::Err Client::netx_shutdown_both(internal::Socket fd) noexcept {
 }
 
 internal::Err Client::netx_closesocket(internal::Socket fd) noexcept {
-  if ((settings_.protocol_flags & protocol_flag_tls) != 0) {
-    if (fd_to_ssl_.count(fd) != 1) {
-      return internal::Err::invalid_argument;
+  std::unique_ptr<internal::Transport> t;
+  {
+    std::unique_lock<std::mutex> _{transports_mutex_};
+    for (auto it = transports_.begin(); it != transports_.end(); ++it) {
+      if ((*it)->sock == fd) {
+        t = std::move(*it);
+        transports_.erase(it);
+        break;
+      }
+    }
+  }
+  if (t != nullptr) {
+    if (conn_ == t.get()) {
+      conn_ = nullptr;
+    }
+    if (t->ssl != nullptr) {
+      ::SSL_free(t->ssl);
+      t->ssl = nullptr;
     }
-    ::SSL_free(fd_to_ssl_.at(fd));
-    fd_to_ssl_.erase(fd);
   }
   if (sys->Closesocket(fd) != 0) {
     return netx_map_errno(sys->GetLastError());
@@ -2460,6 +5087,36 @@ internal::Err Client::netx_closesocket(internal::Socket fd) noexcept {
   return internal::Err::none;
 }
 
+internal::Transport *Client::netx_transport_get(
+    internal::Socket fd) const noexcept {
+  // The data loops perform I/O on conn_, so we find it without locking. This
+  // is safe because conn_ only changes on the thread running the test, while
+  // racer threads are not running.
+  if (conn_ != nullptr && conn_->sock == fd) {
+    return conn_;
+  }
+  std::unique_lock<std::mutex> _{transports_mutex_};
+  for (auto &t : transports_) {
+    if (t->sock == fd) {
+      return t.get();
+    }
+  }
+  return nullptr;
+}
+
+internal::Transport *Client::netx_transport_add(internal::Socket fd) noexcept {
+  std::unique_lock<std::mutex> _{transports_mutex_};
+  for (auto &t : transports_) {
+    if (t->sock == fd) {
+      return t.get();
+    }
+  }
+  std::unique_ptr<internal::Transport> t{new internal::Transport{}};
+  t->sock = fd;
+  transports_.push_back(std::move(t));
+  return transports_.back().get();
+}
+
 // Curl helpers
 // ````````````
 
@@ -2500,7 +5157,10 @@ class CurlxLoggerAdapter : public internal::Logger {
 bool Client::query_locate_api_curl(const std::string &url, long timeout,
                                    std::string *body) noexcept {
   CurlxLoggerAdapter adapter{this};
-  internal::Curlx curlx{adapter, settings_.user_agent};
+  // The process-wide share handle lets consecutive queries, including the ones
+  // issued by different clients, reuse the DNS cache and warm connections.
+  internal::Curlx curlx{adapter, settings_.user_agent,
+                        &internal::CurlShare::Global()};
   return curlx.GetMaybeSOCKS5(settings_.socks5h_port, url, timeout, body);
 }
 
@@ -4,10 +4,14 @@
 #ifndef MEASUREMENTLAB_LIBNDT7_API_H
 #define MEASUREMENTLAB_LIBNDT7_API_H
 
+#include <atomic>
+#include <chrono>
 #include <cstdint>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #ifndef LIBNDT7_SINGLE_INCLUDE
@@ -59,6 +63,7 @@ namespace libndt7 {
 namespace internal {
 enum class Err;
 class Sys;
+class Transport;
 using Size = uint64_t;
 #ifdef _WIN32
 using Socket = SOCKET;
@@ -156,17 +161,20 @@ class EventHandler {
  public:
   /// Called when a warning message is emitted. The default behavior is to write
   /// the warning onto the `std::clog` standard stream. \warning This method
-  /// could be called from a different thread context.
+  /// could be called from a different thread context, but never concurrently
+  /// with on_warning(), on_info() or on_debug().
   virtual void on_warning(const std::string &s) const noexcept = 0;
 
   /// Called when an informational message is emitted. The default behavior is
   /// to write the message onto the `std::clog` standard stream. \warning This
-  /// method could be called from a different thread context.
+  /// method could be called from a different thread context, but never
+  /// concurrently with on_warning(), on_info() or on_debug().
   virtual void on_info(const std::string &s) const noexcept = 0;
 
   /// Called when a debug message is emitted. The default behavior is
   /// to write the message onto the `std::clog` standard stream. \warning This
-  /// method could be called from a different thread context.
+  /// method could be called from a different thread context, but never
+  /// concurrently with on_warning(), on_info() or on_debug().
   virtual void on_debug(const std::string &s) const noexcept = 0;
 
   /// Called to inform you about the measured speed. The default behavior is
@@ -211,6 +219,45 @@ class EventHandler {
   virtual ~EventHandler() noexcept;
 };
 
+// SocketProfile
+// `````````````
+
+/// Socket options. In the Settings, these are the options that we set before
+/// connecting, where zero, empty or negative values mean using the system
+/// default. In the SummaryData, these are the values that the kernel reports
+/// for the connection used by a subtest, where zero, empty or negative values
+/// mean that the option is not available on this platform.
+struct SocketProfile {
+  /// Receive buffer size (SO_RCVBUF) in bytes. Setting it disables receive
+  /// buffer autotuning on Linux. On Linux, when we have the CAP_NET_ADMIN
+  /// capability, we use SO_RCVBUFFORCE to exceed net.core.rmem_max. Note that
+  /// Linux reports twice the value that was set, to account for overhead.
+  int rcvbuf = 0;
+
+  /// Send buffer size (SO_SNDBUF) in bytes. Like rcvbuf, but for sending and
+  /// using SO_SNDBUFFORCE to exceed net.core.wmem_max.
+  int sndbuf = 0;
+
+  /// Congestion control algorithm (TCP_CONGESTION), e.g. "bbr". This is only
+  /// supported on Linux and the algorithm must be available to the kernel.
+  std::string congestion;
+
+  /// Maximum number of unsent bytes in the send buffer (TCP_NOTSENT_LOWAT).
+  int notsent_lowat = 0;
+
+  /// Microseconds to busy poll the device queue when reading (SO_BUSY_POLL).
+  /// This is only supported on Linux.
+  int busy_poll = 0;
+
+  /// Whether to disable Nagle's algorithm (TCP_NODELAY), such that the small
+  /// control frames, e.g. measurements and close frames, are sent at once.
+  bool nodelay = false;
+
+  /// Type of service (IP_TOS, or IPV6_TCLASS for IPv6), e.g. a DSCP value
+  /// shifted left by two bits.
+  int tos = -1;
+};
+
 // Settings
 // ````````
 
@@ -267,6 +314,12 @@ class Settings {
   /// than anticipated, due to buffering and/or changing network conditions.
   Timeout max_runtime = Timeout{14} /* seconds */;
 
+  /// Overall time budget, in milliseconds, of Client::run(), covering the
+  /// Locate API query and all the subtests. Every I/O operation waits at most
+  /// until the end of the budget, as well as at most until the end of the
+  /// subtest in progress. Zero (the default) means no overall budget.
+  uint32_t max_run_time_ms = 0;
+
   /// SOCKSv5h port to use for tunnelling traffic using, e.g., Tor. If non
   /// empty, all DNS and TCP traffic should be tunnelled over such port.
   std::string socks5h_port;
@@ -284,30 +337,591 @@ class Settings {
   /// not disable this option in general, since doing that is insecure.
   bool tls_verify_peer = true;
 
+  /// Size of the buffer used to receive data during the download. With a
+  /// nonzero size, we read from the network in chunks of up to this many bytes
+  /// and parse WebSocket frames out of the buffer, rather than issuing a read
+  /// for each frame header and payload. With TLS, we also enable OpenSSL's
+  /// read-ahead using a record buffer of this size, so that a single socket
+  /// read fetches several TLS records. Set to zero to disable buffering.
+  uint32_t recv_buffer_size = 1 << 17;
+
+  /// Whether the download and the upload may use a compile-time I/O path,
+  /// which calls the Sys directly and bypasses the virtual netx_recv(),
+  /// netx_recvn(), netx_send(), netx_sendn() and related methods of Client.
+  /// This path is faster but ignores overrides of such methods, hence it is
+  /// disabled by default. Enable it unless you override them.
+  bool io_fastpath = false;
+
+  /// Whether to cache the results of the Locate API and reuse them, as long as
+  /// the access tokens they contain are valid, rather than querying the Locate
+  /// API before each test. Servers that fail are removed from the cache, so
+  /// that the next test starts from the next server in the list.
+  bool locate_cache = true;
+
+  /// File where to persist the cached Locate API results, such that later
+  /// processes can also reuse them. When empty (the default), results are only
+  /// cached in memory and shared by the clients in the current process.
+  std::string locate_cache_path;
+
+  /// Time budget, in milliseconds, for measuring the TCP connect time of the
+  /// servers returned by the Locate API. All servers are probed in parallel and
+  /// the tests then use the servers in order of increasing connect time. Set to
+  /// zero to use the servers in the order returned by the Locate API.
+  uint32_t probe_timeout_ms = 500;
+
+  /// Maximum number of servers to which we connect in parallel before each
+  /// subtest. We start connecting to the first server and, if no connection
+  /// is ready after race_stagger_ms, also to the next one, and so on. We use
+  /// the first connection completing the WebSocket handshake and close the
+  /// others. Since each losing connection also starts a test on its server,
+  /// racing is disabled by default, i.e. we try the servers one after the
+  /// other. Set to a value larger than one (e.g. 3) to enable racing.
+  uint32_t race_width = 1;
+
+  /// Delay in milliseconds between connection attempts (see race_width).
+  uint32_t race_stagger_ms = 250;
+
+  /// Interval in milliseconds at which we sample the number of bytes that
+  /// have been transferred, which cannot be smaller than 10 ms. See also
+  /// Client::get_time_series(). Set to zero to disable sampling.
+  uint32_t sample_interval_ms = 100;
+
+  /// Interval in milliseconds at which a separate thread reads the TCP_INFO
+  /// of the connection used by a subtest. See also Client::get_tcp_info().
+  /// This is only supported on Linux. Set to zero to disable sampling.
+  uint32_t tcp_info_interval_ms = 100;
+
+  /// Maximum number of throughput samples and of TCP_INFO samples kept for
+  /// each subtest. The memory for samples is allocated before each subtest
+  /// starts. When a subtest produces more samples, we keep the most recent.
+  uint32_t sample_capacity = 4096;
+
+  /// Whether to stop a subtest early once its speed has converged, i.e. when
+  /// the speeds measured over three consecutive windows of convergence_window_ms
+  /// are within convergence_tolerance of their mean. This saves bytes, e.g. on
+  /// metered networks, at the cost of some accuracy.
+  bool adaptive_duration = false;
+
+  /// Length of the windows used to decide whether the speed has converged.
+  /// Must be positive when adaptive_duration is enabled; otherwise the speed
+  /// is never considered converged and run() logs a warning.
+  uint32_t convergence_window_ms = 1000;
+
+  /// Maximum relative difference between the speed of each window and the
+  /// mean speed for the speed to be considered converged.
+  double convergence_tolerance = 0.05;
+
+  /// Maximum number of bytes that each subtest should transfer. Both the
+  /// download and the upload stop as soon as they have transferred at least
+  /// this many bytes, so they may exceed it by up to one message (i.e. up to
+  /// the size of the last WebSocket frame). Zero means no limit.
+  uint64_t subtest_byte_budget = 0;
+
   /// Run in "summary only" mode. If this flag is enabled, most log messages are
   /// hidden and the only output on stdout is the test summary.
   bool summary_only = false;
+
+  /// Maximum number of unsent bytes in the send buffer during the upload
+  /// (TCP_NOTSENT_LOWAT), used unless socket_profile.notsent_lowat is set.
+  /// Keeping few unsent bytes lets the measurement messages leave on time,
+  /// rather than after all the queued payload. Zero keeps the system default.
+  uint32_t upload_notsent_lowat = 1 << 17;
+
+  /// Socket options set by netx_dial() before connecting. The values that the
+  /// kernel used are in SummaryData::download_socket and upload_socket. When
+  /// the kernel rejects an option, we log a warning and continue.
+  SocketProfile socket_profile;
 };
 
 // SummaryData
 // ```````````
 
+// ServerProbe contains the result of probing a server before the test.
+struct ServerProbe {
+  // Hostname of the server.
+  std::string hostname;
+
+  // Port of the server.
+  std::string port;
+
+  // Time to establish a TCP connection (milliseconds). Negative if the
+  // connection failed or did not complete within the time budget.
+  double connect_time = -1.0;
+};
+
+// SpeedHistogram counts the speeds measured at each measurement interval of a
+// subtest. Buckets are fixed, so that recording a speed does not allocate.
+struct SpeedHistogram {
+  // Number of buckets, not counting the one for speeds above all bounds.
+  static constexpr size_t num_buckets = 13;
+
+  // Returns the inclusive upper bound of the @p index-th bucket (kbit/s).
+  static double upper_bound(size_t index) noexcept;
+
+  // Number of speeds in each bucket. Unlike Prometheus buckets, these are not
+  // cumulative. The last entry counts the speeds above all bounds.
+  uint64_t counts[num_buckets + 1] = {};
+
+  // Number of recorded speeds.
+  uint64_t count = 0;
+
+  // Sum of the recorded speeds (kbit/s).
+  double sum = 0.0;
+
+  // Records the @p speed measured over an interval (kbit/s).
+  void observe(double speed) noexcept;
+};
+
+// NetxCounters counts the I/O performed by the connection used by a subtest.
+struct NetxCounters {
+  // Bytes received, including WebSocket framing.
+  uint64_t bytes_recv = 0;
+
+  // Bytes sent, including WebSocket framing.
+  uint64_t bytes_sent = 0;
+
+  // Successful nonblocking receives.
+  uint64_t recv_calls = 0;
+
+  // Successful nonblocking sends.
+  uint64_t send_calls = 0;
+
+  // Socket reads issued by the TLS layer.
+  uint64_t bio_reads = 0;
+};
+
+// PhaseTimings contains the time spent in each phase of establishing and
+// starting to use the connection of a subtest (milliseconds). Phases that were
+// not measured, e.g. the TLS handshake for clear text tests, are negative.
+struct PhaseTimings {
+  // Time to resolve the server hostname.
+  double resolve = -1.0;
+
+  // Time to establish the TCP connection.
+  double connect = -1.0;
+
+  // Time to complete the TLS handshake.
+  double tls_handshake = -1.0;
+
+  // Time to complete the WebSocket handshake.
+  double ws_handshake = -1.0;
+
+  // Time from the start of the subtest to the first payload message that we
+  // received (download) or sent (upload). Since the first messages are small,
+  // this is a good approximation of the time to the first payload byte.
+  double first_message = -1.0;
+};
+
+// StopReason tells why a subtest stopped.
+enum class StopReason {
+  // The subtest ran for its whole duration.
+  completed = 0,
+
+  // The speed converged (see Settings::adaptive_duration).
+  converged = 1,
+
+  // The subtest transferred at least Settings::subtest_byte_budget bytes.
+  byte_budget = 2,
+
+  // Client::cancel() was called.
+  canceled = 3,
+};
+
+// ThroughputSample is the number of bytes transferred during a sampling
+// interval of a subtest.
+struct ThroughputSample {
+  // Time since the beginning of the subtest at the end of the interval
+  // (seconds).
+  double elapsed = 0.0;
+
+  // Duration of the interval (seconds). This could be longer than the sampling
+  // interval, e.g. when we're blocked waiting for a large message.
+  double duration = 0.0;
+
+  // Bytes transferred during the interval.
+  uint64_t bytes = 0;
+};
+
+// ThroughputStats summarizes the speeds of the samples of a subtest (kbit/s).
+// All fields are zero when there are no samples.
+struct ThroughputStats {
+  // Number of samples.
+  uint64_t samples = 0;
+
+  // 10th percentile of the speed.
+  double p10 = 0.0;
+
+  // Median speed.
+  double median = 0.0;
+
+  // 90th percentile of the speed.
+  double p90 = 0.0;
+
+  // 99th percentile of the speed.
+  double p99 = 0.0;
+
+  // Highest speed.
+  double peak = 0.0;
+
+  // Time since the beginning of the subtest after which the speed reached its
+  // steady state (seconds), i.e. when the average speed over 250 ms reached
+  // 90% of the median speed of the second half of the subtest. Negative if
+  // the speed never reached the steady state.
+  double time_to_steady_state = -1.0;
+};
+
+// TcpInfoSample contains TCP_INFO fields read by the client during a subtest.
+// The receiver-side fields are mostly useful for the download, while the
+// sender-side fields are mostly useful for the upload.
+struct TcpInfoSample {
+  // Time since the beginning of the subtest (seconds).
+  double elapsed = 0.0;
+
+  // Smoothed RTT (microseconds).
+  uint32_t rtt = 0;
+
+  // Minimum RTT (microseconds).
+  uint32_t min_rtt = 0;
+
+  // RTT estimated by the receiver (microseconds).
+  uint32_t rcv_rtt = 0;
+
+  // Receive buffer space the receiver is advertising (bytes).
+  uint32_t rcv_space = 0;
+
+  // Bytes received and acknowledged.
+  uint64_t bytes_received = 0;
+
+  // Bytes sent and acknowledged by the peer.
+  uint64_t bytes_acked = 0;
+
+  // Sender estimate of the delivery rate (bytes/s).
+  uint64_t delivery_rate = 0;
+
+  // Time spent sending data (microseconds).
+  uint64_t busy_time = 0;
+
+  // Time the sender was limited by the receive window (microseconds).
+  uint64_t rwnd_limited = 0;
+
+  // Time the sender was limited by the send buffer (microseconds).
+  uint64_t sndbuf_limited = 0;
+
+  // Whether the delivery rate was limited by the sending application.
+  bool app_limited = false;
+};
+
+// TcpInfoStats summarizes the TCP_INFO samples of a subtest. All fields are
+// zero when there are no samples.
+struct TcpInfoStats {
+  // Number of samples.
+  uint64_t samples = 0;
+
+  // Speed at which the data was acknowledged, i.e. received by the client
+  // during the download and by the server during the upload (kbit/s).
+  double goodput = 0.0;
+
+  // Median of the RTT estimated by the receiver (microseconds).
+  uint32_t rcv_rtt = 0;
+
+  // Minimum RTT (microseconds).
+  uint32_t min_rtt = 0;
+
+  // Largest receive buffer space advertised by the receiver (bytes).
+  uint32_t rcv_space = 0;
+
+  // Fraction of the sending time limited by the receive window.
+  double rwnd_limited = 0.0;
+
+  // Fraction of the sending time limited by the send buffer.
+  double sndbuf_limited = 0.0;
+
+  // Fraction of the samples whose delivery rate was limited by the sending
+  // application rather than by the network.
+  double app_limited = 0.0;
+};
+
+// The following X-macros list the fields of the objects of an ndt7 measurement
+// message as XX(type, member, JSON name). The TCPInfo fields follow the order
+// of the kernel struct tcp_info, as reported by M-Lab servers.
+#define NDT7_ENUM_MEASUREMENT_APP_INFO     \
+  XX(uint64_t, elapsed_time, ElapsedTime) \
+  XX(uint64_t, num_bytes, NumBytes)
+
+#define NDT7_ENUM_MEASUREMENT_TCP_INFO         \
+  XX(uint8_t, state, State)                    \
+  XX(uint8_t, ca_state, CAState)               \
+  XX(uint8_t, retransmits, Retransmits)        \
+  XX(uint8_t, probes, Probes)                  \
+  XX(uint8_t, backoff, Backoff)                \
+  XX(uint8_t, options, Options)                \
+  XX(uint8_t, wscale, WScale)                  \
+  XX(uint8_t, app_limited, AppLimited)         \
+  XX(uint32_t, rto, RTO)                       \
+  XX(uint32_t, ato, ATO)                       \
+  XX(uint32_t, snd_mss, SndMSS)                \
+  XX(uint32_t, rcv_mss, RcvMSS)                \
+  XX(uint32_t, unacked, Unacked)               \
+  XX(uint32_t, sacked, Sacked)                 \
+  XX(uint32_t, lost, Lost)                     \
+  XX(uint32_t, retrans, Retrans)               \
+  XX(uint32_t, fackets, Fackets)               \
+  XX(uint32_t, last_data_sent, LastDataSent)   \
+  XX(uint32_t, last_ack_sent, LastAckSent)     \
+  XX(uint32_t, last_data_recv, LastDataRecv)   \
+  XX(uint32_t, last_ack_recv, LastAckRecv)     \
+  XX(uint32_t, pmtu, PMTU)                     \
+  XX(uint32_t, rcv_ssthresh, RcvSsThresh)      \
+  XX(uint32_t, rtt, RTT)                       \
+  XX(uint32_t, rttvar, RTTVar)                 \
+  XX(uint32_t, snd_ssthresh, SndSsThresh)      \
+  XX(uint32_t, snd_cwnd, SndCwnd)              \
+  XX(uint32_t, advmss, AdvMSS)                 \
+  XX(uint32_t, reordering, Reordering)         \
+  XX(uint32_t, rcv_rtt, RcvRTT)                \
+  XX(uint32_t, rcv_space, RcvSpace)            \
+  XX(uint32_t, total_retrans, TotalRetrans)    \
+  XX(int64_t, pacing_rate, PacingRate)         \
+  XX(int64_t, max_pacing_rate, MaxPacingRate)  \
+  XX(uint64_t, bytes_acked, BytesAcked)        \
+  XX(uint64_t, bytes_received, BytesReceived)  \
+  XX(uint32_t, segs_out, SegsOut)              \
+  XX(uint32_t, segs_in, SegsIn)                \
+  XX(uint32_t, notsent_bytes, NotsentBytes)    \
+  XX(uint32_t, min_rtt, MinRTT)                \
+  XX(uint32_t, data_segs_in, DataSegsIn)       \
+  XX(uint32_t, data_segs_out, DataSegsOut)     \
+  XX(uint64_t, delivery_rate, DeliveryRate)    \
+  XX(uint64_t, busy_time, BusyTime)            \
+  XX(uint64_t, rwnd_limited, RWndLimited)      \
+  XX(uint64_t, sndbuf_limited, SndBufLimited)  \
+  XX(uint32_t, delivered, Delivered)           \
+  XX(uint32_t, delivered_ce, DeliveredCE)      \
+  XX(uint64_t, bytes_sent, BytesSent)          \
+  XX(uint64_t, bytes_retrans, BytesRetrans)    \
+  XX(uint32_t, dsack_dups, DSackDups)          \
+  XX(uint32_t, reord_seen, ReordSeen)          \
+  XX(uint32_t, rcv_ooopack, RcvOooPack)        \
+  XX(uint32_t, snd_wnd, SndWnd)                \
+  XX(uint64_t, elapsed_time, ElapsedTime)
+
+#define NDT7_ENUM_MEASUREMENT_BBR_INFO     \
+  XX(uint64_t, bw, BW)                     \
+  XX(uint32_t, min_rtt, MinRTT)            \
+  XX(uint32_t, pacing_gain, PacingGain)    \
+  XX(uint32_t, cwnd_gain, CwndGain)        \
+  XX(uint64_t, elapsed_time, ElapsedTime)
+
+#define XX(type_, member_, json_) member_,
+
+// MeasurementAppInfoField, MeasurementTcpInfoField and MeasurementBbrInfoField
+// name the fields of the objects of an ndt7 measurement, such that we can
+// tell whether the message contained them (see MeasurementTcpInfo::has()).
+enum class MeasurementAppInfoField : uint8_t { NDT7_ENUM_MEASUREMENT_APP_INFO };
+enum class MeasurementTcpInfoField : uint8_t { NDT7_ENUM_MEASUREMENT_TCP_INFO };
+enum class MeasurementBbrInfoField : uint8_t { NDT7_ENUM_MEASUREMENT_BBR_INFO };
+
+#undef XX
+#define XX(type_, member_, json_) type_ member_ = 0;
+
+// MeasurementAppInfo is the AppInfo of an ndt7 measurement.
+struct MeasurementAppInfo {
+  NDT7_ENUM_MEASUREMENT_APP_INFO
+
+  // Bit N is set when the message contained the field N.
+  uint64_t present = 0;
+
+  // Returns whether the message contained @p field.
+  bool has(MeasurementAppInfoField field) const noexcept {
+    return ((present >> (unsigned)field) & 1) != 0;
+  }
+};
+
+// MeasurementTcpInfo is the TCPInfo of an ndt7 measurement.
+struct MeasurementTcpInfo {
+  NDT7_ENUM_MEASUREMENT_TCP_INFO
+
+  // Bit N is set when the message contained the field N.
+  uint64_t present = 0;
+
+  // Returns whether the message contained @p field.
+  bool has(MeasurementTcpInfoField field) const noexcept {
+    return ((present >> (unsigned)field) & 1) != 0;
+  }
+};
+
+// MeasurementBbrInfo is the BBRInfo of an ndt7 measurement.
+struct MeasurementBbrInfo {
+  NDT7_ENUM_MEASUREMENT_BBR_INFO
+
+  // Bit N is set when the message contained the field N.
+  uint64_t present = 0;
+
+  // Returns whether the message contained @p field.
+  bool has(MeasurementBbrInfoField field) const noexcept {
+    return ((present >> (unsigned)field) & 1) != 0;
+  }
+};
+
+#undef XX
+
+// Measurement is an ndt7 measurement message sent by the server. Unlike the
+// message, it has a fixed layout, such that we can keep the measurements of a
+// whole subtest in little memory. Fields missing in the message are zero and
+// their bit in the `present` bitmask of their object is not set.
+struct Measurement {
+  // Whether the message contained the AppInfo, TCPInfo and BBRInfo objects.
+  bool has_app_info = false;
+  bool has_tcp_info = false;
+  bool has_bbr_info = false;
+
+  MeasurementAppInfo app_info;
+  MeasurementTcpInfo tcp_info;
+  MeasurementBbrInfo bbr_info;
+};
+
+// ConnectionInfo identifies the connection of a subtest. The server sends it
+// at most once, hence we do not store it into each Measurement.
+struct ConnectionInfo {
+  // Client endpoint, as seen by the server.
+  std::string client;
+
+  // Server endpoint.
+  std::string server;
+
+  // Unique identifier of the connection.
+  std::string uuid;
+};
+
+// CpuDiagnosis tells whether the client CPU, rather than the network, limited
+// the speed of a subtest. The client is considered CPU-limited when the thread
+// running the subtest was on a CPU (or was preempted) for at least 90% of the
+// subtest and, when known, TCP confirms that the sender was waiting for the
+// client rather than for the network.
+struct CpuDiagnosis {
+  // CPU time used by the thread running the subtest (seconds). Negative if
+  // not available on this platform.
+  double cpu_time = -1.0;
+
+  // Duration of the subtest (seconds).
+  double wall_time = 0.0;
+
+  // Voluntary context switches of the thread, i.e., waits for I/O.
+  uint64_t voluntary_switches = 0;
+
+  // Involuntary context switches of the thread, i.e., preemptions.
+  uint64_t involuntary_switches = 0;
+
+  // Fraction of the sending time in which the sender waited for the client.
+  // For the download, it is the fraction of the server busy time limited by
+  // the receive window advertised by the client. For the upload, it is
+  // TcpInfoStats::app_limited. Negative if unknown.
+  double client_limited = -1.0;
+
+  // Whether the client CPU limited the speed.
+  bool cpu_limited = false;
+
+  // Confidence in cpu_limited being true, between zero and one. It is zero
+  // when cpu_limited is false and at most 0.5 when client_limited is unknown.
+  double confidence = 0.0;
+};
+
 // SummaryData contains the fields that summarize a completed test.
 struct SummaryData {
   // Download speed in kbit/s.
-  double download_speed;
+  double download_speed = 0.0;
 
   // Upload speed in kbit/s.
-  double upload_speed;
+  double upload_speed = 0.0;
 
   // Download retransmission rate (bytes_retrans / bytes_sent).
-  double download_retrans;
+  double download_retrans = 0.0;
 
   // Upload retransmission rate (bytes_retrans / bytes_sent).
-  double upload_retrans;
+  double upload_retrans = 0.0;
 
   // TCPInfo's MinRTT (microseconds).
-  uint32_t min_rtt;
+  uint32_t min_rtt = 0;
+
+  // Servers probed before the test, in the order in which we tried them.
+  std::vector<ServerProbe> server_probes;
+
+  // Speeds measured at each measurement interval of the download.
+  SpeedHistogram download_intervals;
+
+  // Speeds measured at each measurement interval of the upload.
+  SpeedHistogram upload_intervals;
+
+  // I/O performed by the download.
+  NetxCounters download_netx;
+
+  // I/O performed by the upload.
+  NetxCounters upload_netx;
+
+  // Time to query the Locate API (milliseconds). Negative if not queried.
+  double locate_time = -1.0;
+
+  // Connection phases of the download.
+  PhaseTimings download_phases;
+
+  // Connection phases of the upload.
+  PhaseTimings upload_phases;
+
+  // Statistics of the speeds sampled during the download.
+  ThroughputStats download_throughput;
+
+  // Statistics of the speeds sampled during the upload.
+  ThroughputStats upload_throughput;
+
+  // Statistics of the TCP_INFO sampled during the download.
+  TcpInfoStats download_tcp_info;
+
+  // Statistics of the TCP_INFO sampled during the upload.
+  TcpInfoStats upload_tcp_info;
+
+  // Why the download stopped.
+  StopReason download_stop_reason = StopReason::completed;
+
+  // Why the upload stopped.
+  StopReason upload_stop_reason = StopReason::completed;
+
+  // Whether the client CPU limited the download.
+  CpuDiagnosis download_cpu;
+
+  // Whether the client CPU limited the upload.
+  CpuDiagnosis upload_cpu;
+
+  // Statistics of the TCPInfo in the measurements sent by the server during
+  // the download. The server is the sender during the download.
+  TcpInfoStats download_server_tcp_info;
+
+  // Statistics of the TCPInfo in the measurements sent by the server during
+  // the upload. The server is the receiver during the upload.
+  TcpInfoStats upload_server_tcp_info;
+
+  // Connection of the download, as reported by the server.
+  ConnectionInfo download_connection_info;
+
+  // Connection of the upload, as reported by the server.
+  ConnectionInfo upload_connection_info;
+
+  // Socket options of the download connection, as reported by the kernel.
+  SocketProfile download_socket;
+
+  // Socket options of the upload connection, as reported by the kernel.
+  SocketProfile upload_socket;
+};
+
+// Progress describes the subtest that is running.
+struct Progress {
+  // Running subtest or zero when no subtest is running.
+  NettestFlags nettest = 0;
+
+  // Time since the beginning of the subtest (seconds).
+  double elapsed = 0.0;
+
+  // Speed measured over the latest measurement interval (kbit/s).
+  double speed = 0.0;
 };
 
 // Client
@@ -346,12 +960,57 @@ class Client : public EventHandler {
   /// returns true. When using the Locate API, `run` will attempt a test with
   /// multiple servers, stopping on the first success or continue trying the
   /// next server on failure. If all attempts fail, `run` returns false.
+  /// You can call `run` many times on the same Client: each run starts from
+  /// an empty summary, while buffers and cached state are reused.
   virtual bool run() noexcept;
 
   // After running a successful test with `run`, `get_summary` returns the test
   // summary metrics.
   virtual SummaryData get_summary() noexcept;
 
+  // While `run` is running, `get_progress` returns the progress of the running
+  // subtest. Unlike other methods, it is safe to call from another thread.
+  Progress get_progress() const noexcept;
+
+  // After running a test with `run`, `get_time_series` returns the samples of
+  // the @p nettest subtest in chronological order (see Settings).
+  std::vector<ThroughputSample> get_time_series(NettestFlags nettest) const
+      noexcept;
+
+  // After running a test with `run`, `get_tcp_info` returns the TCP_INFO
+  // samples of the @p nettest subtest in chronological order (see Settings).
+  // While `run` is running, it returns the samples collected so far.
+  std::vector<TcpInfoSample> get_tcp_info(NettestFlags nettest) const noexcept;
+
+  // After running a test with `run`, `get_server_tcp_info` returns the TCPInfo
+  // in the measurements sent by the server during the @p nettest subtest, in
+  // chronological order. Fields that the server did not send are zero.
+  std::vector<TcpInfoSample> get_server_tcp_info(NettestFlags nettest) const
+      noexcept;
+
+  // After running a test with `run`, `get_measurements` returns the
+  // measurements sent by the server during the @p nettest subtest, in
+  // chronological order. Like the other samples, at most
+  // Settings::sample_capacity measurements are kept.
+  std::vector<Measurement> get_measurements(NettestFlags nettest) const
+      noexcept;
+
+  // `cancel` aborts the test that `run` is running, if any, within a few
+  // milliseconds. It is safe to call from another thread or from a signal
+  // handler. The canceled `run` returns false and the summary keeps the
+  // results collected so far, with the StopReason of the interrupted subtest
+  // set to canceled. The cancellation stays in effect until `reset_cancel`
+  // is called, so a `run` that starts after `cancel` returns false at once.
+  void cancel() noexcept;
+
+  // `reset_cancel` forgets the previous `cancel` calls. Call it before
+  // starting a new `run`, e.g. before handing the client to the thread that
+  // is going to call `run`, so that a `cancel` issued in between is not lost.
+  void reset_cancel() noexcept;
+
+  // Returns whether the last test run by `run` was canceled.
+  bool is_canceled() const noexcept;
+
   void on_warning(const std::string &s) const noexcept override;
 
   void on_info(const std::string &s) const noexcept override;
@@ -397,6 +1056,33 @@ class Client : public EventHandler {
   virtual std::string replace_all_with(std::string templ, std::string pattern,
                                        std::string replace);
 
+  // Probe the servers in @p targets and sort them by increasing connect time.
+  // Servers that cannot be probed within Settings::probe_timeout_ms, including
+  // the time to resolve their name, are moved at the end of the list.
+  virtual void probe_targets(std::vector<nlohmann::json> *targets) noexcept;
+
+  // Join the probes that probe_targets() gave up on and that have finished
+  // since. Returns the number of those still running.
+  size_t join_probe_threads() noexcept;
+
+  // Locate API cache. The key is the Locate API URL that was queried. A lookup
+  // only returns the targets whose access tokens will not expire before the
+  // tests are complete and fails if there are none.
+  virtual bool locate_cache_lookup(const std::string &key,
+                                   std::vector<nlohmann::json> *urls) noexcept;
+  virtual void locate_cache_store(
+      const std::string &key, const std::vector<nlohmann::json> &urls) noexcept;
+
+  // Remove @p urls from the results cached by the last query_locate_api().
+  virtual void locate_cache_forget(const nlohmann::json &urls) noexcept;
+
+  // Return the earliest expiry time, in seconds since the Unix epoch, of the
+  // access tokens contained by @p urls, or zero if there is no such token.
+  static int64_t locate_token_expiry(const nlohmann::json &urls) noexcept;
+
+  // Return the current time in seconds since the Unix epoch.
+  virtual int64_t locate_cache_now() const noexcept;
+
   // ndt7 protocol API
   // `````````````````
   //
@@ -415,6 +1101,73 @@ class Client : public EventHandler {
   // ndt7_connect connects to @p url_path.
   bool ndt7_connect(const UrlParts &url) noexcept;
 
+  // ndt7_connect_race connects to @p urls in parallel, staggering the attempts
+  // as specified by the Settings. On success, @p winner is the index of the
+  // URL that connected first and the next ndt7_download() or ndt7_upload()
+  // will use such connection rather than connecting again. Unless it is null,
+  // @p failed receives the indexes of the URLs to which we could not connect,
+  // excluding the attempts canceled because the race was over or by cancel().
+  bool ndt7_connect_race(const std::vector<UrlParts> &urls, size_t *winner,
+                         std::vector<size_t> *failed) noexcept;
+
+  // ndt7_run_subtest runs the @p nettest subtest using the first of @p targets
+  // with which it succeeds. It returns false if all targets failed.
+  bool ndt7_run_subtest(const std::vector<nlohmann::json> &targets,
+                        NettestFlags nettest) noexcept;
+
+  // ndt7_download_measurement processes a measurement @p message received
+  // during the download, updating the summary and the measurements.
+  void ndt7_download_measurement(const std::string &message) noexcept;
+
+  // ndt7_upload_server_measurement processes a measurement @p message
+  // received from the server during the upload, recording it.
+  void ndt7_upload_server_measurement(const std::string &message) noexcept;
+
+  // ndt7_client_measurement returns the measurement to send to the server
+  // after transferring @p total bytes over @p fd in @p elapsed_usec.
+  std::string ndt7_client_measurement(internal::Socket fd,
+                                      uint64_t elapsed_usec,
+                                      internal::Size total) noexcept;
+
+  // ndt7_upload_measurement is like ndt7_client_measurement but it also
+  // updates the upload retransmission rate in the summary.
+  std::string ndt7_upload_measurement(internal::Socket fd,
+                                      uint64_t elapsed_usec,
+                                      internal::Size total) noexcept;
+
+  // ndt7_set_progress updates what get_progress() returns.
+  void ndt7_set_progress(NettestFlags nettest, double elapsed,
+                         double speed) noexcept;
+
+  // ndt7_sampler_reset prepares for sampling the @p nettest subtest. This is
+  // where we allocate the memory for samples.
+  void ndt7_sampler_reset(NettestFlags nettest) noexcept;
+
+  // ndt7_sampler_add records @p sample for the @p nettest subtest. This
+  // does not allocate memory.
+  void ndt7_sampler_add(NettestFlags nettest,
+                        const ThroughputSample &sample) noexcept;
+
+  // ndt7_throughput_stats computes the statistics of @p samples, which must
+  // be in chronological order.
+  static ThroughputStats ndt7_throughput_stats(
+      const std::vector<ThroughputSample> &samples) noexcept;
+
+  // ndt7_tcp_info_add records @p sample for the @p nettest subtest. This
+  // does not allocate memory. We call this from the sampler thread, hence it
+  // locks the samples.
+  void ndt7_tcp_info_add(NettestFlags nettest,
+                         const TcpInfoSample &sample) noexcept;
+
+  // ndt7_tcp_info_stats computes the statistics of the TCP_INFO @p samples
+  // of the @p nettest subtest, which must be in chronological order.
+  static TcpInfoStats ndt7_tcp_info_stats(
+      NettestFlags nettest, const std::vector<TcpInfoSample> &samples) noexcept;
+
+  // ndt7_cpu_diagnosis returns @p diagnosis, whose measured fields must be
+  // already set, with cpu_limited and confidence filled in.
+  static CpuDiagnosis ndt7_cpu_diagnosis(CpuDiagnosis diagnosis) noexcept;
+
   // WebSocket
   // `````````
   //
@@ -475,6 +1228,17 @@ class Client : public EventHandler {
                            uint8_t *base, internal::Size total,
                            internal::Size *count) const noexcept;
 
+  // Like ws_recvmsg() but parses the @p size bytes at @p data, which were
+  // already received on @p sock, rather than reading from @p sock. If they
+  // contain a whole message, @p consumed is set to the number of bytes of
+  // the message and of the control frames preceding it. Otherwise, it is
+  // set to zero and nothing is parsed.
+  internal::Err ws_recvmsg_buffered(internal::Socket sock,
+                                    const uint8_t *data, internal::Size size,
+                                    uint8_t *opcode, uint8_t *base,
+                                    internal::Size total, internal::Size *count,
+                                    internal::Size *consumed) const noexcept;
+
   // Networking layer
   // ````````````````
   //
@@ -534,7 +1298,9 @@ class Client : public EventHandler {
                                   internal::Size count,
                                   internal::Size *actual) const noexcept;
 
-  // Receive from the network without blocking.
+  // Receive from the network without blocking. This uses TLS if the
+  // Transport owning @p fd has an SSL object. A socket without a Transport,
+  // e.g. one used before the TLS handshake, is read in clear text.
   virtual internal::Err netx_recv_nonblocking(
       internal::Socket fd, void *base, internal::Size count,
       internal::Size *actual) const noexcept;
@@ -548,7 +1314,8 @@ class Client : public EventHandler {
                                   internal::Size count,
                                   internal::Size *actual) const noexcept;
 
-  // Send to the network without blocking.
+  // Send to the network without blocking. Like netx_recv_nonblocking(), this
+  // uses TLS only if the Transport owning @p fd has an SSL object.
   virtual internal::Err netx_send_nonblocking(
       internal::Socket fd, const void *base, internal::Size count,
       internal::Size *actual) const noexcept;
@@ -561,10 +1328,25 @@ class Client : public EventHandler {
   virtual internal::Err netx_resolve(const std::string &hostname,
                                      std::vector<std::string> *addrs) noexcept;
 
+  // Measure the time required to connect to @p hostname and @p port, giving
+  // up after @p timeout_ms milliseconds. The connection is closed afterwards.
+  virtual internal::Err netx_probe(const std::string &hostname,
+                                   const std::string &port,
+                                   uint32_t timeout_ms,
+                                   double *connect_time) noexcept;
+
   // Set socket non blocking.
   virtual internal::Err netx_setnonblocking(internal::Socket fd,
                                             bool enable) noexcept;
 
+  // Set the Settings::socket_profile options of @p fd, whose address family
+  // is @p family, before connecting. Options that cannot be set are logged
+  // and skipped, so this never fails.
+  void netx_apply_socket_profile(internal::Socket fd, int family) noexcept;
+
+  // Read the SocketProfile options of @p fd as reported by the kernel.
+  SocketProfile netx_socket_profile(internal::Socket fd) const noexcept;
+
   // Pauses until the socket becomes readable.
   virtual internal::Err netx_wait_readable(internal::Socket,
                                            Timeout timeout) const noexcept;
@@ -573,6 +1355,14 @@ class Client : public EventHandler {
   virtual internal::Err netx_wait_writeable(internal::Socket,
                                             Timeout timeout) const noexcept;
 
+  // Returns the milliseconds for which an I/O operation may wait, i.e.
+  // @p timeout seconds or less, if the run or the subtest ends earlier.
+  int netx_timeout_msec(Timeout timeout) const noexcept;
+
+  // Returns a descriptor becoming readable once cancel() is called, which
+  // every wait polls along with the socket, or -1 if there is none.
+  internal::Socket netx_cancel_fd() const noexcept;
+
   // Main function for dealing with I/O patterned after poll(2).
   virtual internal::Err netx_poll(std::vector<pollfd> *fds,
                                   int timeout_msec) const noexcept;
@@ -580,9 +1370,44 @@ class Client : public EventHandler {
   // Shutdown both ends of a socket.
   virtual internal::Err netx_shutdown_both(internal::Socket fd) noexcept;
 
-  // Close a socket.
+  // Whether ndt7_download() and ndt7_upload() may use the compile-time I/O
+  // path (see ws_recvmsg_fast() and netx_sendn_fast()), which bypasses the
+  // virtual netx_recv(), netx_send() and related methods. By default, this
+  // returns Settings::io_fastpath.
+  virtual bool netx_fastpath_enabled() const noexcept;
+
+  // Like ws_recvmsg() but reads from @p t using the compile-time I/O path.
+  internal::Err ws_recvmsg_fast(internal::Transport *t, uint8_t *opcode,
+                                uint8_t *base, internal::Size total,
+                                internal::Size *count) const noexcept;
+
+  // Like netx_sendn() but writes on @p t using the compile-time I/O path.
+  internal::Err netx_sendn_fast(internal::Transport *t, const void *base,
+                                internal::Size count) const noexcept;
+
+  // Like netx_recv_nonblocking() but reads from @p t using the compile-time
+  // I/O path.
+  internal::Err netx_recv_nonblocking_fast(
+      internal::Transport *t, void *base, internal::Size count,
+      internal::Size *actual) const noexcept;
+
+  // Like netx_send_nonblocking() but writes on @p t using the compile-time
+  // I/O path.
+  internal::Err netx_send_nonblocking_fast(
+      internal::Transport *t, const void *base, internal::Size count,
+      internal::Size *actual) const noexcept;
+
+  // Close a socket. This also releases the Transport owning @p fd, if any.
   virtual internal::Err netx_closesocket(internal::Socket fd) noexcept;
 
+  // Return the Transport owning @p fd or nullptr if there is none. This is
+  // how the socket based netx API finds the state of a connection. Finding
+  // the connection of the running subtest does not take any lock.
+  internal::Transport *netx_transport_get(internal::Socket fd) const noexcept;
+
+  // Return the Transport owning @p fd, creating it if needed.
+  internal::Transport *netx_transport_add(internal::Socket fd) noexcept;
+
   virtual bool query_locate_api_curl(const std::string &url, long timeout,
                                      std::string *body) noexcept;
 
@@ -596,12 +1421,6 @@ class Client : public EventHandler {
  protected:
   SummaryData summary_;
 
-  // ndt7 Measurement object.
-  std::unique_ptr<nlohmann::json> measurement_;
-
-  // ndt7 ConnectionInfo object.
-  std::unique_ptr<nlohmann::json> connection_info_;
-
  private:
   class Winsock {
    public:
@@ -613,11 +1432,100 @@ class Client : public EventHandler {
     ~Winsock() noexcept;
   };
 
-  internal::Socket sock_ = (internal::Socket)-1;
+  // Connection used by the running nettest. Owned by transports_.
+  internal::Transport *conn_ = nullptr;
   std::vector<NettestFlags> granted_suite_;
   Settings settings_;
 
-  std::map<internal::Socket, SSL *> fd_to_ssl_;
+  // All the connections owned by this client. We use a small vector rather
+  // than a map because we typically only have one or two connections.
+  std::vector<std::unique_ptr<internal::Transport>> transports_;
+  mutable std::mutex transports_mutex_;
+  std::string locate_cache_key_;
+  bool conn_pending_ = false;
+
+  // Buffer used to receive download messages, reused across runs.
+  std::unique_ptr<uint8_t[]> download_buffer_;
+
+  Progress progress_;
+  mutable std::mutex progress_mutex_;
+
+  // Connection phases of the connection established by ndt7_connect() or by
+  // ndt7_connect_race().
+  PhaseTimings conn_phases_;
+
+  // Probes that were still running when probe_targets() gave up on them,
+  // typically because of a slow DNS lookup. Each probe sets its done flag
+  // when it returns. The next probe_targets() joins the finished ones, and
+  // the destructor joins the others.
+  struct ProbeThread {
+    std::thread thread;
+    std::shared_ptr<std::atomic<bool>> done;
+  };
+  std::vector<ProbeThread> probe_threads_;
+
+  // Deadlines of the run and of the subtest in progress. I/O never waits past
+  // either of them. They are time_point::max() when there is no deadline.
+  std::chrono::steady_clock::time_point run_deadline_ =
+      std::chrono::steady_clock::time_point::max();
+  std::chrono::steady_clock::time_point subtest_deadline_ =
+      std::chrono::steady_clock::time_point::max();
+
+  // Set by cancel(), which also writes into the cancel pipe to wake up any
+  // wait in progress. We have no pipe on Windows, where waits notice the
+  // cancellation when they wake up.
+  std::atomic<bool> canceled_{false};
+  int cancel_pipe_[2] = {-1, -1};
+
+  // Ring buffer of the samples of a subtest. Memory is only allocated by
+  // reset(), so that adding samples does not allocate.
+  template <typename Sample>
+  class SampleRing {
+   public:
+    void reset(size_t capacity) noexcept {
+      samples_.resize(capacity);
+      next_ = 0;
+      count_ = 0;
+    }
+
+    void add(const Sample &sample) noexcept {
+      if (samples_.empty()) {
+        return;
+      }
+      samples_[next_] = sample;
+      next_ = (next_ + 1) % samples_.size();
+      count_ = (count_ < samples_.size()) ? count_ + 1 : count_;
+    }
+
+    // Returns the samples in chronological order.
+    std::vector<Sample> get() const noexcept {
+      std::vector<Sample> samples;
+      size_t capacity = samples_.size();
+      for (size_t i = 0; i < count_; ++i) {
+        samples.push_back(samples_[(next_ + capacity - count_ + i) % capacity]);
+      }
+      return samples;
+    }
+
+   private:
+    std::vector<Sample> samples_;
+    size_t next_ = 0;
+    size_t count_ = 0;
+  };
+
+  // Throughput samples of the download and of the upload.
+  SampleRing<ThroughputSample> download_samples_;
+  SampleRing<ThroughputSample> upload_samples_;
+
+  // TCP_INFO samples of the download and of the upload. The sampler thread
+  // writes them, hence they are guarded by tcp_info_mutex_.
+  SampleRing<TcpInfoSample> download_tcp_info_;
+  SampleRing<TcpInfoSample> upload_tcp_info_;
+  mutable std::mutex tcp_info_mutex_;
+
+  // Measurements sent by the server during the download and the upload.
+  SampleRing<Measurement> download_measurements_;
+  SampleRing<Measurement> upload_measurements_;
 #ifdef _WIN32
   Winsock winsock_;
 #endif
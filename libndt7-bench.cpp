@@ -0,0 +1,388 @@
+// Part of Measurement Lab <https://www.measurementlab.net/>.
+// Measurement Lab libndt7 is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+
+// libndt7-bench - microbenchmarks for libndt7 internals. Results are
+// written on the standard output as a JSON document, such that we can save
+// them and compare them across commits.
+
+#include "single_include/libndt7.hpp"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/socket.h>
+#endif
+#include <string.h>
+
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define LIBNDT7_BENCH_HAVE_CYCLES
+#endif
+
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+
+using namespace measurementlab::libndt7;
+
+// StreamSys is a Sys returning an endless stream of WebSocket frames.
+class StreamSys : public internal::Sys {
+ public:
+  explicit StreamSys(std::string frames) : frames_{std::move(frames)} {}
+
+  internal::Ssize Recv(internal::Socket, void *base,
+                       internal::Size count) const noexcept override {
+    internal::Size avail = frames_.size() - off_;
+    if (count > avail) {
+      count = avail;
+    }
+    memcpy(base, frames_.data() + off_, count);
+    off_ = (off_ + count) % frames_.size();
+    return (internal::Ssize)count;
+  }
+
+  int Closesocket(internal::Socket) const noexcept override { return 0; }
+
+ private:
+  std::string frames_;
+  mutable internal::Size off_ = 0;
+};
+
+// Returns an unmasked, binary, final server frame carrying @p size bytes.
+static std::string server_frame(internal::Size size) {
+  std::string frame;
+  frame += (char)(0x02 | 0x80);
+  frame += (char)127;
+  for (int shift = 56; shift >= 0; shift -= 8) {
+    frame += (char)((size >> shift) & 0xff);
+  }
+  frame += std::string(size, 'x');
+  return frame;
+}
+
+// Runs @p messages receives and returns the nanoseconds per message.
+template <typename Receive>
+static double measure(Receive receive, int messages) {
+  auto begin = std::chrono::steady_clock::now();
+  for (int i = 0; i < messages; ++i) {
+    if (receive() != internal::Err::none) {
+      std::clog << "fatal: receive failed" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+  std::chrono::duration<double, std::nano> elapsed =
+      std::chrono::steady_clock::now() - begin;
+  return elapsed.count() / messages;
+}
+
+// Runs @p op until at least 100 ms have elapsed and reports the nanoseconds
+// per operation and, where we can read the cycle counter, the bytes processed
+// per cycle, given that each operation processes @p bytes.
+static nlohmann::json micro(const std::string &name, internal::Size bytes,
+                            std::function<void()> op) {
+  op();  // warm up
+  uint64_t iterations = 1;
+  for (;;) {
+#ifdef LIBNDT7_BENCH_HAVE_CYCLES
+    uint64_t cycles = __rdtsc();
+#endif
+    auto begin = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < iterations; ++i) {
+      op();
+    }
+    std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - begin;
+#ifdef LIBNDT7_BENCH_HAVE_CYCLES
+    cycles = __rdtsc() - cycles;
+#endif
+    if (elapsed.count() < 1e8) {
+      iterations *= 2;
+      continue;
+    }
+    nlohmann::json result;
+    result["name"] = name;
+    result["bytes_per_op"] = bytes;
+    result["iterations"] = iterations;
+    result["ns_per_op"] = elapsed.count() / (double)iterations;
+#ifdef LIBNDT7_BENCH_HAVE_CYCLES
+    result["bytes_per_cycle"] =
+        (double)bytes * (double)iterations / (double)cycles;
+#else
+    result["bytes_per_cycle"] = nullptr;
+#endif
+    return result;
+  }
+}
+
+// Keeps the compiler from optimizing away the results of benchmarks.
+static volatile internal::Size bench_sink;
+
+// A measurement like the ones sent by M-Lab servers during the download.
+static const char *server_measurement =
+    R"({"AppInfo":{"ElapsedTime":2501234,"NumBytes":104857600},)"
+    R"("ConnectionInfo":{"Client":"192.0.2.1:54321",)"
+    R"("Server":"198.51.100.1:443",)"
+    R"("UUID":"ndt-abcde_1600000000_0000000000123456"},)"
+    R"("Origin":"server","Test":"download",)"
+    R"("TCPInfo":{"State":1,"CAState":0,"Retransmits":0,"Probes":0,)"
+    R"("Backoff":0,"Options":7,"WScale":119,"AppLimited":0,"RTO":204000,)"
+    R"("ATO":40000,"SndMSS":1448,"RcvMSS":536,"Unacked":120,"Sacked":0,)"
+    R"("Lost":0,"Retrans":0,"Fackets":0,"LastDataSent":0,"LastAckSent":0,)"
+    R"("LastDataRecv":2500,"LastAckRecv":0,"PMTU":1500,)"
+    R"("RcvSsThresh":64076,"RTT":3412,"RTTVar":512,"SndSsThresh":1200,)"
+    R"("SndCwnd":1400,"AdvMSS":1448,"Reordering":3,"RcvRTT":0,)"
+    R"("RcvSpace":14480,"TotalRetrans":12,"PacingRate":987654321,)"
+    R"("MaxPacingRate":-1,"BytesAcked":104000000,"BytesReceived":812,)"
+    R"("SegsOut":72000,"SegsIn":36000,"NotsentBytes":0,"MinRTT":2801,)"
+    R"("DataSegsIn":3,"DataSegsOut":72000,"DeliveryRate":456789012,)"
+    R"("BusyTime":2500000,"RWndLimited":0,"SndBufLimited":120000,)"
+    R"("Delivered":71880,"DeliveredCE":0,"BytesSent":104857600,)"
+    R"("BytesRetrans":17376,"DSackDups":0,"ReordSeen":0,)"
+    R"("ElapsedTime":2501234}})";
+
+#ifdef __linux__
+// TcpInfoSys is a Sys returning a plausible TCP_INFO for any socket.
+class TcpInfoSys : public internal::Sys {
+ public:
+  int Getsockopt(internal::Socket, int, int, void *value,
+                 socklen_t *len) const noexcept override {
+    struct tcp_info ti {};
+    ti.tcpi_rtt = 3412;
+    ti.tcpi_snd_cwnd = 1400;
+    ti.tcpi_min_rtt = 2801;
+    ti.tcpi_bytes_acked = 104000000;
+    memcpy(value, &ti, (std::min)((size_t)*len, sizeof(ti)));
+    return 0;
+  }
+};
+#endif
+
+static nlohmann::json bench_micro() {
+  nlohmann::json results;
+  Client client;
+  for (internal::Size size : {16, 1 << 13, 1 << 20}) {
+    std::unique_ptr<uint8_t[]> buf{new uint8_t[size]};
+    random_printable_fill((char *)buf.get(), size);
+    results.push_back(micro("ws_prepare_frame", size, [&]() {
+      bench_sink = client
+                       .ws_prepare_frame(ws_opcode_binary | ws_fin_flag,
+                                         buf.get(), size)
+                       .size();
+    }));
+  }
+  for (internal::Size size : {16, 1 << 13, 1 << 20}) {
+    Client reader;
+    reader.sys.reset(new StreamSys{server_frame(size)});
+    std::unique_ptr<uint8_t[]> buf{new uint8_t[size]};
+    uint8_t opcode = 0;
+    bool fin = false;
+    internal::Size count = 0;
+    results.push_back(micro("ws_recv_any_frame", size, [&]() {
+      (void)reader.ws_recv_any_frame(17, &opcode, &fin, buf.get(), size,
+                                     &count);
+      bench_sink = count;
+    }));
+    results.push_back(micro("ws_recvmsg", size, [&]() {
+      (void)reader.ws_recvmsg(17, &opcode, buf.get(), size, &count);
+      bench_sink = count;
+    }));
+  }
+  std::string message = server_measurement;
+  results.push_back(micro("ndt7_download_measurement", message.size(), [&]() {
+    client.ndt7_download_measurement(message);
+  }));
+  {
+    Client uploader;
+#ifdef __linux__
+    uploader.sys.reset(new TcpInfoSys{});
+#endif
+    std::string json = uploader.ndt7_upload_measurement(17, 2501234, 1 << 26);
+    results.push_back(micro("ndt7_upload_measurement", json.size(), [&]() {
+      bench_sink =
+          uploader.ndt7_upload_measurement(17, 2501234, 1 << 26).size();
+    }));
+  }
+  {
+    constexpr internal::Size size = 1 << 13;
+    std::unique_ptr<char[]> buf{new char[size]};
+    results.push_back(micro("random_printable_fill", size, [&]() {
+      random_printable_fill(buf.get(), size);
+      bench_sink = (internal::Size)buf[0];
+    }));
+  }
+  std::string url =
+      "wss://ndt-mlab1-mil04.mlab-oti.measurement-lab.org/ndt/v7/download"
+      "?access_token=eyJhbGciOiJFZERTQSIsImtpZCI6ImxvY2F0ZV8yMDIwMDQwOSJ9."
+      "eyJhdWQiOlsibWxhYjEubWlsMDQiXSwiZXhwIjoxNjAwMDAwMDAwfQ.signature";
+  results.push_back(micro("parse_ws_url", url.size(), [&]() {
+    bench_sink = parse_ws_url(url).path.size();
+  }));
+  return results;
+}
+
+static nlohmann::json bench_recvmsg(internal::Size size, int messages) {
+  Client client;
+  client.sys.reset(new StreamSys{server_frame(size)});
+  auto t = client.netx_transport_add(17);
+  std::unique_ptr<uint8_t[]> buf{new uint8_t[size]};
+  uint8_t opcode = 0;
+  internal::Size count = 0;
+  double virtual_ns = measure(
+      [&]() {
+        return client.ws_recvmsg(17, &opcode, buf.get(), size, &count);
+      },
+      messages);
+  internal::Size calls = t->recv_calls;
+  double fast_ns = measure(
+      [&]() {
+        return client.ws_recvmsg_fast(t, &opcode, buf.get(), size, &count);
+      },
+      messages);
+  nlohmann::json result;
+  result["message_size"] = size;
+  result["messages"] = messages;
+  result["recv_calls_per_message"] = (double)calls / messages;
+  result["ws_recvmsg_ns_per_message"] = virtual_ns;
+  result["ws_recvmsg_fast_ns_per_message"] = fast_ns;
+  result["saved_ns_per_recv_call"] =
+      (virtual_ns - fast_ns) * messages / (double)calls;
+  return result;
+}
+
+#ifndef _WIN32
+// SocketpairClient is a Client whose TCP connection is one end of a pair of
+// connected sockets, so that we can run TLS without using the network.
+class SocketpairClient : public Client {
+ public:
+  using Client::Client;
+
+  internal::Socket fd = (internal::Socket)-1;
+
+  internal::Err netx_maybesocks5h_dial(const std::string &,
+                                       const std::string &,
+                                       internal::Socket *sock) noexcept override {
+    *sock = fd;
+    return internal::Err::none;
+  }
+};
+
+// Creates a TLS server context using an ephemeral self-signed certificate.
+static SSL_CTX *new_server_ctx() {
+  EVP_PKEY *pkey = nullptr;
+  EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+  if (pctx == nullptr || EVP_PKEY_keygen_init(pctx) <= 0 ||
+      EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pctx, NID_X9_62_prime256v1) <= 0 ||
+      EVP_PKEY_keygen(pctx, &pkey) <= 0) {
+    std::clog << "fatal: cannot generate private key" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  EVP_PKEY_CTX_free(pctx);
+  X509 *cert = X509_new();
+  ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+  X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+  X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+  X509_set_pubkey(cert, pkey);
+  X509_NAME *name = X509_get_subject_name(cert);
+  X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                             (const unsigned char *)"localhost", -1, -1, 0);
+  X509_set_issuer_name(cert, name);
+  X509_sign(cert, pkey, EVP_sha256());
+  SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+  if (ctx == nullptr || SSL_CTX_use_certificate(ctx, cert) != 1 ||
+      SSL_CTX_use_PrivateKey(ctx, pkey) != 1) {
+    std::clog << "fatal: cannot create server context" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  X509_free(cert);
+  EVP_PKEY_free(pkey);
+  return ctx;
+}
+
+// Downloads @p total bytes over TLS, sent by the server as binary messages of
+// @p size bytes, and reports the number of BIO reads and SSL reads per MiB.
+static nlohmann::json bench_tls_recv(uint32_t recv_buffer_size,
+                                     internal::Size size,
+                                     internal::Size total) {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+    std::clog << "fatal: socketpair failed" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  internal::Size messages = total / size;
+  std::thread server{[&]() {
+    SSL_CTX *ctx = new_server_ctx();
+    SSL *ssl = SSL_new(ctx);
+    SSL_set_fd(ssl, fds[1]);
+    if (SSL_accept(ssl) == 1) {
+      std::string frame = server_frame(size);
+      for (internal::Size i = 0; i < messages; ++i) {
+        if (SSL_write(ssl, frame.data(), (int)frame.size()) <= 0) {
+          break;
+        }
+      }
+    }
+    SSL_free(ssl);
+    SSL_CTX_free(ctx);
+    close(fds[1]);
+  }};
+  Settings settings;
+  settings.protocol_flags = protocol_flag_tls;
+  settings.tls_verify_peer = false;
+  settings.recv_buffer_size = recv_buffer_size;
+  SocketpairClient client{settings};
+  client.fd = fds[0];
+  (void)fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+  internal::Socket sock = (internal::Socket)-1;
+  if (client.netx_maybessl_dial("localhost", "443", &sock) !=
+      internal::Err::none) {
+    std::clog << "fatal: TLS handshake failed" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  auto t = client.netx_transport_get(sock);
+  internal::Size bio_reads = t->bio_reads;
+  internal::Size recv_calls = t->recv_calls;
+  std::unique_ptr<uint8_t[]> buf{new uint8_t[size]};
+  uint8_t opcode = 0;
+  internal::Size count = 0;
+  double ns = measure(
+      [&]() {
+        return client.ws_recvmsg_fast(t, &opcode, buf.get(), size, &count);
+      },
+      (int)messages);
+  server.join();
+  double mib = (double)(messages * size) / (1 << 20);
+  nlohmann::json result;
+  result["recv_buffer_size"] = recv_buffer_size;
+  result["message_size"] = size;
+  result["bio_reads_per_mib"] = (double)(t->bio_reads - bio_reads) / mib;
+  result["ssl_reads_per_mib"] = (double)(t->recv_calls - recv_calls) / mib;
+  result["ns_per_mib"] = ns * (double)messages / mib;
+  return result;
+}
+#endif
+
+int main() {
+  nlohmann::json results;
+  results["version"] = std::to_string(version_major) + "." +
+                       std::to_string(version_minor) + "." +
+                       std::to_string(version_patch);
+  results["micro"] = bench_micro();
+  results["netx_fastpath"].push_back(bench_recvmsg(16, 1000000));
+  results["netx_fastpath"].push_back(bench_recvmsg(1 << 13, 200000));
+  results["netx_fastpath"].push_back(bench_recvmsg(1 << 20, 2000));
+#ifndef _WIN32
+  for (uint32_t recv_buffer_size : {0u, Settings{}.recv_buffer_size}) {
+    for (internal::Size size : {1 << 13, 1 << 20}) {
+      results["tls_recv"].push_back(
+          bench_tls_recv(recv_buffer_size, size, 256 << 20));
+    }
+  }
+#endif
+  std::cout << results.dump(2) << std::endl;
+}
@@ -6,11 +6,35 @@
 
 #include "libndt7/libndt7.h"  // not standalone
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#ifndef _WIN32
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <ctime>
+#include <deque>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <sstream>
 #include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #ifdef __clang__
 #pragma clang diagnostic push
@@ -30,19 +54,155 @@
 
 using namespace measurementlab;
 
-// BatchClient only prints JSON messages on stdout.
+// NdjsonWriter writes newline-delimited JSON to a stream from a background
+// thread, such that a slow reader of the stream does not slow down the test.
+// Lines are appended to a buffer that we hand to the thread when it is large
+// enough or old enough. Buffers are recycled once written. At most
+// max_pending buffers wait for the thread: beyond that, write() waits, such
+// that we never drop lines.
+class NdjsonWriter {
+ public:
+  explicit NdjsonWriter(std::ostream *output) noexcept;
+  NdjsonWriter(const NdjsonWriter &) = delete;
+  NdjsonWriter &operator=(const NdjsonWriter &) = delete;
+  ~NdjsonWriter() noexcept;
+
+  // write queues @p line, to which it appends a newline.
+  void write(const std::string &line) noexcept;
+
+  // flush returns once all the lines queued so far have been written.
+  void flush() noexcept;
+
+ private:
+  static constexpr size_t flush_size = 1 << 16;
+  static constexpr size_t max_pending = 64;
+  static constexpr std::chrono::milliseconds flush_interval{250};
+
+  void handoff_locked() noexcept;
+  void loop() noexcept;
+
+  std::ostream *output_;
+  std::mutex mutex_;
+  std::condition_variable wakeup_;
+  std::condition_variable written_;
+  std::string buffer_;
+  std::chrono::steady_clock::time_point buffer_begin_;
+  std::deque<std::string> pending_;
+  std::vector<std::string> free_;
+  bool writing_ = false;
+  bool stop_ = false;
+  std::thread thread_;
+};
+
+constexpr size_t NdjsonWriter::flush_size;
+constexpr size_t NdjsonWriter::max_pending;
+constexpr std::chrono::milliseconds NdjsonWriter::flush_interval;
+
+NdjsonWriter::NdjsonWriter(std::ostream *output) noexcept
+    : output_{output}, thread_{&NdjsonWriter::loop, this} {}
+
+NdjsonWriter::~NdjsonWriter() noexcept {
+  flush();
+  {
+    std::unique_lock<std::mutex> lock{mutex_};
+    stop_ = true;
+  }
+  wakeup_.notify_one();
+  thread_.join();
+}
+
+void NdjsonWriter::write(const std::string &line) noexcept {
+  std::unique_lock<std::mutex> lock{mutex_};
+  if (buffer_.empty()) {
+    buffer_begin_ = std::chrono::steady_clock::now();
+  }
+  buffer_ += line;
+  buffer_ += '\n';
+  if (buffer_.size() >= flush_size ||
+      std::chrono::steady_clock::now() - buffer_begin_ >= flush_interval) {
+    written_.wait(lock, [this]() { return pending_.size() < max_pending; });
+    handoff_locked();
+  }
+}
+
+void NdjsonWriter::flush() noexcept {
+  std::unique_lock<std::mutex> lock{mutex_};
+  written_.wait(lock, [this]() { return pending_.size() < max_pending; });
+  handoff_locked();
+  written_.wait(lock, [this]() { return pending_.empty() && !writing_; });
+}
+
+// handoff_locked queues the current buffer, if not empty, for the thread. It
+// must be called with mutex_ held.
+void NdjsonWriter::handoff_locked() noexcept {
+  if (buffer_.empty()) {
+    return;
+  }
+  pending_.push_back(std::move(buffer_));
+  buffer_.clear();
+  if (!free_.empty()) {
+    buffer_ = std::move(free_.back());
+    free_.pop_back();
+  }
+  wakeup_.notify_one();
+}
+
+void NdjsonWriter::loop() noexcept {
+  std::unique_lock<std::mutex> lock{mutex_};
+  for (;;) {
+    if (pending_.empty()) {
+      if (stop_) {
+        return;
+      }
+      // Wake up periodically to write lines that would otherwise wait for
+      // the next write() to be handed off.
+      (void)wakeup_.wait_for(lock, flush_interval);
+      if (pending_.empty() && !buffer_.empty() &&
+          std::chrono::steady_clock::now() - buffer_begin_ >= flush_interval) {
+        handoff_locked();
+      }
+      continue;
+    }
+    std::string buffer = std::move(pending_.front());
+    pending_.pop_front();
+    writing_ = true;
+    lock.unlock();
+    output_->write(buffer.data(), (std::streamsize)buffer.size());
+    output_->flush();
+    buffer.clear();  // keeps the capacity for reuse
+    lock.lock();
+    writing_ = false;
+    free_.push_back(std::move(buffer));
+    written_.notify_all();
+  }
+}
+
+// BatchClient only prints JSON messages on stdout. To avoid slowing down the
+// test when stdout is slow, it writes them using a NdjsonWriter and waits for
+// them to be written when the test is over.
 class BatchClient : public libndt7::Client {
   public:
     using libndt7::Client::Client;
+    bool run() noexcept override;
     void on_result(std::string, std::string, std::string value) noexcept override;
     void on_performance(libndt7::NettestFlags, uint8_t, uint64_t, double,
                         double) noexcept override;
     void summary() noexcept override;
+
+  private:
+    NdjsonWriter writer_{&std::cout};
 };
 
+// run is overridden to write all the results before returning.
+bool BatchClient::run() noexcept {
+  bool rv = libndt7::Client::run();
+  writer_.flush();
+  return rv;
+}
+
 // on_result is overridden to only print the JSON value on stdout.
 void BatchClient::on_result(std::string, std::string, std::string value) noexcept {
-  std::cout << value << std::endl;
+  writer_.write(value);
 }
 // on_performance is overridded to hide the user-friendly output messages.
 void BatchClient::on_performance(libndt7::NettestFlags tid, uint8_t nflows,
@@ -54,37 +214,813 @@ void BatchClient::on_performance(libndt7::NettestFlags tid, uint8_t nflows,
   performance["TestId"] = (int)tid;
   performance["Speed"] = libndt7::format_speed_from_kbits(measured_bytes,
                                                          elapsed_time);
-  std::cout << performance.dump() << std::endl;
+  writer_.write(performance.dump());
 }
 
-// summary is overridden to print a JSON summary.
-void BatchClient::summary() noexcept {
-  nlohmann::json summary;
+// phases_to_json converts the connection phases of a subtest into JSON,
+// omitting the phases that were not measured.
+static nlohmann::json phases_to_json(const libndt7::PhaseTimings &phases) {
+  nlohmann::json json = nlohmann::json::object();
+  auto phase = [&](const char *name, double value) {
+    if (value >= 0.0) {
+      json[name] = value;
+    }
+  };
+  phase("Resolve", phases.resolve);
+  phase("Connect", phases.connect);
+  phase("TLSHandshake", phases.tls_handshake);
+  phase("WebSocketHandshake", phases.ws_handshake);
+  phase("FirstMessage", phases.first_message);
+  return json;
+}
 
-  if (summary_.download_speed != 0.0) {
-    nlohmann::json download;
-    download["Speed"] = summary_.download_speed;
-    download["Retransmission"] = summary_.download_retrans;
+// throughput_to_json converts the statistics of the sampled speeds into JSON.
+static nlohmann::json throughput_to_json(const libndt7::ThroughputStats &stats) {
+  nlohmann::json json;
+  json["Samples"] = stats.samples;
+  json["P10"] = stats.p10;
+  json["Median"] = stats.median;
+  json["P90"] = stats.p90;
+  json["P99"] = stats.p99;
+  json["Peak"] = stats.peak;
+  json["TimeToSteadyState"] = stats.time_to_steady_state;
+  return json;
+}
 
-    if (measurement_ != nullptr) {
-      download["ConnectionInfo"] = *connection_info_;
-      download["LastMeasurement"] = *measurement_;
-    }
+// tcp_info_to_json converts the statistics of the TCP_INFO samples into JSON.
+static nlohmann::json tcp_info_to_json(const libndt7::TcpInfoStats &stats) {
+  nlohmann::json json;
+  json["Samples"] = stats.samples;
+  json["Goodput"] = stats.goodput;
+  json["MinRTT"] = stats.min_rtt;
+  json["RcvRTT"] = stats.rcv_rtt;
+  json["RcvSpace"] = stats.rcv_space;
+  json["RwndLimited"] = stats.rwnd_limited;
+  json["SndbufLimited"] = stats.sndbuf_limited;
+  json["AppLimited"] = stats.app_limited;
+  return json;
+}
+
+// measurement_to_json converts a measurement sent by the server into JSON,
+// with only the fields that the server sent.
+static nlohmann::json measurement_to_json(
+    const libndt7::Measurement &measurement) {
+  nlohmann::json json = nlohmann::json::object();
+#define XX(type_, member_, json_)  \
+  if (fields.has(Field::member_)) { \
+    object[#json_] = fields.member_; \
+  }
+  if (measurement.has_app_info) {
+    nlohmann::json &object = json["AppInfo"] = nlohmann::json::object();
+    const libndt7::MeasurementAppInfo &fields = measurement.app_info;
+    using Field = libndt7::MeasurementAppInfoField;
+    NDT7_ENUM_MEASUREMENT_APP_INFO
+  }
+  if (measurement.has_tcp_info) {
+    nlohmann::json &object = json["TCPInfo"] = nlohmann::json::object();
+    const libndt7::MeasurementTcpInfo &fields = measurement.tcp_info;
+    using Field = libndt7::MeasurementTcpInfoField;
+    NDT7_ENUM_MEASUREMENT_TCP_INFO
+  }
+  if (measurement.has_bbr_info) {
+    nlohmann::json &object = json["BBRInfo"] = nlohmann::json::object();
+    const libndt7::MeasurementBbrInfo &fields = measurement.bbr_info;
+    using Field = libndt7::MeasurementBbrInfoField;
+    NDT7_ENUM_MEASUREMENT_BBR_INFO
+  }
+#undef XX
+  return json;
+}
+
+// connection_info_to_json converts the ConnectionInfo sent by the server into
+// JSON.
+static nlohmann::json connection_info_to_json(
+    const libndt7::ConnectionInfo &info) {
+  nlohmann::json json;
+  json["Client"] = info.client;
+  json["Server"] = info.server;
+  json["UUID"] = info.uuid;
+  return json;
+}
+
+// netx_to_json converts the I/O counters of a subtest into JSON.
+static nlohmann::json netx_to_json(const libndt7::NetxCounters &netx) {
+  nlohmann::json json;
+  json["BytesRecv"] = netx.bytes_recv;
+  json["BytesSent"] = netx.bytes_sent;
+  json["RecvCalls"] = netx.recv_calls;
+  json["SendCalls"] = netx.send_calls;
+  json["BioReads"] = netx.bio_reads;
+  return json;
+}
+
+// cpu_to_json converts the CPU diagnosis of a subtest into JSON.
+static nlohmann::json cpu_to_json(const libndt7::CpuDiagnosis &cpu) {
+  nlohmann::json json;
+  json["CPUTime"] = cpu.cpu_time;
+  json["WallTime"] = cpu.wall_time;
+  json["VoluntarySwitches"] = cpu.voluntary_switches;
+  json["InvoluntarySwitches"] = cpu.involuntary_switches;
+  json["ClientLimited"] = cpu.client_limited;
+  json["CPULimited"] = cpu.cpu_limited;
+  json["Confidence"] = cpu.confidence;
+  return json;
+}
+
+// socket_to_json converts the socket options of a subtest into JSON.
+static nlohmann::json socket_to_json(const libndt7::SocketProfile &profile) {
+  nlohmann::json json;
+  json["RcvBuf"] = profile.rcvbuf;
+  json["SndBuf"] = profile.sndbuf;
+  json["Congestion"] = profile.congestion;
+  json["NotsentLowat"] = profile.notsent_lowat;
+  json["BusyPoll"] = profile.busy_poll;
+  json["NoDelay"] = profile.nodelay;
+  json["TOS"] = profile.tos;
+  return json;
+}
+
+// stop_reason_to_string returns the name of @p reason.
+static std::string stop_reason_to_string(libndt7::StopReason reason) {
+  switch (reason) {
+    case libndt7::StopReason::converged: return "converged";
+    case libndt7::StopReason::byte_budget: return "byte_budget";
+    case libndt7::StopReason::canceled: return "canceled";
+    default: return "completed";
+  }
+}
+
+// summary_to_json converts the summary of a test into JSON.
+static nlohmann::json summary_to_json(const libndt7::SummaryData &data) {
+  nlohmann::json summary = nlohmann::json::object();
 
+  if (data.download_speed != 0.0) {
+    nlohmann::json download;
+    download["Speed"] = data.download_speed;
+    download["Retransmission"] = data.download_retrans;
+    download["Phases"] = phases_to_json(data.download_phases);
+    download["Throughput"] = throughput_to_json(data.download_throughput);
+    download["StopReason"] = stop_reason_to_string(data.download_stop_reason);
+    download["Netx"] = netx_to_json(data.download_netx);
+    download["CPU"] = cpu_to_json(data.download_cpu);
+    download["Socket"] = socket_to_json(data.download_socket);
+    if (data.download_tcp_info.samples > 0) {
+      download["ClientTCPInfo"] = tcp_info_to_json(data.download_tcp_info);
+    }
+    if (data.download_server_tcp_info.samples > 0) {
+      download["ServerTCPInfo"] =
+          tcp_info_to_json(data.download_server_tcp_info);
+    }
     summary["Download"] = download;
-    summary["Latency"] = summary_.min_rtt;
+    summary["Latency"] = data.min_rtt;
   }
 
-  if (summary_.upload_speed != 0.0) {
+  if (data.upload_speed != 0.0) {
     nlohmann::json upload;
-    upload["Speed"] = summary_.upload_speed;
-    upload["Retransmission"] = summary_.upload_retrans;
+    upload["Speed"] = data.upload_speed;
+    upload["Retransmission"] = data.upload_retrans;
+    upload["Phases"] = phases_to_json(data.upload_phases);
+    upload["Throughput"] = throughput_to_json(data.upload_throughput);
+    upload["StopReason"] = stop_reason_to_string(data.upload_stop_reason);
+    upload["Netx"] = netx_to_json(data.upload_netx);
+    upload["CPU"] = cpu_to_json(data.upload_cpu);
+    upload["Socket"] = socket_to_json(data.upload_socket);
+    if (data.upload_tcp_info.samples > 0) {
+      upload["ClientTCPInfo"] = tcp_info_to_json(data.upload_tcp_info);
+    }
+    if (data.upload_server_tcp_info.samples > 0) {
+      upload["ServerTCPInfo"] = tcp_info_to_json(data.upload_server_tcp_info);
+    }
     summary["Upload"] = upload;
   }
 
-  std::cout << summary.dump() << std::endl;
+  if (data.locate_time >= 0.0) {
+    summary["LocateTime"] = data.locate_time;
+  }
+
+  for (auto &probe : data.server_probes) {
+    nlohmann::json server;
+    server["Hostname"] = probe.hostname;
+    server["Port"] = probe.port;
+    server["ConnectTime"] = probe.connect_time;
+    summary["ServerProbes"].push_back(server);
+  }
+
+  return summary;
+}
+
+// summary is overridden to print a JSON summary.
+void BatchClient::summary() noexcept {
+  nlohmann::json summary = summary_to_json(summary_);
+
+  auto measurements = get_measurements(libndt7::nettest_flag_download);
+  if (summary.contains("Download") && !measurements.empty()) {
+    summary["Download"]["ConnectionInfo"] =
+        connection_info_to_json(summary_.download_connection_info);
+    summary["Download"]["LastMeasurement"] =
+        measurement_to_json(measurements.back());
+  }
+
+  writer_.write(summary.dump());
+  writer_.flush();
 }
 
+// Metrics
+// ```````
+//
+// We expose metrics using the OpenMetrics text format, either by writing them
+// into a file, e.g. for the textfile collector of the Prometheus node exporter,
+// or, in daemon mode, by serving them over HTTP. Speeds, retransmission and
+// latency are gauges describing the latest successful test. Histograms and
+// I/O counters instead accumulate over all the tests.
+
+class Metrics {
+ public:
+  // add accounts for a completed test.
+  void add(bool success, const libndt7::SummaryData &summary) noexcept;
+
+  // format returns the metrics in OpenMetrics text format. When a test is
+  // running, @p progress should describe it.
+  std::string format(const libndt7::Progress &progress) const noexcept;
+
+  uint64_t runs() const noexcept { return runs_; }
+
+  uint64_t failures() const noexcept { return failures_; }
+
+ private:
+  uint64_t runs_ = 0;
+  uint64_t failures_ = 0;
+  int64_t last_success_time_ = 0;
+  libndt7::SummaryData last_success_{};
+  libndt7::SpeedHistogram download_intervals_;
+  libndt7::SpeedHistogram upload_intervals_;
+  libndt7::NetxCounters download_netx_;
+  libndt7::NetxCounters upload_netx_;
+};
+
+static void add_histogram(libndt7::SpeedHistogram *total,
+                          const libndt7::SpeedHistogram &histogram) noexcept {
+  for (size_t i = 0; i <= libndt7::SpeedHistogram::num_buckets; ++i) {
+    total->counts[i] += histogram.counts[i];
+  }
+  total->count += histogram.count;
+  total->sum += histogram.sum;
+}
+
+static void add_netx(libndt7::NetxCounters *total,
+                     const libndt7::NetxCounters &counters) noexcept {
+  total->bytes_recv += counters.bytes_recv;
+  total->bytes_sent += counters.bytes_sent;
+  total->recv_calls += counters.recv_calls;
+  total->send_calls += counters.send_calls;
+  total->bio_reads += counters.bio_reads;
+}
+
+void Metrics::add(bool success, const libndt7::SummaryData &summary) noexcept {
+  runs_ += 1;
+  failures_ += (success) ? 0 : 1;
+  if (success) {
+    last_success_time_ = (int64_t)std::time(nullptr);
+    last_success_ = summary;
+  }
+  add_histogram(&download_intervals_, summary.download_intervals);
+  add_histogram(&upload_intervals_, summary.upload_intervals);
+  add_netx(&download_netx_, summary.download_netx);
+  add_netx(&upload_netx_, summary.upload_netx);
+}
+
+// escape_label_value escapes @p s for use as an OpenMetrics label value.
+static std::string escape_label_value(const std::string &s) {
+  std::string out;
+  for (char c : s) {
+    if (c == '\\' || c == '"') {
+      out += '\\';
+      out += c;
+    } else if (c == '\n') {
+      out += "\\n";
+    } else {
+      out += c;
+    }
+  }
+  return out;
+}
+
+std::string Metrics::format(const libndt7::Progress &progress) const noexcept {
+  std::ostringstream out;
+  out << std::setprecision(15);
+  auto family = [&](const char *name, const char *type, const char *help) {
+    out << "# TYPE " << name << " " << type << "\n";
+    out << "# HELP " << name << " " << help << "\n";
+  };
+  const char *tests[] = {"download", "upload"};
+
+  family("ndt7_runs", "counter", "Number of tests.");
+  out << "ndt7_runs_total " << runs_ << "\n";
+  family("ndt7_failures", "counter", "Number of failed tests.");
+  out << "ndt7_failures_total " << failures_ << "\n";
+
+  if (last_success_time_ != 0) {
+    const libndt7::SummaryData &last = last_success_;
+    family("ndt7_last_success_timestamp_seconds", "gauge",
+           "When the latest successful test completed.");
+    out << "ndt7_last_success_timestamp_seconds " << last_success_time_
+        << "\n";
+    family("ndt7_speed_bits_per_second", "gauge",
+           "Speed measured by the latest successful test.");
+    double speeds[] = {last.download_speed, last.upload_speed};
+    for (size_t i = 0; i < 2; ++i) {
+      if (speeds[i] != 0.0) {
+        out << "ndt7_speed_bits_per_second{test=\"" << tests[i] << "\"} "
+            << speeds[i] * 1000.0 << "\n";
+      }
+    }
+    family("ndt7_retransmission_ratio", "gauge",
+           "Retransmitted bytes over sent bytes in the latest successful test.");
+    double retrans[] = {last.download_retrans, last.upload_retrans};
+    for (size_t i = 0; i < 2; ++i) {
+      if (speeds[i] != 0.0) {
+        out << "ndt7_retransmission_ratio{test=\"" << tests[i] << "\"} "
+            << retrans[i] << "\n";
+      }
+    }
+    if (last.download_speed != 0.0) {
+      family("ndt7_min_rtt_seconds", "gauge",
+             "Minimum RTT measured by the server in the latest successful "
+             "download.");
+      out << "ndt7_min_rtt_seconds " << last.min_rtt / 1e06 << "\n";
+    }
+    if (last.locate_time >= 0.0) {
+      family("ndt7_locate_time_seconds", "gauge",
+             "Time to query the Locate API in the latest successful test.");
+      out << "ndt7_locate_time_seconds " << last.locate_time / 1e03 << "\n";
+    }
+    family("ndt7_phase_seconds", "gauge",
+           "Time spent in each connection phase in the latest successful "
+           "test.");
+    const libndt7::PhaseTimings *phases[] = {&last.download_phases,
+                                             &last.upload_phases};
+    for (size_t i = 0; i < 2; ++i) {
+      if (speeds[i] == 0.0) {
+        continue;
+      }
+      std::pair<const char *, double> values[] = {
+          {"resolve", phases[i]->resolve},
+          {"connect", phases[i]->connect},
+          {"tls_handshake", phases[i]->tls_handshake},
+          {"ws_handshake", phases[i]->ws_handshake},
+          {"first_message", phases[i]->first_message},
+      };
+      for (auto &value : values) {
+        if (value.second >= 0.0) {
+          out << "ndt7_phase_seconds{test=\"" << tests[i] << "\",phase=\""
+              << value.first << "\"} " << value.second / 1e03 << "\n";
+        }
+      }
+    }
+    family("ndt7_server_connect_time_seconds", "gauge",
+           "Time to connect to the servers probed by the latest successful "
+           "test.");
+    for (auto &probe : last.server_probes) {
+      if (probe.connect_time >= 0.0) {
+        out << "ndt7_server_connect_time_seconds{hostname=\""
+            << escape_label_value(probe.hostname) << "\",port=\""
+            << escape_label_value(probe.port) << "\"} "
+            << probe.connect_time / 1e03 << "\n";
+      }
+    }
+  }
+
+  family("ndt7_interval_speed_bits_per_second", "histogram",
+         "Speed measured over each 250 ms interval.");
+  const libndt7::SpeedHistogram *histograms[] = {&download_intervals_,
+                                                 &upload_intervals_};
+  for (size_t i = 0; i < 2; ++i) {
+    uint64_t cumulative = 0;
+    for (size_t b = 0; b <= libndt7::SpeedHistogram::num_buckets; ++b) {
+      cumulative += histograms[i]->counts[b];
+      out << "ndt7_interval_speed_bits_per_second_bucket{test=\"" << tests[i]
+          << "\",le=\"";
+      if (b < libndt7::SpeedHistogram::num_buckets) {
+        out << libndt7::SpeedHistogram::upper_bound(b) * 1000.0;
+      } else {
+        out << "+Inf";
+      }
+      out << "\"} " << cumulative << "\n";
+    }
+    out << "ndt7_interval_speed_bits_per_second_count{test=\"" << tests[i]
+        << "\"} " << histograms[i]->count << "\n";
+    out << "ndt7_interval_speed_bits_per_second_sum{test=\"" << tests[i]
+        << "\"} " << histograms[i]->sum * 1000.0 << "\n";
+  }
+
+  const libndt7::NetxCounters *netx[] = {&download_netx_, &upload_netx_};
+  struct {
+    const char *name;
+    const char *help;
+    uint64_t libndt7::NetxCounters::*field;
+  } counters[] = {
+      {"ndt7_netx_received_bytes", "Bytes received.",
+       &libndt7::NetxCounters::bytes_recv},
+      {"ndt7_netx_sent_bytes", "Bytes sent.",
+       &libndt7::NetxCounters::bytes_sent},
+      {"ndt7_netx_recv_calls", "Successful nonblocking receives.",
+       &libndt7::NetxCounters::recv_calls},
+      {"ndt7_netx_send_calls", "Successful nonblocking sends.",
+       &libndt7::NetxCounters::send_calls},
+      {"ndt7_netx_bio_reads", "Socket reads issued by the TLS layer.",
+       &libndt7::NetxCounters::bio_reads},
+  };
+  for (auto &counter : counters) {
+    family(counter.name, "counter", counter.help);
+    for (size_t i = 0; i < 2; ++i) {
+      out << counter.name << "_total{test=\"" << tests[i] << "\"} "
+          << netx[i]->*counter.field << "\n";
+    }
+  }
+
+  if (progress.nettest != 0) {
+    const char *test = (progress.nettest == libndt7::nettest_flag_download)
+                           ? "download"
+                           : "upload";
+    family("ndt7_progress_elapsed_seconds", "gauge",
+           "Time since the beginning of the running subtest.");
+    out << "ndt7_progress_elapsed_seconds{test=\"" << test << "\"} "
+        << progress.elapsed << "\n";
+    family("ndt7_progress_speed_bits_per_second", "gauge",
+           "Speed measured over the latest interval of the running subtest.");
+    out << "ndt7_progress_speed_bits_per_second{test=\"" << test << "\"} "
+        << progress.speed * 1000.0 << "\n";
+  }
+
+  out << "# EOF\n";
+  return out.str();
+}
+
+// write_metrics_file atomically replaces @p path with @p metrics.
+static bool write_metrics_file(const std::string &path,
+                               const std::string &metrics) {
+  std::string temp = path + ".tmp";
+  {
+    std::ofstream file{temp, std::ios::trunc};
+    file << metrics;
+    if (!file.good()) {
+      return false;
+    }
+  }
+#ifdef _WIN32
+  (void)remove(path.c_str());
+#endif
+  return rename(temp.c_str(), path.c_str()) == 0;
+}
+
+#ifndef _WIN32
+// Daemon mode
+// ```````````
+//
+// In daemon mode we run a test every `interval` seconds, randomly shortened or
+// lengthened by up to `jitter` times the interval so that many clients started
+// at the same time do not all hit the servers at once. Tests can also be
+// requested through a Unix domain control socket, which accepts one command
+// per connection and answers with a single line of JSON:
+//
+// - `run` starts a test now, unless a test is already running;
+// - `status` returns counters and the result of the last test;
+// - `cancel` aborts the running test, if any;
+// - `quit` exits after the running test, if any, has completed.
+//
+// On SIGINT or SIGTERM we cancel the running test and exit.
+//
+// All tests use the same Client, so that what it has cached (TLS contexts,
+// buffers, Locate API results and connections to the Locate API) is reused.
+// Each test appends a line of JSON containing its result to the output.
+//
+// When configured to do so, we also serve metrics over HTTP. Any request for
+// `/metrics` gets the metrics, including the progress of the running test.
+
+struct DaemonSettings {
+  double interval = 3600.0;
+  double jitter = 0.1;
+  std::string control_socket;
+  std::string metrics_address;
+  std::string metrics_file;
+};
+
+static volatile sig_atomic_t daemon_signaled = 0;
+
+static void daemon_on_signal(int signo) {
+  daemon_signaled = 1;
+  // Restore the default handler so that a second signal exits immediately.
+  signal(signo, SIG_DFL);
+}
+
+class Daemon {
+ public:
+  Daemon(DaemonSettings settings, libndt7::Client *client, std::ostream *output,
+         bool print_summary) noexcept
+      : settings_{std::move(settings)}, client_{client}, output_{output},
+        print_summary_{print_summary} {}
+
+  // loop runs tests until we receive a signal or the `quit` command.
+  int loop() noexcept;
+
+  // handle_command executes a control socket @p command and returns the reply.
+  nlohmann::json handle_command(const std::string &command) noexcept;
+
+ private:
+  int listen_control_socket() noexcept;
+  int listen_metrics_address() noexcept;
+  void serve_control_connection(int fd) noexcept;
+  void serve_metrics_connection(int fd) noexcept;
+  void schedule() noexcept;
+  void run_once() noexcept;
+
+  DaemonSettings settings_;
+  libndt7::Client *client_;
+  std::ostream *output_;
+  bool print_summary_;
+  std::mt19937_64 rng_{std::random_device{}()};
+  std::chrono::steady_clock::time_point next_run_;
+  std::thread worker_;
+  std::atomic<bool> running_{false};
+  bool run_requested_ = false;
+  bool quit_ = false;
+
+  // The following fields are written by the worker and read by the loop.
+  std::mutex mutex_;
+  Metrics metrics_;
+  nlohmann::json last_result_;
+};
+
+// read_request reads from @p fd until @p terminator or until the peer stops
+// sending. We use timeouts so that a stuck peer cannot block the daemon.
+static std::string read_request(int fd, const char *terminator) noexcept {
+  timeval tv{};
+  tv.tv_sec = 1;
+  (void)setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  (void)setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  std::string request;
+  char buf[256];
+  while (request.find(terminator) == std::string::npos &&
+         request.size() < 4096) {
+    ssize_t n = recv(fd, buf, sizeof(buf), 0);
+    if (n <= 0) {
+      break;
+    }
+    request.append(buf, (size_t)n);
+  }
+  return request;
+}
+
+int Daemon::loop() noexcept {
+  int listener = -1;
+  if (!settings_.control_socket.empty()) {
+    listener = listen_control_socket();
+    if (listener == -1) {
+      return EXIT_FAILURE;
+    }
+  }
+  int metrics_listener = -1;
+  if (!settings_.metrics_address.empty()) {
+    metrics_listener = listen_metrics_address();
+    if (metrics_listener == -1) {
+      return EXIT_FAILURE;
+    }
+  }
+  signal(SIGINT, daemon_on_signal);
+  signal(SIGTERM, daemon_on_signal);
+  signal(SIGPIPE, SIG_IGN);
+  next_run_ = std::chrono::steady_clock::now();
+  while (!quit_ && !daemon_signaled) {
+    if (!running_ && worker_.joinable()) {
+      worker_.join();
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (!running_ && (run_requested_ || now >= next_run_)) {
+      run_requested_ = false;
+      schedule();
+      // Reset before setting running_, after which `cancel` may cancel the
+      // test even though the worker has not called run() yet.
+      client_->reset_cancel();
+      running_ = true;
+      worker_ = std::thread{[this]() { run_once(); }};
+    }
+    // Wake up periodically to notice when the running test completes.
+    auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(
+                       next_run_ - std::chrono::steady_clock::now())
+                       .count();
+    timeout = (std::max)((int64_t)0, (std::min)((int64_t)250, (int64_t)timeout));
+    pollfd pfds[2]{};
+    pfds[0].fd = listener;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = metrics_listener;
+    pfds[1].events = POLLIN;
+    // Note that poll() ignores negative file descriptors.
+    if (poll(pfds, 2, (int)timeout) <= 0) {
+      continue;
+    }
+    if ((pfds[0].revents & POLLIN) != 0) {
+      int fd = accept(listener, nullptr, nullptr);
+      if (fd != -1) {
+        serve_control_connection(fd);
+        close(fd);
+      }
+    }
+    if ((pfds[1].revents & POLLIN) != 0) {
+      int fd = accept(metrics_listener, nullptr, nullptr);
+      if (fd != -1) {
+        serve_metrics_connection(fd);
+        close(fd);
+      }
+    }
+  }
+  if (worker_.joinable()) {
+    if (daemon_signaled) {
+      std::clog << "canceling the running test" << std::endl;
+      client_->cancel();
+    } else {
+      std::clog << "waiting for the running test to complete" << std::endl;
+    }
+    worker_.join();
+  }
+  if (listener != -1) {
+    close(listener);
+    unlink(settings_.control_socket.c_str());
+  }
+  if (metrics_listener != -1) {
+    close(metrics_listener);
+  }
+  return EXIT_SUCCESS;
+}
+
+int Daemon::listen_control_socket() noexcept {
+  sockaddr_un sun{};
+  sun.sun_family = AF_UNIX;
+  if (settings_.control_socket.size() >= sizeof(sun.sun_path)) {
+    std::clog << "fatal: control socket path too long" << std::endl;
+    return -1;
+  }
+  strcpy(sun.sun_path, settings_.control_socket.c_str());
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) {
+    std::clog << "fatal: cannot create control socket" << std::endl;
+    return -1;
+  }
+  // Remove the socket left behind by a previous instance, if any.
+  (void)unlink(sun.sun_path);
+  if (bind(fd, (sockaddr *)&sun, sizeof(sun)) != 0 ||
+      chmod(sun.sun_path, S_IRUSR | S_IWUSR) != 0 || listen(fd, 8) != 0) {
+    std::clog << "fatal: cannot listen on control socket: "
+              << settings_.control_socket << std::endl;
+    close(fd);
+    return -1;
+  }
+  std::clog << "listening on control socket: " << settings_.control_socket
+            << std::endl;
+  return fd;
+}
+
+int Daemon::listen_metrics_address() noexcept {
+  // The address is either `<ipv4>:<port>` or `[<ipv6>]:<port>`.
+  std::string address = settings_.metrics_address;
+  auto pos = address.rfind(':');
+  if (pos == std::string::npos) {
+    std::clog << "fatal: invalid metrics address: " << address << std::endl;
+    return -1;
+  }
+  std::string host = address.substr(0, pos);
+  std::string port = address.substr(pos + 1);
+  if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+    host = host.substr(1, host.size() - 2);
+  }
+  addrinfo hints{};
+  hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV | AI_PASSIVE;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo *rp = nullptr;
+  if (getaddrinfo(host.c_str(), port.c_str(), &hints, &rp) != 0) {
+    std::clog << "fatal: invalid metrics address: " << address << std::endl;
+    return -1;
+  }
+  int fd = socket(rp->ai_family, SOCK_STREAM, 0);
+  int on = 1;
+  if (fd == -1 ||
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+      bind(fd, rp->ai_addr, rp->ai_addrlen) != 0 || listen(fd, 8) != 0) {
+    std::clog << "fatal: cannot listen on metrics address: " << address
+              << std::endl;
+    if (fd != -1) {
+      close(fd);
+    }
+    freeaddrinfo(rp);
+    return -1;
+  }
+  freeaddrinfo(rp);
+  std::clog << "serving metrics at: http://" << address << "/metrics"
+            << std::endl;
+  return fd;
+}
+
+void Daemon::serve_control_connection(int fd) noexcept {
+  std::string command = read_request(fd, "\n");
+  command = command.substr(0, command.find_first_of("\r\n"));
+  std::string reply = handle_command(command).dump() + "\n";
+  (void)send(fd, reply.data(), reply.size(), 0);
+}
+
+void Daemon::serve_metrics_connection(int fd) noexcept {
+  std::string request = read_request(fd, "\r\n\r\n");
+  std::string response;
+  if (request.compare(0, 13, "GET /metrics ") == 0) {
+    std::string body;
+    {
+      std::unique_lock<std::mutex> _{mutex_};
+      body = metrics_.format(client_->get_progress());
+    }
+    response = "HTTP/1.1 200 OK\r\n"
+               "Content-Type: application/openmetrics-text; version=1.0.0; "
+               "charset=utf-8\r\n"
+               "Content-Length: " + std::to_string(body.size()) + "\r\n"
+               "Connection: close\r\n\r\n" + body;
+  } else {
+    response = "HTTP/1.1 404 Not Found\r\n"
+               "Content-Length: 0\r\n"
+               "Connection: close\r\n\r\n";
+  }
+  (void)send(fd, response.data(), response.size(), 0);
+}
+
+nlohmann::json Daemon::handle_command(const std::string &command) noexcept {
+  nlohmann::json reply;
+  if (command == "run") {
+    reply["Accepted"] = !running_;
+    run_requested_ = !running_;
+  } else if (command == "status") {
+    std::unique_lock<std::mutex> _{mutex_};
+    reply["Running"] = running_.load();
+    reply["Runs"] = metrics_.runs();
+    reply["Failures"] = metrics_.failures();
+    reply["NextRunIn"] =
+        std::chrono::duration<double>(next_run_ -
+                                      std::chrono::steady_clock::now())
+            .count();
+    reply["LastResult"] = last_result_;
+  } else if (command == "cancel") {
+    reply["Canceled"] = running_.load();
+    if (running_) {
+      client_->cancel();
+    }
+  } else if (command == "quit") {
+    reply["Quitting"] = true;
+    quit_ = true;
+  } else {
+    reply["Error"] = "unknown command: " + command;
+  }
+  return reply;
+}
+
+// jittered_interval returns @p interval seconds randomly shortened or
+// lengthened by up to @p jitter times @p interval.
+static double jittered_interval(double interval, double jitter,
+                                std::mt19937_64 *rng) noexcept {
+  std::uniform_real_distribution<double> random{-jitter, jitter};
+  return interval * (1.0 + random(*rng));
+}
+
+void Daemon::schedule() noexcept {
+  std::chrono::duration<double> delay{
+      jittered_interval(settings_.interval, settings_.jitter, &rng_)};
+  next_run_ = std::chrono::steady_clock::now() +
+              std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                  delay);
+  std::clog << "next test in " << (int64_t)delay.count() << " seconds"
+            << std::endl;
+}
+
+void Daemon::run_once() noexcept {
+  bool success = client_->run();
+  if (success && print_summary_) {
+    client_->summary();
+  }
+  nlohmann::json result;
+  result["Time"] = (int64_t)std::time(nullptr);
+  result["Success"] = success;
+  result["Canceled"] = client_->is_canceled();
+  result["Summary"] = summary_to_json(client_->get_summary());
+  *output_ << result.dump() << std::endl;
+  {
+    std::unique_lock<std::mutex> _{mutex_};
+    metrics_.add(success, client_->get_summary());
+    last_result_ = std::move(result);
+    if (!settings_.metrics_file.empty() &&
+        !write_metrics_file(settings_.metrics_file,
+                            metrics_.format(libndt7::Progress{}))) {
+      std::clog << "warning: cannot write metrics to: "
+                << settings_.metrics_file << std::endl;
+    }
+  }
+  running_ = false;
+}
+#endif  // _WIN32
+
 struct KeyValueParserState {
   std::string first;
   std::string rest;
@@ -121,6 +1057,10 @@ you may specify an API key for the Locate API using:
 * `-locate-api-url=<url>`
 * `-locate-params=<name>=<value>[[,<name2>=<value2>],...]`
 
+Locate API results are reused while their access tokens are valid. Use
+`-locate-cache=<path>` to also reuse them across runs by saving them into
+the specified file.
+
 Instead of the Locate API, you may specify a specific server using a combination
 of the flags:
  * `-port=<port>`
@@ -133,12 +1073,60 @@ The default mode is wss (TLS).
  * `-ca-bundle-path=<path>` allows specifying an alternate CA bundle.
 
 You may control information output using a combination of the following flags:
- * `-batch` outputs JSON results to STDOUT.
+ * `-batch` outputs JSON results to STDOUT, one per line. They are written
+   in the background, in batches, and are all written before the client
+   exits.
  * `-summary` only prints a summary at the end of the test.
  * `-verbose` prints additional debug information.
 
 In combination, -batch and -summary produce a final summary in JSON.
 
+The summary includes statistics of the speed sampled every 100 ms, which
+you can change using `-sample-interval=<milliseconds>` (at least 10).
+On Linux, it also includes statistics of the TCP_INFO read every 100 ms,
+which you can change using `-tcp-info-interval=<milliseconds>` (0 disables).
+
+With `-daemon`, ndt7-client-cc runs periodically until it is interrupted.
+The following flags are only valid with `-daemon`:
+ * `-interval=<seconds>` is the average time between tests (default: 3600).
+ * `-jitter=<fraction>` randomizes the interval by up to the given fraction
+   of it, so that many clients do not all run at the same time (default: 0.1).
+ * `-control-socket=<path>` listens on a Unix domain socket accepting the
+   `run`, `status`, `cancel` and `quit` commands, one per connection.
+ * `-output=<path>` appends a JSON line with the result of each test to the
+   specified file rather than writing it to STDOUT.
+ * `-metrics-address=<address>:<port>` serves metrics in the OpenMetrics text
+   format at `http://<address>:<port>/metrics`.
+
+The `-metrics-file=<path>` flag writes metrics in the OpenMetrics text format
+into the specified file after each test, e.g. for the textfile collector of
+the Prometheus node exporter.
+
+To save bytes, e.g. on metered networks, you may stop subtests early:
+ * `-adaptive` stops a subtest once its speed has converged.
+ * `-byte-budget=<bytes>` stops a subtest after transferring the given number
+   of bytes.
+
+The `-max-run-time=<milliseconds>` flag bounds the whole test, from the query
+to Locate API to the end of the upload. Network operations do not wait past
+this time budget.
+
+The `-race-width=<count>` flag connects to up to the given number of servers
+in parallel before each subtest, starting a new connection every 250 ms, and
+uses the first one that is ready (default: 1). This is faster with a slow or
+unresponsive server, but each losing connection also starts a test on its
+server.
+
+You may tune the sockets used by the subtests, e.g. when the system defaults
+limit the window to less than the bandwidth-delay product of the path:
+ * `-rcvbuf=<bytes>` and `-sndbuf=<bytes>` set the socket buffer sizes.
+ * `-congestion=<name>` sets the congestion control algorithm (Linux).
+ * `-notsent-lowat=<bytes>` limits the unsent bytes in the send buffer.
+ * `-busy-poll=<microseconds>` busy polls the device queue (Linux).
+ * `-nodelay` disables Nagle's algorithm.
+ * `-tos=<value>` sets the IP type of service.
+The summary includes the values that the kernel actually used.
+
 The `-socks5h <port>` flag causes this tool to use the specified SOCKS5h
 proxy to contact Locate API and for running the selected subtests.
 
@@ -146,6 +1134,7 @@ The `-version` shows the version number and exits.)" << std::endl;
   // clang-format on
 }
 
+#ifndef NDT7_CLIENT_CC_NO_MAIN
 int main(int, char **argv) {
   libndt7::Settings settings;
   settings.verbosity = libndt7::verbosity_info;
@@ -153,6 +1142,13 @@ int main(int, char **argv) {
   settings.nettest_flags = libndt7::NettestFlags{0};
   bool batch_mode = false;
   bool summary = false;
+  bool daemon = false;
+  std::string daemon_param;
+  std::string output;
+  std::string metrics_file;
+#ifndef _WIN32
+  DaemonSettings daemon_settings;
+#endif
 
   {
     argh::parser cmdline;
@@ -161,11 +1157,29 @@ int main(int, char **argv) {
     cmdline.add_param("socks5h");
     cmdline.add_param("locate-api-key");
     cmdline.add_param("locate-api-url");
+    cmdline.add_param("locate-cache");
     cmdline.add_param("locate-params");
     cmdline.add_param("port");
     cmdline.add_param("scheme");
     cmdline.add_param("hostname");
     cmdline.add_param("user-agent");
+    cmdline.add_param("interval");
+    cmdline.add_param("jitter");
+    cmdline.add_param("control-socket");
+    cmdline.add_param("output");
+    cmdline.add_param("metrics-address");
+    cmdline.add_param("metrics-file");
+    cmdline.add_param("sample-interval");
+    cmdline.add_param("tcp-info-interval");
+    cmdline.add_param("byte-budget");
+    cmdline.add_param("max-run-time");
+    cmdline.add_param("race-width");
+    cmdline.add_param("rcvbuf");
+    cmdline.add_param("sndbuf");
+    cmdline.add_param("congestion");
+    cmdline.add_param("notsent-lowat");
+    cmdline.add_param("busy-poll");
+    cmdline.add_param("tos");
     cmdline.parse(argv);
     for (auto &flag : cmdline.flags()) {
       if (flag == "download") {
@@ -193,6 +1207,15 @@ int main(int, char **argv) {
       } else if (flag == "summary") {
         summary = true;
         std::clog << "will only display summary" << std::endl;
+      } else if (flag == "adaptive") {
+        settings.adaptive_duration = true;
+        std::clog << "will stop subtests once their speed converges" << std::endl;
+      } else if (flag == "nodelay") {
+        settings.socket_profile.nodelay = true;
+        std::clog << "will disable Nagle's algorithm" << std::endl;
+      } else if (flag == "daemon") {
+        daemon = true;
+        std::clog << "will run in daemon mode" << std::endl;
       } else {
         std::clog << "fatal: unrecognized flag: " << flag << std::endl;
         usage();
@@ -200,6 +1223,11 @@ int main(int, char **argv) {
       }
     }
     for (auto &param : cmdline.params()) {
+      if (param.first == "interval" || param.first == "jitter" ||
+          param.first == "control-socket" || param.first == "output" ||
+          param.first == "metrics-address") {
+        daemon_param = param.first;
+      }
       if (param.first == "ca-bundle-path") {
         settings.ca_bundle_path = param.second;
         std::clog << "will use this CA bundle: " << param.second << std::endl;
@@ -220,6 +1248,9 @@ int main(int, char **argv) {
       } else if (param.first == "locate-api-url") {
         settings.locate_api_base_url = param.second;
         std::clog << "will use this locate api url: " << param.second << std::endl;
+      } else if (param.first == "locate-cache") {
+        settings.locate_cache_path = param.second;
+        std::clog << "will cache locate results in: " << param.second << std::endl;
       } else if (param.first == "port") {
         settings.port = param.second;
         std::clog << "will use this port: " << param.second << std::endl;
@@ -235,12 +1266,140 @@ int main(int, char **argv) {
       } else if (param.first == "socks5h") {
         settings.socks5h_port = param.second;
         std::clog << "will use the socks5h proxy at: 127.0.0.1:" << param.second << std::endl;
+#ifndef _WIN32
+      } else if (param.first == "interval" || param.first == "jitter") {
+        double value = 0.0;
+        try {
+          value = std::stod(param.second);
+        } catch (const std::exception &) {
+          value = -1.0;
+        }
+        bool valid = (param.first == "interval") ? value > 0.0
+                                                 : value >= 0.0 && value < 1.0;
+        if (!valid) {
+          std::clog << "fatal: invalid " << param.first << ": " << param.second << std::endl;
+          exit(EXIT_FAILURE);
+        }
+        if (param.first == "interval") {
+          daemon_settings.interval = value;
+        } else {
+          daemon_settings.jitter = value;
+        }
+        std::clog << "will use this " << param.first << ": " << value << std::endl;
+      } else if (param.first == "control-socket") {
+        daemon_settings.control_socket = param.second;
+        std::clog << "will use this control socket: " << param.second << std::endl;
+      } else if (param.first == "metrics-address") {
+        daemon_settings.metrics_address = param.second;
+        std::clog << "will serve metrics at: " << param.second << std::endl;
+#endif
+      } else if (param.first == "sample-interval") {
+        int value = 0;
+        try {
+          value = std::stoi(param.second);
+        } catch (const std::exception &) {
+          value = -1;
+        }
+        if (value < 10) {
+          std::clog << "fatal: invalid sample-interval: " << param.second << std::endl;
+          exit(EXIT_FAILURE);
+        }
+        settings.sample_interval_ms = (uint32_t)value;
+        std::clog << "will sample the throughput every " << value << " ms" << std::endl;
+      } else if (param.first == "tcp-info-interval") {
+        int value = 0;
+        try {
+          value = std::stoi(param.second);
+        } catch (const std::exception &) {
+          value = -1;
+        }
+        if (value < 0) {
+          std::clog << "fatal: invalid tcp-info-interval: " << param.second << std::endl;
+          exit(EXIT_FAILURE);
+        }
+        settings.tcp_info_interval_ms = (uint32_t)value;
+        std::clog << "will read TCP_INFO every " << value << " ms" << std::endl;
+      } else if (param.first == "max-run-time") {
+        int value = 0;
+        try {
+          value = std::stoi(param.second);
+        } catch (const std::exception &) {
+          value = -1;
+        }
+        if (value < 0) {
+          std::clog << "fatal: invalid max-run-time: " << param.second << std::endl;
+          exit(EXIT_FAILURE);
+        }
+        settings.max_run_time_ms = (uint32_t)value;
+        std::clog << "will run for at most " << value << " ms" << std::endl;
+      } else if (param.first == "race-width") {
+        int value = 0;
+        try {
+          value = std::stoi(param.second);
+        } catch (const std::exception &) {
+          value = -1;
+        }
+        if (value < 1) {
+          std::clog << "fatal: invalid race-width: " << param.second << std::endl;
+          exit(EXIT_FAILURE);
+        }
+        settings.race_width = (uint32_t)value;
+        std::clog << "will connect to up to " << value << " servers in parallel" << std::endl;
+      } else if (param.first == "byte-budget") {
+        uint64_t value = 0;
+        try {
+          value = std::stoull(param.second);
+        } catch (const std::exception &) {
+          std::clog << "fatal: invalid byte-budget: " << param.second << std::endl;
+          exit(EXIT_FAILURE);
+        }
+        settings.subtest_byte_budget = value;
+        std::clog << "will transfer at most " << value << " bytes per subtest" << std::endl;
+      } else if (param.first == "rcvbuf" || param.first == "sndbuf" ||
+                 param.first == "notsent-lowat" || param.first == "busy-poll" ||
+                 param.first == "tos") {
+        int value = 0;
+        try {
+          value = std::stoi(param.second);
+        } catch (const std::exception &) {
+          value = -1;
+        }
+        if (value < 0 || (param.first == "tos" && value > 255)) {
+          std::clog << "fatal: invalid " << param.first << ": " << param.second << std::endl;
+          exit(EXIT_FAILURE);
+        }
+        if (param.first == "rcvbuf") {
+          settings.socket_profile.rcvbuf = value;
+        } else if (param.first == "sndbuf") {
+          settings.socket_profile.sndbuf = value;
+        } else if (param.first == "notsent-lowat") {
+          settings.socket_profile.notsent_lowat = value;
+        } else if (param.first == "busy-poll") {
+          settings.socket_profile.busy_poll = value;
+        } else {
+          settings.socket_profile.tos = value;
+        }
+        std::clog << "will use this " << param.first << ": " << value << std::endl;
+      } else if (param.first == "congestion") {
+        settings.socket_profile.congestion = param.second;
+        std::clog << "will use this congestion control: " << param.second << std::endl;
+      } else if (param.first == "metrics-file") {
+        metrics_file = param.second;
+        std::clog << "will write metrics to: " << param.second << std::endl;
+      } else if (param.first == "output") {
+        output = param.second;
+        std::clog << "will append results to: " << param.second << std::endl;
       } else {
         std::clog << "fatal: unrecognized param: " << param.first << std::endl;
         usage();
         exit(EXIT_FAILURE);
       }
     }
+    if (!daemon && !daemon_param.empty()) {
+      std::clog << "fatal: -" << daemon_param << " requires -daemon" << std::endl;
+      usage();
+      exit(EXIT_FAILURE);
+    }
     if (settings.scheme != "ws" && settings.scheme != "wss" ) {
       std::clog << "fatal: invalid scheme: " << settings.scheme << std::endl;
       usage();
@@ -274,15 +1433,45 @@ int main(int, char **argv) {
   }
 
   settings.summary_only = summary;
+  // We do not override the netx methods, so we can bypass them.
+  settings.io_fastpath = true;
   std::unique_ptr<libndt7::Client>  client;
   if (batch_mode) {
     client.reset(new BatchClient{settings});
   } else {
     client.reset(new libndt7::Client{settings});
   }
+  if (daemon) {
+#ifndef _WIN32
+    std::ofstream file;
+    if (!output.empty()) {
+      file.open(output, std::ios::app);
+      if (!file.good()) {
+        std::clog << "fatal: cannot open output file: " << output << std::endl;
+        exit(EXIT_FAILURE);
+      }
+    }
+    daemon_settings.metrics_file = metrics_file;
+    Daemon d{daemon_settings, client.get(), (file.is_open()) ? &file : &std::cout,
+             !batch_mode};
+    return d.loop();
+#else
+    std::clog << "fatal: daemon mode is not supported on Windows" << std::endl;
+    exit(EXIT_FAILURE);
+#endif
+  }
   bool rv = client->run();
   if (rv ) {
     client->summary();
   }
+  if (!metrics_file.empty()) {
+    Metrics metrics;
+    metrics.add(rv, client->get_summary());
+    if (!write_metrics_file(metrics_file, metrics.format(libndt7::Progress{}))) {
+      std::clog << "warning: cannot write metrics to: " << metrics_file
+                << std::endl;
+    }
+  }
   return (rv) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
+#endif  // NDT7_CLIENT_CC_NO_MAIN
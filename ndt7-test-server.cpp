@@ -0,0 +1,855 @@
+// Part of Measurement Lab <https://www.measurementlab.net/>.
+// Measurement Lab libndt7 is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+
+// ndt7-test-server - a loopback ndt7 server, such that we can benchmark and
+// test the client without using the network. It serves the download and the
+// upload subtests over ws:// and over wss://, the latter with a self-signed
+// certificate generated at startup, as well as a static Locate API pointing
+// to itself.
+
+#include "third_party/github.com/nlohmann/json/json.hpp"
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/tcp.h>
+#include <linux/version.h>
+#endif
+
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __clang__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wsign-conversion"
+#endif  // __clang__
+#include "third_party/github.com/adishavit/argh/argh.h"
+#ifdef __clang__
+#pragma clang diagnostic pop
+#endif  // __clang__
+
+#if defined(__linux__) && LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0)
+#define NDT7_TEST_SERVER_BYTES_SENT
+#endif
+
+// ServerSettings contains the server configuration.
+struct ServerSettings {
+  // Address on which we listen.
+  std::string address = "127.0.0.1";
+
+  // Ports for ws://, wss:// and the Locate API. Zero picks a free port.
+  uint16_t ws_port = 8080;
+  uint16_t wss_port = 4443;
+  uint16_t locate_port = 8998;
+
+  // Size of the download messages. Zero means starting from 8 KiB and
+  // doubling the size like M-Lab servers do.
+  uint64_t message_size = 0;
+
+  // Duration of the download in seconds. The client decides when the upload
+  // ends.
+  double duration = 10.0;
+
+  // Interval between measurement messages, in milliseconds. Zero disables
+  // sending measurements.
+  uint32_t measurement_interval_ms = 250;
+
+  // File where to write the certificate, e.g., to use it with the
+  // `-ca-bundle-path` flag of ndt7-client-cc.
+  std::string cert_file;
+};
+
+// When scaling, we double the message size each time the bytes sent exceed
+// scaling_fraction times the current size, up to max_scaled_message_size.
+constexpr uint64_t initial_message_size = 1 << 13;
+constexpr uint64_t max_scaled_message_size = 1 << 20;
+constexpr uint64_t scaling_fraction = 16;
+
+// Opcodes. See <https://tools.ietf.org/html/rfc6455#section-11.8>.
+constexpr uint8_t ws_opcode_text = 1;
+constexpr uint8_t ws_opcode_binary = 2;
+constexpr uint8_t ws_opcode_close = 8;
+constexpr uint8_t ws_fin_flag = 0x80;
+
+static volatile sig_atomic_t server_signaled = 0;
+
+static void server_on_signal(int) { server_signaled = 1; }
+
+// Conn is an accepted connection, optionally using TLS.
+class Conn {
+ public:
+  Conn(int fd, SSL *ssl) noexcept : fd_{fd}, ssl_{ssl} {}
+
+  Conn(const Conn &) = delete;
+  Conn &operator=(const Conn &) = delete;
+
+  ~Conn() noexcept {
+    if (ssl_ != nullptr) {
+      (void)SSL_shutdown(ssl_);
+      SSL_free(ssl_);
+    }
+    close(fd_);
+  }
+
+  int fd() const noexcept { return fd_; }
+
+  bool readn(void *base, size_t count) noexcept {
+    auto p = (char *)base;
+    while (count > 0) {
+      ssize_t n = 0;
+      if (ssl_ != nullptr) {
+        int chunk = (int)(std::min)(count, (size_t)INT32_MAX);
+        n = SSL_read(ssl_, p, chunk);
+      } else {
+        n = recv(fd_, p, count, 0);
+        if (n < 0 && errno == EINTR) {
+          continue;
+        }
+      }
+      if (n <= 0) {
+        return false;
+      }
+      p += n;
+      count -= (size_t)n;
+    }
+    return true;
+  }
+
+  bool writen(const void *base, size_t count) noexcept {
+    auto p = (const char *)base;
+    while (count > 0) {
+      ssize_t n = 0;
+      if (ssl_ != nullptr) {
+        int chunk = (int)(std::min)(count, (size_t)INT32_MAX);
+        n = SSL_write(ssl_, p, chunk);
+      } else {
+        n = send(fd_, p, count, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+          continue;
+        }
+      }
+      if (n <= 0) {
+        return false;
+      }
+      p += n;
+      count -= (size_t)n;
+    }
+    return true;
+  }
+
+  bool writen(const std::string &s) noexcept {
+    return writen(s.data(), s.size());
+  }
+
+  // Reads a CRLF terminated line of at most @p maxlen bytes. Bytes are read
+  // one at a time, which is fine for the small HTTP requests we process.
+  bool readln(std::string *line, size_t maxlen) noexcept {
+    line->clear();
+    char c = 0;
+    while (line->size() < maxlen && readn(&c, 1)) {
+      if (c == '\n') {
+        if (!line->empty() && line->back() == '\r') {
+          line->pop_back();
+        }
+        return true;
+      }
+      *line += c;
+    }
+    return false;
+  }
+
+ private:
+  int fd_;
+  SSL *ssl_;
+};
+
+// Returns an unmasked server frame carrying @p payload.
+static std::string ws_frame(uint8_t opcode, const std::string &payload) {
+  std::string frame;
+  frame += (char)(opcode | ws_fin_flag);
+  uint64_t size = payload.size();
+  if (size < 126) {
+    frame += (char)size;
+  } else if (size <= UINT16_MAX) {
+    frame += (char)126;
+    frame += (char)((size >> 8) & 0xff);
+    frame += (char)(size & 0xff);
+  } else {
+    frame += (char)127;
+    for (int shift = 56; shift >= 0; shift -= 8) {
+      frame += (char)((size >> shift) & 0xff);
+    }
+  }
+  return frame + payload;
+}
+
+// Returns a binary frame carrying @p size random bytes.
+static std::string ws_binary_frame(uint64_t size, std::mt19937 *rng) {
+  std::string payload;
+  payload.reserve((size_t)size);
+  std::uniform_int_distribution<int> byte{0, 255};
+  for (uint64_t i = 0; i < size; ++i) {
+    payload += (char)byte(*rng);
+  }
+  return ws_frame(ws_opcode_binary, payload);
+}
+
+// Reads a client frame and discards its payload, setting @p opcode and the
+// payload @p size. Returns false on I/O error or protocol violation.
+static bool ws_discard_frame(Conn *conn, uint8_t *opcode,
+                             uint64_t *size) noexcept {
+  uint8_t header[2];
+  if (!conn->readn(header, sizeof(header))) {
+    return false;
+  }
+  *opcode = header[0] & 0x0f;
+  if ((header[1] & 0x80) == 0) {
+    return false;  // client frames MUST be masked
+  }
+  uint64_t length = header[1] & 0x7f;
+  if (length == 126 || length == 127) {
+    uint8_t ext[8];
+    size_t ext_size = (length == 126) ? 2 : 8;
+    if (!conn->readn(ext, ext_size)) {
+      return false;
+    }
+    length = 0;
+    for (size_t i = 0; i < ext_size; ++i) {
+      length = (length << 8) | ext[i];
+    }
+  }
+  uint8_t mask[4];
+  if (!conn->readn(mask, sizeof(mask))) {
+    return false;
+  }
+  *size = length;
+  char buf[1 << 16];
+  while (length > 0) {
+    size_t chunk = (size_t)(std::min)(length, (uint64_t)sizeof(buf));
+    if (!conn->readn(buf, chunk)) {
+      return false;
+    }
+    length -= chunk;
+  }
+  return true;
+}
+
+// Returns the Sec-WebSocket-Accept value for @p key (RFC6455 Sect. 4.2.2).
+static std::string ws_accept_key(const std::string &key) {
+  std::string s = key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int digest_size = 0;
+  if (EVP_Digest(s.data(), s.size(), digest, &digest_size, EVP_sha1(),
+                 nullptr) != 1) {
+    return "";
+  }
+  unsigned char encoded[4 * ((EVP_MAX_MD_SIZE + 2) / 3) + 1];
+  int n = EVP_EncodeBlock(encoded, digest, (int)digest_size);
+  return std::string{(const char *)encoded, (size_t)n};
+}
+
+// Compares @p a and @p b ignoring the case.
+static bool equal_fold(const std::string &a, const std::string &b) noexcept {
+  return a.size() == b.size() &&
+         std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+           return tolower((unsigned char)x) == tolower((unsigned char)y);
+         });
+}
+
+// Processes the WebSocket upgrade request and sets @p test to either
+// "download" or "upload". Returns false if the request is not valid.
+static bool ws_accept(Conn *conn, std::string *test) noexcept {
+  constexpr size_t max_line_length = 8000;
+  constexpr size_t max_headers = 100;
+  std::string line;
+  if (!conn->readln(&line, max_line_length)) {
+    return false;
+  }
+  // For example: `GET /ndt/v7/download?foo=bar HTTP/1.1`.
+  std::string path;
+  auto first = line.find(' ');
+  auto second = line.find(' ', first + 1);
+  if (line.compare(0, 4, "GET ") == 0 && second != std::string::npos) {
+    path = line.substr(first + 1, second - first - 1);
+    path = path.substr(0, path.find('?'));
+  }
+  std::string key;
+  bool upgrade = false;
+  bool protocol = false;
+  for (size_t i = 0;; ++i) {
+    if (i >= max_headers || !conn->readln(&line, max_line_length)) {
+      return false;
+    }
+    if (line.empty()) {
+      break;
+    }
+    auto colon = line.find(':');
+    if (colon == std::string::npos) {
+      continue;
+    }
+    std::string name = line.substr(0, colon);
+    std::string value = line.substr(colon + 1);
+    value.erase(0, value.find_first_not_of(' '));
+    if (equal_fold(name, "Sec-WebSocket-Key")) {
+      key = value;
+    } else if (equal_fold(name, "Upgrade")) {
+      upgrade = equal_fold(value, "websocket");
+    } else if (equal_fold(name, "Sec-WebSocket-Protocol")) {
+      protocol = value.find("net.measurementlab.ndt.v7") != std::string::npos;
+    }
+  }
+  if (path == "/ndt/v7/download") {
+    *test = "download";
+  } else if (path == "/ndt/v7/upload") {
+    *test = "upload";
+  } else {
+    (void)conn->writen("HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+    return false;
+  }
+  if (key.empty() || !upgrade || !protocol) {
+    (void)conn->writen("HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n");
+    return false;
+  }
+  return conn->writen("HTTP/1.1 101 Switching Protocols\r\n"
+                      "Upgrade: websocket\r\n"
+                      "Connection: Upgrade\r\n"
+                      "Sec-WebSocket-Accept: " + ws_accept_key(key) + "\r\n"
+                      "Sec-WebSocket-Protocol: net.measurementlab.ndt.v7\r\n"
+                      "\r\n");
+}
+
+// Returns the numeric `address:port` of @p sa.
+static std::string format_endpoint(const sockaddr *sa, socklen_t len) {
+  char host[NI_MAXHOST];
+  char port[NI_MAXSERV];
+  if (getnameinfo(sa, len, host, sizeof(host), port, sizeof(port),
+                  NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+    return "";
+  }
+  std::string address = host;
+  if (address.find(':') != std::string::npos) {
+    address = "[" + address + "]";
+  }
+  return address + ":" + port;
+}
+
+static nlohmann::json connection_info(int fd, const std::string &uuid) {
+  sockaddr_storage ss{};
+  socklen_t len = sizeof(ss);
+  nlohmann::json info;
+  if (getpeername(fd, (sockaddr *)&ss, &len) == 0) {
+    info["Client"] = format_endpoint((sockaddr *)&ss, len);
+  }
+  len = sizeof(ss);
+  if (getsockname(fd, (sockaddr *)&ss, &len) == 0) {
+    info["Server"] = format_endpoint((sockaddr *)&ss, len);
+  }
+  info["UUID"] = uuid;
+  return info;
+}
+
+// Returns a measurement message like the ones sent by M-Lab servers. The
+// TCPInfo comes from the kernel when possible, otherwise we fill the fields
+// used by clients using the application level counters.
+static std::string measurement(int fd, const std::string &test,
+                               const nlohmann::json &info,
+                               std::chrono::steady_clock::time_point begin,
+                               uint64_t num_bytes) {
+  auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+                     std::chrono::steady_clock::now() - begin)
+                     .count();
+  nlohmann::json m;
+  m["AppInfo"]["ElapsedTime"] = (int64_t)elapsed;
+  m["AppInfo"]["NumBytes"] = num_bytes;
+  m["ConnectionInfo"] = info;
+  m["Origin"] = "server";
+  m["Test"] = test;
+  nlohmann::json &tcpinfo = m["TCPInfo"];
+  tcpinfo["ElapsedTime"] = (int64_t)elapsed;
+  tcpinfo["BytesSent"] = (test == "download") ? num_bytes : 0;
+  tcpinfo["BytesReceived"] = (test == "upload") ? num_bytes : 0;
+  tcpinfo["BytesRetrans"] = 0;
+  tcpinfo["MinRTT"] = 0;
+#ifdef __linux__
+  struct tcp_info ti {};
+  socklen_t len = sizeof(ti);
+  if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) == 0) {
+    tcpinfo["State"] = ti.tcpi_state;
+    tcpinfo["RTO"] = ti.tcpi_rto;
+    tcpinfo["SndMSS"] = ti.tcpi_snd_mss;
+    tcpinfo["RcvMSS"] = ti.tcpi_rcv_mss;
+    tcpinfo["Unacked"] = ti.tcpi_unacked;
+    tcpinfo["Lost"] = ti.tcpi_lost;
+    tcpinfo["RTT"] = ti.tcpi_rtt;
+    tcpinfo["RTTVar"] = ti.tcpi_rttvar;
+    tcpinfo["SndCwnd"] = ti.tcpi_snd_cwnd;
+    tcpinfo["RcvSpace"] = ti.tcpi_rcv_space;
+    tcpinfo["TotalRetrans"] = ti.tcpi_total_retrans;
+    tcpinfo["PacingRate"] = ti.tcpi_pacing_rate;
+    tcpinfo["BytesAcked"] = ti.tcpi_bytes_acked;
+    tcpinfo["BytesReceived"] = ti.tcpi_bytes_received;
+    tcpinfo["MinRTT"] = ti.tcpi_min_rtt;
+    tcpinfo["DeliveryRate"] = ti.tcpi_delivery_rate;
+    tcpinfo["BusyTime"] = ti.tcpi_busy_time;
+    tcpinfo["RWndLimited"] = ti.tcpi_rwnd_limited;
+    tcpinfo["SndBufLimited"] = ti.tcpi_sndbuf_limited;
+#ifdef NDT7_TEST_SERVER_BYTES_SENT
+    tcpinfo["BytesSent"] = ti.tcpi_bytes_sent;
+    tcpinfo["BytesRetrans"] = ti.tcpi_bytes_retrans;
+#endif
+  }
+#else
+  (void)fd;
+#endif
+  return ws_frame(ws_opcode_text, m.dump());
+}
+
+static std::string new_uuid(std::mt19937 *rng) {
+  std::uniform_int_distribution<int> nibble{0, 15};
+  std::string uuid;
+  for (int i = 0; i < 32; ++i) {
+    uuid += "0123456789abcdef"[nibble(*rng)];
+  }
+  return uuid;
+}
+
+// Sends binary messages for the configured duration, interleaved with
+// measurements, and then closes the WebSocket connection.
+static void serve_download(const ServerSettings &settings, Conn *conn,
+                           const nlohmann::json &info, std::mt19937 *rng) {
+  uint64_t size = (settings.message_size > 0) ? settings.message_size
+                                               : initial_message_size;
+  std::string frame = ws_binary_frame(size, rng);
+  const auto interval =
+      std::chrono::milliseconds(settings.measurement_interval_ms);
+  const auto duration = std::chrono::duration<double>(settings.duration);
+  auto begin = std::chrono::steady_clock::now();
+  auto next_measurement = begin;
+  uint64_t total = 0;
+  for (;;) {
+    auto now = std::chrono::steady_clock::now();
+    if (now - begin >= duration) {
+      break;
+    }
+    if (settings.measurement_interval_ms > 0 && now >= next_measurement) {
+      if (!conn->writen(measurement(conn->fd(), "download", info, begin,
+                                    total))) {
+        return;
+      }
+      next_measurement = now + interval;
+    }
+    if (!conn->writen(frame)) {
+      return;
+    }
+    total += size;
+    if (settings.message_size == 0 && size < max_scaled_message_size &&
+        total >= scaling_fraction * size) {
+      size *= 2;
+      frame = ws_binary_frame(size, rng);
+    }
+  }
+  if (settings.measurement_interval_ms > 0 &&
+      !conn->writen(measurement(conn->fd(), "download", info, begin, total))) {
+    return;
+  }
+  if (!conn->writen(ws_frame(ws_opcode_close, ""))) {
+    return;
+  }
+  // Give the client a chance to reply to the close frame.
+  uint8_t opcode = 0;
+  uint64_t count = 0;
+  while (ws_discard_frame(conn, &opcode, &count) &&
+         opcode != ws_opcode_close) {
+  }
+}
+
+// Receives messages until the client stops sending, sending measurements
+// meanwhile. Clients decide when the upload ends, currently after ten
+// seconds, so we only close the connection after a grace period.
+static void serve_upload(const ServerSettings &settings, Conn *conn,
+                         const nlohmann::json &info) {
+  const auto interval =
+      std::chrono::milliseconds(settings.measurement_interval_ms);
+  const auto duration =
+      std::chrono::duration<double>((std::max)(settings.duration, 10.0) + 5.0);
+  auto begin = std::chrono::steady_clock::now();
+  auto next_measurement = begin;
+  uint64_t total = 0;
+  for (;;) {
+    auto now = std::chrono::steady_clock::now();
+    if (now - begin >= duration) {
+      (void)conn->writen(ws_frame(ws_opcode_close, ""));
+      return;
+    }
+    if (settings.measurement_interval_ms > 0 && now >= next_measurement) {
+      if (!conn->writen(measurement(conn->fd(), "upload", info, begin,
+                                    total))) {
+        return;
+      }
+      next_measurement = now + interval;
+    }
+    uint8_t opcode = 0;
+    uint64_t count = 0;
+    if (!ws_discard_frame(conn, &opcode, &count)) {
+      return;
+    }
+    if (opcode == ws_opcode_close) {
+      (void)conn->writen(ws_frame(ws_opcode_close, ""));
+      return;
+    }
+    total += count;
+  }
+}
+
+static void serve_ndt7(const ServerSettings &settings, SSL_CTX *ctx, int fd) {
+  // Make sure that a stuck client cannot block this thread forever.
+  timeval tv{};
+  tv.tv_sec = (time_t)(std::max)(settings.duration, 10.0) + 10;
+  (void)setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  (void)setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  SSL *ssl = nullptr;
+  if (ctx != nullptr) {
+    ssl = SSL_new(ctx);
+    if (ssl == nullptr) {
+      close(fd);
+      return;
+    }
+    SSL_set_fd(ssl, fd);
+    if (SSL_accept(ssl) != 1) {
+      SSL_free(ssl);
+      close(fd);
+      return;
+    }
+  }
+  Conn conn{fd, ssl};
+  std::string test;
+  if (!ws_accept(&conn, &test)) {
+    return;
+  }
+  std::mt19937 rng{std::random_device{}()};
+  nlohmann::json info = connection_info(fd, new_uuid(&rng));
+  std::clog << test << ": " << info.value("Client", "") << std::endl;
+  if (test == "download") {
+    serve_download(settings, &conn, info, &rng);
+  } else {
+    serve_upload(settings, &conn, info);
+  }
+}
+
+// Replies to any Locate API query with the URLs of this server.
+static void serve_locate(const ServerSettings &settings, uint16_t ws_port,
+                         uint16_t wss_port, int fd) {
+  timeval tv{};
+  tv.tv_sec = 5;
+  (void)setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  (void)setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  Conn conn{fd, nullptr};
+  std::string request_line;
+  if (!conn.readln(&request_line, 8000)) {
+    return;
+  }
+  for (std::string line; conn.readln(&line, 8000) && !line.empty();) {
+    // Skip the headers.
+  }
+  if (request_line.compare(0, 8, "GET /v2/") != 0) {
+    (void)conn.writen(
+        "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n"
+        "Connection: close\r\n\r\n");
+    return;
+  }
+  std::string host = settings.address;
+  if (host.find(':') != std::string::npos) {
+    host = "[" + host + "]";
+  }
+  nlohmann::json result;
+  result["machine"] = "localhost";
+  result["location"]["city"] = "Loopback";
+  result["location"]["country"] = "ZZ";
+  for (auto test : {"download", "upload"}) {
+    std::string path = std::string{"/ndt/v7/"} + test;
+    result["urls"]["ws://" + path] =
+        "ws://" + host + ":" + std::to_string((unsigned)ws_port) + path;
+    result["urls"]["wss://" + path] =
+        "wss://" + host + ":" + std::to_string((unsigned)wss_port) + path;
+  }
+  nlohmann::json body;
+  body["results"].push_back(result);
+  std::string s = body.dump();
+  (void)conn.writen("HTTP/1.1 200 OK\r\n"
+                    "Content-Type: application/json\r\n"
+                    "Content-Length: " + std::to_string(s.size()) + "\r\n"
+                    "Connection: close\r\n\r\n" + s);
+}
+
+// Creates a TLS server context using an ephemeral self-signed certificate
+// valid for localhost and for @p address.
+static SSL_CTX *new_server_ctx(const std::string &address,
+                               const std::string &cert_file) {
+  EVP_PKEY *pkey = nullptr;
+  EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+  if (pctx == nullptr || EVP_PKEY_keygen_init(pctx) <= 0 ||
+      EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pctx, NID_X9_62_prime256v1) <= 0 ||
+      EVP_PKEY_keygen(pctx, &pkey) <= 0) {
+    std::clog << "fatal: cannot generate private key" << std::endl;
+    return nullptr;
+  }
+  EVP_PKEY_CTX_free(pctx);
+  X509 *cert = X509_new();
+  ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+  X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+  X509_gmtime_adj(X509_getm_notAfter(cert), 30 * 24 * 3600);
+  X509_set_pubkey(cert, pkey);
+  X509_NAME *name = X509_get_subject_name(cert);
+  X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                             (const unsigned char *)"localhost", -1, -1, 0);
+  X509_set_issuer_name(cert, name);
+  std::string san = "DNS:localhost";
+  in6_addr ignored{};
+  if (inet_pton(AF_INET, address.c_str(), &ignored) == 1 ||
+      inet_pton(AF_INET6, address.c_str(), &ignored) == 1) {
+    san += ",IP:" + address;
+  } else {
+    san += ",DNS:" + address;
+  }
+  X509_EXTENSION *ext = X509V3_EXT_conf_nid(nullptr, nullptr,
+                                            NID_subject_alt_name, san.c_str());
+  if (ext != nullptr) {
+    X509_add_ext(cert, ext, -1);
+    X509_EXTENSION_free(ext);
+  }
+  X509_sign(cert, pkey, EVP_sha256());
+  SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+  if (ctx == nullptr || SSL_CTX_use_certificate(ctx, cert) != 1 ||
+      SSL_CTX_use_PrivateKey(ctx, pkey) != 1) {
+    std::clog << "fatal: cannot create server context" << std::endl;
+    return nullptr;
+  }
+  if (!cert_file.empty()) {
+    FILE *fp = fopen(cert_file.c_str(), "w");
+    if (fp == nullptr || PEM_write_X509(fp, cert) != 1) {
+      std::clog << "fatal: cannot write certificate: " << cert_file
+                << std::endl;
+      return nullptr;
+    }
+    fclose(fp);
+  }
+  X509_free(cert);
+  EVP_PKEY_free(pkey);
+  return ctx;
+}
+
+// Listens on @p address and @p *port. When @p *port is zero, it is set to
+// the port chosen by the kernel. Returns -1 on failure.
+static int listen_tcp(const std::string &address, uint16_t *port) {
+  addrinfo hints{};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV;
+  addrinfo *rp = nullptr;
+  if (getaddrinfo(address.c_str(), std::to_string((unsigned)*port).c_str(), &hints,
+                  &rp) != 0) {
+    std::clog << "fatal: invalid address: " << address << std::endl;
+    return -1;
+  }
+  int fd = socket(rp->ai_family, rp->ai_socktype, 0);
+  int on = 1;
+  if (fd == -1 ||
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+      bind(fd, rp->ai_addr, rp->ai_addrlen) != 0 || listen(fd, 64) != 0) {
+    std::clog << "fatal: cannot listen on " << address << ":" << *port << ": "
+              << strerror(errno) << std::endl;
+    freeaddrinfo(rp);
+    if (fd != -1) {
+      close(fd);
+    }
+    return -1;
+  }
+  freeaddrinfo(rp);
+  sockaddr_storage ss{};
+  socklen_t len = sizeof(ss);
+  if (getsockname(fd, (sockaddr *)&ss, &len) == 0) {
+    *port = (ss.ss_family == AF_INET6)
+                ? ntohs(((sockaddr_in6 *)&ss)->sin6_port)
+                : ntohs(((sockaddr_in *)&ss)->sin_port);
+  }
+  return fd;
+}
+
+static void usage() {
+  // clang-format off
+  std::clog << R"(Usage: ndt7-test-server [options]
+
+Serves ndt7 over ws:// and wss:// as well as a static Locate API, such that
+you can run ndt7-client-cc without using the network, e.g.:
+
+    ndt7-client-cc -download -upload -scheme=ws \
+      -locate-api-url=http://127.0.0.1:8998
+
+The wss:// port uses a self-signed certificate. Either run the client with
+`-insecure` or save the certificate with `-cert-file` and run the client with
+`-ca-bundle-path=<file> -hostname=localhost -port=<wss-port>`.
+
+Options:
+ * `-address=<ip>` is the address to listen on (default: 127.0.0.1).
+ * `-ws-port=<port>`, `-wss-port=<port>` and `-locate-port=<port>` set the
+   ports (defaults: 8080, 4443 and 8998). Zero picks a free port.
+ * `-message-size=<bytes>` fixes the size of download messages. By default
+   we start from 8 KiB and scale up to 1 MiB like M-Lab servers.
+ * `-duration=<seconds>` is the duration of the download (default: 10).
+ * `-measurement-interval=<milliseconds>` is the interval between the
+   measurements sent to the client (default: 250, 0 disables them).
+ * `-cert-file=<path>` writes the certificate in PEM format into <path>.
+
+At startup, we print the ports we listen on as a line of JSON on STDOUT.)" << std::endl;
+  // clang-format on
+}
+
+// Parses @p value as an unsigned integer no larger than @p max, or exits.
+static uint64_t parse_uint(const std::string &name, const std::string &value,
+                           uint64_t max) {
+  uint64_t result = 0;
+  try {
+    size_t pos = 0;
+    result = std::stoull(value, &pos);
+    if (pos != value.size() || value[0] == '-' || result > max) {
+      throw std::out_of_range{name};
+    }
+  } catch (const std::exception &) {
+    std::clog << "fatal: invalid " << name << ": " << value << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  return result;
+}
+
+int main(int, char **argv) {
+  ServerSettings settings;
+  {
+    argh::parser cmdline;
+    for (auto param : {"address", "ws-port", "wss-port", "locate-port",
+                       "message-size", "duration", "measurement-interval",
+                       "cert-file"}) {
+      cmdline.add_param(param);
+    }
+    cmdline.parse(argv);
+    for (auto &flag : cmdline.flags()) {
+      if (flag == "help") {
+        usage();
+        exit(EXIT_SUCCESS);
+      }
+      std::clog << "fatal: unrecognized flag: " << flag << std::endl;
+      usage();
+      exit(EXIT_FAILURE);
+    }
+    for (auto &param : cmdline.params()) {
+      if (param.first == "address") {
+        settings.address = param.second;
+      } else if (param.first == "ws-port") {
+        settings.ws_port =
+            (uint16_t)parse_uint(param.first, param.second, UINT16_MAX);
+      } else if (param.first == "wss-port") {
+        settings.wss_port =
+            (uint16_t)parse_uint(param.first, param.second, UINT16_MAX);
+      } else if (param.first == "locate-port") {
+        settings.locate_port =
+            (uint16_t)parse_uint(param.first, param.second, UINT16_MAX);
+      } else if (param.first == "message-size") {
+        settings.message_size =
+            parse_uint(param.first, param.second, (uint64_t)1 << 24);
+      } else if (param.first == "duration") {
+        settings.duration = (double)parse_uint(param.first, param.second, 3600);
+      } else if (param.first == "measurement-interval") {
+        settings.measurement_interval_ms =
+            (uint32_t)parse_uint(param.first, param.second, 60000);
+      } else if (param.first == "cert-file") {
+        settings.cert_file = param.second;
+      } else {
+        std::clog << "fatal: unrecognized param: " << param.first << std::endl;
+        usage();
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+
+  SSL_CTX *ctx = new_server_ctx(settings.address, settings.cert_file);
+  if (ctx == nullptr) {
+    exit(EXIT_FAILURE);
+  }
+  uint16_t ws_port = settings.ws_port;
+  uint16_t wss_port = settings.wss_port;
+  uint16_t locate_port = settings.locate_port;
+  int ws_fd = listen_tcp(settings.address, &ws_port);
+  int wss_fd = listen_tcp(settings.address, &wss_port);
+  int locate_fd = listen_tcp(settings.address, &locate_port);
+  if (ws_fd == -1 || wss_fd == -1 || locate_fd == -1) {
+    exit(EXIT_FAILURE);
+  }
+  nlohmann::json ports;
+  ports["ws"] = ws_port;
+  ports["wss"] = wss_port;
+  ports["locate"] = locate_port;
+  std::cout << ports.dump() << std::endl;
+
+  signal(SIGINT, server_on_signal);
+  signal(SIGTERM, server_on_signal);
+  signal(SIGPIPE, SIG_IGN);
+  while (!server_signaled) {
+    pollfd pfds[3]{};
+    pfds[0].fd = ws_fd;
+    pfds[1].fd = wss_fd;
+    pfds[2].fd = locate_fd;
+    for (auto &pfd : pfds) {
+      pfd.events = POLLIN;
+    }
+    if (poll(pfds, 3, 250) <= 0) {
+      continue;
+    }
+    for (auto &pfd : pfds) {
+      if ((pfd.revents & POLLIN) == 0) {
+        continue;
+      }
+      int fd = accept(pfd.fd, nullptr, nullptr);
+      if (fd == -1) {
+        continue;
+      }
+      // Each connection is served by its own thread, which owns `fd`.
+      if (pfd.fd == locate_fd) {
+        std::thread{[settings, ws_port, wss_port, fd]() {
+          serve_locate(settings, ws_port, wss_port, fd);
+        }}.detach();
+      } else {
+        SSL_CTX *conn_ctx = (pfd.fd == wss_fd) ? ctx : nullptr;
+        std::thread{[settings, conn_ctx, fd]() {
+          serve_ndt7(settings, conn_ctx, fd);
+        }}.detach();
+      }
+    }
+  }
+  close(ws_fd);
+  close(wss_fd);
+  close(locate_fd);
+}
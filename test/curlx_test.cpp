@@ -4,6 +4,8 @@
 
 #include "libndt7/internal/curlx.hpp"
 
+#include <vector>
+
 #define CATCH_CONFIG_MAIN
 // TODO(github.com/m-lab/ndt7-client-cc/issues/10): Remove pragma ignoring warning when possible.
 #if !defined(__clang__) && defined(__GNUC__)
@@ -51,6 +53,53 @@ TEST_CASE("Curlx::GetMaybeSOCKS5() deals with Curlx::SetoptProxy() failure") {
   REQUIRE(!curlx.GetMaybeSOCKS5("9050", "http://x.org", 1, &body));
 }
 
+class FailCurlxSetoptShare : public Curlx {
+ public:
+  using Curlx::Curlx;
+  CURLcode SetoptShare(UniqueCurl &, CurlShare *) noexcept override {
+    return CURLE_UNSUPPORTED_PROTOCOL;  // any error is okay here
+  }
+};
+
+TEST_CASE("Curlx::GetMaybeSOCKS5() deals with Curlx::SetoptShare() failure") {
+  CurlShare share;
+  FailCurlxSetoptShare curlx{NoLoggerInstance(), "agent", &share};
+  std::string body;
+  REQUIRE(!curlx.GetMaybeSOCKS5("", "http://x.org", 1, &body));
+}
+
+class CountingCurlxSetoptShare : public Curlx {
+ public:
+  using Curlx::Curlx;
+  CURLcode SetoptShare(UniqueCurl &, CurlShare *share) noexcept override {
+    shares.push_back(share);
+    return CURLE_UNSUPPORTED_PROTOCOL;  // stop here
+  }
+  std::vector<CurlShare *> shares;
+};
+
+TEST_CASE("Curlx::GetMaybeSOCKS5() uses the share handle only if configured") {
+  std::string body;
+  CountingCurlxSetoptShare without{NoLoggerInstance()};
+  REQUIRE(!without.GetMaybeSOCKS5("", "http://x.org", 1, &body));
+  REQUIRE(without.shares.empty());
+  CountingCurlxSetoptShare with{NoLoggerInstance(), "agent",
+                                &CurlShare::Global()};
+  REQUIRE(!with.GetMaybeSOCKS5("", "http://x.org", 1, &body));
+  REQUIRE(with.shares == std::vector<CurlShare *>{&CurlShare::Global()});
+}
+
+// CurlShare tests
+// ---------------
+
+TEST_CASE("CurlShare::Global() returns a usable share handle") {
+  REQUIRE(&CurlShare::Global() == &CurlShare::Global());
+  REQUIRE(CurlShare::Global().Get() != nullptr);
+  Curlx curlx{NoLoggerInstance()};
+  UniqueCurl handle{curlx.NewUniqueCurl()};
+  REQUIRE(curlx.SetoptShare(handle, &CurlShare::Global()) == CURLE_OK);
+}
+
 // Curlx::Get() tests
 // ------------------
 
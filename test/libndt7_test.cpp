@@ -17,13 +17,19 @@
 #include <errno.h>
 #ifndef _WIN32
 #include <fcntl.h>
+#include <sys/stat.h>
 #endif
 #include <limits.h>
 #include <stdint.h>
 #include <string.h>
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <deque>
+#include <fstream>
+#include <map>
+#include <thread>
 #include <vector>
 
 #define CATCH_CONFIG_MAIN
@@ -53,6 +59,305 @@ using namespace measurementlab::libndt7;
 // Speaking of coverage, if specific code is already tested by running the
 // example client, we don't need to write also a test for it here.
 
+// SpeedHistogram::observe() tests
+// -------------------------------
+
+TEST_CASE("SpeedHistogram::observe() uses the correct bucket") {
+  SpeedHistogram histogram;
+  histogram.observe(0.0);
+  histogram.observe(1000.0);
+  histogram.observe(1000.5);
+  histogram.observe(1e9);
+  REQUIRE(histogram.counts[0] == 2);
+  REQUIRE(histogram.counts[1] == 1);
+  REQUIRE(histogram.counts[SpeedHistogram::num_buckets] == 1);
+  REQUIRE(histogram.count == 4);
+  REQUIRE(histogram.sum == 1e9 + 2000.5);
+}
+
+// Client::ndt7_sampler_add() tests
+// ---------------------------------
+
+static ThroughputSample sample_at(double elapsed, uint64_t bytes) {
+  ThroughputSample sample;
+  sample.elapsed = elapsed;
+  sample.duration = 0.1;
+  sample.bytes = bytes;
+  return sample;
+}
+
+TEST_CASE("Client::ndt7_sampler_add() keeps the most recent samples") {
+  Settings settings;
+  settings.sample_capacity = 4;
+  Client client{settings};
+  client.ndt7_sampler_reset(nettest_flag_download);
+  for (uint64_t i = 1; i <= 6; ++i) {
+    client.ndt7_sampler_add(nettest_flag_download, sample_at(0.1 * (double)i, i));
+  }
+  auto samples = client.get_time_series(nettest_flag_download);
+  REQUIRE(samples.size() == 4);
+  for (size_t i = 0; i < 4; ++i) {
+    REQUIRE(samples[i].bytes == i + 3);
+  }
+  REQUIRE(client.get_time_series(nettest_flag_upload).empty());
+}
+
+TEST_CASE("Client::ndt7_throughput_stats() works as expected") {
+  REQUIRE(Client::ndt7_throughput_stats({}).samples == 0);
+  // Ramp up to 10 kB every 100 ms (i.e. 800 kbit/s) in five samples.
+  std::vector<ThroughputSample> samples;
+  for (uint64_t i = 1; i <= 20; ++i) {
+    samples.push_back(sample_at(0.1 * (double)i, 2000 * (std::min)(i, (uint64_t)5)));
+  }
+  auto stats = Client::ndt7_throughput_stats(samples);
+  REQUIRE(stats.samples == 20);
+  REQUIRE(stats.p10 == Approx(320.0));
+  REQUIRE(stats.median == Approx(800.0));
+  REQUIRE(stats.peak == Approx(800.0));
+  // The window ending at 0.6 s is the first averaging at least 720 kbit/s.
+  REQUIRE(stats.time_to_steady_state == Approx(0.6));
+}
+
+TEST_CASE("Client::ndt7_throughput_stats() deals with no elapsed time") {
+  auto stats = Client::ndt7_throughput_stats({sample_at(0.0, 1000)});
+  REQUIRE(stats.samples == 1);
+  REQUIRE(stats.median == Approx(80.0));
+  REQUIRE(stats.peak == Approx(80.0));
+  REQUIRE(stats.time_to_steady_state < 0.0);
+}
+
+// Client::ndt7_tcp_info_stats() tests
+// -----------------------------------
+
+TEST_CASE("Client::ndt7_tcp_info_stats() works as expected") {
+  REQUIRE(Client::ndt7_tcp_info_stats(nettest_flag_download, {}).samples == 0);
+  std::vector<TcpInfoSample> samples(3);
+  for (size_t i = 0; i < samples.size(); ++i) {
+    samples[i].elapsed = 0.5 * (double)i;
+    samples[i].rcv_rtt = (uint32_t)(3000 - 1000 * i);
+    samples[i].min_rtt = (uint32_t)(1000 * i);
+    samples[i].rcv_space = (uint32_t)(1000 * (i + 1));
+    samples[i].bytes_received = 125000 * i;
+    samples[i].bytes_acked = 250000 * i;
+    samples[i].busy_time = 1000000;
+    samples[i].rwnd_limited = 250000;
+    samples[i].app_limited = (i == 0);
+  }
+  auto stats = Client::ndt7_tcp_info_stats(nettest_flag_download, samples);
+  REQUIRE(stats.samples == 3);
+  REQUIRE(stats.goodput == Approx(2000.0));
+  REQUIRE(stats.rcv_rtt == 2000);
+  REQUIRE(stats.min_rtt == 1000);
+  REQUIRE(stats.rcv_space == 3000);
+  REQUIRE(stats.rwnd_limited == Approx(0.25));
+  REQUIRE(stats.app_limited == Approx(1.0 / 3.0));
+  stats = Client::ndt7_tcp_info_stats(nettest_flag_upload, samples);
+  REQUIRE(stats.goodput == Approx(4000.0));
+}
+
+// Client::ndt7_upload_server_measurement() tests
+// ----------------------------------------------
+
+TEST_CASE("Client::ndt7_upload_server_measurement() records the TCPInfo") {
+  Client client;
+  client.ndt7_sampler_reset(nettest_flag_upload);
+  client.ndt7_upload_server_measurement("{}");
+  client.ndt7_upload_server_measurement("not json");
+  client.ndt7_upload_server_measurement(
+      R"({"TCPInfo": {"ElapsedTime": 250000, "MinRTT": 1500, "RTT": 2000,)"
+      R"( "BytesReceived": 1048576, "RcvRTT": 3000}})");
+  auto samples = client.get_server_tcp_info(nettest_flag_upload);
+  REQUIRE(samples.size() == 1);
+  REQUIRE(samples[0].elapsed == Approx(0.25));
+  REQUIRE(samples[0].min_rtt == 1500);
+  REQUIRE(samples[0].rtt == 2000);
+  REQUIRE(samples[0].bytes_received == 1048576);
+  REQUIRE(samples[0].rcv_rtt == 3000);
+  REQUIRE(samples[0].bytes_acked == 0);
+  REQUIRE(client.get_server_tcp_info(nettest_flag_download).empty());
+}
+
+// Client::ndt7_download_measurement() tests
+// -----------------------------------------
+
+TEST_CASE("Client::ndt7_download_measurement() records the measurement") {
+  Client client;
+  client.ndt7_sampler_reset(nettest_flag_download);
+  client.ndt7_download_measurement(
+      R"({"AppInfo": {"ElapsedTime": 250000, "NumBytes": 1048576},)"
+      R"( "ConnectionInfo": {"Client": "192.0.2.1:54321",)"
+      R"( "Server": "198.51.100.1:443", "UUID": "ndt-abcde_1600000000"},)"
+      R"( "Origin": "server", "Test": "download",)"
+      R"( "BBRInfo": {"BW": 123456789, "MinRTT": 2801, "Extra": [1, {"BW": 1}]},)"
+      R"( "TCPInfo": {"State": 1, "MaxPacingRate": -1, "MinRTT": 2801,)"
+      R"( "BytesSent": 1000, "BytesRetrans": 10, "BusyTime": 1000,)"
+      R"( "RWndLimited": 250, "ElapsedTime": 250000}})");
+  auto measurements = client.get_measurements(nettest_flag_download);
+  REQUIRE(measurements.size() == 1);
+  const Measurement &measurement = measurements[0];
+  REQUIRE(measurement.has_app_info);
+  REQUIRE(measurement.app_info.elapsed_time == 250000);
+  REQUIRE(measurement.app_info.num_bytes == 1048576);
+  REQUIRE(measurement.has_bbr_info);
+  REQUIRE(measurement.bbr_info.bw == 123456789);
+  REQUIRE(measurement.bbr_info.min_rtt == 2801);
+  REQUIRE(measurement.has_tcp_info);
+  REQUIRE(measurement.tcp_info.state == 1);
+  REQUIRE(measurement.tcp_info.max_pacing_rate == -1);
+  REQUIRE(measurement.tcp_info.elapsed_time == 250000);
+  REQUIRE(measurement.tcp_info.rtt == 0);
+  REQUIRE(measurement.tcp_info.has(MeasurementTcpInfoField::min_rtt));
+  REQUIRE(!measurement.tcp_info.has(MeasurementTcpInfoField::rtt));
+  REQUIRE(!measurement.bbr_info.has(MeasurementBbrInfoField::elapsed_time));
+  auto summary = client.get_summary();
+  REQUIRE(summary.download_connection_info.client == "192.0.2.1:54321");
+  REQUIRE(summary.download_connection_info.server == "198.51.100.1:443");
+  REQUIRE(summary.download_connection_info.uuid == "ndt-abcde_1600000000");
+  REQUIRE(summary.download_retrans == Approx(0.01));
+  REQUIRE(summary.min_rtt == 2801);
+  REQUIRE(summary.download_cpu.client_limited == Approx(0.25));
+}
+
+TEST_CASE("Client::ndt7_download_measurement() skips invalid messages") {
+  Client client;
+  client.ndt7_sampler_reset(nettest_flag_download);
+  client.ndt7_download_measurement("not json");
+  client.ndt7_download_measurement(R"({"TCPInfo": {"MinRTT": 1)");
+  REQUIRE(client.get_measurements(nettest_flag_download).empty());
+}
+
+TEST_CASE("Client::ndt7_download_measurement() keeps what invalid messages "
+          "would change") {
+  Client client;
+  client.ndt7_sampler_reset(nettest_flag_download);
+  client.ndt7_download_measurement(
+      R"({"ConnectionInfo": {"Client": "192.0.2.1:54321",)"
+      R"( "UUID": "ndt-abcde_1600000000"}, "TCPInfo": {"MinRTT": 2801}})");
+  client.ndt7_download_measurement(
+      R"({"ConnectionInfo": {"Client": "192.0.2.2:12345")");
+  client.ndt7_download_measurement(R"({"TCPInfo": {"RTT": 4000}})");
+  auto summary = client.get_summary();
+  REQUIRE(summary.download_connection_info.client == "192.0.2.1:54321");
+  REQUIRE(summary.download_connection_info.uuid == "ndt-abcde_1600000000");
+  REQUIRE(summary.min_rtt == 2801);
+  REQUIRE(client.get_measurements(nettest_flag_download).size() == 2);
+}
+
+// Client::ndt7_client_measurement() tests
+// ---------------------------------------
+
+TEST_CASE("Client::ndt7_client_measurement() reports the AppInfo") {
+  Client client;
+  auto measurement = nlohmann::json::parse(
+      client.ndt7_client_measurement((internal::Socket)-1, 250000, 1048576));
+  REQUIRE(measurement["AppInfo"]["ElapsedTime"] == 250000);
+  REQUIRE(measurement["AppInfo"]["NumBytes"] == 1048576);
+  REQUIRE(measurement.count("TCPInfo") == 0);  // invalid socket
+}
+
+// Client::ndt7_cpu_diagnosis() tests
+// ----------------------------------
+
+TEST_CASE("Client::ndt7_cpu_diagnosis() works as expected") {
+  CpuDiagnosis diagnosis;
+  diagnosis.wall_time = 10.0;
+
+  SECTION("When the CPU time is not available") {
+    auto result = Client::ndt7_cpu_diagnosis(diagnosis);
+    REQUIRE(!result.cpu_limited);
+    REQUIRE(result.confidence == 0.0);
+  }
+
+  SECTION("When the thread was mostly waiting for I/O") {
+    diagnosis.cpu_time = 3.0;
+    diagnosis.voluntary_switches = 1000;
+    diagnosis.client_limited = 0.8;
+    REQUIRE(!Client::ndt7_cpu_diagnosis(diagnosis).cpu_limited);
+  }
+
+  SECTION("When the thread was mostly preempted") {
+    diagnosis.cpu_time = 5.0;
+    diagnosis.involuntary_switches = 1000;
+    diagnosis.client_limited = 0.8;
+    auto result = Client::ndt7_cpu_diagnosis(diagnosis);
+    REQUIRE(result.cpu_limited);
+    REQUIRE(result.confidence == Approx(1.0));
+  }
+
+  SECTION("When the thread was busy and the TCP state is unknown") {
+    diagnosis.cpu_time = 9.5;
+    auto result = Client::ndt7_cpu_diagnosis(diagnosis);
+    REQUIRE(result.cpu_limited);
+    REQUIRE(result.confidence == Approx(0.5));
+  }
+
+  SECTION("When the thread was busy but the sender was not waiting for us") {
+    diagnosis.cpu_time = 9.5;
+    diagnosis.client_limited = 0.01;
+    REQUIRE(!Client::ndt7_cpu_diagnosis(diagnosis).cpu_limited);
+  }
+
+  SECTION("When the thread was busy and the sender was waiting for us") {
+    diagnosis.cpu_time = 9.5;
+    diagnosis.client_limited = 0.2;
+    auto result = Client::ndt7_cpu_diagnosis(diagnosis);
+    REQUIRE(result.cpu_limited);
+    REQUIRE(result.confidence == Approx(0.7));
+  }
+}
+
+#ifdef __linux__
+TEST_CASE("TcpInfoSampler reads TCP_INFO in the background") {
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  REQUIRE(listener != -1);
+  sockaddr_in sin{};
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  REQUIRE(bind(listener, (sockaddr *)&sin, sizeof(sin)) == 0);
+  REQUIRE(listen(listener, 1) == 0);
+  socklen_t len = sizeof(sin);
+  REQUIRE(getsockname(listener, (sockaddr *)&sin, &len) == 0);
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  REQUIRE(connect(sock, (sockaddr *)&sin, sizeof(sin)) == 0);
+  Client client;
+  client.ndt7_sampler_reset(nettest_flag_download);
+  {
+    TcpInfoSampler sampler{&client, nettest_flag_download, sock, 10,
+                           std::chrono::steady_clock::now()};
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    // We can read the samples while the sampler is running.
+    REQUIRE(!client.get_tcp_info(nettest_flag_download).empty());
+  }
+  auto samples = client.get_tcp_info(nettest_flag_download);
+  REQUIRE(samples.size() >= 2);
+  REQUIRE(samples.back().elapsed > samples.front().elapsed);
+  REQUIRE(samples.back().rtt > 0);
+  close(sock);
+  close(listener);
+}
+#endif
+
+// ConvergenceDetector tests
+// -------------------------
+
+TEST_CASE("ConvergenceDetector detects a stable speed") {
+  ConvergenceDetector detector{1.0, 0.05};
+  // Slow start: 100, 800, 1000, 1020, 990 kB per second.
+  uint64_t totals[] = {100000, 900000, 1900000, 2920000, 3910000};
+  bool converged[] = {false, false, false, false, true};
+  for (size_t i = 0; i < 5; ++i) {
+    REQUIRE(detector.update(0.5 + (double)i, totals[i] / 2) == false);
+    REQUIRE(detector.update(1.0 + (double)i, totals[i]) == converged[i]);
+  }
+}
+
+TEST_CASE("ConvergenceDetector is disabled with a zero window") {
+  ConvergenceDetector detector{0.0, 0.05};
+  for (size_t i = 1; i < 10; ++i) {
+    REQUIRE(detector.update((double)i, i * 1000) == false);
+  }
+}
+
 // UrlParts Client::parse_ws_url(const std::string& url) tests
 // -----------------------------------------------------------
 
@@ -150,6 +455,56 @@ TEST_CASE("Client::run() deals with Client::query_locate_api() failure") {
   REQUIRE(client.run() == false);
 }
 
+class WarningsClient : public FailQueryMlabns {
+ public:
+  using FailQueryMlabns::FailQueryMlabns;
+  void on_warning(const std::string &s) const noexcept override {
+    warnings.push_back(s);
+  }
+  mutable std::vector<std::string> warnings;
+};
+
+TEST_CASE("Client::run() warns when the convergence window is zero") {
+  Settings settings;
+  settings.verbosity = verbosity_warning;
+  settings.adaptive_duration = true;
+  settings.convergence_window_ms = 0;
+  WarningsClient client{settings};
+  REQUIRE(client.run() == false);
+  REQUIRE(client.warnings.size() == 1);
+  REQUIRE(client.warnings[0].find("convergence_window_ms") !=
+          std::string::npos);
+}
+
+class StaleSummaryClient : public Client {
+ public:
+  using Client::Client;
+  bool query_locate_api(const std::map<std::string, std::string>&, std::vector<nlohmann::json>*) noexcept override {
+    return true;
+  }
+  void set_stale_summary() noexcept {
+    summary_.download_speed = 1.0;
+    summary_.server_probes.push_back(ServerProbe{});
+    ndt7_sampler_reset(nettest_flag_download);
+    ndt7_download_measurement(R"({"AppInfo": {"NumBytes": 1}})");
+  }
+  bool has_measurement() const noexcept {
+    return !get_measurements(nettest_flag_download).empty();
+  }
+};
+
+TEST_CASE("Client::run() starts from an empty summary") {
+  Settings settings;
+  settings.nettest_flags = NettestFlags{0};
+  StaleSummaryClient client{settings};
+  client.set_stale_summary();
+  REQUIRE(client.has_measurement());
+  REQUIRE(client.run() == true);
+  REQUIRE(client.get_summary().download_speed == 0.0);
+  REQUIRE(client.get_summary().server_probes.empty());
+  REQUIRE(client.has_measurement() == false);
+}
+
 // Client::on_warning() tests
 // --------------------------
 
@@ -188,6 +543,38 @@ TEST_CASE(
   REQUIRE(client.query_locate_api(metadata, &targets) == false);
 }
 
+class RecordMlabnsTimeout : public Client {
+ public:
+  using Client::Client;
+  long timeout = 0;
+  int timeout_msec = 0;
+  bool query_locate_api_curl(const std::string &, long t,
+                         std::string *) noexcept override {
+    timeout = t;
+    timeout_msec = netx_timeout_msec(Timeout{7});
+    return false;
+  }
+};
+
+TEST_CASE("Client::run() bounds I/O timeouts with max_run_time_ms") {
+  Settings settings;
+  settings.max_run_time_ms = 1500;
+  RecordMlabnsTimeout client{settings};
+  REQUIRE(client.run() == false);
+  REQUIRE(client.timeout == 2);
+  REQUIRE(client.timeout_msec > 1000);
+  REQUIRE(client.timeout_msec <= 1500);
+  // The budget only applies while running.
+  REQUIRE(client.netx_timeout_msec(Timeout{7}) == 7000);
+}
+
+TEST_CASE("Client::run() uses the I/O timeout without max_run_time_ms") {
+  RecordMlabnsTimeout client;
+  REQUIRE(client.run() == false);
+  REQUIRE(client.timeout == 7);
+  REQUIRE(client.timeout_msec == 7000);
+}
+
 class EmptyMlabnsJson : public Client {
  public:
   using Client::Client;
@@ -239,6 +626,1058 @@ TEST_CASE("Client::query_locate_api() deals with incomplete JSON") {
   REQUIRE(client.query_locate_api(metadata, &targets) == false);
 }
 
+// Client::probe_targets() tests
+// -----------------------------
+
+class FakeProbeClient : public Client {
+ public:
+  using Client::Client;
+  internal::Err netx_probe(const std::string &hostname, const std::string &,
+                           uint32_t, double *connect_time) noexcept override {
+    if (hostname == "c.example.org") {
+      return internal::Err::timed_out;
+    }
+    if (hostname == "slow.example.org") {
+      // Simulate a DNS lookup that does not honour the time budget.
+      std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+    }
+    while (hostname == "late.example.org" && !release) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    *connect_time = (hostname == "a.example.org") ? 40.0 : 20.0;
+    return internal::Err::none;
+  }
+  std::atomic<bool> release{false};
+};
+
+static nlohmann::json probe_target(const std::string &hostname) {
+  nlohmann::json urls;
+  urls["wss:///ndt/v7/download"] = "wss://" + hostname + "/ndt/v7/download";
+  return urls;
+}
+
+TEST_CASE("Client::probe_targets() sorts targets by connect time") {
+  Settings settings;
+  settings.protocol_flags = protocol_flag_tls;
+  FakeProbeClient client{settings};
+  std::vector<nlohmann::json> targets{probe_target("c.example.org"),
+                                      probe_target("a.example.org"),
+                                      probe_target("b.example.org")};
+  client.probe_targets(&targets);
+  REQUIRE(targets == std::vector<nlohmann::json>{
+                         probe_target("b.example.org"),
+                         probe_target("a.example.org"),
+                         probe_target("c.example.org")});
+  auto probes = client.get_summary().server_probes;
+  REQUIRE(probes.size() == 3);
+  REQUIRE(probes[0].hostname == "b.example.org");
+  REQUIRE(probes[0].port == "443");
+  REQUIRE(probes[0].connect_time == 20.0);
+  REQUIRE(probes[2].connect_time < 0.0);
+}
+
+TEST_CASE("Client::probe_targets() does not wait past the time budget") {
+  Settings settings;
+  settings.protocol_flags = protocol_flag_tls;
+  settings.probe_timeout_ms = 100;
+  FakeProbeClient client{settings};
+  std::vector<nlohmann::json> targets{probe_target("slow.example.org"),
+                                      probe_target("a.example.org")};
+  auto begin = std::chrono::steady_clock::now();
+  client.probe_targets(&targets);
+  REQUIRE(std::chrono::steady_clock::now() - begin <
+          std::chrono::milliseconds(800));
+  REQUIRE(targets == std::vector<nlohmann::json>{
+                         probe_target("a.example.org"),
+                         probe_target("slow.example.org")});
+  auto probes = client.get_summary().server_probes;
+  REQUIRE(probes.size() == 2);
+  REQUIRE(probes[0].connect_time == 40.0);
+  REQUIRE(probes[1].connect_time < 0.0);
+}
+
+TEST_CASE("Client::probe_targets() joins the late probes once finished") {
+  Settings settings;
+  settings.protocol_flags = protocol_flag_tls;
+  settings.probe_timeout_ms = 50;
+  FakeProbeClient client{settings};
+  std::vector<nlohmann::json> targets{probe_target("late.example.org")};
+  client.probe_targets(&targets);
+  size_t running = client.join_probe_threads();
+  client.release = true;
+  REQUIRE(running == 1);
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (client.join_probe_threads() != 0 &&
+         std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  REQUIRE(client.join_probe_threads() == 0);
+  // The next call does not leave any probe behind.
+  targets = {probe_target("a.example.org")};
+  client.probe_targets(&targets);
+  REQUIRE(client.join_probe_threads() == 0);
+}
+
+#ifndef _WIN32
+TEST_CASE("Client::netx_probe() measures the connect time") {
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  REQUIRE(listener != -1);
+  sockaddr_in sin{};
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  REQUIRE(bind(listener, (sockaddr *)&sin, sizeof(sin)) == 0);
+  REQUIRE(listen(listener, 1) == 0);
+  socklen_t len = sizeof(sin);
+  REQUIRE(getsockname(listener, (sockaddr *)&sin, &len) == 0);
+  std::string port = std::to_string((int)ntohs(sin.sin_port));
+  Client client;
+  double connect_time = -1.0;
+  REQUIRE(client.netx_probe("127.0.0.1", port, 1000, &connect_time) ==
+          internal::Err::none);
+  REQUIRE(connect_time >= 0.0);
+  close(listener);
+  REQUIRE(client.netx_probe("127.0.0.1", port, 1000, &connect_time) !=
+          internal::Err::none);
+}
+#endif
+
+// Client::ndt7_connect_race() tests
+// ---------------------------------
+
+class RacingSys : public internal::Sys {
+ public:
+  using Sys::Sys;
+  int Closesocket(internal::Socket) const noexcept override { return 0; }
+};
+
+class RacingClient : public Client {
+ public:
+  using Client::Client;
+  internal::Err netx_maybews_dial(const std::string &hostname,
+                                  const std::string &port, uint64_t,
+                                  std::string, std::string,
+                                  internal::Socket *sock) noexcept override {
+    if (hostname == "fail.example.org") {
+      return internal::Err::connection_refused;
+    }
+    if (hostname == "slow.example.org") {
+      // Wait until the race is over, which should be reported as canceled.
+      std::vector<pollfd> none;
+      auto err = netx_poll(&none, 10000);
+      canceled += (err == internal::Err::canceled) ? 1 : 0;
+      return err;
+    }
+    *sock = (internal::Socket)std::stoi(port);
+    return internal::Err::none;
+  }
+  std::atomic<int> canceled{0};
+};
+
+static UrlParts race_url(const std::string &host, const std::string &port) {
+  UrlParts url;
+  url.scheme = "ws";
+  url.host = host;
+  url.port = port;
+  url.path = "/ndt/v7/download";
+  return url;
+}
+
+TEST_CASE("Settings::race_width disables racing by default") {
+  // Each losing connection would start an unwanted test on its server.
+  Settings settings;
+  REQUIRE(settings.race_width == 1);
+}
+
+TEST_CASE("Client::ndt7_connect_race() uses the first connected server") {
+  Settings settings;
+  settings.race_stagger_ms = 20;
+  RacingClient client{settings};
+  client.sys.reset(new RacingSys{});
+  auto begin = std::chrono::steady_clock::now();
+  size_t winner = 0;
+  std::vector<size_t> failed{42};
+  REQUIRE(client.ndt7_connect_race({race_url("slow.example.org", "1"),
+                                    race_url("fast.example.org", "17")},
+                                   &winner, &failed) == true);
+  REQUIRE(winner == 1);
+  REQUIRE(failed.empty());  // the slow server merely lost the race
+  REQUIRE(std::chrono::steady_clock::now() - begin < std::chrono::seconds(5));
+  REQUIRE(client.canceled == 1);
+  REQUIRE(client.netx_transport_get(17) != nullptr);
+}
+
+TEST_CASE("Client::ndt7_connect_race() does not wait after a failure") {
+  Settings settings;
+  settings.race_stagger_ms = 60000;
+  RacingClient client{settings};
+  client.sys.reset(new RacingSys{});
+  size_t winner = 0;
+  std::vector<size_t> failed;
+  REQUIRE(client.ndt7_connect_race({race_url("fail.example.org", "1"),
+                                    race_url("fast.example.org", "21")},
+                                   &winner, &failed) == true);
+  REQUIRE(winner == 1);
+  REQUIRE(failed == std::vector<size_t>{0});
+}
+
+TEST_CASE("Client::ndt7_connect_race() fails when all servers fail") {
+  RacingClient client;
+  size_t winner = 0;
+  REQUIRE(client.ndt7_connect_race({race_url("fail.example.org", "1"),
+                                    race_url("fail.example.org", "2")},
+                                   &winner, nullptr) == false);
+}
+
+class LoggingRacingClient : public Client {
+ public:
+  using Client::Client;
+  internal::Err netx_maybews_dial(const std::string &hostname,
+                                  const std::string &, uint64_t, std::string,
+                                  std::string, internal::Socket *) noexcept
+      override {
+    for (int i = 0; i < 20; ++i) {
+      LIBNDT7_EMIT_DEBUG("dialing " << hostname);
+    }
+    return internal::Err::connection_refused;
+  }
+  void on_debug(const std::string &) const noexcept override {
+    int n = ++inflight;
+    int max = max_inflight;
+    while (n > max && !max_inflight.compare_exchange_weak(max, n)) {
+    }
+    std::this_thread::sleep_for(std::chrono::microseconds(200));
+    --inflight;
+  }
+  mutable std::atomic<int> inflight{0};
+  mutable std::atomic<int> max_inflight{0};
+};
+
+TEST_CASE("Client::ndt7_connect_race() serializes the logging callbacks") {
+  Settings settings;
+  settings.race_stagger_ms = 0;
+  settings.verbosity = verbosity_debug;
+  LoggingRacingClient client{settings};
+  size_t winner = 0;
+  std::vector<size_t> failed;
+  REQUIRE(client.ndt7_connect_race({race_url("a.example.org", "1"),
+                                    race_url("b.example.org", "2"),
+                                    race_url("c.example.org", "3")},
+                                   &winner, &failed) == false);
+  REQUIRE(failed == std::vector<size_t>{0, 1, 2});
+  REQUIRE(client.max_inflight == 1);
+}
+
+#ifndef _WIN32
+// TlsRacingClient connects both racers to a closed socket pair at the same
+// time, such that they look for the CA bundle and start TLS concurrently.
+class TlsRacingClient : public Client {
+ public:
+  using Client::Client;
+  internal::Err netx_maybesocks5h_dial(const std::string &,
+                                       const std::string &,
+                                       internal::Socket *sock) noexcept
+      override {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+      return internal::Err::io_error;
+    }
+    close(fds[1]);
+    *sock = fds[0];
+    std::unique_lock<std::mutex> lock{mutex};
+    ++arrived;
+    cond.notify_all();
+    (void)cond.wait_for(lock, std::chrono::seconds(5),
+                        [this]() { return arrived == 2; });
+    return internal::Err::none;
+  }
+  void on_warning(const std::string &message) const noexcept override {
+    std::unique_lock<std::mutex> _{mutex};
+    warnings.push_back(message);
+  }
+  mutable std::mutex mutex;
+  std::condition_variable cond;
+  int arrived = 0;
+  mutable std::vector<std::string> warnings;
+};
+
+TEST_CASE("Client::ndt7_connect_race() finds the CA bundle before racing") {
+  if (access("/etc/ssl/cert.pem", R_OK) != 0 &&
+      access("/etc/ssl/certs/ca-certificates.crt", R_OK) != 0) {
+    WARN("skipping: there is no CA bundle on this system");
+    return;
+  }
+  Settings settings;
+  settings.protocol_flags = protocol_flag_tls;
+  settings.race_stagger_ms = 0;
+  REQUIRE(settings.ca_bundle_path.empty());
+  TlsRacingClient client{settings};
+  size_t winner = 0;
+  std::vector<size_t> failed;
+  auto url = race_url("127.0.0.1", "443");
+  url.scheme = "wss";
+  REQUIRE(client.ndt7_connect_race({url, url}, &winner, &failed) == false);
+  REQUIRE(client.arrived == 2);
+  // Both racers got as far as the TLS handshake.
+  REQUIRE(failed == std::vector<size_t>{0, 1});
+  for (auto &warning : client.warnings) {
+    REQUIRE(warning.find("CA bundle") == std::string::npos);
+  }
+}
+#endif
+
+// Client::ndt7_connect() tests
+// ----------------------------
+
+#ifndef _WIN32
+// PhasesSys takes some time to resolve and to connect. The connection is
+// one end of a socket pair.
+class PhasesSys : public internal::Sys {
+ public:
+  explicit PhasesSys(internal::Socket fd) noexcept : fd_{fd} {}
+  int Getaddrinfo(const char *domain, const char *port, const addrinfo *hints,
+                  addrinfo **res) const noexcept override {
+    if ((hints->ai_flags & AI_NUMERICHOST) == 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    }
+    return Sys::Getaddrinfo(domain, port, hints, res);
+  }
+  internal::Socket NewSocket(int, int, int) const noexcept override {
+    return fd_;
+  }
+  int Connect(internal::Socket, const sockaddr *,
+              socklen_t) const noexcept override {
+    std::this_thread::sleep_for(std::chrono::milliseconds(40));
+    return 0;
+  }
+
+ private:
+  internal::Socket fd_;
+};
+
+class PhasesClient : public Client {
+ public:
+  using Client::Client;
+  internal::Err ws_handshake(internal::Socket, std::string, uint64_t,
+                             std::string, std::string) noexcept override {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    return internal::Err::none;
+  }
+};
+
+// Returns a TLS server context using an ephemeral self-signed certificate.
+static SSL_CTX *new_test_server_ctx() {
+  EVP_PKEY *pkey = nullptr;
+  EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+  REQUIRE(pctx != nullptr);
+  REQUIRE(EVP_PKEY_keygen_init(pctx) > 0);
+  REQUIRE(EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pctx, NID_X9_62_prime256v1) >
+          0);
+  REQUIRE(EVP_PKEY_keygen(pctx, &pkey) > 0);
+  EVP_PKEY_CTX_free(pctx);
+  X509 *cert = X509_new();
+  ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+  X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+  X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+  X509_set_pubkey(cert, pkey);
+  X509_NAME *name = X509_get_subject_name(cert);
+  X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                             (const unsigned char *)"localhost", -1, -1, 0);
+  X509_set_issuer_name(cert, name);
+  X509_sign(cert, pkey, EVP_sha256());
+  SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+  REQUIRE(ctx != nullptr);
+  REQUIRE(SSL_CTX_use_certificate(ctx, cert) == 1);
+  REQUIRE(SSL_CTX_use_PrivateKey(ctx, pkey) == 1);
+  X509_free(cert);
+  EVP_PKEY_free(pkey);
+  return ctx;
+}
+
+TEST_CASE("Client::ndt7_download() reports the connection phases") {
+  int fds[2] = {-1, -1};
+  REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  SSL_CTX *ctx = new_test_server_ctx();
+  std::thread server{[&]() {
+    // Delay the handshake once the ClientHello has arrived.
+    pollfd pfd{};
+    pfd.fd = fds[1];
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, 5000) == 1) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      SSL *ssl = SSL_new(ctx);
+      SSL_set_fd(ssl, fds[1]);
+      if (SSL_accept(ssl) == 1) {
+        (void)SSL_shutdown(ssl);
+      }
+      SSL_free(ssl);
+    }
+    close(fds[1]);
+  }};
+  Settings settings;
+  settings.protocol_flags = protocol_flag_tls;
+  settings.tls_verify_peer = false;
+  PhasesClient client{settings};
+  client.sys.reset(new PhasesSys{fds[0]});
+  UrlParts url;
+  url.scheme = "wss";
+  url.host = "localhost";
+  url.port = "443";
+  url.path = "/ndt/v7/download";
+  auto begin = std::chrono::steady_clock::now();
+  (void)client.ndt7_download(url);
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - begin;
+  server.join();
+  SSL_CTX_free(ctx);
+  auto phases = client.get_summary().download_phases;
+  REQUIRE(phases.resolve >= 30.0);
+  REQUIRE(phases.connect >= 40.0);
+  REQUIRE(phases.tls_handshake >= 50.0);
+  REQUIRE(phases.ws_handshake >= 20.0);
+  // Each phase only accounts for its own delay, hence the phases do not
+  // overlap and their sum cannot exceed the time spent connecting.
+  REQUIRE(phases.resolve + phases.connect + phases.tls_handshake +
+              phases.ws_handshake <=
+          elapsed.count());
+}
+
+// Client::ndt7_upload() and Client::ndt7_download() loop tests
+// -----------------------------------------------------------
+
+// LoopSys gives the client one end of a socket pair. Once armed, it plays a
+// script simulating a send buffer that fills up: each send writes at most
+// `chunk` bytes and the n-th send follows `steps[n]`, when present, writing
+// at most `bytes` bytes, possibly none. After such send, the send buffer
+// looks full for `stall_ms` milliseconds: sends fail with EWOULDBLOCK and
+// polls do not report the socket as writable.
+class LoopSys : public internal::Sys {
+ public:
+  struct Step {
+    internal::Size bytes;
+    int stall_ms;
+  };
+  explicit LoopSys(internal::Socket fd) noexcept : fd_{fd} {}
+  internal::Socket NewSocket(int, int, int) const noexcept override {
+    return fd_;
+  }
+  int Connect(internal::Socket, const sockaddr *,
+              socklen_t) const noexcept override {
+    return 0;
+  }
+  internal::Ssize Send(internal::Socket fd, const void *base,
+                       internal::Size count) const noexcept override {
+    if (!armed) {
+      return Sys::Send(fd, base, count);
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (now < stall_end) {
+      blocked_sends += 1;
+      SetLastError(OS_EWOULDBLOCK);
+      return -1;
+    }
+    sends += 1;
+    count = (std::min)(count, chunk);
+    auto step = steps.find(sends);
+    if (step != steps.end()) {
+      count = (std::min)(count, step->second.bytes);
+      stall_end = now + std::chrono::milliseconds(step->second.stall_ms);
+      if (count <= 0) {
+        SetLastError(OS_EWOULDBLOCK);
+        return -1;
+      }
+      stalled_mid_write = true;
+    }
+    return Sys::Send(fd, base, count);
+  }
+  int Poll(pollfd *fds, nfds_t nfds, int timeout) const noexcept override {
+    auto now = std::chrono::steady_clock::now();
+    bool want_write = false;
+    for (nfds_t i = 0; i < nfds; ++i) {
+      want_write |= (fds[i].fd == fd_ && (fds[i].events & POLLOUT) != 0);
+    }
+    if (!armed || !want_write || now >= stall_end) {
+      return Sys::Poll(fds, nfds, timeout);
+    }
+    // Wait for the other events until the stall ends, at which point the
+    // socket becomes writable.
+    std::vector<short> events;
+    for (nfds_t i = 0; i < nfds; ++i) {
+      events.push_back(fds[i].events);
+      if (fds[i].fd == fd_) {
+        fds[i].events = (short)(fds[i].events & ~POLLOUT);
+      }
+    }
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    stall_end - now)
+                    .count() + 1;
+    int rv = Sys::Poll(fds, nfds, (timeout < 0 || timeout > left)
+                                      ? (int)left
+                                      : timeout);
+    for (nfds_t i = 0; i < nfds; ++i) {
+      fds[i].events = events[i];
+    }
+    if (rv == 0 && std::chrono::steady_clock::now() >= stall_end) {
+      for (nfds_t i = 0; i < nfds; ++i) {
+        fds[i].revents = (fds[i].fd == fd_) ? (short)POLLOUT : (short)0;
+      }
+      rv = 1;
+    }
+    return rv;
+  }
+
+  bool armed = false;
+  internal::Size chunk = internal::SizeMax;
+  std::map<int, Step> steps;
+  mutable int sends = 0;
+  mutable int blocked_sends = 0;
+  mutable std::chrono::steady_clock::time_point stall_end;
+  // Set when a stall starts after a send that wrote some bytes.
+  mutable std::atomic<bool> stalled_mid_write{false};
+
+ private:
+  internal::Socket fd_;
+};
+
+// LoopClient skips the WebSocket handshake, at which point it arms its
+// LoopSys, and records when it creates each upload measurement. It cancels
+// the test once it has created `max_measurements` measurements.
+class LoopClient : public Client {
+ public:
+  using Client::Client;
+  internal::Err ws_handshake(internal::Socket, std::string, uint64_t,
+                             std::string, std::string) noexcept override {
+    static_cast<LoopSys *>(sys.get())->armed = true;
+    return internal::Err::none;
+  }
+  void on_result(std::string, std::string name,
+                 std::string value) noexcept override {
+    if (name != "upload") {
+      return;
+    }
+    created[value] = std::chrono::steady_clock::now();
+    if (created.size() >= max_measurements) {
+      cancel();
+    }
+  }
+
+  std::map<std::string, std::chrono::steady_clock::time_point> created;
+  size_t max_measurements = 5;
+};
+
+// ClientFrame is a WebSocket frame received by LoopServer.
+struct ClientFrame {
+  uint8_t opcode = 0;
+  uint64_t size = 0;
+  std::string text;  // the unmasked payload, unless the frame is binary
+  std::chrono::steady_clock::time_point arrived;
+};
+
+// Moves the complete frames at the beginning of @p data to @p frames.
+static void parse_client_frames(std::string *data,
+                                std::vector<ClientFrame> *frames) {
+  auto now = std::chrono::steady_clock::now();
+  size_t off = 0;
+  for (;;) {
+    const uint8_t *p = (const uint8_t *)data->data() + off;
+    size_t avail = data->size() - off;
+    if (avail < 2) {
+      break;
+    }
+    uint64_t size = p[1] & 0x7f;
+    size_t header = 2;
+    if (size == 126) {
+      if (avail < 4) {
+        break;
+      }
+      size = (uint64_t)p[2] << 8 | p[3];
+      header = 4;
+    } else if (size == 127) {
+      if (avail < 10) {
+        break;
+      }
+      size = 0;
+      for (size_t i = 2; i < 10; ++i) {
+        size = size << 8 | p[i];
+      }
+      header = 10;
+    }
+    const uint8_t *mask = ((p[1] & 0x80) != 0) ? p + header : nullptr;
+    header += (mask != nullptr) ? 4 : 0;
+    if (avail < header || avail - header < size) {
+      break;
+    }
+    ClientFrame frame;
+    frame.opcode = p[0] & 0x0f;
+    frame.size = size;
+    frame.arrived = now;
+    if (frame.opcode != ws_opcode_binary) {
+      for (size_t i = 0; i < (size_t)size; ++i) {
+        frame.text += (char)(p[header + i] ^ ((mask != nullptr) ? mask[i % 4]
+                                                                 : 0));
+      }
+    }
+    frames->push_back(std::move(frame));
+    off += header + (size_t)size;
+  }
+  data->erase(0, off);
+}
+
+// LoopServer is the server side of a subtest, in clear text or, when it has
+// a SSL_CTX, with TLS. It records the frames sent by the client until the
+// client shuts down the connection. When `download` is set, it also sends a
+// small binary frame every 5 ms. Once `close_when` becomes true, it sends a
+// CLOSE frame and stops sending other frames. It sends `split_message`, if
+// any, in two halves: the first one at the beginning and the second one
+// `split_gap_ms` milliseconds later.
+class LoopServer {
+ public:
+  LoopServer(int fd, SSL_CTX *ctx) noexcept : fd_{fd}, ctx_{ctx} {}
+
+  void run() {
+    SSL *ssl = nullptr;
+    if (ctx_ != nullptr) {
+      ssl = SSL_new(ctx_);
+      SSL_set_fd(ssl, fd_);
+      if (SSL_accept(ssl) != 1) {
+        SSL_free(ssl);
+        close(fd_);
+        return;
+      }
+    }
+    (void)fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) | O_NONBLOCK);
+    auto write_all = [&](const std::string &data) {
+      (void)((ssl != nullptr)
+                 ? SSL_write(ssl, data.data(), (int)data.size())
+                 : (int)send(fd_, data.data(), data.size(), MSG_NOSIGNAL));
+    };
+    const std::string data_frame =
+        std::string{"\x82\x64", 2} + std::string(100, 'x');
+    auto next_send = std::chrono::steady_clock::now();
+    bool close_sent = false;
+    const size_t half = split_message.size() / 2;
+    if (half > 0) {
+      write_all(split_message.substr(0, half));
+      split_begin = std::chrono::steady_clock::now();
+    }
+    std::string data;
+    for (bool eof = false; !eof;) {
+      if (half > 0 && split_end == std::chrono::steady_clock::time_point{} &&
+          std::chrono::steady_clock::now() >=
+              split_begin + std::chrono::milliseconds(split_gap_ms)) {
+        write_all(split_message.substr(half));
+        split_end = std::chrono::steady_clock::now();
+      }
+      if (close_when != nullptr && !close_sent && close_when->load()) {
+        write_all(std::string{"\x88\x00", 2});
+        close_sent = true;
+      }
+      if (download && !close_sent &&
+          std::chrono::steady_clock::now() >= next_send) {
+        write_all(data_frame);
+        next_send += std::chrono::milliseconds(5);
+      }
+      if (ssl == nullptr || SSL_pending(ssl) <= 0) {
+        pollfd pfd{};
+        pfd.fd = fd_;
+        pfd.events = POLLIN;
+        (void)poll(&pfd, 1, 5);
+      }
+      for (;;) {
+        char buf[65536];
+        int n = (ssl != nullptr)
+                    ? SSL_read(ssl, buf, (int)sizeof(buf))
+                    : (int)recv(fd_, buf, sizeof(buf), 0);
+        if (n > 0) {
+          data.append(buf, (size_t)n);
+          parse_client_frames(&data, &frames);
+          continue;
+        }
+        eof = (ssl != nullptr) ? SSL_get_error(ssl, n) != SSL_ERROR_WANT_READ
+                               : (n == 0 || errno != EAGAIN);
+        break;
+      }
+    }
+    leftover = std::move(data);
+    SSL_free(ssl);
+    close(fd_);
+  }
+
+  bool download = false;
+  const std::atomic<bool> *close_when = nullptr;
+  std::string split_message;
+  int split_gap_ms = 0;
+  // When the server sent the two halves of `split_message`.
+  std::chrono::steady_clock::time_point split_begin;
+  std::chrono::steady_clock::time_point split_end;
+  std::vector<ClientFrame> frames;
+  std::string leftover;  // bytes that are not part of a complete frame
+
+ private:
+  int fd_;
+  SSL_CTX *ctx_;
+};
+
+// Runs the @p nettest subtest of @p client, connected to @p server through
+// the socket pair @p fds, and returns whether the subtest succeeded.
+static bool run_loop(LoopClient *client, LoopServer *server, int fds[2],
+                     NettestFlags nettest) {
+  std::thread thread{[&]() { server->run(); }};
+  UrlParts url;
+  url.host = "127.0.0.1";
+  url.port = "443";
+  url.path = (nettest == nettest_flag_upload) ? "/ndt/v7/upload"
+                                              : "/ndt/v7/download";
+  bool ok = (nettest == nettest_flag_upload) ? client->ndt7_upload(url)
+                                             : client->ndt7_download(url);
+  (void)shutdown(fds[0], SHUT_WR);
+  thread.join();
+  return ok;
+}
+
+// Returns a TLS server context for the loop tests, or nullptr for clear text.
+// We disable session tickets, which the client would otherwise try to read
+// as measurements.
+static SSL_CTX *new_loop_server_ctx(bool tls) {
+  if (!tls) {
+    return nullptr;
+  }
+  SSL_CTX *ctx = new_test_server_ctx();
+  REQUIRE(SSL_CTX_set_num_tickets(ctx, 0) == 1);
+  return ctx;
+}
+
+// Checks the upload loop when a frame gets stuck half-written for 600 ms.
+static void check_upload_loop(bool tls) {
+  int fds[2] = {-1, -1};
+  REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  SSL_CTX *ctx = new_loop_server_ctx(tls);
+  Settings settings;
+  if (tls) {
+    settings.protocol_flags = protocol_flag_tls;
+    settings.tls_verify_peer = false;
+  }
+  LoopClient client{settings};
+  auto sys = new LoopSys{fds[0]};
+  sys->chunk = 4096;
+  sys->steps[2] = LoopSys::Step{4096, 600};
+  client.sys.reset(sys);
+  LoopServer server{fds[1], ctx};
+  REQUIRE(run_loop(&client, &server, fds, nettest_flag_upload));
+  SSL_CTX_free(ctx);
+  REQUIRE(sys->blocked_sends > 0);
+  // Canceling the test may interrupt the last frame.
+  REQUIRE((server.leftover.empty() ||
+           (uint8_t)server.leftover[0] == (ws_opcode_binary | ws_fin_flag)));
+  std::vector<const ClientFrame *> measurements;
+  for (auto &frame : server.frames) {
+    if (frame.opcode == ws_opcode_binary) {
+      REQUIRE(frame.size == 8192);
+    } else {
+      REQUIRE(frame.opcode == ws_opcode_text);
+      REQUIRE(client.created.count(frame.text) == 1);
+      measurements.push_back(&frame);
+    }
+  }
+  // While the first frame was stuck, the client woke up to create the
+  // measurement due at 250 ms. The next one, created as soon as the frame
+  // could make progress, replaced it and was sent right after such frame.
+  REQUIRE(server.frames.size() > 1);
+  REQUIRE(server.frames[1].opcode == ws_opcode_text);
+  size_t replaced = 0;
+  for (auto &created : client.created) {
+    if (created.second < sys->stall_end) {
+      for (auto measurement : measurements) {
+        REQUIRE(measurement->text != created.first);
+      }
+      replaced += 1;
+    }
+  }
+  REQUIRE(replaced == 1);
+  // We also did not send the measurement created when canceling the test.
+  REQUIRE(measurements.size() == client.created.size() - 2);
+  // The other measurements left in the order in which we created them and
+  // did not wait for the next measurement interval.
+  for (size_t i = 0; i < measurements.size(); ++i) {
+    auto created = client.created.at(measurements[i]->text);
+    REQUIRE((i == 0 ||
+             created > client.created.at(measurements[i - 1]->text)));
+    REQUIRE(measurements[i]->arrived - created <
+            std::chrono::milliseconds(250));
+  }
+}
+
+TEST_CASE("Client::ndt7_upload() sends measurements between frames") {
+  check_upload_loop(false);
+}
+
+TEST_CASE("Client::ndt7_upload() repeats a pending TLS write") {
+  check_upload_loop(true);
+}
+
+TEST_CASE("Client::ndt7_upload() replies to a CLOSE between frames") {
+  int fds[2] = {-1, -1};
+  REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  LoopClient client;
+  auto sys = new LoopSys{fds[0]};
+  sys->chunk = 4096;
+  sys->steps[2] = LoopSys::Step{4096, 600};
+  client.sys.reset(sys);
+  // The server closes the upload while the first frame is half-written.
+  LoopServer server{fds[1], nullptr};
+  server.close_when = &sys->stalled_mid_write;
+  REQUIRE(run_loop(&client, &server, fds, nettest_flag_upload));
+  REQUIRE(server.leftover.empty());
+  REQUIRE(!server.frames.empty());
+  for (size_t i = 0; i < server.frames.size() - 1; ++i) {
+    auto &frame = server.frames[i];
+    REQUIRE((frame.opcode == ws_opcode_text ||
+             (frame.opcode == ws_opcode_binary && frame.size == 8192)));
+  }
+  REQUIRE(server.frames.back().opcode == ws_opcode_close);
+}
+
+// Checks that the upload loop keeps sending while a server measurement is
+// only partially received.
+static void check_upload_split_message(bool tls) {
+  int fds[2] = {-1, -1};
+  REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  SSL_CTX *ctx = new_loop_server_ctx(tls);
+  Settings settings;
+  if (tls) {
+    settings.protocol_flags = protocol_flag_tls;
+    settings.tls_verify_peer = false;
+  }
+  LoopClient client{settings};
+  auto sys = new LoopSys{fds[0]};
+  client.sys.reset(sys);
+  LoopServer server{fds[1], ctx};
+  std::string json = R"({"TCPInfo": {"MinRTT": 1234}})";
+  server.split_message = std::string{"\x81"} + (char)json.size() + json;
+  server.split_gap_ms = 800;
+  REQUIRE(run_loop(&client, &server, fds, nettest_flag_upload));
+  SSL_CTX_free(ctx);
+  REQUIRE(server.split_end > server.split_begin);
+  // The measurements due at 250 and 500 ms did not wait for the second half.
+  size_t sent_meanwhile = 0;
+  for (auto &frame : server.frames) {
+    if (frame.opcode == ws_opcode_text && frame.arrived > server.split_begin &&
+        frame.arrived < server.split_end) {
+      sent_meanwhile += 1;
+    }
+  }
+  REQUIRE(sent_meanwhile >= 1);
+  REQUIRE(client.get_summary().min_rtt == 1234);
+}
+
+TEST_CASE("Client::ndt7_upload() does not wait for a split server message") {
+  check_upload_split_message(false);
+}
+
+TEST_CASE("Client::ndt7_upload() does not wait for a split TLS record") {
+  check_upload_split_message(true);
+}
+
+// Checks the download loop when the client cannot write the measurement due
+// at 250 ms for 300 ms and then stalls for 300 ms after writing the first
+// bytes of the next measurement. The server closes the download during the
+// second stall.
+static void check_download_loop(bool tls) {
+  int fds[2] = {-1, -1};
+  REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  SSL_CTX *ctx = new_loop_server_ctx(tls);
+  Settings settings;
+  if (tls) {
+    settings.protocol_flags = protocol_flag_tls;
+    settings.tls_verify_peer = false;
+  }
+  LoopClient client{settings};
+  auto sys = new LoopSys{fds[0]};
+  sys->steps[1] = LoopSys::Step{0, 300};
+  sys->steps[3] = LoopSys::Step{10, 300};
+  client.sys.reset(sys);
+  LoopServer server{fds[1], ctx};
+  server.download = true;
+  server.close_when = &sys->stalled_mid_write;
+  REQUIRE(run_loop(&client, &server, fds, nettest_flag_download));
+  SSL_CTX_free(ctx);
+  REQUIRE(server.leftover.empty());
+  // The measurements arrived whole, followed by the reply to the CLOSE.
+  REQUIRE(server.frames.size() >= 3);
+  std::vector<uint64_t> elapsed;
+  for (size_t i = 0; i < server.frames.size() - 1; ++i) {
+    REQUIRE(server.frames[i].opcode == ws_opcode_text);
+    auto measurement = nlohmann::json::parse(server.frames[i].text);
+    elapsed.push_back(measurement["AppInfo"]["ElapsedTime"].get<uint64_t>());
+    REQUIRE((i == 0 || elapsed[i] > elapsed[i - 1]));
+  }
+  REQUIRE(server.frames.back().opcode == ws_opcode_close);
+  REQUIRE(elapsed[0] >= 250000);
+  if (!tls) {
+    // In clear text, nothing of the first measurement was written, so the
+    // one due at 500 ms replaced it. With TLS, the client must complete a
+    // write that would block instead.
+    REQUIRE(elapsed[0] >= 500000);
+  }
+}
+
+TEST_CASE("Client::ndt7_download() sends whole measurements") {
+  check_download_loop(false);
+}
+
+TEST_CASE("Client::ndt7_download() completes pending TLS writes") {
+  check_download_loop(true);
+}
+#endif  // _WIN32
+
+// Client::locate_cache_lookup() tests
+// -----------------------------------
+
+// Returns a URL with an access token expiring at @p exp. The token is not
+// signed, which is fine since the client does not verify tokens.
+static std::string url_with_token(const std::string &path, int64_t exp) {
+  static const char table[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+  std::string payload = "{\"exp\":" + std::to_string(exp) + "}";
+  std::string encoded;
+  uint32_t accum = 0;
+  int bits = 0;
+  for (char c : payload) {
+    accum = (accum << 8) | (uint8_t)c;
+    bits += 8;
+    while (bits >= 6) {
+      bits -= 6;
+      encoded += table[(accum >> bits) & 0x3f];
+    }
+  }
+  if (bits > 0) {
+    encoded += table[(accum << (6 - bits)) & 0x3f];
+  }
+  return "wss://ndt.example.org" + path + "?access_token=eyJhbGciOiJub25lIn0." +
+         encoded + ".sig&index=0";
+}
+
+static std::string locate_body(int64_t exp) {
+  nlohmann::json body;
+  for (auto &machine : {"a", "b"}) {
+    nlohmann::json urls;
+    urls["wss:///ndt/v7/download"] =
+        url_with_token(std::string{"/"} + machine + "/download", exp);
+    urls["wss:///ndt/v7/upload"] =
+        url_with_token(std::string{"/"} + machine + "/upload", exp);
+    body["results"].push_back({{"machine", machine}, {"urls", urls}});
+  }
+  return body.dump();
+}
+
+class CountingLocateCurl : public Client {
+ public:
+  using Client::Client;
+  bool query_locate_api_curl(const std::string &, long,
+                             std::string *body) noexcept override {
+    ++calls;
+    *body = locate_body(exp);
+    return true;
+  }
+  int64_t exp = 0;
+  int calls = 0;
+};
+
+TEST_CASE("Client::locate_token_expiry() parses the access tokens") {
+  nlohmann::json urls;
+  urls["wss:///ndt/v7/download"] = url_with_token("/download", 1700000100);
+  urls["wss:///ndt/v7/upload"] = url_with_token("/upload", 1700000050);
+  REQUIRE(Client::locate_token_expiry(urls) == 1700000050);
+  urls["ws:///ndt/v7/upload"] = "ws://ndt.example.org/ndt/v7/upload";
+  REQUIRE(Client::locate_token_expiry(urls) == 0);
+  REQUIRE(Client::locate_token_expiry(nlohmann::json{}) == 0);
+}
+
+TEST_CASE("Client::query_locate_api() reuses results with valid tokens") {
+  Settings settings;
+  settings.locate_api_base_url = "https://locate-cache-valid.example.org";
+  CountingLocateCurl client{settings};
+  client.exp = client.locate_cache_now() + 3600;
+  std::map<std::string, std::string> metadata;
+  std::vector<nlohmann::json> first, second, third;
+  REQUIRE(client.query_locate_api(metadata, &first) == true);
+  REQUIRE(client.query_locate_api(metadata, &second) == true);
+  REQUIRE(client.calls == 1);
+  REQUIRE(second == first);
+  // A failed target is skipped by the following lookups.
+  client.locate_cache_forget(first[0]);
+  REQUIRE(client.query_locate_api(metadata, &third) == true);
+  REQUIRE(client.calls == 1);
+  REQUIRE(third == std::vector<nlohmann::json>{first[1]});
+}
+
+TEST_CASE("Client::query_locate_api() does not reuse expiring results") {
+  Settings settings;
+  settings.locate_api_base_url = "https://locate-cache-expiring.example.org";
+  CountingLocateCurl client{settings};
+  client.exp = client.locate_cache_now() + 10;  // less than a test
+  std::map<std::string, std::string> metadata;
+  std::vector<nlohmann::json> first, second;
+  REQUIRE(client.query_locate_api(metadata, &first) == true);
+  REQUIRE(client.query_locate_api(metadata, &second) == true);
+  REQUIRE(client.calls == 2);
+}
+
+TEST_CASE("Client::query_locate_api() does not cache when disabled") {
+  Settings settings;
+  settings.locate_api_base_url = "https://locate-cache-disabled.example.org";
+  settings.locate_cache = false;
+  CountingLocateCurl client{settings};
+  client.exp = client.locate_cache_now() + 3600;
+  std::map<std::string, std::string> metadata;
+  std::vector<nlohmann::json> first, second;
+  REQUIRE(client.query_locate_api(metadata, &first) == true);
+  REQUIRE(client.query_locate_api(metadata, &second) == true);
+  REQUIRE(client.calls == 2);
+}
+
+TEST_CASE("Client::query_locate_api() saves results on disk") {
+  Settings settings;
+  settings.locate_api_base_url = "https://locate-cache-disk.example.org";
+  settings.locate_cache_path = "locate-cache-test.json";
+  (void)remove(settings.locate_cache_path.c_str());
+  CountingLocateCurl client{settings};
+  client.exp = client.locate_cache_now() + 3600;
+  std::map<std::string, std::string> metadata;
+  std::vector<nlohmann::json> targets;
+  REQUIRE(client.query_locate_api(metadata, &targets) == true);
+  std::ifstream file{settings.locate_cache_path};
+  auto disk = nlohmann::json::parse(file);
+  REQUIRE(disk.size() == 1);
+  REQUIRE(disk.begin().value().size() == 2);
+  REQUIRE(disk.begin().value()[0]["expiry"] == client.exp);
+#ifndef _WIN32
+  struct stat st {};
+  REQUIRE(stat(settings.locate_cache_path.c_str(), &st) == 0);
+  REQUIRE((st.st_mode & 0777) == 0600);
+#endif
+  (void)remove(settings.locate_cache_path.c_str());
+}
+
+TEST_CASE("Client::locate_cache_lookup() reads results saved on disk") {
+  Settings settings;
+  settings.locate_cache_path = "locate-cache-test.json";
+  Client client{settings};
+  nlohmann::json urls;
+  urls["wss:///ndt/v7/download"] =
+      url_with_token("/download", client.locate_cache_now() + 3600);
+  nlohmann::json disk;
+  disk["disk-only-key"].push_back(
+      {{"urls", urls}, {"expiry", client.locate_cache_now() + 3600}});
+  {
+    std::ofstream file{settings.locate_cache_path};
+    file << disk.dump();
+  }
+  std::vector<nlohmann::json> targets;
+  REQUIRE(client.locate_cache_lookup("disk-only-key", &targets) == true);
+  REQUIRE(targets == std::vector<nlohmann::json>{urls});
+  (void)remove(settings.locate_cache_path.c_str());
+}
+
 // Client::netx_maybesocks5h_dial() tests
 // --------------------------------------
 
@@ -1046,6 +2485,54 @@ TEST_CASE("Client::netx_dial() deals with Client::connect() socket error") {
   REQUIRE(client.netx_dial("1.2.3.4", "33", &sock) == internal::Err::io_error);
 }
 
+// Client::netx_apply_socket_profile() tests
+// -----------------------------------------
+
+#ifdef __linux__
+TEST_CASE("Client::netx_apply_socket_profile() sets the socket options") {
+  Settings settings;
+  settings.socket_profile.sndbuf = 1 << 16;
+  settings.socket_profile.notsent_lowat = 1 << 14;
+  settings.socket_profile.nodelay = true;
+  settings.socket_profile.tos = 0x10;
+  Client client{settings};
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  REQUIRE(fd != -1);
+  client.netx_apply_socket_profile(fd, AF_INET);
+  auto profile = client.netx_socket_profile(fd);
+  REQUIRE(profile.sndbuf >= (1 << 16));
+  REQUIRE(profile.notsent_lowat == (1 << 14));
+  REQUIRE(profile.nodelay);
+  REQUIRE(profile.tos == 0x10);
+  REQUIRE(!profile.congestion.empty());
+  close(fd);
+}
+
+class FailSetsockoptSys : public internal::Sys {
+ public:
+  using Sys::Sys;
+  mutable std::vector<int> names;
+  int Setsockopt(internal::Socket, int, int name, const void *,
+                 socklen_t) const noexcept override {
+    names.push_back(name);
+    return -1;
+  }
+};
+
+TEST_CASE("Client::netx_apply_socket_profile() skips failing options") {
+  Settings settings;
+  settings.socket_profile.rcvbuf = 1 << 20;
+  settings.socket_profile.nodelay = true;
+  settings.socket_profile.tos = 0x10;
+  Client client{settings};
+  auto sys = new FailSetsockoptSys{};
+  client.sys.reset(sys);
+  client.netx_apply_socket_profile(0, AF_INET6);
+  REQUIRE(sys->names ==
+          std::vector<int>{SO_RCVBUFFORCE, SO_RCVBUF, TCP_NODELAY, IPV6_TCLASS});
+}
+#endif  // __linux__
+
 // Client::netx_recv_nonblocking() tests
 // -------------------------------------
 
@@ -1488,6 +2975,249 @@ TEST_CASE("Client::netx_poll() deals with timeout") {
   REQUIRE(client.netx_poll(&pfds, timeout) == internal::Err::timed_out);
 }
 
+#ifndef _WIN32
+
+TEST_CASE("Client::cancel() wakes up Client::netx_poll()") {
+  int fds[2];
+  REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  pollfd pfd{};
+  pfd.fd = fds[0];
+  pfd.events |= POLLIN;
+  std::vector<pollfd> pfds;
+  pfds.push_back(pfd);
+  Client client;
+  std::thread canceler{[&client]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    client.cancel();
+  }};
+  auto begin = std::chrono::steady_clock::now();
+  REQUIRE(client.netx_poll(&pfds, 10000) == internal::Err::canceled);
+  REQUIRE(std::chrono::steady_clock::now() - begin < std::chrono::seconds(1));
+  REQUIRE(pfds.size() == 1);
+  REQUIRE(pfds[0].revents == 0);
+  REQUIRE(client.is_canceled());
+  canceler.join();
+  close(fds[0]);
+  close(fds[1]);
+}
+
+#endif  // !_WIN32
+
+TEST_CASE("Client::run() honours a Client::cancel() issued before it") {
+  RecordMlabnsTimeout client;
+  client.cancel();
+  REQUIRE(client.run() == false);
+  REQUIRE(client.timeout == 0);
+  REQUIRE(client.is_canceled());
+}
+
+TEST_CASE("Client::reset_cancel() forgets previous Client::cancel() calls") {
+  RecordMlabnsTimeout client;
+  client.cancel();
+  client.reset_cancel();
+  REQUIRE(!client.is_canceled());
+  REQUIRE(client.run() == false);
+  REQUIRE(client.timeout == 7);
+  REQUIRE(!client.is_canceled());
+}
+
+// Client::netx_transport_get() tests
+// ----------------------------------
+
+class NoopClosesocket : public internal::Sys {
+ public:
+  using Sys::Sys;
+  int Closesocket(internal::Socket) const noexcept override { return 0; }
+};
+
+TEST_CASE("Client::netx_transport_add() returns the existing Transport") {
+  Client client;
+  client.sys.reset(new NoopClosesocket{});
+  REQUIRE(client.netx_transport_get(17) == nullptr);
+  auto t = client.netx_transport_add(17);
+  REQUIRE(t != nullptr);
+  REQUIRE(t->sock == 17);
+  REQUIRE(t->ssl == nullptr);
+  REQUIRE(client.netx_transport_add(17) == t);
+  REQUIRE(client.netx_transport_get(17) == t);
+  REQUIRE(client.netx_transport_add(21) != t);
+  REQUIRE(client.netx_closesocket(17) == internal::Err::none);
+  REQUIRE(client.netx_transport_get(17) == nullptr);
+  REQUIRE(client.netx_transport_get(21) != nullptr);
+}
+
+class CountingRecv : public internal::Sys {
+ public:
+  using Sys::Sys;
+  internal::Ssize Recv(internal::Socket, void *,
+                       internal::Size count) const noexcept override {
+    return (internal::Ssize)count;
+  }
+  int Closesocket(internal::Socket) const noexcept override { return 0; }
+};
+
+TEST_CASE("Client::netx_recv_nonblocking() updates the Transport counters") {
+  Client client;
+  client.sys.reset(new CountingRecv{});
+  auto t = client.netx_transport_add(17);
+  char buf[64];
+  internal::Size n = 0;
+  REQUIRE(client.netx_recv_nonblocking(17, buf, sizeof(buf), &n) ==
+          internal::Err::none);
+  REQUIRE(n == sizeof(buf));
+  REQUIRE(t->recv_calls == 1);
+  REQUIRE(t->bytes_recv == sizeof(buf));
+  REQUIRE(t->send_calls == 0);
+}
+
+// Client::ws_recvmsg_fast() tests
+// -------------------------------
+
+class FramesRecv : public internal::Sys {
+ public:
+  using Sys::Sys;
+  std::string input;
+  internal::Ssize Recv(internal::Socket, void *base,
+                       internal::Size count) const noexcept override {
+    // Feed at most three bytes at a time to exercise short reads.
+    count = (std::min)(count, (internal::Size)3);
+    count = (std::min)(count, (internal::Size)input.size() - off);
+    if (count == 0) {
+      return 0;
+    }
+    memcpy(base, input.data() + off, count);
+    off += count;
+    return (internal::Ssize)count;
+  }
+  int Closesocket(internal::Socket) const noexcept override { return 0; }
+
+ private:
+  mutable internal::Size off = 0;
+};
+
+static std::string server_frame(uint8_t first_byte, const std::string &data) {
+  std::string frame;
+  frame += (char)first_byte;
+  frame += (char)data.size();
+  frame += data;
+  return frame;
+}
+
+TEST_CASE("Client::ws_recvmsg_fast() behaves like Client::ws_recvmsg()") {
+  std::string input = server_frame(0x02, "abc") + server_frame(0x80, "def") +
+                      server_frame(0x81, "{}");
+  auto run = [&](bool fast, std::vector<std::string> *messages) {
+    Client client;
+    auto sys = new FramesRecv{};
+    sys->input = input;
+    client.sys.reset(sys);
+    auto t = client.netx_transport_add(17);
+    for (;;) {
+      uint8_t opcode = 0;
+      uint8_t buf[64];
+      internal::Size count = 0;
+      auto err = fast ? client.ws_recvmsg_fast(t, &opcode, buf, sizeof(buf),
+                                               &count)
+                      : client.ws_recvmsg(17, &opcode, buf, sizeof(buf),
+                                          &count);
+      if (err != internal::Err::none) {
+        REQUIRE(err == internal::Err::eof);
+        break;
+      }
+      messages->push_back(std::to_string((int)opcode) + ":" +
+                          std::string{(char *)buf, count});
+    }
+    REQUIRE(t->bytes_recv == input.size());
+  };
+  std::vector<std::string> slow, fast;
+  run(false, &slow);
+  run(true, &fast);
+  REQUIRE(slow == std::vector<std::string>{"2:abcdef", "1:{}"});
+  REQUIRE(fast == slow);
+}
+
+TEST_CASE("Client::netx_recvn() consumes bytes buffered by ws_recvmsg_fast()") {
+  Client client;
+  auto sys = new FramesRecv{};
+  sys->input = server_frame(0x82, "abc") + "tail";
+  client.sys.reset(sys);
+  auto t = client.netx_transport_add(17);
+  uint8_t opcode = 0;
+  uint8_t buf[64];
+  internal::Size count = 0;
+  REQUIRE(client.ws_recvmsg_fast(t, &opcode, buf, sizeof(buf), &count) ==
+          internal::Err::none);
+  REQUIRE(std::string{(char *)buf, count} == "abc");
+  REQUIRE(t->rbuf_end - t->rbuf_off > 0);
+  REQUIRE(client.netx_recvn(17, buf, 4) == internal::Err::none);
+  REQUIRE(std::string{(char *)buf, 4} == "tail");
+}
+
+// Client::netx_send_nonblocking_fast() tests
+// ------------------------------------------
+
+class ShortSend : public internal::Sys {
+ public:
+  using Sys::Sys;
+  mutable internal::Size room = 8;
+  internal::Ssize Send(internal::Socket, const void *,
+                       internal::Size count) const noexcept override {
+    count = (std::min)(count, room);
+    if (count == 0) {
+      SetLastError(OS_EWOULDBLOCK);
+      return -1;
+    }
+    room -= count;
+    return (internal::Ssize)count;
+  }
+  int Closesocket(internal::Socket) const noexcept override { return 0; }
+};
+
+TEST_CASE("Client::netx_send_nonblocking_fast() performs a single send") {
+  Client client;
+  client.sys.reset(new ShortSend{});
+  auto t = client.netx_transport_add(17);
+  char buf[5] = {};
+  internal::Size n = 0;
+  REQUIRE(client.netx_send_nonblocking_fast(t, buf, sizeof(buf), &n) ==
+          internal::Err::none);
+  REQUIRE(n == 5);
+  REQUIRE(client.netx_send_nonblocking_fast(t, buf, sizeof(buf), &n) ==
+          internal::Err::none);
+  REQUIRE(n == 3);
+  REQUIRE(client.netx_send_nonblocking_fast(t, buf, sizeof(buf), &n) ==
+          internal::Err::operation_would_block);
+  REQUIRE(n == 0);
+  REQUIRE(t->send_calls == 2);
+  REQUIRE(t->bytes_sent == 8);
+}
+
+TEST_CASE("Client::netx_fastpath_enabled() follows Settings::io_fastpath") {
+  {
+    Client client;
+    REQUIRE(!client.netx_fastpath_enabled());
+  }
+  {
+    Settings settings;
+    settings.io_fastpath = true;
+    Client client{settings};
+    REQUIRE(client.netx_fastpath_enabled());
+  }
+}
+
+TEST_CASE("Client::netx_recv_nonblocking() reads in clear text without a Transport") {
+  Settings settings;
+  settings.protocol_flags = protocol_flag_tls;
+  Client client{settings};
+  client.sys.reset(new CountingRecv{});
+  char buf[64];
+  internal::Size n = 0;
+  REQUIRE(client.netx_recv_nonblocking(17, buf, sizeof(buf), &n) ==
+          internal::Err::none);
+  REQUIRE(n == sizeof(buf));
+  REQUIRE(client.netx_transport_get(17) == nullptr);
+}
+
 // Client::query_locate_api_curl() tests
 // ---------------------------------
 
@@ -0,0 +1,325 @@
+// Part of Measurement Lab <https://www.measurementlab.net/>.
+// Measurement Lab libndt7 is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+
+// loopback_test - runs ndt7-client-cc against ndt7-test-server on the
+// loopback interface, measures the client performance and compares it with
+// the baseline stored in a JSON file. The speeds and the CPU time depend on
+// the machine running the test, hence we only report them; the test fails
+// when a metric that does not depend on the machine regresses by more than
+// the tolerance written in such file. Use `-update` to store the metrics
+// measured on your machine as the new baseline.
+
+#include "third_party/github.com/nlohmann/json/json.hpp"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef __clang__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wsign-conversion"
+#endif  // __clang__
+#include "third_party/github.com/adishavit/argh/argh.h"
+#ifdef __clang__
+#pragma clang diagnostic pop
+#endif  // __clang__
+
+// Each subtest stops after this many bytes, such that tests are quick and
+// move the same amount of data regardless of the speed.
+static const char *byte_budget = "2000000000";
+
+// Each test must complete within this many seconds. CMake gives the test
+// some more time, such that we can stop the processes we have started
+// before ctest kills us and leaves them running.
+static const unsigned int max_seconds = 100;
+
+// The processes to stop when the test takes too much time.
+static volatile pid_t server_pid = -1;
+static volatile pid_t client_pid = -1;
+
+static void on_alarm(int) {
+  if (client_pid != -1) {
+    kill(client_pid, SIGKILL);
+  }
+  if (server_pid != -1) {
+    kill(server_pid, SIGKILL);
+  }
+  static const char msg[] = "fatal: the test is taking too much time\n";
+  ssize_t rv = write(STDERR_FILENO, msg, sizeof(msg) - 1);
+  (void)rv;
+  _exit(EXIT_FAILURE);
+}
+
+// Starts @p args and returns its PID, setting @p out to the read end of a
+// pipe connected to its standard output. Returns -1 on failure.
+static pid_t spawn(const std::vector<std::string> &args, int *out) {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    return -1;
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    dup2(fds[1], STDOUT_FILENO);
+    close(fds[0]);
+    close(fds[1]);
+    std::vector<char *> argv;
+    for (auto &arg : args) {
+      argv.push_back((char *)arg.c_str());
+    }
+    argv.push_back(nullptr);
+    execv(argv[0], argv.data());
+    _exit(127);
+  }
+  close(fds[1]);
+  if (pid == -1) {
+    close(fds[0]);
+    return -1;
+  }
+  *out = fds[0];
+  return pid;
+}
+
+// Reads from @p fd until the end of the file or until @p stop is found.
+static std::string read_until(int fd, const std::string &stop) {
+  std::string data;
+  char buf[4096];
+  while (stop.empty() || data.find(stop) == std::string::npos) {
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n <= 0) {
+      break;
+    }
+    data.append(buf, (size_t)n);
+  }
+  return data;
+}
+
+// Returns the summary printed by the client in batch mode.
+static nlohmann::json find_summary(const std::string &output) {
+  nlohmann::json summary;
+  std::istringstream lines{output};
+  for (std::string line; std::getline(lines, line);) {
+    try {
+      auto json = nlohmann::json::parse(line);
+      if (json.is_object() && !json.contains("Key") &&
+          (json.contains("Download") || json.contains("Upload"))) {
+        summary = json;
+      }
+    } catch (const nlohmann::json::exception &) {
+      // Skip lines that are not JSON.
+    }
+  }
+  return summary;
+}
+
+// Computes the metrics of the test from the client @p summary and from the
+// client resource @p usage.
+static nlohmann::json compute_metrics(const nlohmann::json &summary,
+                                      const rusage &usage, bool tls) {
+  nlohmann::json metrics;
+  double bytes = 0.0;
+  double io_calls = 0.0;
+  for (auto subtest : {"Download", "Upload"}) {
+    if (!summary.contains(subtest)) {
+      continue;
+    }
+    const nlohmann::json &result = summary[subtest];
+    std::string name = (std::string{subtest} == "Download") ? "download_gbps"
+                                                            : "upload_gbps";
+    metrics[name] = result.value("Speed", 0.0) / 1e06;
+    const nlohmann::json &netx = result.at("Netx");
+    bytes += netx.value("BytesRecv", 0.0) + netx.value("BytesSent", 0.0);
+    // The reads and writes issued by the client, not counting the polls.
+    // With TLS, the reads are those of the BIO, which reads the socket, and
+    // the writes are the calls to SSL_write(), which may write many records.
+    io_calls += netx.value(tls ? "BioReads" : "RecvCalls", 0.0) +
+                netx.value("SendCalls", 0.0);
+  }
+  double cpu = (double)usage.ru_utime.tv_sec +
+               (double)usage.ru_utime.tv_usec / 1e06 +
+               (double)usage.ru_stime.tv_sec +
+               (double)usage.ru_stime.tv_usec / 1e06;
+  metrics["cpu_seconds_per_gb"] = (bytes > 0.0) ? cpu / (bytes / 1e09) : 0.0;
+  metrics["io_calls_per_mb"] = (bytes > 0.0) ? io_calls / (bytes / 1e06) : 0.0;
+#ifdef __APPLE__
+  metrics["peak_rss_mb"] = (double)usage.ru_maxrss / (1 << 20);
+#else
+  metrics["peak_rss_mb"] = (double)usage.ru_maxrss / (1 << 10);
+#endif
+  return metrics;
+}
+
+// Returns whether @p metric does not depend on the speed of the machine, such
+// that we can compare it with a baseline recorded on another machine.
+static bool is_gated(const std::string &metric) {
+  return metric == "io_calls_per_mb" || metric == "peak_rss_mb";
+}
+
+// Compares @p metrics with @p baseline and returns the number of regressions
+// of the gated metrics, for which lower is better. The other metrics are
+// only reported.
+static int compare(const nlohmann::json &metrics, const nlohmann::json &baseline,
+                   double tolerance) {
+  int regressions = 0;
+  for (auto &metric : metrics.items()) {
+    if (!baseline.contains(metric.key())) {
+      std::clog << "no baseline for: " << metric.key() << std::endl;
+      continue;
+    }
+    double value = metric.value().get<double>();
+    double base = baseline[metric.key()].get<double>();
+    if (!is_gated(metric.key())) {
+      std::clog << "info: " << metric.key() << " = " << value
+                << " (baseline: " << base << ")" << std::endl;
+      continue;
+    }
+    bool regressed = value > base * (1.0 + tolerance);
+    std::clog << (regressed ? "REGRESSED: " : "ok: ") << metric.key() << " = "
+              << value << " (baseline: " << base << ")" << std::endl;
+    regressions += regressed ? 1 : 0;
+  }
+  return regressions;
+}
+
+int main(int, char **argv) {
+  std::string server_path;
+  std::string client_path;
+  std::string baseline_path;
+  std::string scheme = "ws";
+  std::string subtests = "both";
+  bool update = false;
+  {
+    argh::parser cmdline;
+    for (auto param : {"server", "client", "baseline", "scheme", "subtests"}) {
+      cmdline.add_param(param);
+    }
+    cmdline.parse(argv);
+    update = cmdline["update"];
+    cmdline("server") >> server_path;
+    cmdline("client") >> client_path;
+    cmdline("baseline") >> baseline_path;
+    cmdline("scheme") >> scheme;
+    cmdline("subtests") >> subtests;
+  }
+  if (server_path.empty() || client_path.empty() || baseline_path.empty() ||
+      (scheme != "ws" && scheme != "wss") ||
+      (subtests != "download" && subtests != "upload" && subtests != "both")) {
+    std::clog << "Usage: loopback_test -server=<path> -client=<path> "
+                 "-baseline=<path> -scheme=<ws|wss> "
+                 "-subtests=<download|upload|both> [-update]"
+              << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  std::string name = scheme + "_" + subtests;
+  signal(SIGALRM, on_alarm);
+  alarm(max_seconds);
+
+  int server_out = -1;
+  pid_t server = spawn({server_path, "-ws-port=0", "-wss-port=0",
+                        "-locate-port=0"},
+                       &server_out);
+  if (server == -1) {
+    std::clog << "fatal: cannot start: " << server_path << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  server_pid = server;
+  nlohmann::json ports;
+  try {
+    ports = nlohmann::json::parse(read_until(server_out, "\n"));
+  } catch (const nlohmann::json::exception &) {
+    std::clog << "fatal: cannot read the server ports" << std::endl;
+    kill(server, SIGTERM);
+    exit(EXIT_FAILURE);
+  }
+  close(server_out);
+
+  std::vector<std::string> args{client_path};
+  if (subtests != "upload") {
+    args.push_back("-download");
+  }
+  if (subtests != "download") {
+    args.push_back("-upload");
+  }
+  args.push_back("-scheme=" + scheme);
+  args.push_back("-locate-api-url=http://127.0.0.1:" +
+                 std::to_string(ports.value("locate", 0)));
+  args.push_back("-batch");
+  args.push_back("-summary");
+  args.push_back(std::string{"-byte-budget="} + byte_budget);
+  if (scheme == "wss") {
+    args.push_back("-insecure");  // the certificate is self-signed
+  }
+  int client_out = -1;
+  pid_t client = spawn(args, &client_out);
+  if (client == -1) {
+    std::clog << "fatal: cannot start: " << client_path << std::endl;
+    kill(server, SIGTERM);
+    exit(EXIT_FAILURE);
+  }
+  client_pid = client;
+  std::string output = read_until(client_out, "");
+  close(client_out);
+  int status = 0;
+  rusage usage{};
+  (void)wait4(client, &status, 0, &usage);
+  client_pid = -1;
+  kill(server, SIGTERM);
+  (void)waitpid(server, nullptr, 0);
+  server_pid = -1;
+  alarm(0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    std::clog << "fatal: the client failed" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  nlohmann::json summary = find_summary(output);
+  nlohmann::json metrics;
+  try {
+    metrics = compute_metrics(summary, usage, scheme == "wss");
+  } catch (const nlohmann::json::exception &exc) {
+    std::clog << "fatal: unexpected summary: " << exc.what() << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  nlohmann::json result;
+  result[name] = metrics;
+  std::cout << result.dump() << std::endl;
+
+  nlohmann::json baselines;
+  {
+    std::ifstream file{baseline_path};
+    try {
+      file >> baselines;
+    } catch (const nlohmann::json::exception &) {
+      baselines = nlohmann::json::object();
+    }
+  }
+  if (update) {
+    baselines[name] = metrics;
+    std::ofstream file{baseline_path};
+    file << baselines.dump(2) << std::endl;
+    if (!file.good()) {
+      std::clog << "fatal: cannot write: " << baseline_path << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    std::clog << "updated the baseline of: " << name << std::endl;
+    exit(EXIT_SUCCESS);
+  }
+  if (!baselines.contains(name)) {
+    std::clog << "no baseline for: " << name << std::endl;
+    exit(EXIT_SUCCESS);
+  }
+  double tolerance = baselines.value("tolerance", 0.5);
+  exit(compare(metrics, baselines[name], tolerance) == 0 ? EXIT_SUCCESS
+                                                         : EXIT_FAILURE);
+}
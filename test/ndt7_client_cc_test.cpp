@@ -0,0 +1,448 @@
+// Part of Measurement Lab <https://www.measurementlab.net/>.
+// Measurement Lab libndt7 is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+
+// We include the client itself, without its main(), so that we can test the
+// helpers it defines. Some of them are only used by main().
+#define NDT7_CLIENT_CC_NO_MAIN
+#if defined(__clang__)
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wunused-function"
+#elif defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
+#include "ndt7-client-cc.cpp"
+#if defined(__clang__)
+#pragma clang diagnostic pop
+#elif defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+
+#include <algorithm>
+#include <streambuf>
+
+#define CATCH_CONFIG_MAIN
+// TODO(github.com/m-lab/ndt7-client-cc/issues/10): Remove pragma ignoring warning when possible.
+#if !defined(__clang__) && defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+#include "third_party/github.com/catchorg/Catch2/catch.hpp"
+#if !defined(__clang__) && defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+
+// Metrics tests
+// -------------
+
+TEST_CASE("Metrics::format() writes the OpenMetrics text format") {
+  libndt7::SummaryData summary;
+  summary.download_intervals.observe(3000.0);
+  summary.download_intervals.observe(2e07);
+  summary.download_netx.bytes_recv = 1000;
+  summary.download_netx.recv_calls = 10;
+  summary.upload_netx.bytes_sent = 2000;
+  summary.upload_netx.send_calls = 20;
+  Metrics metrics;
+  metrics.add(false, summary);
+  libndt7::Progress progress;
+  progress.nettest = libndt7::nettest_flag_download;
+  progress.elapsed = 1.5;
+  progress.speed = 2000.0;
+  // clang-format off
+  const char *expected = R"(# TYPE ndt7_runs counter
+# HELP ndt7_runs Number of tests.
+ndt7_runs_total 1
+# TYPE ndt7_failures counter
+# HELP ndt7_failures Number of failed tests.
+ndt7_failures_total 1
+# TYPE ndt7_interval_speed_bits_per_second histogram
+# HELP ndt7_interval_speed_bits_per_second Speed measured over each 250 ms interval.
+ndt7_interval_speed_bits_per_second_bucket{test="download",le="1000000"} 0
+ndt7_interval_speed_bits_per_second_bucket{test="download",le="2500000"} 0
+ndt7_interval_speed_bits_per_second_bucket{test="download",le="5000000"} 1
+ndt7_interval_speed_bits_per_second_bucket{test="download",le="10000000"} 1
+ndt7_interval_speed_bits_per_second_bucket{test="download",le="25000000"} 1
+ndt7_interval_speed_bits_per_second_bucket{test="download",le="50000000"} 1
+ndt7_interval_speed_bits_per_second_bucket{test="download",le="100000000"} 1
+ndt7_interval_speed_bits_per_second_bucket{test="download",le="250000000"} 1
+ndt7_interval_speed_bits_per_second_bucket{test="download",le="500000000"} 1
+ndt7_interval_speed_bits_per_second_bucket{test="download",le="1000000000"} 1
+ndt7_interval_speed_bits_per_second_bucket{test="download",le="2500000000"} 1
+ndt7_interval_speed_bits_per_second_bucket{test="download",le="5000000000"} 1
+ndt7_interval_speed_bits_per_second_bucket{test="download",le="10000000000"} 1
+ndt7_interval_speed_bits_per_second_bucket{test="download",le="+Inf"} 2
+ndt7_interval_speed_bits_per_second_count{test="download"} 2
+ndt7_interval_speed_bits_per_second_sum{test="download"} 20003000000
+ndt7_interval_speed_bits_per_second_bucket{test="upload",le="1000000"} 0
+ndt7_interval_speed_bits_per_second_bucket{test="upload",le="2500000"} 0
+ndt7_interval_speed_bits_per_second_bucket{test="upload",le="5000000"} 0
+ndt7_interval_speed_bits_per_second_bucket{test="upload",le="10000000"} 0
+ndt7_interval_speed_bits_per_second_bucket{test="upload",le="25000000"} 0
+ndt7_interval_speed_bits_per_second_bucket{test="upload",le="50000000"} 0
+ndt7_interval_speed_bits_per_second_bucket{test="upload",le="100000000"} 0
+ndt7_interval_speed_bits_per_second_bucket{test="upload",le="250000000"} 0
+ndt7_interval_speed_bits_per_second_bucket{test="upload",le="500000000"} 0
+ndt7_interval_speed_bits_per_second_bucket{test="upload",le="1000000000"} 0
+ndt7_interval_speed_bits_per_second_bucket{test="upload",le="2500000000"} 0
+ndt7_interval_speed_bits_per_second_bucket{test="upload",le="5000000000"} 0
+ndt7_interval_speed_bits_per_second_bucket{test="upload",le="10000000000"} 0
+ndt7_interval_speed_bits_per_second_bucket{test="upload",le="+Inf"} 0
+ndt7_interval_speed_bits_per_second_count{test="upload"} 0
+ndt7_interval_speed_bits_per_second_sum{test="upload"} 0
+# TYPE ndt7_netx_received_bytes counter
+# HELP ndt7_netx_received_bytes Bytes received.
+ndt7_netx_received_bytes_total{test="download"} 1000
+ndt7_netx_received_bytes_total{test="upload"} 0
+# TYPE ndt7_netx_sent_bytes counter
+# HELP ndt7_netx_sent_bytes Bytes sent.
+ndt7_netx_sent_bytes_total{test="download"} 0
+ndt7_netx_sent_bytes_total{test="upload"} 2000
+# TYPE ndt7_netx_recv_calls counter
+# HELP ndt7_netx_recv_calls Successful nonblocking receives.
+ndt7_netx_recv_calls_total{test="download"} 10
+ndt7_netx_recv_calls_total{test="upload"} 0
+# TYPE ndt7_netx_send_calls counter
+# HELP ndt7_netx_send_calls Successful nonblocking sends.
+ndt7_netx_send_calls_total{test="download"} 0
+ndt7_netx_send_calls_total{test="upload"} 20
+# TYPE ndt7_netx_bio_reads counter
+# HELP ndt7_netx_bio_reads Socket reads issued by the TLS layer.
+ndt7_netx_bio_reads_total{test="download"} 0
+ndt7_netx_bio_reads_total{test="upload"} 0
+# TYPE ndt7_progress_elapsed_seconds gauge
+# HELP ndt7_progress_elapsed_seconds Time since the beginning of the running subtest.
+ndt7_progress_elapsed_seconds{test="download"} 1.5
+# TYPE ndt7_progress_speed_bits_per_second gauge
+# HELP ndt7_progress_speed_bits_per_second Speed measured over the latest interval of the running subtest.
+ndt7_progress_speed_bits_per_second{test="download"} 2000000
+# EOF
+)";
+  // clang-format on
+  REQUIRE(metrics.format(progress) == expected);
+}
+
+TEST_CASE("Metrics::format() describes the latest successful test") {
+  libndt7::SummaryData summary;
+  summary.download_speed = 50000.0;
+  summary.download_retrans = 0.01;
+  summary.min_rtt = 12000.0;
+  summary.locate_time = 250.0;
+  summary.download_phases.connect = 20.0;
+  libndt7::ServerProbe probe;
+  probe.hostname = "a\"b.example.org";
+  probe.port = "443";
+  probe.connect_time = 30.0;
+  summary.server_probes.push_back(probe);
+  Metrics metrics;
+  metrics.add(true, summary);
+  metrics.add(false, libndt7::SummaryData{});
+  std::string text = metrics.format(libndt7::Progress{});
+  for (auto &line : {
+           "ndt7_runs_total 2\n",
+           "ndt7_failures_total 1\n",
+           "# TYPE ndt7_last_success_timestamp_seconds gauge\n",
+           "ndt7_speed_bits_per_second{test=\"download\"} 50000000\n",
+           "ndt7_retransmission_ratio{test=\"download\"} 0.01\n",
+           "ndt7_min_rtt_seconds 0.012\n",
+           "ndt7_locate_time_seconds 0.25\n",
+           "ndt7_phase_seconds{test=\"download\",phase=\"connect\"} 0.02\n",
+           "ndt7_server_connect_time_seconds{hostname=\"a\\\"b.example.org\","
+           "port=\"443\"} 0.03\n",
+       }) {
+    INFO(line);
+    REQUIRE(text.find(line) != std::string::npos);
+  }
+  // The upload did not run, hence there are no upload gauges.
+  REQUIRE(text.find("ndt7_speed_bits_per_second{test=\"upload\"}") ==
+          std::string::npos);
+  REQUIRE(text.find("ndt7_progress_") == std::string::npos);
+  REQUIRE(text.size() >= 6);
+  REQUIRE(text.compare(text.size() - 6, 6, "# EOF\n") == 0);
+}
+
+// NdjsonWriter tests
+// ------------------
+
+// GatedBuf is a stream buffer whose writes wait until the gate is open, such
+// that we can emulate a slow reader of the NdjsonWriter output.
+class GatedBuf : public std::streambuf {
+ public:
+  explicit GatedBuf(bool open = true) noexcept : open_{open} {}
+
+  void set_open(bool open) noexcept {
+    std::unique_lock<std::mutex> lock{mutex_};
+    open_ = open;
+    changed_.notify_all();
+  }
+
+  // wait_for_writes returns whether at least @p count writes have started
+  // within @p timeout.
+  bool wait_for_writes(size_t count, std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock{mutex_};
+    return changed_.wait_for(lock, timeout,
+                             [&]() { return writes_ >= count; });
+  }
+
+  // wait_for_size returns whether at least @p size bytes have been written
+  // within @p timeout.
+  bool wait_for_size(size_t size, std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock{mutex_};
+    return changed_.wait_for(lock, timeout,
+                             [&]() { return data_.size() >= size; });
+  }
+
+  std::string data() {
+    std::unique_lock<std::mutex> lock{mutex_};
+    return data_;
+  }
+
+ protected:
+  std::streamsize xsputn(const char *s, std::streamsize count) override {
+    std::unique_lock<std::mutex> lock{mutex_};
+    ++writes_;
+    changed_.notify_all();
+    changed_.wait(lock, [this]() { return open_; });
+    data_.append(s, (size_t)count);
+    changed_.notify_all();
+    return count;
+  }
+
+  int_type overflow(int_type ch) override {
+    if (traits_type::eq_int_type(ch, traits_type::eof())) {
+      return traits_type::not_eof(ch);
+    }
+    char c = traits_type::to_char_type(ch);
+    (void)xsputn(&c, 1);
+    return ch;
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  bool open_;
+  size_t writes_ = 0;
+  std::string data_;
+};
+
+// The NdjsonWriter hands off buffers of 1 << 16 bytes.
+constexpr size_t ndjson_flush_size = 1 << 16;
+
+TEST_CASE("NdjsonWriter hands off a buffer once it is large enough") {
+  GatedBuf buf;
+  std::ostream output{&buf};
+  NdjsonWriter writer{&output};
+  auto begin = std::chrono::steady_clock::now();
+  writer.write("{}");
+  REQUIRE(!buf.wait_for_size(1, std::chrono::milliseconds{50}));
+  writer.write(std::string(ndjson_flush_size, 'x'));
+  REQUIRE(buf.wait_for_size(ndjson_flush_size + 4,
+                            std::chrono::milliseconds{1000}));
+  // Otherwise, the buffer may have been handed off because of its age.
+  REQUIRE(std::chrono::steady_clock::now() - begin <
+          std::chrono::milliseconds{250});
+  REQUIRE(buf.data() == "{}\n" + std::string(ndjson_flush_size, 'x') + "\n");
+}
+
+TEST_CASE("NdjsonWriter hands off a buffer once it is old enough") {
+  GatedBuf buf;
+  std::ostream output{&buf};
+  NdjsonWriter writer{&output};
+  auto begin = std::chrono::steady_clock::now();
+  writer.write("{}");
+  REQUIRE(buf.wait_for_size(3, std::chrono::milliseconds{2000}));
+  REQUIRE(std::chrono::steady_clock::now() - begin >=
+          std::chrono::milliseconds{250});
+  REQUIRE(buf.data() == "{}\n");
+}
+
+TEST_CASE("NdjsonWriter::flush() returns once the lines are written") {
+  GatedBuf buf;
+  std::ostream output{&buf};
+  NdjsonWriter writer{&output};
+  writer.write("{\"a\": 1}");
+  writer.write("{\"b\": 2}");
+  writer.flush();
+  REQUIRE(buf.data() == "{\"a\": 1}\n{\"b\": 2}\n");
+  writer.flush();  // nothing to write
+  REQUIRE(buf.data() == "{\"a\": 1}\n{\"b\": 2}\n");
+}
+
+TEST_CASE("NdjsonWriter::write() waits when too many buffers are pending") {
+  GatedBuf buf{false};
+  std::ostream output{&buf};
+  NdjsonWriter writer{&output};
+  std::string expected;
+  auto line = [&expected](size_t index) {
+    std::string line(ndjson_flush_size - 1, (char)('a' + index % 26));
+    expected += line + "\n";
+    return line;
+  };
+  // The first buffer blocks the thread while it is being written; the next
+  // 64 buffers wait for it; the one after that cannot be queued.
+  writer.write(line(0));
+  REQUIRE(buf.wait_for_writes(1, std::chrono::milliseconds{1000}));
+  for (size_t i = 1; i <= 64; ++i) {
+    writer.write(line(i));
+  }
+  std::atomic<bool> written{false};
+  std::string last = line(65);
+  std::thread writer_thread{[&]() {
+    writer.write(last);
+    written = true;
+  }};
+  std::this_thread::sleep_for(std::chrono::milliseconds{100});
+  bool written_while_blocked = written;
+  buf.set_open(true);
+  writer_thread.join();
+  REQUIRE(!written_while_blocked);
+  REQUIRE(written);
+  writer.flush();
+  REQUIRE(buf.data() == expected);
+}
+
+TEST_CASE("NdjsonWriter::~NdjsonWriter() writes the pending lines") {
+  GatedBuf buf{false};
+  std::ostream output{&buf};
+  std::string expected;
+  std::thread opener;
+  {
+    NdjsonWriter writer{&output};
+    writer.write(std::string(ndjson_flush_size, 'x'));
+    expected += std::string(ndjson_flush_size, 'x') + "\n";
+    REQUIRE(buf.wait_for_writes(1, std::chrono::milliseconds{1000}));
+    for (int i = 0; i < 100; ++i) {
+      writer.write("{\"i\": " + std::to_string(i) + "}");
+      expected += "{\"i\": " + std::to_string(i) + "}\n";
+    }
+    // The destructor must wait for the slow reader.
+    opener = std::thread{[&buf]() {
+      std::this_thread::sleep_for(std::chrono::milliseconds{100});
+      buf.set_open(true);
+    }};
+  }
+  opener.join();
+  REQUIRE(buf.data() == expected);
+}
+
+// measurement_to_json() tests
+// ----------------------------
+
+TEST_CASE("measurement_to_json() only writes the fields sent by the server") {
+  libndt7::Measurement measurement;
+  measurement.has_tcp_info = true;
+  measurement.tcp_info.min_rtt = 2801;
+  measurement.tcp_info.present |=
+      (uint64_t)1 << (unsigned)libndt7::MeasurementTcpInfoField::min_rtt;
+  measurement.tcp_info.rtt = 0;
+  measurement.tcp_info.present |=
+      (uint64_t)1 << (unsigned)libndt7::MeasurementTcpInfoField::rtt;
+  measurement.has_bbr_info = true;
+  nlohmann::json json = measurement_to_json(measurement);
+  REQUIRE(json.size() == 2);
+  REQUIRE(json["TCPInfo"].size() == 2);
+  REQUIRE(json["TCPInfo"]["MinRTT"] == 2801);
+  REQUIRE(json["TCPInfo"]["RTT"] == 0);
+  REQUIRE(json["BBRInfo"].is_object());
+  REQUIRE(json["BBRInfo"].empty());
+}
+
+// Daemon tests
+// ------------
+
+#ifndef _WIN32
+TEST_CASE("jittered_interval() stays within the jitter") {
+  std::mt19937_64 rng{17};
+  REQUIRE(jittered_interval(60.0, 0.0, &rng) == 60.0);
+  double min = 60.0, max = 60.0;
+  for (int i = 0; i < 1000; ++i) {
+    double value = jittered_interval(60.0, 0.1, &rng);
+    REQUIRE(value >= 54.0);
+    REQUIRE(value <= 66.0);
+    min = (std::min)(min, value);
+    max = (std::max)(max, value);
+  }
+  // With this many draws we should use most of the allowed range.
+  REQUIRE(min < 55.0);
+  REQUIRE(max > 65.0);
+}
+
+TEST_CASE("Daemon::handle_command() handles the control commands") {
+  libndt7::Client client;
+  std::ostringstream output;
+  Daemon daemon{DaemonSettings{}, &client, &output, false};
+
+  auto reply = daemon.handle_command("status");
+  REQUIRE(reply["Running"] == false);
+  REQUIRE(reply["Runs"] == 0);
+  REQUIRE(reply["Failures"] == 0);
+  REQUIRE(reply.contains("NextRunIn"));
+  REQUIRE(reply["LastResult"].is_null());
+
+  REQUIRE(daemon.handle_command("run")["Accepted"] == true);
+  REQUIRE(daemon.handle_command("cancel")["Canceled"] == false);
+  REQUIRE(!client.is_canceled());
+  REQUIRE(daemon.handle_command("quit")["Quitting"] == true);
+  REQUIRE(daemon.handle_command("foo")["Error"] == "unknown command: foo");
+}
+
+// send_command sends @p command to the control socket at @p path and returns
+// the reply, retrying until the daemon listens.
+static nlohmann::json send_command(const std::string &path,
+                                   const std::string &command) {
+  sockaddr_un sun{};
+  sun.sun_family = AF_UNIX;
+  strcpy(sun.sun_path, path.c_str());
+  for (int attempt = 0; attempt < 100; ++attempt) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    REQUIRE(fd != -1);
+    if (connect(fd, (sockaddr *)&sun, sizeof(sun)) != 0) {
+      close(fd);
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      continue;
+    }
+    std::string request = command + "\n";
+    REQUIRE(send(fd, request.data(), request.size(), 0) ==
+            (ssize_t)request.size());
+    std::string reply = read_request(fd, "\n");
+    close(fd);
+    return nlohmann::json::parse(reply);
+  }
+  FAIL("cannot connect to the control socket");
+  return nullptr;
+}
+
+TEST_CASE("Daemon::loop() runs a test and obeys the control socket") {
+  libndt7::Settings settings;
+  settings.verbosity = libndt7::verbosity_quiet;
+  settings.nettest_flags = libndt7::nettest_flag_download;
+  // Nothing listens on this port, hence the test fails immediately.
+  settings.hostname = "127.0.0.1";
+  settings.port = "1";
+  settings.scheme = "ws";
+  libndt7::Client client{settings};
+  DaemonSettings daemon_settings;
+  daemon_settings.control_socket = "ndt7-client-cc-test.sock";
+  std::ostringstream output;
+  Daemon daemon{daemon_settings, &client, &output, false};
+  int rv = EXIT_FAILURE;
+  std::thread thread{[&]() { rv = daemon.loop(); }};
+  auto status = send_command(daemon_settings.control_socket, "status");
+  REQUIRE(status.contains("Running"));
+  // The first test starts immediately, hence the next one is about an
+  // interval away, give or take the jitter.
+  REQUIRE(status["NextRunIn"].get<double>() > 3600.0 * 0.85);
+  REQUIRE(send_command(daemon_settings.control_socket, "quit")["Quitting"] ==
+          true);
+  thread.join();
+  REQUIRE(rv == EXIT_SUCCESS);
+  // The daemon waits for the running test before quitting.
+  auto lines = output.str();
+  REQUIRE(std::count(lines.begin(), lines.end(), '\n') == 1);
+  auto result = nlohmann::json::parse(lines);
+  REQUIRE(result["Success"] == false);
+  REQUIRE(result["Canceled"] == false);
+  REQUIRE(access(daemon_settings.control_socket.c_str(), F_OK) != 0);
+}
+#endif  // _WIN32